@@ -0,0 +1,22 @@
+AC_DEFUN([PDNS_ENABLE_FAST_CONTEXT_SWITCH], [
+  AC_REQUIRE([AC_CANONICAL_HOST])
+  AC_MSG_CHECKING([whether to use hand-written context switching for MTasker])
+  AC_ARG_ENABLE([fast-context-switch],
+    AS_HELP_STRING([--enable-fast-context-switch],
+      [switch MTasker contexts without swapcontext(), which does a system call on every switch. Only available on x86-64 and aarch64 @<:@default=auto@:>@]),
+    [enable_fast_context_switch=$enableval],
+    [enable_fast_context_switch=auto])
+
+  AS_CASE([$host_cpu],
+    [x86_64|amd64|aarch64|arm64], [fast_context_switch_supported=yes],
+    [fast_context_switch_supported=no])
+
+  AS_IF([test "x$enable_fast_context_switch" = "xauto"],
+    [enable_fast_context_switch=$fast_context_switch_supported])
+
+  AS_IF([test "x$enable_fast_context_switch" = "xyes" -a "x$fast_context_switch_supported" = "xno"],
+    [AC_MSG_ERROR([hand-written context switching is not available for $host_cpu])])
+
+  AM_CONDITIONAL([MTASKER_FCONTEXT], [test "x$enable_fast_context_switch" = "xyes"])
+  AC_MSG_RESULT([$enable_fast_context_switch])
+])
@@ -62,6 +62,7 @@ GSQLBackend::GSQLBackend(const string &mode, const string &suffix)
 
   d_listQuery=getArg("list-query");
   d_listSubZoneQuery=getArg("list-subzone-query");
+  d_listOrderedQuery=getArg("list-ordered-query");
 
   d_MasterOfDomainsZoneQuery=getArg("master-zone-query");
   d_InfoOfDomainsZoneQuery=getArg("info-zone-query");
@@ -136,6 +137,7 @@ GSQLBackend::GSQLBackend(const string &mode, const string &suffix)
   d_ANYIdQuery_stmt = NULL;
   d_listQuery_stmt = NULL;
   d_listSubZoneQuery_stmt = NULL;
+  d_listOrderedQuery_stmt = NULL;
   d_MasterOfDomainsZoneQuery_stmt = NULL;
   d_InfoOfDomainsZoneQuery_stmt = NULL;
   d_InfoOfAllSlaveDomainsQuery_stmt = NULL;
@@ -1002,6 +1004,25 @@ bool GSQLBackend::listSubZone(const DNSName &zone, int domain_id) {
   return true;
 }
 
+bool GSQLBackend::listOrdered(const DNSName &target, int domain_id)
+{
+  DLOG(L<<"GSQLBackend constructing handle for ordered list of domain id '"<<domain_id<<"'"<<endl);
+
+  try {
+    d_query_name = "list-ordered-query";
+    d_query_stmt = d_listOrderedQuery_stmt;
+    d_query_stmt->
+      bind("domain_id", domain_id)->
+      execute();
+  }
+  catch(SSqlException &e) {
+    throw PDNSException("GSQLBackend listOrdered query: "+e.txtReason());
+  }
+
+  d_qname.clear();
+  return true;
+}
+
 bool GSQLBackend::get(DNSResourceRecord &r)
 {
   // L << "GSQLBackend get() was called for "<<qtype.getName() << " record: ";
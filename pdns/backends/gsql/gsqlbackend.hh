@@ -37,6 +37,7 @@ public:
       d_ANYIdQuery_stmt = d_db->prepare(d_ANYIdQuery, 2);
       d_listQuery_stmt = d_db->prepare(d_listQuery, 2);
       d_listSubZoneQuery_stmt = d_db->prepare(d_listSubZoneQuery, 3);
+      d_listOrderedQuery_stmt = d_db->prepare(d_listOrderedQuery, 1);
       d_MasterOfDomainsZoneQuery_stmt = d_db->prepare(d_MasterOfDomainsZoneQuery, 1);
       d_InfoOfDomainsZoneQuery_stmt = d_db->prepare(d_InfoOfDomainsZoneQuery, 1);
       d_InfoOfAllSlaveDomainsQuery_stmt = d_db->prepare(d_InfoOfAllSlaveDomainsQuery, 0);
@@ -107,6 +108,7 @@ public:
     release(&d_ANYIdQuery_stmt);
     release(&d_listQuery_stmt);
     release(&d_listSubZoneQuery_stmt);
+    release(&d_listOrderedQuery_stmt);
     release(&d_MasterOfDomainsZoneQuery_stmt);
     release(&d_InfoOfDomainsZoneQuery_stmt);
     release(&d_InfoOfAllSlaveDomainsQuery_stmt);
@@ -199,6 +201,7 @@ public:
 
   bool replaceRRSet(uint32_t domain_id, const DNSName& qname, const QType& qt, const vector<DNSResourceRecord>& rrset);
   bool listSubZone(const DNSName &zone, int domain_id);
+  bool listOrdered(const DNSName &target, int domain_id);
   int addDomainKey(const DNSName& name, const KeyData& key);
   bool getDomainKeys(const DNSName& name, unsigned int kind, std::vector<KeyData>& keys);
   bool getAllDomainMetadata(const DNSName& name, std::map<std::string, std::vector<std::string> >& meta);
@@ -242,6 +245,7 @@ private:
 
   string d_listQuery;
   string d_listSubZoneQuery;
+  string d_listOrderedQuery;
   string d_logprefix;
 
   string d_MasterOfDomainsZoneQuery;
@@ -319,6 +323,7 @@ private:
   SSqlStatement* d_ANYIdQuery_stmt;
   SSqlStatement* d_listQuery_stmt;
   SSqlStatement* d_listSubZoneQuery_stmt;
+  SSqlStatement* d_listOrderedQuery_stmt;
   SSqlStatement* d_MasterOfDomainsZoneQuery_stmt;
   SSqlStatement* d_InfoOfDomainsZoneQuery_stmt;
   SSqlStatement* d_InfoOfAllSlaveDomainsQuery_stmt;
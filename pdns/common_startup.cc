@@ -28,6 +28,7 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include "dynhandler.hh"
+#include "signingpipe.hh"
 #include <boost/foreach.hpp>
 
 bool g_anyToTcp;
@@ -71,6 +72,7 @@ void declareArguments()
   ::arg().set("max-queue-length","Maximum queuelength before considering situation lost")="5000";
 
   ::arg().set("retrieval-threads", "Number of AXFR-retrieval threads for slave operation")="2";
+  ::arg().set("retrieval-max-per-master", "Maximum number of simultaneous AXFR-retrievals from a single master")="4";
   ::arg().setSwitch("experimental-json-interface", "If the webserver should serve JSON data")="no";
   ::arg().setSwitch("experimental-api-readonly", "If the JSON API should disallow data modification")="no";
   ::arg().set("experimental-api-key", "REST API Static authentication key (required for API use)")="";
@@ -88,7 +90,8 @@ void declareArguments()
   ::arg().set("default-soa-name","name to insert in the SOA record if none set in the backend")="a.misconfigured.powerdns.server";
   ::arg().set("default-soa-mail","mail address to insert in the SOA record if none set in the backend")="";
   ::arg().set("distributor-threads","Default number of Distributor (backend) threads to start")="3";
-  ::arg().set("signing-threads","Default number of signer threads to start")="3";
+  ::arg().set("signing-threads","Number of threads in the signing pool, shared by outgoing AXFRs and live answers")="3";
+  ::arg().setSwitch("signing-live-answers","Spread the signing of live answers with several RRsets over the signing threads")="no";
   ::arg().set("receiver-threads","Default number of receiver threads to start")="1";
   ::arg().set("queue-limit","Maximum number of milliseconds to queue a query")="1500"; 
   ::arg().set("recursor","If recursion is desired, IP address of a recursing nameserver")="no"; 
@@ -149,9 +152,12 @@ void declareArguments()
 
   ::arg().set("trusted-notification-proxy", "IP address of incoming notification proxy")="";
   ::arg().set("slave-renotify", "If we should send out notifications for slaved updates")="no";
+  ::arg().setSwitch("slave-ixfr", "If we should ask masters for an IXFR before falling back to an AXFR")="yes";
 
   ::arg().set("default-ttl","Seconds a result is valid if not set otherwise")="3600";
   ::arg().set("max-tcp-connections","Maximum number of TCP connections")="10";
+  ::arg().set("tcp-threads","Number of threads answering questions over TCP")="2";
+  ::arg().set("tcp-idle-timeout","Seconds after which an idle TCP connection is closed")="5";
   ::arg().setSwitch("no-shuffle","Set this to prevent random shuffling of answers - for regression testing")="off";
 
   ::arg().set("experimental-logfile", "Filename of the log file for JSON parser" )= "/var/log/pdns.log";
@@ -224,6 +230,16 @@ static uint64_t getLatency(const std::string& str)
   return avg_latency;
 }
 
+static uint64_t getXfrCount(const std::string& str)
+{
+  return str=="xfr-queued" ? Communicator.getSuckQueued() : Communicator.getSuckInFlight();
+}
+
+static uint64_t getSigningStats(const std::string& str)
+{
+  return str=="signing-queue" ? SigningPool::instance().getQueued() : SigningPool::instance().getBatches();
+}
+
 void declareStats(void)
 {
   S.declare("udp-queries","Number of UDP queries received");
@@ -244,6 +260,8 @@ void declareStats(void)
   S.declare("recursing-questions","Number of questions sent to recursor");
   S.declare("corrupt-packets","Number of corrupt packets received");
   S.declare("signatures", "Number of DNSSEC signatures made");
+  S.declare("signing-queue", "Number of records waiting for a signing thread", getSigningStats);
+  S.declare("signing-batches", "Number of batches of records signed by the signing threads", getSigningStats);
   S.declare("tcp-queries","Number of TCP queries received");
   S.declare("tcp-answers","Number of answers sent out over TCP");
   S.declare("tcp-answers-bytes","Total size of answers sent out over TCP");
@@ -271,6 +289,12 @@ void declareStats(void)
   S.declare("dnsupdate-changes", "DNS update changes to records in total.");
 
   S.declare("incoming-notifications", "NOTIFY packets received.");
+  S.declare("xfr-queued", "Number of incoming zone transfers waiting for a retrieval thread", getXfrCount);
+  S.declare("xfr-in-flight", "Number of incoming zone transfers in progress", getXfrCount);
+  S.declare("xfr-done", "Number of incoming zone transfers completed");
+  S.declare("xfr-failed", "Number of incoming zone transfers that failed because of the master");
+  S.declare("xfr-failed-local", "Number of incoming zone transfers that failed because of a local problem");
+  S.declare("xfr-bytes-received", "Total size of incoming zone transfers");
 
   S.declare("uptime", "Uptime of process in seconds", uptimeOfProcess);
   S.declare("real-memory-usage", "Actual unique use of memory in bytes (approx)", getRealMemoryUsage);
@@ -356,8 +380,44 @@ void *qthread(void *number)
     }
   }
 
+  /* Answers packet cache hits straight from the wire, skipping the parsing of the query into a DNSPacket
+     and the copying and re-parsing of the cached answer. Logging and the policy engine want the full packet,
+     so they get the slow path. */
+  UDPNameserver::fastpath_t fastpath;
+  if(!logDNSQueries && !LPE) {
+    fastpath = [&](const char* packet, int len, int sock, const ComboAddress& remote, const ComboAddress* local, DTime& dt) {
+      string answer;
+      DNSName qname;
+      uint16_t qtype;
+      bool dnssecOk;
+      if(!PC.getRaw(packet, len, doRecursion, answer, &qname, &qtype, &dnssecOk))
+        return false;
+
+      if (skipfirst)
+        skipfirst=false;
+      else
+        numreceived++;
+
+      if(remote.getSocklen()==sizeof(sockaddr_in))
+        numreceived4++;
+      else
+        numreceived6++;
+
+      if(dnssecOk)
+        numreceiveddo++;
+
+      S.ringAccount("queries", qname.toString()+"/"+QType(qtype).getName());
+      S.ringAccount("remotes", remote);
+
+      NS->send(answer, qname, qtype, sock, remote, local);
+      diff=dt.udiff();
+      avg_latency=(int)(0.999*avg_latency+0.001*diff); // 'EWMA'
+      return true;
+    };
+  }
+
   for(;;) {
-    if(!(P=NS->receive(&question))) { // receive a packet         inline
+    if(!(P=NS->receive(&question, fastpath))) { // receive a packet, or answer it from the packet cache         inline
       continue;                    // packet was broken, try again
     }
 
@@ -510,6 +570,8 @@ void mainthread()
   // NOW SAFE TO CREATE THREADS!
   dl->go();
 
+  SigningPool::instance().start(::arg().asNum("signing-threads", 1));
+
   pthread_t qtid;
 
   if(::arg().mustDo("webserver"))
@@ -37,23 +37,34 @@
 #include "arguments.hh"
 #include "packetcache.hh"
 #include <boost/lexical_cast.hpp>
+#include "statbag.hh"
 
 // #include "namespaces.hh"
 
+extern StatBag S;
+
 void CommunicatorClass::retrievalLoopThread(void)
 {
+  std::unique_ptr<UeberBackend> B; // reused by the transfers of this thread, suck() replaces it after a backend error
   for(;;) {
-    d_suck_sem.wait();
     SuckRequest sr;
-    {
-      Lock l(&d_lock);
-      if(d_suckdomains.empty()) 
-        continue;
-        
-      sr=d_suckdomains.front();
-      d_suckdomains.pop_front();
-    }
-    suck(sr.domain,sr.master);
+    if(!d_suckdomains.wait(sr))
+      continue;
+
+    struct timeval start;
+    gettimeofday(&start, 0);
+    uint64_t bytes=0;
+    XfrResult result=suck(sr.domain, sr.master, B, bytes);
+    struct timeval now;
+    gettimeofday(&now, 0);
+    unsigned int msec=(now.tv_sec-start.tv_sec)*1000 + (now.tv_usec-start.tv_usec)/1000;
+
+    if(result == XfrResult::Done)
+      S.inc("xfr-done");
+    else
+      S.inc(result == XfrResult::MasterFailed ? "xfr-failed" : "xfr-failed-local");
+    S.deposit("xfr-bytes-received", bytes);
+    d_suckdomains.done(sr, result == XfrResult::MasterFailed, bytes, msec, now.tv_sec);
   }
 }
 
@@ -67,6 +78,8 @@ void CommunicatorClass::go()
     exit(1);
   }
 
+  d_suckdomains.setMaxPerMaster(::arg().asNum("retrieval-max-per-master"));
+
   pthread_t tid;
   pthread_create(&tid,0,&launchhelper,this); // Starts CommunicatorClass::mainloop()
   for(int n=0; n < ::arg().asNum("retrieval-threads", 1); ++n)
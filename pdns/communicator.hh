@@ -39,30 +39,11 @@ using namespace boost::multi_index;
 
 #include "lock.hh"
 #include "packethandler.hh"
+#include "resolver.hh"
+#include "transferscheduler.hh"
 
 #include "namespaces.hh"
 
-struct SuckRequest
-{
-  DNSName domain;
-  string master;
-  bool operator<(const SuckRequest& b) const
-  {
-    return tie(domain, master) < tie(b.domain, b.master);
-  }
-};
-
-struct IDTag{};
-
-typedef multi_index_container<
-  SuckRequest,
-  indexed_by<
-    sequenced<>,
-    ordered_unique<tag<IDTag>, identity<SuckRequest> >
-  >
-> UniQueue;
-typedef UniQueue::index<IDTag>::type domains_by_name_t;
-
 class NotificationQueue
 {
 public:
@@ -155,7 +136,6 @@ public:
     d_masterschanged=d_slaveschanged=true;
     d_nsock4 = -1;
     d_nsock6 = -1;
-    d_havepriosuckrequest = false;
     d_preventSelfNotification = false;
   }
   time_t doNotifications();    
@@ -164,7 +144,10 @@ public:
   
   void drillHole(const DNSName &domain, const string &ip);
   bool justNotified(const DNSName &domain, const string &ip);
-  void addSuckRequest(const DNSName &domain, const string &master);
+  void addSuckRequest(const DNSName &domain, const string &master, bool priority=false);
+  uint64_t getSuckQueued() const { return d_suckdomains.getQueued(); }
+  uint64_t getSuckInFlight() const { return d_suckdomains.getInFlight(); }
+  map<string, TransferScheduler::MasterStats> getSuckMasterStats() const { return d_suckdomains.getMasterStats(); }
   void addSlaveCheckRequest(const DomainInfo& di, const ComboAddress& remote);
   void addTrySuperMasterRequest(DNSPacket *p);
   void notify(const DNSName &domain, const string &ip);
@@ -190,14 +173,15 @@ private:
   map<pair<DNSName,string>,time_t>d_holes;
   pthread_mutex_t d_holelock;
   void launchRetrievalThreads();
-  void suck(const DNSName &domain, const string &remote);
+  enum class XfrResult { Done, MasterFailed, LocalFailed };
+  XfrResult suck(const DNSName &domain, const string &remote, std::unique_ptr<UeberBackend>& B, uint64_t& bytes);
+  bool ixfrSuck(const DNSName &domain, const string &remote, DomainInfo& di, DNSSECKeeper& dk, const DNSName& tsigkeyname, const DNSName& tsigalgorithm, const string& tsigsecret, const ComboAddress* laddr, uint64_t& bytes, uint32_t& serial, std::unique_ptr<AXFRRetriever>& retriever, Resolver::res_t& fullZone);
   void slaveRefresh(PacketHandler *P);
   void masterUpdateCheck(PacketHandler *P);
   pthread_mutex_t d_lock;
   
-  UniQueue d_suckdomains;
+  TransferScheduler d_suckdomains;
   
-  Semaphore d_suck_sem;
   Semaphore d_any_sem;
   time_t d_tickinterval;
   set<DomainInfo> d_tocheck;
@@ -205,7 +189,6 @@ private:
   set<string> d_alsoNotify;
   NotificationQueue d_nq;
   NetmaskGroup d_onlyNotify;
-  bool d_havepriosuckrequest;
   bool d_masterschanged, d_slaveschanged;
   bool d_preventSelfNotification;
 };
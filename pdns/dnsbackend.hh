@@ -139,6 +139,14 @@ public:
     return false;
   }
 
+  //! Like list(), but the enabled records come in the order of their stored (rectified) ordername, with all records of a name together
+  /** Return false if you can't, the caller then falls back to list(). Records without an ordername,
+      like glue, may come first or last. */
+  virtual bool listOrdered(const DNSName &target, int domain_id)
+  {
+    return false;
+  }
+
   // the DNSSEC related (getDomainMetadata has broader uses too)
   bool isDnssecDomainMetadata (const string& name) {
     return (name == "PRESIGNED" || name == "NSEC3PARAM" || name == "NSEC3NARROW");
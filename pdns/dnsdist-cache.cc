@@ -0,0 +1,276 @@
+#include "dnsdist-cache.hh"
+#include "dns.hh"
+#include "misc.hh"
+#include <limits>
+#include <netinet/in.h>
+
+DNSDistPacketCache::DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL, uint32_t minTTL, unsigned int shards) : d_shards(shards ? shards : 1), d_maxEntries(maxEntries), d_maxTTL(maxTTL), d_minTTL(minTTL)
+{
+  d_maxEntriesPerShard = d_maxEntries / d_shards.size();
+  if(!d_maxEntriesPerShard)
+    d_maxEntriesPerShard = 1;
+  for(auto& shard : d_shards)
+    shard.map.reserve(d_maxEntriesPerShard);
+}
+
+// skips a (possibly compressed) name starting at *pos, returns false if it runs past the end of the packet
+static bool skipDNSName(const char* packet, uint16_t length, uint16_t* pos)
+{
+  while(*pos < length) {
+    uint8_t labellen = packet[*pos];
+    if(!labellen) {
+      (*pos)++;
+      return true;
+    }
+    if((labellen & 0xc0) == 0xc0) {
+      *pos += 2;
+      return *pos <= length;
+    }
+    *pos += labellen + 1;
+  }
+  return false;
+}
+
+/* calls visitor with the offset of the TTL field of every record in the packet, skipping the OPT pseudo-record.
+   Returns false if the packet turned out to be malformed */
+template<typename Visitor>
+static bool visitRecordTTLs(const char* packet, uint16_t length, Visitor visitor)
+{
+  if(length < sizeof(dnsheader))
+    return false;
+  const struct dnsheader* dh = (const struct dnsheader*) packet;
+  uint16_t pos = sizeof(dnsheader);
+
+  for(unsigned int n = 0; n < ntohs(dh->qdcount); ++n) {
+    if(!skipDNSName(packet, length, &pos))
+      return false;
+    pos += 4; // qtype, qclass
+  }
+
+  unsigned int numrecords = ntohs(dh->ancount) + ntohs(dh->nscount) + ntohs(dh->arcount);
+  for(unsigned int n = 0; n < numrecords; ++n) {
+    if(!skipDNSName(packet, length, &pos) || pos + 10 > length)
+      return false;
+    uint16_t qtype = (((unsigned char)packet[pos]) << 8) + (unsigned char)packet[pos+1];
+    uint16_t rdlength = (((unsigned char)packet[pos+8]) << 8) + (unsigned char)packet[pos+9];
+    if(qtype != QType::OPT)
+      visitor(pos + 4);
+    pos += 10 + rdlength;
+    if(pos > length)
+      return false;
+  }
+  return true;
+}
+
+static uint32_t getTTLAt(const char* packet, uint16_t offset)
+{
+  uint32_t ttl;
+  memcpy(&ttl, packet + offset, sizeof(ttl));
+  return ntohl(ttl);
+}
+
+//! returns the lowest TTL of all records in this packet, or 0 if there are none (or the packet is malformed)
+uint32_t DNSDistPacketCache::getMinTTL(const char* packet, uint16_t length)
+{
+  uint32_t result = std::numeric_limits<uint32_t>::max();
+  bool seen = false;
+  if(!visitRecordTTLs(packet, length, [&](uint16_t offset) {
+        result = std::min(result, getTTLAt(packet, offset));
+        seen = true;
+      }))
+    return 0;
+  return seen ? result : 0;
+}
+
+static void ageRecordTTLs(char* packet, uint16_t length, uint32_t seconds)
+{
+  if(!seconds)
+    return;
+  visitRecordTTLs(packet, length, [packet, seconds](uint16_t offset) {
+      uint32_t ttl = getTTLAt(packet, offset);
+      ttl = htonl(ttl > seconds ? ttl - seconds : 0);
+      memcpy(packet + offset, &ttl, sizeof(ttl));
+    });
+}
+
+//! hashes the query except for its ID, using the lowercased qname. 'consumed' is the length of the qname in wire format
+uint32_t DNSDistPacketCache::getKey(const char* packet, uint16_t packetLen, unsigned int consumed)
+{
+  uint32_t result = 0;
+  const unsigned char* p = (const unsigned char*) packet;
+  result = burtle(p + 2, sizeof(dnsheader) - 2, result);
+  result = burtleCI(p + sizeof(dnsheader), consumed, result);
+  if(packetLen > sizeof(dnsheader) + consumed)
+    result = burtle(p + sizeof(dnsheader) + consumed, packetLen - sizeof(dnsheader) - consumed, result);
+  return result;
+}
+
+bool DNSDistPacketCache::cachedValueMatches(const CacheValue& cachedValue, const DNSName& qname, uint16_t qtype, uint16_t qclass)
+{
+  return cachedValue.qtype == qtype && cachedValue.qclass == qclass && cachedValue.qname == qname;
+}
+
+void DNSDistPacketCache::insert(uint32_t key, const DNSName& qname, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen)
+{
+  if(responseLen < sizeof(dnsheader) + qname.wirelength() + 4)
+    return;
+
+  const struct dnsheader* dh = (const struct dnsheader*) response;
+  if(dh->rcode != RCode::NoError && dh->rcode != RCode::NXDomain)
+    return;
+  if(ntohs(dh->qdcount) != 1)
+    return;
+
+  uint32_t minTTL = getMinTTL(response, responseLen);
+  if(minTTL > d_maxTTL)
+    minTTL = d_maxTTL;
+  if(minTTL == 0 || minTTL < d_minTTL)
+    return;
+
+  CacheValue newValue;
+  newValue.qname = qname;
+  newValue.qtype = qtype;
+  newValue.qclass = qclass;
+  newValue.added = time(nullptr);
+  newValue.validity = newValue.added + minTTL;
+  newValue.value.assign(response, responseLen);
+
+  auto& shard = getShard(key);
+  std::unique_lock<std::mutex> lock(shard.lock, std::try_to_lock);
+  if(!lock.owns_lock()) {
+    d_deferredInserts++;
+    return;
+  }
+
+  auto it = shard.map.find(key);
+  if(it == shard.map.end()) {
+    if(shard.map.size() >= d_maxEntriesPerShard)
+      return;
+    shard.map.insert({key, std::move(newValue)});
+    d_entries++;
+    return;
+  }
+
+  /* in case of collision, don't override the existing entry
+     unless it has expired */
+  if(!cachedValueMatches(it->second, qname, qtype, qclass)) {
+    d_insertCollisions++;
+    if(it->second.validity > newValue.added)
+      return;
+  }
+  it->second = std::move(newValue);
+}
+
+bool DNSDistPacketCache::get(const char* query, uint16_t queryLen, const DNSName& qname, uint16_t qtype, uint16_t qclass, unsigned int consumed, char* response, uint16_t* responseLen, uint32_t* keyOut, bool skipAging)
+{
+  uint32_t key = getKey(query, queryLen, consumed);
+  if(keyOut)
+    *keyOut = key;
+
+  uint16_t questionLen = sizeof(dnsheader) + consumed;
+  if(response != query && *responseLen >= questionLen)
+    memcpy(response, query, questionLen);
+
+  time_t now = time(nullptr);
+  uint32_t age;
+  auto& shard = getShard(key);
+  {
+    std::unique_lock<std::mutex> lock(shard.lock, std::try_to_lock);
+    if(!lock.owns_lock()) {
+      d_deferredLookups++;
+      return false;
+    }
+
+    auto it = shard.map.find(key);
+    if(it == shard.map.end() || it->second.validity < now) {
+      d_misses++;
+      return false;
+    }
+
+    const CacheValue& value = it->second;
+    if(value.value.size() > *responseLen || value.value.size() < questionLen) {
+      d_misses++;
+      return false;
+    }
+
+    if(!cachedValueMatches(value, qname, qtype, qclass)) {
+      d_lookupCollisions++;
+      return false;
+    }
+
+    /* we keep the ID and question section of the query, so the exact
+       spelling of the qname the client used is preserved */
+    memcpy(response + 2, value.value.c_str() + 2, sizeof(dnsheader) - 2);
+    memcpy(response + questionLen, value.value.c_str() + questionLen, value.value.size() - questionLen);
+    *responseLen = value.value.size();
+    age = now - value.added;
+  }
+
+  if(!skipAging)
+    ageRecordTTLs(response, *responseLen, age);
+  d_hits++;
+  return true;
+}
+
+/* Remove expired entries, until the cache has at most upTo entries in it. */
+void DNSDistPacketCache::purgeExpired(size_t upTo)
+{
+  time_t now = time(nullptr);
+  size_t perShard = upTo / d_shards.size();
+  for(auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard.lock);
+    for(auto it = shard.map.begin(); it != shard.map.end() && shard.map.size() > perShard; ) {
+      if(it->second.validity < now) {
+        it = shard.map.erase(it);
+        d_entries--;
+      }
+      else
+        ++it;
+    }
+  }
+}
+
+/* Remove all entries, keeping only upTo entries in the cache */
+void DNSDistPacketCache::expunge(size_t upTo)
+{
+  size_t perShard = upTo / d_shards.size();
+  for(auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard.lock);
+    while(shard.map.size() > perShard) {
+      shard.map.erase(shard.map.begin());
+      d_entries--;
+    }
+  }
+}
+
+void DNSDistPacketCache::expungeByName(const DNSName& name, uint16_t qtype, bool suffixMatch)
+{
+  for(auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard.lock);
+    for(auto it = shard.map.begin(); it != shard.map.end(); ) {
+      const CacheValue& value = it->second;
+      bool nameMatches = suffixMatch ? value.qname.isPartOf(name) : value.qname == name;
+      if(nameMatches && (qtype == QType::ANY || qtype == value.qtype)) {
+        it = shard.map.erase(it);
+        d_entries--;
+      }
+      else
+        ++it;
+    }
+  }
+}
+
+bool DNSDistPacketCache::isFull()
+{
+  return d_entries >= d_maxEntries;
+}
+
+uint64_t DNSDistPacketCache::getSize()
+{
+  return d_entries;
+}
+
+string DNSDistPacketCache::toString()
+{
+  return std::to_string(getSize()) + "/" + std::to_string(d_maxEntries);
+}
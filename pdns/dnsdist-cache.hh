@@ -0,0 +1,83 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include "dnsname.hh"
+#include "qtype.hh"
+
+/* A packet cache for dnsdist, keyed on the wire format of the query.
+
+   The key is a hash over the query header (minus the ID), the lowercased qname
+   and everything following the qname, so EDNS0 options and the RD & CD bits are part
+   of the key. On a hit, the stored qname, qtype and qclass are compared to rule out
+   hash collisions, the ID of the stored answer is replaced by the ID of the query
+   and all TTLs are decremented by the time the answer has been in the cache.
+
+   Entries are spread over a number of shards, each with its own lock, so threads
+   hitting different names don't contend. */
+
+class DNSDistPacketCache : boost::noncopyable
+{
+public:
+  DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL=86400, uint32_t minTTL=60, unsigned int shards=16);
+
+  void insert(uint32_t key, const DNSName& qname, uint16_t qtype, uint16_t qclass, const char* response, uint16_t responseLen);
+  //! response may point to the same buffer as query, *responseLen is the size of that buffer on input
+  bool get(const char* query, uint16_t queryLen, const DNSName& qname, uint16_t qtype, uint16_t qclass, unsigned int consumed, char* response, uint16_t* responseLen, uint32_t* keyOut, bool skipAging=false);
+  void purgeExpired(size_t upTo=0);
+  void expunge(size_t upTo=0);
+  void expungeByName(const DNSName& name, uint16_t qtype=QType::ANY, bool suffixMatch=false);
+  bool isFull();
+  string toString();
+  uint64_t getSize();
+  uint64_t getHits() const { return d_hits; }
+  uint64_t getMisses() const { return d_misses; }
+  uint64_t getDeferredLookups() const { return d_deferredLookups; }
+  uint64_t getDeferredInserts() const { return d_deferredInserts; }
+  uint64_t getLookupCollisions() const { return d_lookupCollisions; }
+  uint64_t getInsertCollisions() const { return d_insertCollisions; }
+  uint64_t getMaxEntries() const { return d_maxEntries; }
+
+  static uint32_t getMinTTL(const char* packet, uint16_t length);
+  static uint32_t getKey(const char* packet, uint16_t packetLen, unsigned int consumed);
+
+private:
+  struct CacheValue
+  {
+    time_t getTTD() const { return validity; }
+    DNSName qname;
+    uint16_t qtype{0};
+    uint16_t qclass{0};
+    time_t added{0};
+    time_t validity{0};
+    string value;
+  };
+
+  struct CacheShard
+  {
+    std::mutex lock;
+    std::unordered_map<uint32_t,CacheValue> map;
+  };
+
+  CacheShard& getShard(uint32_t key)
+  {
+    return d_shards[key % d_shards.size()];
+  }
+
+  static bool cachedValueMatches(const CacheValue& cachedValue, const DNSName& qname, uint16_t qtype, uint16_t qclass);
+
+  std::vector<CacheShard> d_shards;
+  std::atomic<uint64_t> d_deferredLookups{0};
+  std::atomic<uint64_t> d_deferredInserts{0};
+  std::atomic<uint64_t> d_hits{0};
+  std::atomic<uint64_t> d_misses{0};
+  std::atomic<uint64_t> d_insertCollisions{0};
+  std::atomic<uint64_t> d_lookupCollisions{0};
+  std::atomic<uint64_t> d_entries{0};
+  size_t d_maxEntries;
+  size_t d_maxEntriesPerShard;
+  uint32_t d_maxTTL;
+  uint32_t d_minTTL;
+};
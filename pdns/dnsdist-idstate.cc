@@ -0,0 +1,47 @@
+#include "dnsdist-idstate.hh"
+
+DNSName IDQNames::get(unsigned int slot) const
+{
+  if(slot >= d_slots)
+    return DNSName();
+  const char* name = &d_names[slot * s_stride];
+  unsigned char len = name[0];
+  if(!len)
+    return DNSName();
+  try {
+    return DNSName(name + 1, len, 0, false);
+  }
+  catch(std::exception& e) {
+    // only when the slot was reused while we were reading it
+    return DNSName();
+  }
+}
+
+unsigned int pickIDState(std::vector<IDState>& idStates, std::atomic<uint64_t>& idOffset, bool& reused)
+{
+  unsigned int offset = 0;
+  for(unsigned int n = 0; n < 8; ++n) {
+    offset = (idOffset++) % idStates.size();
+    if(idStates[offset].origFD < 0) {
+      reused = false;
+      return offset;
+    }
+  }
+  reused = true;
+  return offset;
+}
+
+unsigned int expireIDStates(std::vector<IDState>& idStates, const IDQNames& qnames, Rings& rings)
+{
+  unsigned int expired = 0;
+  for(unsigned int slot = 0; slot < idStates.size(); ++slot) {
+    IDState& ids = idStates[slot];
+    if(ids.origFD >= 0 && ids.age++ > 2) {
+      ids.age = 0;
+      ids.origFD = -1;
+      expired++;
+      rings.insertResponse(qnames.get(slot), ids.qtype, 0, 2000000);
+    }
+  }
+  return expired;
+}
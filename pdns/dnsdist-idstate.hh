@@ -0,0 +1,120 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "dnsdist-cache.hh"
+#include "dnsdist-rings.hh"
+#include "iputils.hh"
+#include "misc.hh"
+
+struct StopWatch
+{
+#ifndef CLOCK_MONOTONIC_RAW
+#define CLOCK_MONOTONIC_RAW CLOCK_MONOTONIC
+#endif
+  struct timespec d_start{0,0};
+  void start() {  
+    if(clock_gettime(CLOCK_MONOTONIC_RAW, &d_start) < 0)
+      unixDie("Getting timestamp");
+    
+  }
+  
+  double udiff() const {
+    struct timespec now;
+    if(clock_gettime(CLOCK_MONOTONIC_RAW, &now) < 0)
+      unixDie("Getting timestamp");
+    
+    return 1000000.0*(now.tv_sec - d_start.tv_sec) + (now.tv_nsec - d_start.tv_nsec)/1000.0;
+  }
+
+  double udiffAndSet() {
+    struct timespec now;
+    if(clock_gettime(CLOCK_MONOTONIC_RAW, &now) < 0)
+      unixDie("Getting timestamp");
+    
+    auto ret= 1000000.0*(now.tv_sec - d_start.tv_sec) + (now.tv_nsec - d_start.tv_nsec)/1000.0;
+    d_start = now;
+    return ret;
+  }
+
+};
+
+/* one in-flight query to a downstream server. A hash of the qname is checked against the question
+   section of the response before relaying it, so that a late answer for a slot that has since been
+   reused doesn't get sent to the wrong client. The qname itself is not kept here, see IDQNames */
+struct IDState
+{
+  IDState() : origFD(-1), delayMsec(0) { origDest.sin4.sin_family = 0;}
+  IDState(const IDState& orig)
+  {
+    origFD = orig.origFD;
+    origID = orig.origID;
+    origRemote = orig.origRemote;
+    origDest = orig.origDest;
+    delayMsec = orig.delayMsec;
+    qnameHash = orig.qnameHash;
+    qtype = orig.qtype;
+    qclass = orig.qclass;
+    cacheKey = orig.cacheKey;
+    packetCache = std::atomic_load(&orig.packetCache);
+    age.store(orig.age.load());
+  }
+
+  ComboAddress origRemote;                                    // 28
+  ComboAddress origDest;                                      // 28
+  StopWatch sentTime;                                         // 16
+  std::shared_ptr<DNSDistPacketCache> packetCache{nullptr};   // 16, std::atomic_load() and std::atomic_store() only
+  int origFD;  // set to <0 to indicate this state is empty   // 4
+  int delayMsec;                                              // 4
+  uint32_t qnameHash;                                         // 4
+  uint32_t cacheKey;                                          // 4
+  std::atomic<uint16_t> age{0};                               // 2
+  uint16_t qtype;                                             // 2
+  uint16_t qclass;                                            // 2
+  uint16_t origID;                                            // 2
+};
+
+/* The qnames of the queries in flight to a downstream server, by slot, in wire format. They are only
+   needed to record timed out queries with their name, so they live apart from the IDStates and are
+   only allocated and written when setTimeoutQNames() enabled that. */
+class IDQNames
+{
+public:
+  void resize(size_t slots)
+  {
+    d_names.reset(new char[slots * s_stride]());
+    d_slots = slots;
+  }
+  bool empty() const
+  {
+    return d_slots == 0;
+  }
+  //! wire is the uncompressed qname of the query, a name that does not fit is not kept
+  void set(unsigned int slot, const char* wire, unsigned int len)
+  {
+    char* name = &d_names[slot * s_stride];
+    if(len >= s_stride)
+      len = 0;
+    name[0] = len;
+    memcpy(name + 1, wire, len);
+  }
+  //! the qname set() for this slot, or an empty name if there is none
+  DNSName get(unsigned int slot) const;
+
+private:
+  static const size_t s_stride = 256; // the length, then the name
+  std::unique_ptr<char[]> d_names;
+  size_t d_slots{0};
+};
+
+/* Picks the slot for a new query to a downstream server and returns its offset. Up to 8 slots that
+   are still waiting for an answer are skipped, every probe taking a fresh offset so threads don't
+   pick the same slot. If all of them are busy, the last one is taken anyway and reused is set. */
+unsigned int pickIDState(std::vector<IDState>& idStates, std::atomic<uint64_t>& idOffset, bool& reused);
+
+/* Called once a second by the maintenance thread: frees the slots that have been waiting for an
+   answer for more than 2 calls and records them in the response ring as timeouts, with their
+   qname if qnames has them. Returns the number of slots freed. */
+unsigned int expireIDStates(std::vector<IDState>& idStates, const IDQNames& qnames, Rings& rings);
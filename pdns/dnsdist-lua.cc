@@ -1,3 +1,6 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include "dnsdist.hh"
 #include "dnsrulactions.hh"
 #include <thread>
@@ -19,6 +22,7 @@ public:
 
   Action operator()(const ComboAddress& remote, const DNSName& qname, uint16_t qtype, dnsheader* dh, int len, string* ruleresult) const
   {
+    std::lock_guard<std::mutex> lock(g_luamutex);
     auto ret = d_func(remote, qname, qtype, dh, len);
     if(ruleresult)
       *ruleresult=std::get<1>(ret);
@@ -164,6 +168,19 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 			  ret->tcpRecvTimeout=boost::lexical_cast<int>(boost::get<string>(vars["tcpRecvTimeout"]));
 			}
 
+			if(vars.count("maxOutstanding")) {
+			  size_t maxOutstanding=boost::lexical_cast<size_t>(boost::get<string>(vars["maxOutstanding"]));
+			  if(maxOutstanding < 1 || maxOutstanding > 65536) {
+			    g_outputBuffer="maxOutstanding should be between 1 and 65536\n";
+			    errlog("Invalid maxOutstanding value %d for server %s", maxOutstanding, ret->remote.toStringWithPort());
+			  }
+			  else {
+			    ret->idStates.resize(maxOutstanding);
+			    if(g_timeoutQNames)
+			      ret->idQNames.resize(maxOutstanding);
+			  }
+			}
+
 			if(g_launchWork) {
 			  g_launchWork->push_back([ret]() {
 			      ret->tid = move(thread(responderThread, ret));
@@ -244,7 +261,7 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       g_policy.setState(policy);
     });
   g_lua.writeFunction("setServerPolicyLua", [](string name, policy_t policy)  {
-      g_policy.setState(ServerPolicy{name, policy});
+      g_policy.setState(ServerPolicy{name, policy, true});
     });
 
   g_lua.writeFunction("showServerPolicy", []() {
@@ -253,9 +270,57 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 
   g_lua.writeFunction("truncateTC", [](bool tc) { g_truncateTC=tc; });
 
+  g_lua.writeFunction("setUDPMultipleMessagesVectorSize", [client](size_t vSize) {
+      if(client)
+	return;
+      if(!g_launchWork) {
+	g_outputBuffer="setUDPMultipleMessagesVectorSize() can only be used at configuration time\n";
+	return;
+      }
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+      g_udpVectorSize=vSize;
+#else
+      errlog("recvmmsg() support is not available, ignoring setUDPMultipleMessagesVectorSize(%d)", vSize);
+#endif
+    });
+
+  g_lua.writeFunction("setMaxUDPOutstanding", [client](size_t maxOutstanding) {
+      if(client)
+	return;
+      if(!g_launchWork) {
+	g_outputBuffer="setMaxUDPOutstanding() can only be used at configuration time\n";
+	return;
+      }
+      if(maxOutstanding < 1 || maxOutstanding > 65536) {
+	g_outputBuffer="The maximum number of outstanding queries should be between 1 and 65536\n";
+	return;
+      }
+      g_maxOutstanding=maxOutstanding;
+    });
+
+  g_lua.writeFunction("setTimeoutQNames", [client](bool enabled) {
+      if(client)
+	return;
+      if(!g_launchWork) {
+	g_outputBuffer="setTimeoutQNames() can only be used at configuration time\n";
+	return;
+      }
+      g_timeoutQNames=enabled;
+    });
+
+  g_lua.writeFunction("setRingBuffersSize", [client](size_t capacity, boost::optional<size_t> numberOfShards) {
+      if(client)
+	return;
+      if(!g_launchWork) {
+	g_outputBuffer="setRingBuffersSize() can only be used at configuration time\n";
+	return;
+      }
+      g_rings.setCapacity(capacity, numberOfShards ? *numberOfShards : g_rings.getNumberOfShards());
+    });
+
   g_lua.registerMember("name", &ServerPolicy::name);
   g_lua.registerMember("policy", &ServerPolicy::policy);
-  g_lua.writeFunction("newServerPolicy", [](string name, policy_t policy) { return ServerPolicy{name, policy};});
+  g_lua.writeFunction("newServerPolicy", [](string name, policy_t policy) { return ServerPolicy{name, policy, true};});
   g_lua.writeVariable("firstAvailable", ServerPolicy{"firstAvailable", firstAvailable});
   g_lua.writeVariable("roundrobin", ServerPolicy{"roundrobin", roundrobin});
   g_lua.writeVariable("wrandom", ServerPolicy{"wrandom", wrandom});
@@ -264,12 +329,15 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       g_ACL.modify([domain](NetmaskGroup& nmg) { nmg.addMask(domain); });
     });
 
-  g_lua.writeFunction("addLocal", [client](const std::string& addr, boost::optional<bool> doTCP) {
+  g_lua.writeFunction("addLocal", [client](const std::string& addr, boost::optional<bool> doTCP, boost::optional<bool> reusePort, boost::optional<unsigned int> udpThreads) {
       if(client)
 	return;
       try {
 	ComboAddress loc(addr, 53);
-	g_locals.push_back({loc, doTCP ? *doTCP : true}); /// only works pre-startup, so no sync necessary
+	unsigned int threads = udpThreads ? *udpThreads : 1;
+	if(!threads)
+	  threads = 1;
+	g_locals.push_back(std::make_tuple(loc, doTCP ? *doTCP : true, reusePort ? *reusePort : false, threads)); /// only works pre-startup, so no sync necessary
       }
       catch(std::exception& e) {
 	g_outputBuffer="Error: "+string(e.what())+"\n";
@@ -371,8 +439,8 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
     });
 
 
-  g_lua.writeFunction("MaxQPSIPRule", [](unsigned int qps, boost::optional<int> ipv4trunc, boost::optional<int> ipv6trunc) {
-      return std::shared_ptr<DNSRule>(new MaxQPSIPRule(qps, ipv4trunc.get_value_or(32), ipv6trunc.get_value_or(64)));
+  g_lua.writeFunction("MaxQPSIPRule", [](unsigned int qps, boost::optional<int> ipv4trunc, boost::optional<int> ipv6trunc, boost::optional<int> maxEntries, boost::optional<int> expiration) {
+      return std::shared_ptr<DNSRule>(new MaxQPSIPRule(qps, ipv4trunc.get_value_or(32), ipv6trunc.get_value_or(64), maxEntries.get_value_or(65536), expiration.get_value_or(300)));
     });
 
 
@@ -471,6 +539,80 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 
   g_lua.writeFunction("getServer", [](int i) { return g_dstates.getCopy().at(i); });
 
+  g_lua.writeFunction("newPacketCache", [](size_t maxEntries, boost::optional<uint32_t> maxTTL, boost::optional<uint32_t> minTTL) {
+      return std::make_shared<DNSDistPacketCache>(maxEntries, maxTTL ? *maxTTL : 86400, minTTL ? *minTTL : 60);
+    });
+  g_lua.registerFunction("toString", &DNSDistPacketCache::toString);
+  g_lua.registerFunction("isFull", &DNSDistPacketCache::isFull);
+  g_lua.registerFunction<void(std::shared_ptr<DNSDistPacketCache>::*)(boost::optional<size_t>)>("purgeExpired", [](std::shared_ptr<DNSDistPacketCache> cache, boost::optional<size_t> upTo) {
+      if(cache)
+        cache->purgeExpired(upTo ? *upTo : 0);
+    });
+  g_lua.registerFunction<void(std::shared_ptr<DNSDistPacketCache>::*)(boost::optional<size_t>)>("expunge", [](std::shared_ptr<DNSDistPacketCache> cache, boost::optional<size_t> upTo) {
+      if(cache)
+        cache->expunge(upTo ? *upTo : 0);
+    });
+  g_lua.registerFunction<void(std::shared_ptr<DNSDistPacketCache>::*)(const std::string&, boost::optional<uint16_t>, boost::optional<bool>)>("expungeByName", [](std::shared_ptr<DNSDistPacketCache> cache, const std::string& name, boost::optional<uint16_t> qtype, boost::optional<bool> suffixMatch) {
+      if(cache)
+        cache->expungeByName(DNSName(name), qtype ? *qtype : QType::ANY, suffixMatch ? *suffixMatch : false);
+    });
+  g_lua.registerFunction<void(std::shared_ptr<DNSDistPacketCache>::*)()>("printStats", [](const std::shared_ptr<DNSDistPacketCache> cache) {
+      if(cache) {
+        g_outputBuffer="Entries: " + std::to_string(cache->getSize()) + "/" + std::to_string(cache->getMaxEntries()) + "\n";
+        g_outputBuffer+="Hits: " + std::to_string(cache->getHits()) + "\n";
+        g_outputBuffer+="Misses: " + std::to_string(cache->getMisses()) + "\n";
+        g_outputBuffer+="Deferred inserts: " + std::to_string(cache->getDeferredInserts()) + "\n";
+        g_outputBuffer+="Deferred lookups: " + std::to_string(cache->getDeferredLookups()) + "\n";
+        g_outputBuffer+="Lookup Collisions: " + std::to_string(cache->getLookupCollisions()) + "\n";
+        g_outputBuffer+="Insert Collisions: " + std::to_string(cache->getInsertCollisions()) + "\n";
+      }
+    });
+
+  g_lua.writeFunction("getPool", [client](const string& poolName) {
+      if(client) {
+        return std::make_shared<ServerPool>();
+      }
+      return createPoolIfNotExists(poolName);
+    });
+  g_lua.registerFunction<void(std::shared_ptr<ServerPool>::*)(std::shared_ptr<DNSDistPacketCache>)>("setCache", [](std::shared_ptr<ServerPool> pool, std::shared_ptr<DNSDistPacketCache> cache) {
+      if(pool)
+        std::atomic_store(&pool->packetCache, cache);
+    });
+  g_lua.registerFunction<std::shared_ptr<DNSDistPacketCache>(std::shared_ptr<ServerPool>::*)()>("getCache", [](const std::shared_ptr<ServerPool> pool) {
+      std::shared_ptr<DNSDistPacketCache> cache;
+      if(pool)
+        cache = std::atomic_load(&pool->packetCache);
+      return cache;
+    });
+  g_lua.registerFunction<void(std::shared_ptr<ServerPool>::*)()>("unsetCache", [](std::shared_ptr<ServerPool> pool) {
+      if(pool)
+        std::atomic_store(&pool->packetCache, std::shared_ptr<DNSDistPacketCache>(nullptr));
+    });
+
+  g_lua.writeFunction("showPools", []() {
+      try {
+        ostringstream ret;
+        boost::format fmt("%1$-20.20s %|25t|%2$20s %|50t|%3%" );
+        //             1        2         3
+        ret << (fmt % "Name" % "Cache" % "Servers" ) << endl;
+
+        auto servers = g_dstates.getCopy();
+        for(const auto& entry : g_pools.getCopy()) {
+          const string& name = entry.first;
+          auto packetCache = std::atomic_load(&entry.second->packetCache);
+          string cache = packetCache != nullptr ? packetCache->toString() : "";
+          string serversStr;
+          for(const auto& s : getDownstreamCandidates(servers, name)) {
+            if(!serversStr.empty())
+              serversStr += ", ";
+            serversStr += s.second->remote.toStringWithPort();
+          }
+          ret << (fmt % name % cache % serversStr) << endl;
+        }
+        g_outputBuffer=ret.str();
+      }catch(std::exception& e) { g_outputBuffer=e.what(); throw; }
+    });
+
   g_lua.registerFunction<void(DownstreamState::*)(int)>("setQPS", [](DownstreamState& s, int lim) { s.qps = lim ? QPSLimiter(lim, lim) : QPSLimiter(); });
   g_lua.registerFunction<void(DownstreamState::*)(string)>("addPool", [](DownstreamState& s, string pool) { s.pools.insert(pool);});
   g_lua.registerFunction<void(DownstreamState::*)(string)>("rmPool", [](DownstreamState& s, string pool) { s.pools.erase(pool);});
@@ -595,14 +737,13 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       }
     });
 
-  // something needs to be done about this, unlocked will 'mostly' work
   g_lua.writeFunction("topClients", [](unsigned int top) {
       map<ComboAddress, int,ComboAddress::addressOnlyLessThan > counts;
       unsigned int total=0;
-      for(const auto& c : g_rings.clientRing) {
-	counts[c]++;
-	total++;
-      }
+      g_rings.forEachClient([&](const ComboAddress& c) {
+	  counts[c]++;
+	  total++;
+	});
       vector<pair<int, ComboAddress>> rcounts;
       for(const auto& c : counts) 
 	rcounts.push_back(make_pair(c.second, c.first));
@@ -626,19 +767,18 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
       map<DNSName, int> counts;
       unsigned int total=0;
       if(!labels) {
-	for(const auto& a : g_rings.queryRing) {
-	  counts[a]++;
-	  total++;
-	}
+	g_rings.forEachQuery([&](const DNSName& a) {
+	    counts[a]++;
+	    total++;
+	  });
       }
       else {
 	unsigned int lab = *labels;
-	for(auto a : g_rings.queryRing) {
-	  a.trimToLabels(lab);
-	  counts[a]++;
-	  total++;
-	}
-
+	g_rings.forEachQuery([&](DNSName a) {
+	    a.trimToLabels(lab);
+	    counts[a]++;
+	    total++;
+	  });
       }
       // cout<<"Looked at "<<total<<" queries, "<<counts.size()<<" different ones"<<endl;
       vector<pair<int, DNSName>> rcounts;
@@ -668,11 +808,10 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 
 
   g_lua.writeFunction("getResponseRing", []() {
-      decltype(g_rings.respRing) ring;
-      {
-	std::lock_guard<std::mutex> lock(g_rings.respMutex);
-	ring = g_rings.respRing;
-      }
+      vector<Rings::Response> ring;
+      g_rings.forEachResponse([&ring](const Rings::Response& r) {
+	  ring.push_back(r);
+	});
       vector<std::unordered_map<string, boost::variant<string, unsigned int> > > ret;
       ret.reserve(ring.size());
       decltype(ret)::value_type item;
@@ -689,28 +828,25 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
   g_lua.writeFunction("getTopResponses", [](unsigned int top, unsigned int kind, boost::optional<int> labels) {
       map<DNSName, int> counts;
       unsigned int total=0;
-      {
-	std::lock_guard<std::mutex> lock(g_rings.respMutex);
-	if(!labels) {
-	  for(const auto& a : g_rings.respRing) {
+      if(!labels) {
+	g_rings.forEachResponse([&](const Rings::Response& a) {
 	    if(a.rcode!=kind)
-	      continue;
+	      return;
 	    counts[a.name]++;
 	    total++;
-	  }
-	}
-	else {
-	  unsigned int lab = *labels;
-	  for(auto a : g_rings.respRing) {
+	  });
+      }
+      else {
+	unsigned int lab = *labels;
+	g_rings.forEachResponse([&](const Rings::Response& a) {
 	    if(a.rcode!=kind)
-	      continue;
+	      return;
 
-	    a.name.trimToLabels(lab);
-	    counts[a.name]++;
+	    DNSName name(a.name);
+	    name.trimToLabels(lab);
+	    counts[name]++;
 	    total++;
-	  }
-	  
-	}
+	  });
       }
       //      cout<<"Looked at "<<total<<" responses, "<<counts.size()<<" different ones"<<endl;
       vector<pair<int, DNSName>> rcounts;
@@ -749,9 +885,7 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 
       double totlat=0;
       int size=0;
-      {
-	std::lock_guard<std::mutex> lock(g_rings.respMutex);
-	for(const auto& r : g_rings.respRing) {
+      g_rings.forEachResponse([&](const Rings::Response& r) {
 	  ++size;
 	  auto iter = histo.lower_bound(r.usec);
 	  if(iter != histo.end())
@@ -759,8 +893,7 @@ vector<std::function<void(void)>> setupLua(bool client, const std::string& confi
 	  else
 	    histo.rbegin()++;
 	  totlat+=r.usec;
-	}
-      }
+	});
 
       g_outputBuffer = (boost::format("Average response latency: %.02f msec\n") % (0.001*totlat/size)).str();
       double highest=0;
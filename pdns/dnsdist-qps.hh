@@ -0,0 +1,168 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "dnsdist-idstate.hh"
+#include "iputils.hh"
+#include "misc.hh"
+
+class QPSLimiter
+{
+public:
+  QPSLimiter()
+  {
+  }
+
+  QPSLimiter(unsigned int rate, unsigned int burst) : d_rate(rate), d_burst(burst), d_tokens(burst)
+  {
+    d_passthrough=false;
+    d_prev.start();
+  }
+
+  unsigned int getRate() const
+  {
+    return d_passthrough? 0 : d_rate;
+  }
+
+  int getPassed() const
+  {
+    return d_passed;
+  }
+  int getBlocked() const
+  {
+    return d_blocked;
+  }
+
+  bool check() const // this is not quite fair
+  {
+    if(d_passthrough)
+      return true;
+    auto delta = d_prev.udiffAndSet();
+  
+    d_tokens += 1.0*d_rate * (delta/1000000.0);
+
+    if(d_tokens > d_burst)
+      d_tokens = d_burst;
+
+    bool ret=false;
+    if(d_tokens >= 1.0) { // we need this because burst=1 is weird otherwise
+      ret=true;
+      --d_tokens;
+      d_passed++;
+    }
+    else
+      d_blocked++;
+
+    return ret; 
+  }
+private:
+  bool d_passthrough{true};
+  unsigned int d_rate;
+  unsigned int d_burst;
+  mutable double d_tokens;
+  mutable StopWatch d_prev;
+  mutable unsigned int d_passed{0};
+  mutable unsigned int d_blocked{0};
+};
+
+/* Keeps a token bucket per client address. The buckets live in a fixed size open-addressed
+   table, split in shards with their own lock. An address can only sit in one of a few slots
+   following its hash: when they are all taken, the least recently seen one is reused, so a
+   flood of spoofed sources can't make the table grow. Reusing a slot that was seen within the
+   expiration delay counts as an eviction. */
+class QPSLimiterTable
+{
+public:
+  QPSLimiterTable(unsigned int qps, size_t maxEntries, unsigned int expiration) :
+    d_shards(s_shards), d_qps(qps), d_expiration(expiration)
+  {
+    size_t perShard = std::max(maxEntries / s_shards, (size_t)s_probes);
+    for(auto& shard : d_shards)
+      shard.entries.resize(perShard);
+  }
+
+  //! returns false when addr is over its rate
+  bool check(const ComboAddress& addr, time_t now)
+  {
+    uint32_t hash;
+    if(addr.sin4.sin_family == AF_INET)
+      hash = burtle((const unsigned char*)&addr.sin4.sin_addr.s_addr, sizeof(addr.sin4.sin_addr.s_addr), 0);
+    else
+      hash = burtle((const unsigned char*)&addr.sin6.sin6_addr.s6_addr, sizeof(addr.sin6.sin6_addr.s6_addr), 0);
+
+    Shard& shard = d_shards[hash % s_shards];
+    std::lock_guard<std::mutex> lock(shard.lock);
+    Entry& entry = getEntry(shard, addr, hash / s_shards, now);
+    entry.lastSeen = now;
+    return entry.limiter.check();
+  }
+
+  size_t getSize() const
+  {
+    return s_shards * d_shards[0].entries.size();
+  }
+
+  uint64_t getEntriesCount() const
+  {
+    return d_entries;
+  }
+
+  uint64_t getEvictionsCount() const
+  {
+    return d_evictions;
+  }
+
+  static const unsigned int s_shards = 16;
+  static const unsigned int s_probes = 8;
+
+private:
+  struct Entry
+  {
+    Entry()
+    {
+      addr.sin4.sin_family = 0; // marks a slot that was never used
+    }
+    ComboAddress addr;
+    QPSLimiter limiter;
+    time_t lastSeen{0};
+  };
+
+  struct Shard
+  {
+    std::mutex lock;
+    vector<Entry> entries;
+  };
+
+  Entry& getEntry(Shard& shard, const ComboAddress& addr, uint32_t hash, time_t now)
+  {
+    Entry* replacement = nullptr;
+    for(unsigned int n = 0; n < s_probes; ++n) {
+      Entry& entry = shard.entries[(hash + n) % shard.entries.size()];
+      if(entry.addr.sin4.sin_family == 0) {
+        if(!replacement || replacement->addr.sin4.sin_family != 0)
+          replacement = &entry;
+        continue;
+      }
+      if(entry.addr == addr)
+        return entry;
+      if(!replacement || (replacement->addr.sin4.sin_family != 0 && entry.lastSeen < replacement->lastSeen))
+        replacement = &entry;
+    }
+
+    if(replacement->addr.sin4.sin_family == 0)
+      d_entries++;
+    else if(replacement->lastSeen + d_expiration > now)
+      d_evictions++;
+
+    replacement->addr = addr;
+    replacement->limiter = QPSLimiter(d_qps, d_qps);
+    return *replacement;
+  }
+
+  vector<Shard> d_shards;
+  std::atomic<uint64_t> d_entries{0};
+  std::atomic<uint64_t> d_evictions{0};
+  unsigned int d_qps;
+  unsigned int d_expiration;
+};
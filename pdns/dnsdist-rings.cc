@@ -0,0 +1,53 @@
+#include "dnsdist-rings.hh"
+
+void Rings::setCapacity(size_t capacity, size_t numberOfShards)
+{
+  if(!numberOfShards)
+    numberOfShards = 1;
+  size_t perShard = capacity / numberOfShards;
+  if(!perShard)
+    perShard = 1;
+
+  d_shards.clear();
+  d_shards.reserve(numberOfShards);
+  for(size_t n = 0; n < numberOfShards; ++n) {
+    std::unique_ptr<Shard> shard(new Shard());
+    shard->clientRing.set_capacity(perShard);
+    shard->queryRing.set_capacity(perShard);
+    shard->respRing.set_capacity(perShard);
+    d_shards.push_back(std::move(shard));
+  }
+}
+
+template<typename T> void Rings::insert(boost::circular_buffer<T> Shard::* ring, std::mutex Shard::* lock, T&& item)
+{
+  size_t start = d_currentShard++;
+  for(size_t n = 0; n < d_shards.size(); ++n) {
+    Shard& shard = *d_shards[(start + n) % d_shards.size()];
+    std::unique_lock<std::mutex> guard(shard.*lock, std::try_to_lock);
+    if(guard.owns_lock()) {
+      (shard.*ring).push_back(std::move(item));
+      return;
+    }
+  }
+
+  /* all shards are busy, wait for ours */
+  Shard& shard = *d_shards[start % d_shards.size()];
+  std::lock_guard<std::mutex> guard(shard.*lock);
+  (shard.*ring).push_back(std::move(item));
+}
+
+void Rings::insertClient(const ComboAddress& requestor)
+{
+  insert(&Shard::clientRing, &Shard::queryLock, ComboAddress(requestor));
+}
+
+void Rings::insertQuery(const DNSName& name)
+{
+  insert(&Shard::queryRing, &Shard::queryLock, DNSName(name));
+}
+
+void Rings::insertResponse(const DNSName& name, uint16_t qtype, uint8_t rcode, unsigned int usec)
+{
+  insert(&Shard::respRing, &Shard::respLock, Response{name, qtype, rcode, usec});
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <boost/circular_buffer.hpp>
+#include <boost/noncopyable.hpp>
+#include "iputils.hh"
+#include "dnsname.hh"
+
+/* The rings keep the most recent clients, queries and responses around for the
+   top* console commands.
+
+   They are split in a number of shards, each with its own locks and a share of the
+   total capacity. Writers start at the next shard in turn and use the first one
+   they can lock without waiting, so receiver and responder threads almost never
+   contend. Readers visit all shards one after the other, so what they see is the merge
+   of all shards, but the ordering is only preserved within a shard. */
+
+struct Rings : boost::noncopyable
+{
+  struct Response
+  {
+    DNSName name;
+    uint16_t qtype;
+    uint8_t rcode;
+    unsigned int usec;
+  };
+
+  Rings(size_t capacity=10000, size_t numberOfShards=10)
+  {
+    setCapacity(capacity, numberOfShards);
+  }
+
+  //! not thread-safe, only call this before any thread uses the rings
+  void setCapacity(size_t capacity, size_t numberOfShards);
+
+  void insertClient(const ComboAddress& requestor);
+  void insertQuery(const DNSName& name);
+  void insertResponse(const DNSName& name, uint16_t qtype, uint8_t rcode, unsigned int usec);
+
+  template<typename Visitor> void forEachClient(Visitor visitor)
+  {
+    for(auto& shard : d_shards) {
+      std::lock_guard<std::mutex> lock(shard->queryLock);
+      for(const auto& c : shard->clientRing)
+        visitor(c);
+    }
+  }
+
+  template<typename Visitor> void forEachQuery(Visitor visitor)
+  {
+    for(auto& shard : d_shards) {
+      std::lock_guard<std::mutex> lock(shard->queryLock);
+      for(const auto& q : shard->queryRing)
+        visitor(q);
+    }
+  }
+
+  template<typename Visitor> void forEachResponse(Visitor visitor)
+  {
+    for(auto& shard : d_shards) {
+      std::lock_guard<std::mutex> lock(shard->respLock);
+      for(const auto& r : shard->respRing)
+        visitor(r);
+    }
+  }
+
+  size_t getNumberOfShards() const
+  {
+    return d_shards.size();
+  }
+
+private:
+  struct Shard
+  {
+    boost::circular_buffer<ComboAddress> clientRing;
+    boost::circular_buffer<DNSName> queryRing;
+    boost::circular_buffer<Response> respRing;
+    std::mutex queryLock; // protects clientRing and queryRing
+    std::mutex respLock;
+  };
+
+  template<typename T> void insert(boost::circular_buffer<T> Shard::* ring, std::mutex Shard::* lock, T&& item);
+
+  std::vector<std::unique_ptr<Shard> > d_shards;
+  std::atomic<size_t> d_currentShard{0};
+};
@@ -122,6 +122,7 @@ void* tcpClientThread(int pipefd)
      
   auto localPolicy = g_policy.getLocal();
   auto localRulactions = g_rulactions.getLocal();
+  auto localServers = g_dstates.getLocal();
 
   map<ComboAddress,int> sockets;
   for(;;) {
@@ -205,9 +206,12 @@ void* tcpClientThread(int pipefd)
 	  goto drop;
 	}
 
-	{
+	if(localPolicy->isLua) {
 	  std::lock_guard<std::mutex> lock(g_luamutex);
-	  ds = localPolicy->policy(getDownstreamCandidates(g_dstates.getCopy(), pool), ci.remote, qname, qtype, dh);
+	  ds = localPolicy->policy(getDownstreamCandidates(*localServers, pool), ci.remote, qname, qtype, dh);
+	}
+	else {
+	  ds = localPolicy->policy(getDownstreamCandidates(*localServers, pool), ci.remote, qname, qtype, dh);
 	}
 	int dsock;
 	if(!ds) {
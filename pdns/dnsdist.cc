@@ -20,6 +20,9 @@
     Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include "dnsdist.hh"
 #include "sstuff.hh"
 #include "misc.hh"
@@ -41,8 +44,7 @@
 
 /* Known sins:
 
-   Receiver is currently singlethreaded
-      not *that* bad actually, but now that we are thread safe, might want to scale
+   Receiver is singlethreaded per address by default, use the 'udpThreads' parameter of addLocal() to scale
    TCP is a bit wonky and may pick the wrong downstream
    ringbuffers are on a wing & a prayer because partially unlocked
 */
@@ -58,14 +60,17 @@ using std::thread;
 bool g_verbose;
 
 struct DNSDistStats g_stats;
-uint16_t g_maxOutstanding;
+size_t g_maxOutstanding;
+bool g_timeoutQNames;
 bool g_console;
 
 GlobalStateHolder<NetmaskGroup> g_ACL;
 string g_outputBuffer;
-vector<std::pair<ComboAddress, bool>> g_locals;
+vector<std::tuple<ComboAddress, bool, bool, unsigned int>> g_locals;
 
 /* UDP: the grand design. Per socket we listen on for incoming queries there is one thread.
+   An address can be served by several threads, either sharing a socket or each having a
+   socket of its own, bound with SO_REUSEPORT so the kernel spreads the queries over them.
    Then we have a bunch of connected sockets for talking to downstream servers. 
    We send directly to those sockets.
 
@@ -102,11 +107,13 @@ GlobalStateHolder<vector<pair<std::shared_ptr<DNSRule>, std::shared_ptr<DNSActio
 Rings g_rings;
 
 GlobalStateHolder<servers_t> g_dstates;
+GlobalStateHolder<pools_t> g_pools;
 
 int g_tcpRecvTimeout{2};
 int g_tcpSendTimeout{2};
 
 bool g_truncateTC{1};
+size_t g_udpVectorSize{1};
 void truncateTC(const char* packet, unsigned int* len)
 try
 {
@@ -138,72 +145,216 @@ struct DelayedPacket
 
 DelayPipe<DelayedPacket> g_delay;
 
-// listens on a dedicated socket, lobs answers from downstream servers to original requestors
-void* responderThread(std::shared_ptr<DownstreamState> state)
+static void doAvg(double& var, double n, double weight)
+{
+  var = (weight -1) * var/weight + n/weight;
+}
+
+static void sendUDPResponse(int origFD, const char* response, uint16_t responseLen, const ComboAddress& origDest, const ComboAddress& origRemote)
+{
+  if(origDest.sin4.sin_family == 0)
+    sendto(origFD, response, responseLen, 0, (struct sockaddr*)&origRemote, origRemote.getSocklen());
+  else
+    sendfromto(origFD, response, responseLen, 0, origDest, origRemote);
+}
+
+/* handles a response from a downstream server: restores the original ID, updates the statistics and the
+   packet cache and releases the IDState. Returns false if the response should not be relayed,
+   otherwise origFD, origRemote and origDest say where it should go. Delayed responses are taken care of here. */
+static bool processResponse(DownstreamState* state, char* packet, int* len, int* origFD, ComboAddress* origRemote, ComboAddress* origDest)
 {
-  char packet[4096];
-  
   struct dnsheader* dh = (struct dnsheader*)packet;
-  int len;
-  for(;;) {
-    len = recv(state->fd, packet, sizeof(packet), 0);
-    if(len < (signed)sizeof(dnsheader))
-      continue;
+  if(*len < (signed)sizeof(dnsheader))
+    return false;
 
-    if(dh->id >= state->idStates.size())
-      continue;
+  if(dh->id >= state->idStates.size())
+    return false;
 
-    IDState* ids = &state->idStates[dh->id];
-    if(ids->origFD < 0) // duplicate
-      continue;
-    else
-      --state->outstanding;  // you'd think an attacker could game this, but we're using connected socket
+  IDState* ids = &state->idStates[dh->id];
+  if(ids->origFD < 0) // duplicate
+    return false;
 
-    if(dh->tc && g_truncateTC) {
-      truncateTC(packet, (unsigned int*)&len);
+  DNSName qname;
+  if(dh->qdcount) {
+    uint16_t qtype, qclass;
+    unsigned int consumed;
+    try {
+      qname = DNSName(packet, *len, sizeof(dnsheader), false, &qtype, &qclass, &consumed);
+    }
+    catch(std::exception& e) {
+      return false;
+    }
+    /* a late answer for a slot that has since been reused for another query */
+    if(qtype != ids->qtype || qclass != ids->qclass || burtleCI((const unsigned char*)packet + sizeof(dnsheader), consumed, 0) != ids->qnameHash) {
+      g_stats.mismatchedResponses++;
+      return false;
     }
+  }
+
+  --state->outstanding;  // you'd think an attacker could game this, but we're using connected socket
+
+  if(dh->tc && g_truncateTC) {
+    truncateTC(packet, (unsigned int*)len);
+  }
+
+  /* the query path might be reusing this slot right now, so we take our own reference */
+  auto packetCache = std::atomic_load(&ids->packetCache);
+  if(packetCache && !dh->tc) {
+    packetCache->insert(ids->cacheKey, qname, ids->qtype, ids->qclass, packet, *len);
+  }
+
+  dh->id = ids->origID;
+  g_stats.responses++;
+
+  bool relayNow = true;
+  if(ids->delayMsec) {
+    DelayedPacket dp{ids->origFD, string(packet,*len), ids->origRemote, ids->origDest};
+    g_delay.submit(dp, ids->delayMsec);
+    relayNow = false;
+  }
+  else {
+    *origFD = ids->origFD;
+    *origRemote = ids->origRemote;
+    *origDest = ids->origDest;
+  }
+  double udiff = ids->sentTime.udiff();
+  vinfolog("Got answer from %s, relayed to %s, took %f usec", state->remote.toStringWithPort(), ids->origRemote.toStringWithPort(), udiff);
+
+  g_rings.insertResponse(qname, ids->qtype, dh->rcode, udiff);
+  if(dh->rcode == 2)
+    g_stats.servfailResponses++;
+  state->latencyUsec = (127.0 * state->latencyUsec / 128.0) + udiff/128.0;
+
+  if(udiff < 1000) g_stats.latency0_1++;
+  else if(udiff < 10000) g_stats.latency1_10++;
+  else if(udiff < 50000) g_stats.latency10_50++;
+  else if(udiff < 100000) g_stats.latency50_100++;
+  else if(udiff < 1000000) g_stats.latency100_1000++;
+  else g_stats.latencySlow++;
+  
+  doAvg(g_stats.latencyAvg100,     udiff,     100);
+  doAvg(g_stats.latencyAvg1000,    udiff,    1000);
+  doAvg(g_stats.latencyAvg10000,   udiff,   10000);
+  doAvg(g_stats.latencyAvg1000000, udiff, 1000000);
 
-    dh->id = ids->origID;
-    g_stats.responses++;
+  ids->origFD = -1;
+  return relayNow;
+}
 
-    if(ids->delayMsec) {
-      DelayedPacket dp{ids->origFD, string(packet,len), ids->origRemote, ids->origDest};
-      g_delay.submit(dp, ids->delayMsec);
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+/* sendmmsg() can stop early: it returns how many messages went out, or -1 when the first one failed.
+   This keeps calling it until every message was sent or skipped, and returns how many were skipped */
+static unsigned int sendMultipleMessages(int fd, struct mmsghdr* msgs, unsigned int count)
+{
+  unsigned int done = 0, failed = 0;
+  while(done < count) {
+    int sent = sendmmsg(fd, msgs + done, count - done, 0);
+    if(sent > 0) {
+      done += sent;
     }
-    else {
-      if(ids->origDest.sin4.sin_family == 0)
-	sendto(ids->origFD, packet, len, 0, (struct sockaddr*)&ids->origRemote, ids->origRemote.getSocklen());
-      else
-	sendfromto(ids->origFD, packet, len, 0, ids->origDest, ids->origRemote);
+    else if(sent < 0 && errno == EINTR) {
+      continue;
+    }
+    else { // the first message that was left failed, the ones after it may still go out
+      done++;
+      failed++;
     }
-    double udiff = ids->sentTime.udiff();
-    vinfolog("Got answer from %s, relayed to %s, took %f usec", state->remote.toStringWithPort(), ids->origRemote.toStringWithPort(), udiff);
+  }
+  return failed;
+}
+
+/* the batched version of responderThread: pulls up to g_udpVectorSize responses per recvmmsg() call,
+   and relays them with one sendmmsg() call per origin socket */
+static void* multipleMessagesResponderThread(std::shared_ptr<DownstreamState> state)
+{
+  struct MMResponse
+  {
+    char packet[4096];
+    struct iovec iov;
+    struct iovec outIov;
+    ComboAddress origRemote;
+    ComboAddress origDest;
+    char cbuf[256];
+    int origFD;
+  };
+  const size_t vectSize = g_udpVectorSize;
+  std::unique_ptr<MMResponse[]> data(new MMResponse[vectSize]);
+  std::unique_ptr<struct mmsghdr[]> inMsgs(new struct mmsghdr[vectSize]);
+  std::unique_ptr<struct mmsghdr[]> outMsgs(new struct mmsghdr[vectSize]);
+  vector<unsigned int> toRelay;
+  toRelay.reserve(vectSize);
+
+  for(size_t idx = 0; idx < vectSize; idx++) {
+    memset(&inMsgs[idx], 0, sizeof(inMsgs[idx]));
+    data[idx].iov.iov_base = data[idx].packet;
+    data[idx].iov.iov_len = sizeof(data[idx].packet);
+    inMsgs[idx].msg_hdr.msg_iov = &data[idx].iov;
+    inMsgs[idx].msg_hdr.msg_iovlen = 1;
+  }
 
-    {
-      std::lock_guard<std::mutex> lock(g_rings.respMutex);
-      g_rings.respRing.push_back({ids->qname, ids->qtype, (uint8_t)dh->rcode, (unsigned int)udiff});
+  for(;;) {
+    int msgsGot = recvmmsg(state->fd, inMsgs.get(), vectSize, MSG_WAITFORONE, nullptr);
+    if(msgsGot <= 0)
+      continue;
+    g_stats.udpBatches++;
+    g_stats.udpBatchedPackets += msgsGot;
+    doAvg(g_stats.udpBatchSizeAvg, msgsGot, 100);
+
+    toRelay.clear();
+    for(int idx = 0; idx < msgsGot; idx++) {
+      MMResponse& resp = data[idx];
+      int len = inMsgs[idx].msg_len;
+      if(processResponse(state.get(), resp.packet, &len, &resp.origFD, &resp.origRemote, &resp.origDest)) {
+        resp.outIov.iov_base = resp.packet;
+        resp.outIov.iov_len = len;
+        toRelay.push_back(idx);
+      }
     }
-    if(dh->rcode == 2)
-      g_stats.servfailResponses++;
-    state->latencyUsec = (127.0 * state->latencyUsec / 128.0) + udiff/128.0;
-
-    if(udiff < 1000) g_stats.latency0_1++;
-    else if(udiff < 10000) g_stats.latency1_10++;
-    else if(udiff < 50000) g_stats.latency10_50++;
-    else if(udiff < 100000) g_stats.latency50_100++;
-    else if(udiff < 1000000) g_stats.latency100_1000++;
-    else g_stats.latencySlow++;
-    
-    auto doAvg = [](double& var, double n, double weight) {
-      var = (weight -1) * var/weight + n/weight;
-    };
 
-    doAvg(g_stats.latencyAvg100,     udiff,     100);
-    doAvg(g_stats.latencyAvg1000,    udiff,    1000);
-    doAvg(g_stats.latencyAvg10000,   udiff,   10000);
-    doAvg(g_stats.latencyAvg1000000, udiff, 1000000);
+    /* responses usually all go out via the same few frontend sockets, so we group them by socket */
+    while(!toRelay.empty()) {
+      int fd = data[toRelay.front()].origFD;
+      unsigned int count = 0;
+      for(auto it = toRelay.begin(); it != toRelay.end(); ) {
+        MMResponse& resp = data[*it];
+        if(resp.origFD != fd) {
+          ++it;
+          continue;
+        }
+        struct msghdr& msgh = outMsgs[count].msg_hdr;
+        memset(&outMsgs[count], 0, sizeof(outMsgs[count]));
+        msgh.msg_iov = &resp.outIov;
+        msgh.msg_iovlen = 1;
+        msgh.msg_name = (struct sockaddr*)&resp.origRemote;
+        msgh.msg_namelen = resp.origRemote.getSocklen();
+        if(resp.origDest.sin4.sin_family)
+          addCMsgSrcAddr(&msgh, resp.cbuf, &resp.origDest);
+        count++;
+        it = toRelay.erase(it);
+      }
+      sendMultipleMessages(fd, outMsgs.get(), count);
+    }
+  }
+  return 0;
+}
+#endif
+
+// listens on a dedicated socket, lobs answers from downstream servers to original requestors
+void* responderThread(std::shared_ptr<DownstreamState> state)
+{
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+  if(g_udpVectorSize > 1)
+    return multipleMessagesResponderThread(state);
+#endif
 
-    ids->origFD = -1;
+  char packet[4096];
+  int len;
+  int origFD;
+  ComboAddress origRemote, origDest;
+  for(;;) {
+    len = recv(state->fd, packet, sizeof(packet), 0);
+    if(processResponse(state.get(), packet, &len, &origFD, &origRemote, &origDest))
+      sendUDPResponse(origFD, packet, len, origDest, origRemote);
   }
   return 0;
 }
@@ -221,6 +372,8 @@ DownstreamState::DownstreamState(const ComboAddress& remote_)
   fd = SSocket(remote.sin4.sin_family, SOCK_DGRAM, 0);
   SConnect(fd, remote);
   idStates.resize(g_maxOutstanding);
+  if(g_timeoutQNames)
+    idQNames.resize(g_maxOutstanding);
   sw.start();
   infolog("Added downstream server %s", remote.toStringWithPort());
 }
@@ -294,8 +447,8 @@ shared_ptr<DownstreamState> roundrobin(const NumberedServerVector& servers, cons
   if(res->empty())
     return shared_ptr<DownstreamState>();
 
-  static unsigned int counter;
- 
+  static std::atomic<unsigned int> counter{0};
+
   return (*res)[(counter++) % res->size()].second;
 }
 
@@ -348,6 +501,29 @@ NumberedServerVector getDownstreamCandidates(const servers_t& servers, const std
   return ret;
 }
 
+std::shared_ptr<ServerPool> getPool(const pools_t& pools, const std::string& poolName)
+{
+  auto it = pools.find(poolName);
+  if(it == pools.end())
+    return nullptr;
+  return it->second;
+}
+
+std::shared_ptr<ServerPool> createPoolIfNotExists(const std::string& poolName)
+{
+  std::shared_ptr<ServerPool> pool;
+  g_pools.modify([poolName, &pool](pools_t& pools) {
+      auto it = pools.find(poolName);
+      if(it != pools.end()) {
+        pool = it->second;
+        return;
+      }
+      pool = std::make_shared<ServerPool>();
+      pools.insert({poolName, pool});
+    });
+  return pool;
+}
+
 // goal in life - if you send us a reasonably normal packet, we'll get Z for you, otherwise 0
 int getEDNSZ(const char* packet, unsigned int len)
 {
@@ -371,167 +547,331 @@ int getEDNSZ(const char* packet, unsigned int len)
 }
 
 
-// listens to incoming queries, sends out to downstream servers, noting the intended return path 
-void* udpClientThread(ClientState* cs)
-try
-{
-  ComboAddress remote;
-  remote.sin4.sin_family = cs->local.sin4.sin_family;
-  char packet[1500];
-  struct dnsheader* dh = (struct dnsheader*) packet;
-  int len;
-
-  string qname;
-  uint16_t qtype;
+typedef std::function<bool(ComboAddress, DNSName, uint16_t, dnsheader*)> blockfilter_t;
 
-  typedef std::function<bool(ComboAddress, DNSName, uint16_t, dnsheader*)> blockfilter_t;
-  blockfilter_t blockFilter = 0;
-
-  
+// the per-thread copies of the global state consulted for every query
+struct LocalHolders
+{
+  LocalHolders() : acl(g_ACL.getLocal()), policy(g_policy.getLocal()), rulactions(g_rulactions.getLocal()), servers(g_dstates.getLocal()), pools(g_pools.getLocal())
   {
     std::lock_guard<std::mutex> lock(g_luamutex);
     auto candidate = g_lua.readVariable<boost::optional<blockfilter_t> >("blockFilter");
     if(candidate)
       blockFilter = *candidate;
   }
-  auto acl = g_ACL.getLocal();
-  auto localPolicy = g_policy.getLocal();
 
-  auto localRulactions = g_rulactions.getLocal();
-  auto localServers = g_dstates.getLocal();
-  struct msghdr msgh;
-  struct iovec iov;
-  char cbuf[256];
+  LocalStateHolder<NetmaskGroup> acl;
+  LocalStateHolder<ServerPolicy> policy;
+  LocalStateHolder<vector<pair<std::shared_ptr<DNSRule>, std::shared_ptr<DNSAction> > > > rulactions;
+  LocalStateHolder<servers_t> servers;
+  LocalStateHolder<pools_t> pools;
+  blockfilter_t blockFilter{0};
+};
 
-  remote.sin6.sin6_family=cs->local.sin6.sin6_family;
-  fillMSGHdr(&msgh, &iov, cbuf, sizeof(cbuf), packet, sizeof(packet), &remote);
+/* processes a query received on cs from remote, on local address dest (family 0 if unknown).
+   Returns the downstream server the query has been assigned to, after which it only needs to be sent there.
+   If *answerNow is set, packet holds a response of *len bytes that needs to be sent back to remote.
+   Returns 0 and leaves *answerNow false if the query has been dropped. */
+static DownstreamState* processQuery(LocalHolders& holders, ClientState* cs, char* packet, int* len, size_t packetSize, const ComboAddress& remote, const ComboAddress& dest, bool* answerNow)
+{
+  struct dnsheader* dh = (struct dnsheader*) packet;
+  uint16_t qtype, qclass;
+  unsigned int consumed;
+  *answerNow = false;
 
-  for(;;) {
-    try {
-      len = recvmsg(cs->udpFD, &msgh, 0);
-      g_rings.clientRing.push_back(remote);
-      if(len < (int)sizeof(struct dnsheader)) 
-	continue;
-
-      g_stats.queries++;
-      if(!acl->match(remote)) {
-	g_stats.aclDrops++;
-	continue;
-      }
+  g_rings.insertClient(remote);
+  if(*len < (int)sizeof(struct dnsheader)) 
+    return 0;
+
+  g_stats.queries++;
+  if(!holders.acl->match(remote)) {
+    g_stats.aclDrops++;
+    return 0;
+  }
       
-      if(dh->qr)    // don't respond to responses
-	continue;
+  if(dh->qr)    // don't respond to responses
+    return 0;
       
-      DNSName qname(packet, len, 12, false, &qtype);
-      g_rings.queryRing.push_back(qname);
+  DNSName qname(packet, *len, 12, false, &qtype, &qclass, &consumed);
+  g_rings.insertQuery(qname);
             
-      if(blockFilter) {
-	std::lock_guard<std::mutex> lock(g_luamutex);
+  if(holders.blockFilter) {
+    std::lock_guard<std::mutex> lock(g_luamutex);
 	
-	if(blockFilter(remote, qname, qtype, dh)) {
-	  g_stats.blockFilter++;
-	  continue;
-	}
-      }
-
-      DNSAction::Action action=DNSAction::Action::None;
-      string ruleresult;
-      string pool;
-
-      for(const auto& lr : *localRulactions) {
-	if(lr.first->matches(remote, qname, qtype, dh, len)) {
-	  action=(*lr.second)(remote, qname, qtype, dh, len, &ruleresult);
-	  if(action != DNSAction::Action::None) {
-	    lr.first->d_matches++;
-	    break;
-	  }
-	}
-      }
-      int delayMsec=0;
-      switch(action) {
-      case DNSAction::Action::Drop:
-	g_stats.ruleDrop++;
-	continue;
-      case DNSAction::Action::Nxdomain:
-	dh->rcode = RCode::NXDomain;
-	dh->qr=true;
-	g_stats.ruleNXDomain++;
-	break;
-      case DNSAction::Action::Pool: 
-	pool=ruleresult;
-	break;
+    if(holders.blockFilter(remote, qname, qtype, dh)) {
+      g_stats.blockFilter++;
+      return 0;
+    }
+  }
 
-      case DNSAction::Action::Spoof:
-	;
-      case DNSAction::Action::HeaderModify:
-	dh->qr=true;
-	break;
+  DNSAction::Action action=DNSAction::Action::None;
+  string ruleresult;
+  string pool;
 
-      case DNSAction::Action::Delay:
-	delayMsec = atoi(ruleresult.c_str()); // sorry
-	break;
-      case DNSAction::Action::Allow:
-      case DNSAction::Action::None:
+  for(const auto& lr : *holders.rulactions) {
+    if(lr.first->matches(remote, qname, qtype, dh, *len)) {
+      action=(*lr.second)(remote, qname, qtype, dh, *len, &ruleresult);
+      if(action != DNSAction::Action::None) {
+	lr.first->d_matches++;
 	break;
       }
+    }
+  }
+  int delayMsec=0;
+  switch(action) {
+  case DNSAction::Action::Drop:
+    g_stats.ruleDrop++;
+    return 0;
+  case DNSAction::Action::Nxdomain:
+    dh->rcode = RCode::NXDomain;
+    dh->qr=true;
+    g_stats.ruleNXDomain++;
+    break;
+  case DNSAction::Action::Pool: 
+    pool=ruleresult;
+    break;
+
+  case DNSAction::Action::Spoof:
+    ;
+  case DNSAction::Action::HeaderModify:
+    dh->qr=true;
+    break;
+
+  case DNSAction::Action::Delay:
+    delayMsec = atoi(ruleresult.c_str()); // sorry
+    break;
+  case DNSAction::Action::Allow:
+  case DNSAction::Action::None:
+    break;
+  }
 
-      if(dh->qr) { // something turned it into a response
-	g_stats.selfAnswered++;
-	ComboAddress dest;
-	if(HarvestDestinationAddress(&msgh, &dest)) 
-	  sendfromto(cs->udpFD, packet, len, 0, dest, remote);
-	else
-	  sendto(cs->udpFD, packet, len, 0, (struct sockaddr*)&remote, remote.getSocklen());
+  if(dh->qr) { // something turned it into a response
+    g_stats.selfAnswered++;
+    *answerNow = true;
+    return 0;
+  }
 
-	continue;
-      }
+  std::shared_ptr<DNSDistPacketCache> packetCache = nullptr;
+  if(auto serverPool = getPool(*holders.pools, pool))
+    packetCache = std::atomic_load(&serverPool->packetCache);
+
+  uint32_t cacheKey = 0;
+  if(packetCache) {
+    uint16_t cachedResponseSize = packetSize;
+    if(packetCache->get(packet, *len, qname, qtype, qclass, consumed, packet, &cachedResponseSize, &cacheKey)) {
+      g_stats.cacheHits++;
+      *len = cachedResponseSize;
+      *answerNow = true;
+      return 0;
+    }
+    g_stats.cacheMisses++;
+  }
 
-      DownstreamState* ss = 0;
-      auto candidates=getDownstreamCandidates(*localServers, pool);
-      auto policy=localPolicy->policy;
-      {
-	std::lock_guard<std::mutex> lock(g_luamutex);
-	ss = policy(candidates, remote, qname, qtype, dh).get();
-      }
+  DownstreamState* ss = 0;
+  auto candidates=getDownstreamCandidates(*holders.servers, pool);
+  const auto& policy=*holders.policy;
+  if(policy.isLua) {
+    std::lock_guard<std::mutex> lock(g_luamutex);
+    ss = policy.policy(candidates, remote, qname, qtype, dh).get();
+  }
+  else {
+    ss = policy.policy(candidates, remote, qname, qtype, dh).get();
+  }
 
-      if(!ss) {
-	g_stats.noPolicy++;
-	continue;
-	
-      }
-      
-      ss->queries++;
-      
-      unsigned int idOffset = (ss->idOffset++) % ss->idStates.size();
-      IDState* ids = &ss->idStates[idOffset];
+  if(!ss) {
+    g_stats.noPolicy++;
+    return 0;
+  }
       
-      if(ids->origFD < 0) // if we are reusing, no change in outstanding
-	ss->outstanding++;
-      else {
-	ss->reuseds++;
-	g_stats.downstreamTimeouts++;
-      }
+  ss->queries++;
       
-      ids->origFD = cs->udpFD;
-      ids->age = 0;
-      ids->origID = dh->id;
-      ids->origRemote = remote;
-      ids->sentTime.start();
-      ids->qname = qname;
-      ids->qtype = qtype;
-      ids->origDest.sin4.sin_family=0;
-      ids->delayMsec = delayMsec;
-      HarvestDestinationAddress(&msgh, &ids->origDest);
+  bool reused;
+  unsigned int idOffset = pickIDState(ss->idStates, ss->idOffset, reused);
+  IDState* ids = &ss->idStates[idOffset];
+
+  if(!reused) // if we are reusing, no change in outstanding
+    ss->outstanding++;
+  else {
+    ss->reuseds++;
+    g_stats.downstreamTimeouts++;
+  }
       
-      dh->id = idOffset;
+  ids->age = 0;
+  ids->origID = dh->id;
+  ids->origRemote = remote;
+  ids->sentTime.start();
+  ids->qnameHash = burtleCI((const unsigned char*)packet + sizeof(dnsheader), consumed, 0);
+  if(!ss->idQNames.empty())
+    ss->idQNames.set(idOffset, packet + sizeof(dnsheader), consumed);
+  ids->qtype = qtype;
+  ids->qclass = qclass;
+  std::atomic_store(&ids->packetCache, packetCache);
+  ids->cacheKey = cacheKey;
+  ids->origDest = dest;
+  ids->delayMsec = delayMsec;
+  /* the responder thread only looks at a slot once origFD is set */
+  ids->origFD = cs->udpFD;
       
+  dh->id = idOffset;
+  vinfolog("Got query from %s, relayed to %s", remote.toStringWithPort(), ss->remote.toStringWithPort());
+  return ss;
+}
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+/* the batched version of udpClientThread: pulls up to g_udpVectorSize queries per recvmmsg() call, runs
+   them through the rules, then sends the forwarded queries with one sendmmsg() call per downstream server
+   and the responses we generated ourselves with one sendmmsg() call */
+static void* multipleMessagesUDPClientThread(ClientState* cs)
+{
+  struct MMReceiver
+  {
+    char packet[4096];
+    struct iovec iov;
+    struct iovec outIov;
+    ComboAddress remote;
+    ComboAddress dest;
+    char cbuf[256];
+    DownstreamState* ss;
+  };
+  const size_t vectSize = g_udpVectorSize;
+  std::unique_ptr<MMReceiver[]> data(new MMReceiver[vectSize]);
+  std::unique_ptr<struct mmsghdr[]> inMsgs(new struct mmsghdr[vectSize]);
+  std::unique_ptr<struct mmsghdr[]> outMsgs(new struct mmsghdr[vectSize]);
+  vector<unsigned int> toForward, toAnswer;
+  toForward.reserve(vectSize);
+  toAnswer.reserve(vectSize);
+
+  LocalHolders holders;
+
+  auto setupReceive = [&](size_t idx) {
+    data[idx].remote.sin4.sin_family = cs->local.sin4.sin_family;
+    fillMSGHdr(&inMsgs[idx].msg_hdr, &data[idx].iov, data[idx].cbuf, sizeof(data[idx].cbuf), data[idx].packet, sizeof(data[idx].packet), &data[idx].remote);
+    inMsgs[idx].msg_len = 0;
+  };
+  for(size_t idx = 0; idx < vectSize; idx++)
+    setupReceive(idx);
+
+  for(;;) {
+    int msgsGot = recvmmsg(cs->udpFD, inMsgs.get(), vectSize, MSG_WAITFORONE, nullptr);
+    if(msgsGot <= 0)
+      continue;
+    g_stats.udpBatches++;
+    g_stats.udpBatchedPackets += msgsGot;
+    doAvg(g_stats.udpBatchSizeAvg, msgsGot, 100);
+
+    toForward.clear();
+    toAnswer.clear();
+    for(int idx = 0; idx < msgsGot; idx++) {
+      MMReceiver& recvd = data[idx];
+      int len = inMsgs[idx].msg_len;
+      bool answerNow = false;
+      try {
+        HarvestDestinationAddress(&inMsgs[idx].msg_hdr, &recvd.dest);
+        recvd.ss = processQuery(holders, cs, recvd.packet, &len, sizeof(recvd.packet), recvd.remote, recvd.dest, &answerNow);
+      }
+      catch(std::exception& e) {
+        errlog("Got an error in UDP question thread: %s", e.what());
+        recvd.ss = 0;
+      }
+      recvd.outIov.iov_base = recvd.packet;
+      recvd.outIov.iov_len = len;
+      if(answerNow)
+        toAnswer.push_back(idx);
+      else if(recvd.ss)
+        toForward.push_back(idx);
+    }
+
+    if(!toAnswer.empty()) {
+      unsigned int count = 0;
+      for(auto idx : toAnswer) {
+        MMReceiver& recvd = data[idx];
+        struct msghdr& msgh = outMsgs[count].msg_hdr;
+        memset(&outMsgs[count], 0, sizeof(outMsgs[count]));
+        msgh.msg_iov = &recvd.outIov;
+        msgh.msg_iovlen = 1;
+        msgh.msg_name = (struct sockaddr*)&recvd.remote;
+        msgh.msg_namelen = recvd.remote.getSocklen();
+        if(recvd.dest.sin4.sin_family)
+          addCMsgSrcAddr(&msgh, recvd.cbuf, &recvd.dest);
+        count++;
+      }
+      sendMultipleMessages(cs->udpFD, outMsgs.get(), count);
+    }
+
+    /* downstream sockets are connected, so no addresses are needed, we only group the queries per server */
+    while(!toForward.empty()) {
+      DownstreamState* ss = data[toForward.front()].ss;
+      unsigned int count = 0;
+      for(auto it = toForward.begin(); it != toForward.end(); ) {
+        MMReceiver& recvd = data[*it];
+        if(recvd.ss != ss) {
+          ++it;
+          continue;
+        }
+        memset(&outMsgs[count], 0, sizeof(outMsgs[count]));
+        outMsgs[count].msg_hdr.msg_iov = &recvd.outIov;
+        outMsgs[count].msg_hdr.msg_iovlen = 1;
+        count++;
+        it = toForward.erase(it);
+      }
+      unsigned int failed = sendMultipleMessages(ss->fd, outMsgs.get(), count);
+      if(failed) {
+        ss->sendErrors += failed;
+        g_stats.downstreamSendErrors += failed;
+      }
+    }
+
+    for(int idx = 0; idx < msgsGot; idx++)
+      setupReceive(idx);
+  }
+  return 0;
+}
+#endif
+
+// listens to incoming queries, sends out to downstream servers, noting the intended return path 
+void* udpClientThread(ClientState* cs)
+try
+{
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+  if(g_udpVectorSize > 1)
+    return multipleMessagesUDPClientThread(cs);
+#endif
+
+  ComboAddress remote;
+  remote.sin4.sin_family = cs->local.sin4.sin_family;
+  char packet[4096];
+  int len;
+
+  LocalHolders holders;
+  struct msghdr msgh;
+  struct iovec iov;
+  char cbuf[256];
+
+  remote.sin6.sin6_family=cs->local.sin6.sin6_family;
+  fillMSGHdr(&msgh, &iov, cbuf, sizeof(cbuf), packet, sizeof(packet), &remote);
+
+  for(;;) {
+    try {
+      msgh.msg_controllen = sizeof(cbuf);
+      len = recvmsg(cs->udpFD, &msgh, 0);
+
+      ComboAddress dest;
+      HarvestDestinationAddress(&msgh, &dest);
+
+      bool answerNow = false;
+      DownstreamState* ss = processQuery(holders, cs, packet, &len, sizeof(packet), remote, dest, &answerNow);
+      if(answerNow) {
+        sendUDPResponse(cs->udpFD, packet, len, dest, remote);
+        continue;
+      }
+      if(!ss)
+        continue;
+
       len = send(ss->fd, packet, len, 0);
       if(len < 0) {
 	ss->sendErrors++;
 	g_stats.downstreamSendErrors++;
       }
-      
-      vinfolog("Got query from %s, relayed to %s", remote.toStringWithPort(), ss->remote.toStringWithPort());
     }
     catch(std::exception& e){
       errlog("Got an error in UDP question thread: %s", e.what());
@@ -585,10 +925,19 @@ catch(...)
 void* maintThread()
 {
   int interval = 1;
+  unsigned int counter = 0;
 
   for(;;) {
     sleep(interval);
 
+    if(++counter % 60 == 0) { // purge expired entries from the packet caches once a minute
+      for(const auto& pool : g_pools.getCopy()) {
+        auto packetCache = std::atomic_load(&pool.second->packetCache);
+        if(packetCache)
+          packetCache->purgeExpired();
+      }
+    }
+
     if(g_tcpclientthreads.d_queued > 1 && g_tcpclientthreads.d_numthreads < 10)
       g_tcpclientthreads.addTCPClientThread();
 
@@ -607,16 +956,9 @@ void* maintThread()
       dss->prev.queries.store(dss->queries.load());
       dss->prev.reuseds.store(dss->reuseds.load());
       
-      for(IDState& ids  : dss->idStates) { // timeouts
-        if(ids.origFD >=0 && ids.age++ > 2) {
-          ids.age = 0;
-          ids.origFD = -1;
-          dss->reuseds++;
-          --dss->outstanding;
-	  std::lock_guard<std::mutex> lock(g_rings.respMutex);
-	  g_rings.respRing.push_back({ids.qname, ids.qtype, 0, 2000000});
-        }          
-      }
+      unsigned int expired = expireIDStates(dss->idStates, dss->idQNames, g_rings); // timeouts
+      dss->reuseds += expired;
+      dss->outstanding -= expired;
     }
   }
   return 0;
@@ -888,6 +1230,38 @@ static void bindAny(int af, int sock)
 #endif
 }
 
+static ClientState* setupUDPClientState(const ComboAddress& local, bool reusePort)
+{
+  ClientState* cs = new ClientState;
+  cs->local= local;
+  cs->udpFD = SSocket(cs->local.sin4.sin_family, SOCK_DGRAM, 0);
+  if(cs->local.sin4.sin_family == AF_INET6) {
+    SSetsockopt(cs->udpFD, IPPROTO_IPV6, IPV6_V6ONLY, 1);
+  }
+  //if(g_vm.count("bind-non-local"))
+  bindAny(local.sin4.sin_family, cs->udpFD);
+
+  //    if (!setSocketTimestamps(cs->udpFD))
+  //      L<<Logger::Warning<<"Unable to enable timestamp reporting for socket"<<endl;
+
+
+  if(IsAnyAddress(local)) {
+    int one=1;
+    setsockopt(cs->udpFD, IPPROTO_IP, GEN_IP_PKTINFO, &one, sizeof(one));     // linux supports this, so why not - might fail on other systems
+#ifdef IPV6_RECVPKTINFO
+    setsockopt(cs->udpFD, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof(one)); 
+#endif
+  }
+
+#ifdef SO_REUSEPORT
+  if(reusePort)
+    SSetsockopt(cs->udpFD, SOL_SOCKET, SO_REUSEPORT, 1);
+#endif
+
+  SBind(cs->udpFD, cs->local);    
+  return cs;
+}
+
 /**** CARGO CULT CODE AHEAD ****/
 extern "C" {
 char* my_generator(const char* text, int state)
@@ -896,7 +1270,8 @@ char* my_generator(const char* text, int state)
   vector<string> words{"showRules()", "shutdown()", "rmRule(", "mvRule(", "addACL(", "addLocal(", "setServerPolicy(", "setServerPolicyLua(",
       "newServer(", "rmServer(", "showServers()", "show(", "newDNSName(", "newSuffixMatchNode(", "controlSocket(", "topClients(", "showResponseLatency()", 
       "newQPSLimiter(", "makeKey()", "setKey(", "testCrypto()", "addAnyTCRule()", "showServerPolicy()", "setACL(", "showACL()", "addDomainBlock(", 
-      "addPoolRule(", "addQPSLimit(", "topResponses(", "topQueries(", "topRule()", "setDNSSECPool(", "addDelay("};
+      "addPoolRule(", "addQPSLimit(", "topResponses(", "topQueries(", "topRule()", "setDNSSECPool(", "addDelay(",
+      "newPacketCache(", "getPool(", "showPools()", "setUDPMultipleMessagesVectorSize(", "setRingBuffersSize(", "setMaxUDPOutstanding(", "setTimeoutQNames("};
   static int s_counter=0;
   int counter=0;
   if(!state)
@@ -1042,38 +1417,31 @@ try
   if(g_cmdLine.locals.size()) {
     g_locals.clear();
     for(auto loc : g_cmdLine.locals)
-      g_locals.push_back({ComboAddress(loc, 53), true});
+      g_locals.push_back(std::make_tuple(ComboAddress(loc, 53), true, false, 1));
   }
   
   if(g_locals.empty())
-    g_locals.push_back({ComboAddress("0.0.0.0", 53), true});
+    g_locals.push_back(std::make_tuple(ComboAddress("0.0.0.0", 53), true, false, 1));
   
 
   vector<ClientState*> toLaunch;
   for(const auto& local : g_locals) {
-    ClientState* cs = new ClientState;
-    cs->local= local.first;
-    cs->udpFD = SSocket(cs->local.sin4.sin_family, SOCK_DGRAM, 0);
-    if(cs->local.sin4.sin_family == AF_INET6) {
-      SSetsockopt(cs->udpFD, IPPROTO_IPV6, IPV6_V6ONLY, 1);
+    bool reusePort = std::get<2>(local);
+    unsigned int threads = std::get<3>(local);
+#ifndef SO_REUSEPORT
+    if(reusePort) {
+      warnlog("SO_REUSEPORT is not supported on this platform, %d receiver threads will share the socket for %s", threads, std::get<0>(local).toStringWithPort());
+      reusePort = false;
     }
-    //if(g_vm.count("bind-non-local"))
-    bindAny(local.first.sin4.sin_family, cs->udpFD);
-
-    //    if (!setSocketTimestamps(cs->udpFD))
-    //      L<<Logger::Warning<<"Unable to enable timestamp reporting for socket"<<endl;
-
-
-    if(IsAnyAddress(local.first)) {
-      int one=1;
-      setsockopt(cs->udpFD, IPPROTO_IP, GEN_IP_PKTINFO, &one, sizeof(one));     // linux supports this, so why not - might fail on other systems
-#ifdef IPV6_RECVPKTINFO
-      setsockopt(cs->udpFD, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof(one)); 
 #endif
+    ClientState* cs = 0;
+    for(unsigned int n = 0; n < threads; ++n) {
+      if(!cs || reusePort)
+        cs = setupUDPClientState(std::get<0>(local), reusePort);
+      toLaunch.push_back(cs);
     }
-
-    SBind(cs->udpFD, cs->local);    
-    toLaunch.push_back(cs);
+    if(threads > 1)
+      infolog("Launching %d UDP receiver threads for %s%s", threads, std::get<0>(local).toStringWithPort(), reusePort ? " (SO_REUSEPORT)" : "");
   }
 
   if(g_cmdLine.beDaemon) {
@@ -1112,12 +1480,12 @@ try
   }
 
   for(const auto& local : g_locals) {
-    ClientState* cs = new ClientState;
-    if(!local.second) { // no TCP/IP
-      warnlog("Not providing TCP/IP service on local address '%s'", local.first.toStringWithPort());
+    if(!std::get<1>(local)) { // no TCP/IP
+      warnlog("Not providing TCP/IP service on local address '%s'", std::get<0>(local).toStringWithPort());
       continue;
     }
-    cs->local= local.first;
+    ClientState* cs = new ClientState;
+    cs->local= std::get<0>(local);
 
     cs->tcpFD = SSocket(cs->local.sin4.sin_family, SOCK_STREAM, 0);
 
@@ -10,6 +10,10 @@
 #include <mutex>
 #include <thread>
 #include "sholder.hh"
+#include "dnsdist-cache.hh"
+#include "dnsdist-idstate.hh"
+#include "dnsdist-qps.hh"
+#include "dnsdist-rings.hh"
 void* carbonDumpThread();
 uint64_t uptimeOfProcess(const std::string& str);
 struct DNSDistStats
@@ -27,9 +31,15 @@ struct DNSDistStats
   stat_t downstreamSendErrors{0};
   stat_t truncFail{0};
   stat_t noPolicy{0};
+  stat_t cacheHits{0};
+  stat_t cacheMisses{0};
+  stat_t mismatchedResponses{0};
+  stat_t udpBatches{0};
+  stat_t udpBatchedPackets{0};
   stat_t latency0_1{0}, latency1_10{0}, latency10_50{0}, latency50_100{0}, latency100_1000{0}, latencySlow{0};
   
   double latencyAvg100{0}, latencyAvg1000{0}, latencyAvg10000{0}, latencyAvg1000000{0};
+  double udpBatchSizeAvg{0};
   typedef std::function<uint64_t(const std::string&)> statfunction_t;
   typedef boost::variant<stat_t*, double*, statfunction_t> entry_t;
   std::vector<std::pair<std::string, entry_t>> entries{
@@ -39,6 +49,10 @@ struct DNSDistStats
     {"rule-nxdomain", &ruleNXDomain}, {"self-answered", &selfAnswered},
     {"downstream-timeouts", &downstreamTimeouts}, {"downstream-send-errors", &downstreamSendErrors}, 
     {"trunc-failures", &truncFail}, {"no-policy", &noPolicy},
+    {"cache-hits", &cacheHits}, {"cache-misses", &cacheMisses},
+    {"mismatched-responses", &mismatchedResponses},
+    {"udp-batches", &udpBatches}, {"udp-batched-packets", &udpBatchedPackets},
+    {"udp-batch-size-avg", &udpBatchSizeAvg},
     {"latency0-1", &latency0_1}, {"latency1-10", &latency1_10},
     {"latency10-50", &latency10_50}, {"latency50-100", &latency50_100}, 
     {"latency100-1000", &latency100_1000}, {"latency-slow", &latencySlow},
@@ -54,144 +68,8 @@ struct DNSDistStats
 extern struct DNSDistStats g_stats;
 
 
-struct StopWatch
-{
-#ifndef CLOCK_MONOTONIC_RAW
-#define CLOCK_MONOTONIC_RAW CLOCK_MONOTONIC
-#endif
-  struct timespec d_start{0,0};
-  void start() {  
-    if(clock_gettime(CLOCK_MONOTONIC_RAW, &d_start) < 0)
-      unixDie("Getting timestamp");
-    
-  }
-  
-  double udiff() const {
-    struct timespec now;
-    if(clock_gettime(CLOCK_MONOTONIC_RAW, &now) < 0)
-      unixDie("Getting timestamp");
-    
-    return 1000000.0*(now.tv_sec - d_start.tv_sec) + (now.tv_nsec - d_start.tv_nsec)/1000.0;
-  }
-
-  double udiffAndSet() {
-    struct timespec now;
-    if(clock_gettime(CLOCK_MONOTONIC_RAW, &now) < 0)
-      unixDie("Getting timestamp");
-    
-    auto ret= 1000000.0*(now.tv_sec - d_start.tv_sec) + (now.tv_nsec - d_start.tv_nsec)/1000.0;
-    d_start = now;
-    return ret;
-  }
-
-};
-
-class QPSLimiter
-{
-public:
-  QPSLimiter()
-  {
-  }
-
-  QPSLimiter(unsigned int rate, unsigned int burst) : d_rate(rate), d_burst(burst), d_tokens(burst)
-  {
-    d_passthrough=false;
-    d_prev.start();
-  }
-
-  unsigned int getRate() const
-  {
-    return d_passthrough? 0 : d_rate;
-  }
-
-  int getPassed() const
-  {
-    return d_passed;
-  }
-  int getBlocked() const
-  {
-    return d_blocked;
-  }
-
-  bool check() const // this is not quite fair
-  {
-    if(d_passthrough)
-      return true;
-    auto delta = d_prev.udiffAndSet();
-  
-    d_tokens += 1.0*d_rate * (delta/1000000.0);
-
-    if(d_tokens > d_burst)
-      d_tokens = d_burst;
-
-    bool ret=false;
-    if(d_tokens >= 1.0) { // we need this because burst=1 is weird otherwise
-      ret=true;
-      --d_tokens;
-      d_passed++;
-    }
-    else
-      d_blocked++;
-
-    return ret; 
-  }
-private:
-  bool d_passthrough{true};
-  unsigned int d_rate;
-  unsigned int d_burst;
-  mutable double d_tokens;
-  mutable StopWatch d_prev;
-  mutable unsigned int d_passed{0};
-  mutable unsigned int d_blocked{0};
-};
-
-
-struct IDState
-{
-  IDState() : origFD(-1), delayMsec(0) { origDest.sin4.sin_family = 0;}
-  IDState(const IDState& orig)
-  {
-    origFD = orig.origFD;
-    origID = orig.origID;
-    origRemote = orig.origRemote;
-    origDest = orig.origDest;
-    delayMsec = orig.delayMsec;
-    age.store(orig.age.load());
-  }
 
-  int origFD;  // set to <0 to indicate this state is empty   // 4
-
-  ComboAddress origRemote;                                    // 28
-  ComboAddress origDest;                                      // 28
-  StopWatch sentTime;                                         // 16
-  DNSName qname;                                              // 80
-  std::atomic<uint16_t> age;                                  // 4
-  uint16_t qtype;                                             // 2
-  uint16_t origID;                                            // 2
-  int delayMsec;
-};
-
-struct Rings {
-  Rings()
-  {
-    clientRing.set_capacity(10000);
-    queryRing.set_capacity(10000);
-    respRing.set_capacity(10000);
-  }
-  boost::circular_buffer<ComboAddress> clientRing;
-  boost::circular_buffer<DNSName> queryRing;
-  struct Response
-  {
-    DNSName name;
-    uint16_t qtype;
-    uint8_t rcode;
-    unsigned int usec;
-  };
-  boost::circular_buffer<Response> respRing;
-  std::mutex respMutex;
-};
-
-extern Rings g_rings; // XXX locking for this is still substandard, queryRing and clientRing need RW lock
+extern Rings g_rings;
 
 struct ClientState
 {
@@ -231,6 +109,7 @@ struct DownstreamState
   ComboAddress remote;
   QPSLimiter qps;
   vector<IDState> idStates;
+  IDQNames idQNames;
   std::atomic<uint64_t> idOffset{0};
   std::atomic<uint64_t> sendErrors{0};
   std::atomic<uint64_t> outstanding{0};
@@ -267,6 +146,13 @@ struct DownstreamState
 };
 using servers_t =vector<std::shared_ptr<DownstreamState>>;
 
+struct ServerPool
+{
+  // read by the client threads while the console might swap it, so only touch it with std::atomic_load() and std::atomic_store()
+  std::shared_ptr<DNSDistPacketCache> packetCache{nullptr};
+};
+using pools_t=map<std::string,std::shared_ptr<ServerPool>>;
+
 template <class T> using NumberedVector = std::vector<std::pair<unsigned int, T> >;
 
 void* responderThread(std::shared_ptr<DownstreamState> state);
@@ -302,10 +188,15 @@ public:
 using NumberedServerVector = NumberedVector<shared_ptr<DownstreamState>>;
 typedef std::function<shared_ptr<DownstreamState>(const NumberedServerVector& servers, const ComboAddress& remote, const DNSName& qname, uint16_t qtype, dnsheader* dh)> policy_t;
 
+/* builtin policies are thread-safe and get called without any lock held,
+   policies implemented in Lua need to be called with g_luamutex held */
 struct ServerPolicy
 {
+  ServerPolicy(): isLua(false) {}
+  ServerPolicy(const string& name_, policy_t policy_, bool isLua_=false): name(name_), policy(policy_), isLua(isLua_) {}
   string name;
   policy_t policy;
+  bool isLua;
 };
 
 struct CarbonConfig
@@ -320,12 +211,17 @@ extern GlobalStateHolder<ServerPolicy> g_policy;
 extern GlobalStateHolder<servers_t> g_dstates;
 extern GlobalStateHolder<vector<pair<std::shared_ptr<DNSRule>, std::shared_ptr<DNSAction> > > > g_rulactions;
 extern GlobalStateHolder<NetmaskGroup> g_ACL;
+extern GlobalStateHolder<pools_t> g_pools;
 
 extern ComboAddress g_serverControl; // not changed during runtime
 
-extern std::vector<std::pair<ComboAddress, bool>> g_locals; // not changed at runtime (we hope XXX)
+// local address, TCP enabled, SO_REUSEPORT, number of UDP receiver threads
+extern std::vector<std::tuple<ComboAddress, bool, bool, unsigned int>> g_locals; // not changed at runtime (we hope XXX)
 extern std::string g_key; // in theory needs locking
 extern bool g_truncateTC;
+extern size_t g_udpVectorSize;
+extern size_t g_maxOutstanding;
+extern bool g_timeoutQNames;
 extern int g_tcpRecvTimeout;
 extern int g_tcpSendTimeout;
 struct dnsheader;
@@ -333,6 +229,8 @@ struct dnsheader;
 void controlThread(int fd, ComboAddress local);
 vector<std::function<void(void)>> setupLua(bool client, const std::string& config);
 NumberedServerVector getDownstreamCandidates(const servers_t& servers, const std::string& pool);
+std::shared_ptr<ServerPool> getPool(const pools_t& pools, const std::string& poolName);
+std::shared_ptr<ServerPool> createPoolIfNotExists(const std::string& poolName);
 
 std::shared_ptr<DownstreamState> firstAvailable(const NumberedServerVector& servers, const ComboAddress& remote, const DNSName& qname, uint16_t qtype, dnsheader* dh);
 
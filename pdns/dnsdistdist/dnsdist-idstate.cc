@@ -0,0 +1 @@
+../dnsdist-idstate.cc
\ No newline at end of file
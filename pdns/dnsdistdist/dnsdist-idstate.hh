@@ -0,0 +1 @@
+../dnsdist-idstate.hh
\ No newline at end of file
@@ -0,0 +1 @@
+../dnsdist-qps.hh
\ No newline at end of file
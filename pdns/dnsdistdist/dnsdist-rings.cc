@@ -0,0 +1 @@
+../dnsdist-rings.cc
\ No newline at end of file
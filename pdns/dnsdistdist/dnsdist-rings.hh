@@ -0,0 +1 @@
+../dnsdist-rings.hh
\ No newline at end of file
@@ -5,7 +5,6 @@
 #include "dnswriter.hh"
 #include "misc.hh"
 
-#include <boost/functional/hash.hpp>
 
 /* raw storage
    in DNS label format, without trailing 0. So the root is of length 0.
@@ -256,10 +255,14 @@ bool DNSName::operator==(const DNSName& rhs) const
   return true;
 }
 
+uint32_t DNSName::hash(uint32_t init) const
+{
+  return burtleCI((const unsigned char*)d_storage.c_str(), d_storage.size(), init);
+}
+
 size_t hash_value(DNSName const& d)
 {
-  boost::hash<string> hasher;
-  return hasher(toLower(d.toString())); // FIXME400 HACK
+  return d.hash();
 }
 
 string DNSName::escapeLabel(const std::string& label)
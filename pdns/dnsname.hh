@@ -54,6 +54,7 @@ public:
   bool isRoot() const { return !d_empty && d_storage.empty(); }
   void clear() { d_storage.clear(); d_empty=true; }
   void trimToLabels(unsigned int);
+  uint32_t hash(uint32_t init=0) const; //!< case insensitive hash of our wire format, without the final root label
   DNSName& operator+=(const DNSName& rhs)
   {
     if(d_storage.size() + rhs.d_storage.size() > 254) // reserve one byte for the root label
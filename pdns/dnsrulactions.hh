@@ -1,35 +1,32 @@
 #include "dnsdist.hh"
 #include "dnsname.hh"
 
+/* Limits the queries per (truncated) client address, see QPSLimiterTable. */
 class MaxQPSIPRule : public DNSRule
 {
 public:
-  MaxQPSIPRule(unsigned int qps, unsigned int ipv4trunc=32, unsigned int ipv6trunc=64) : 
-    d_qps(qps), d_ipv4trunc(ipv4trunc), d_ipv6trunc(ipv6trunc)
-  {}
+  MaxQPSIPRule(unsigned int qps, unsigned int ipv4trunc=32, unsigned int ipv6trunc=64, size_t maxEntries=65536, unsigned int expiration=300) :
+    d_table(qps, maxEntries, expiration), d_qps(qps), d_ipv4trunc(ipv4trunc), d_ipv6trunc(ipv6trunc)
+  {
+  }
 
   bool matches(const ComboAddress& remote, const DNSName& qname, uint16_t qtype, dnsheader* dh, int len) const override
   {
     ComboAddress zeroport(remote);
     zeroport.sin4.sin_port=0;
     zeroport.truncate(zeroport.sin4.sin_family == AF_INET ? d_ipv4trunc : d_ipv6trunc);
-    auto iter = d_limits.find(zeroport);
-    if(iter == d_limits.end()) {
-      iter=d_limits.insert({zeroport,QPSLimiter(d_qps, d_qps)}).first;
-    }
-    return !iter->second.check();
+    return !d_table.check(zeroport, time(nullptr));
   }
 
   string toString() const override
   {
-    return "IP (/"+std::to_string(d_ipv4trunc)+", /"+std::to_string(d_ipv6trunc)+") match for QPS over " + std::to_string(d_qps);
+    return "IP (/"+std::to_string(d_ipv4trunc)+", /"+std::to_string(d_ipv6trunc)+") match for QPS over " + std::to_string(d_qps) +
+      " (" + std::to_string(d_table.getEntriesCount()) + "/" + std::to_string(d_table.getSize()) + " entries, " + std::to_string(d_table.getEvictionsCount()) + " evictions)";
   }
 
-
 private:
-  mutable std::map<ComboAddress, QPSLimiter> d_limits;
+  mutable QPSLimiterTable d_table;
   unsigned int d_qps, d_ipv4trunc, d_ipv6trunc;
-
 };
 
 class MaxQPSRule : public DNSRule
@@ -199,6 +199,21 @@ string DLRemotesHandler(const vector<string>&parts, Utility::pid_t ppid)
   return ret;
 }
 
+string DLXfrMastersHandler(const vector<string>&parts, Utility::pid_t ppid)
+{
+  extern CommunicatorClass Communicator;
+  typedef map<string, TransferScheduler::MasterStats> masterstats_t;
+  masterstats_t stats = Communicator.getSuckMasterStats();
+  time_t now = time(0);
+  ostringstream os;
+  boost::format fmt("%s\tqueued %d\tin-flight %d\ttransfers %d\tfailed %d\tbytes %d\tavg-msec %.0f\tbackoff %d\n");
+  BOOST_FOREACH(const masterstats_t::value_type& val, stats) {
+    const TransferScheduler::MasterStats& ms = val.second;
+    os << (fmt % val.first % ms.queued % ms.inFlight % ms.transfers % ms.failures % ms.bytes % ms.avgMsec % (ms.backoffUntil > now ? ms.backoffUntil - now : 0)).str();
+  }
+  return os.str();
+}
+
 string DLSettingsHandler(const vector<string>&parts, Utility::pid_t ppid)
 {
   static const char *whitelist[]={"query-logging",0};
@@ -242,7 +257,7 @@ string DLNotifyRetrieveHandler(const vector<string>&parts, Utility::pid_t ppid)
     return "Domain '"+domain+"' is not a slave domain (or has no master defined)";
 
   random_shuffle(di.masters.begin(), di.masters.end());
-  Communicator.addSuckRequest(DNSName(domain), di.masters.front());
+  Communicator.addSuckRequest(DNSName(domain), di.masters.front(), true);
   return "Added retrieval request for '"+domain+"' from master "+di.masters.front();
 }
 
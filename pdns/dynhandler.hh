@@ -45,6 +45,7 @@ string DLCCHandler(const vector<string>&parts, Utility::pid_t ppid);
 string DLQTypesHandler(const vector<string>&parts, Utility::pid_t ppid);
 string DLRSizesHandler(const vector<string>&parts, Utility::pid_t ppid);
 string DLRemotesHandler(const vector<string>&parts, Utility::pid_t ppid);
+string DLXfrMastersHandler(const vector<string>&parts, Utility::pid_t ppid);
 string DLStatusHandler(const vector<string>&parts, Utility::pid_t ppid);
 string DLNotifyHandler(const vector<string>&parts, Utility::pid_t ppid);
 string DLNotifyHostHandler(const vector<string>&parts, Utility::pid_t ppid);
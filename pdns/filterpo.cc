@@ -7,36 +7,273 @@ DNSFilterEngine::DNSFilterEngine()
 {
 }
 
-bool findNamedPolicy(const map<DNSName, DNSFilterEngine::Policy>& polmap, const DNSName& qname, DNSFilterEngine::Policy& pol)
-{
-  DNSName s(qname);
-
-    /* for www.powerdns.com, we need to check:
-         www.powerdns.com.
-           *.powerdns.com.
-             powerdns.com.
-	            *.com.
-                      com.
-	 	        *.
-  			 .       */
- 
-  bool first=true;
-  do {
-    auto iter = polmap.find(s);
-    if(iter != polmap.end()) {
-      pol=iter->second;
-      return true;
-    }
-    if(!first) {
-      iter = polmap.find(DNSName("*")+s);
-      if(iter != polmap.end()) {
-	pol=iter->second;
-	return true;
+DNSFilterEngine::DNSFilterEngine(const DNSFilterEngine& rhs) : d_zones(rhs.d_zones)
+{
+  for(const auto& zone : d_zones)
+    zone->d_shared = true;
+}
+
+DNSFilterEngine& DNSFilterEngine::operator=(const DNSFilterEngine& rhs)
+{
+  d_zones = rhs.d_zones;
+  for(const auto& zone : d_zones)
+    zone->d_shared = true;
+  return *this;
+}
+
+// returns a level holding both a and b, which have the same hash bits up to shift
+DNSFilterEngine::NameTrie::Children::level_t DNSFilterEngine::NameTrie::Children::join(unsigned int shift, const entry_t& a, const entry_t& b, uint64_t owner)
+{
+  auto level = std::make_shared<Level>();
+  level->d_owner = owner;
+  if(shift >= 32) {
+    level->d_slots = {Slot{nullptr, a}, Slot{nullptr, b}};
+    return level;
+  }
+  uint32_t bitA = 1U << ((a->d_hash >> shift) & 31), bitB = 1U << ((b->d_hash >> shift) & 31);
+  level->d_bitmap = bitA | bitB;
+  if(bitA == bitB)
+    level->d_slots = {Slot{join(shift + s_bits, a, b, owner), nullptr}};
+  else if(bitA < bitB)
+    level->d_slots = {Slot{nullptr, a}, Slot{nullptr, b}};
+  else
+    level->d_slots = {Slot{nullptr, b}, Slot{nullptr, a}};
+  return level;
+}
+
+// returns level (which may be 0) with entry in it, replacing the one for the same label. shift is the number of hash bits used above level
+DNSFilterEngine::NameTrie::Children::level_t DNSFilterEngine::NameTrie::Children::insert(const level_t& level, unsigned int shift, const entry_t& entry, uint64_t owner)
+{
+  auto ours = getWritable(level, owner);
+  if(shift >= 32) {
+    for(auto& slot : ours->d_slots) {
+      if(slot.d_entry->d_label == entry->d_label) {
+        slot.d_entry = entry;
+        return ours;
       }
     }
-    first=false;
-  } while(s.chopOff());
-  return false;
+    ours->d_slots.push_back(Slot{nullptr, entry});
+    return ours;
+  }
+
+  uint32_t bit = 1U << ((entry->d_hash >> shift) & 31);
+  unsigned int idx = slotIndex(*ours, bit);
+  if(!(ours->d_bitmap & bit)) {
+    ours->d_bitmap |= bit;
+    ours->d_slots.insert(ours->d_slots.begin() + idx, Slot{nullptr, entry});
+    return ours;
+  }
+
+  Slot& slot = ours->d_slots[idx];
+  if(slot.d_level) {
+    slot.d_level = insert(slot.d_level, shift + s_bits, entry, owner);
+  }
+  else if(slot.d_entry->d_label == entry->d_label) {
+    slot.d_entry = entry;
+  }
+  else {
+    slot.d_level = join(shift + s_bits, slot.d_entry, entry, owner);
+    slot.d_entry.reset();
+  }
+  return ours;
+}
+
+// returns level without label, or 0 if nothing would be left in it
+DNSFilterEngine::NameTrie::Children::level_t DNSFilterEngine::NameTrie::Children::erase(const level_t& level, unsigned int shift, const std::string& label, uint32_t hash, uint64_t owner)
+{
+  auto ours = getWritable(level, owner);
+  if(shift >= 32) {
+    ours->d_slots.erase(std::remove_if(ours->d_slots.begin(), ours->d_slots.end(), [&label](const Slot& slot) { return slot.d_entry->d_label == label; }), ours->d_slots.end());
+  }
+  else {
+    uint32_t bit = 1U << ((hash >> shift) & 31);
+    if(!(ours->d_bitmap & bit))
+      return ours;
+    unsigned int idx = slotIndex(*ours, bit);
+    Slot& slot = ours->d_slots[idx];
+    if(slot.d_level)
+      slot.d_level = erase(slot.d_level, shift + s_bits, label, hash, owner);
+    else if(slot.d_entry->d_label == label)
+      slot.d_entry.reset();
+
+    if(slot.d_level && slot.d_level->d_slots.size() == 1 && slot.d_level->d_slots.front().d_entry) {
+      // a single child left below us moves up to this level
+      slot.d_entry = slot.d_level->d_slots.front().d_entry;
+      slot.d_level.reset();
+    }
+    else if(!slot.d_level && !slot.d_entry) {
+      ours->d_slots.erase(ours->d_slots.begin() + idx);
+      ours->d_bitmap &= ~bit;
+    }
+  }
+  if(ours->d_slots.empty())
+    return level_t();
+  return ours;
+}
+
+// label has to be lowercase
+const DNSFilterEngine::NameTrie::node_t* DNSFilterEngine::NameTrie::Children::findChild(const std::string& label, uint32_t hash) const
+{
+  const Level* level = d_root.get();
+  for(unsigned int shift = 0; level; shift += s_bits) {
+    if(shift >= 32) {
+      for(const auto& slot : level->d_slots)
+        if(slot.d_entry->d_label == label)
+          return &slot.d_entry->d_node;
+      return 0;
+    }
+    uint32_t bit = 1U << ((hash >> shift) & 31);
+    if(!(level->d_bitmap & bit))
+      return 0;
+    const Slot& slot = level->d_slots[slotIndex(*level, bit)];
+    if(slot.d_entry)
+      return slot.d_entry->d_hash == hash && slot.d_entry->d_label == label ? &slot.d_entry->d_node : 0;
+    level = slot.d_level.get();
+  }
+  return 0;
+}
+
+// label has to be lowercase
+void DNSFilterEngine::NameTrie::Children::set(const std::string& label, uint32_t hash, const node_t& node, uint64_t owner)
+{
+  if(!node) {
+    if(d_root)
+      d_root = erase(d_root, 0, label, hash, owner);
+    return;
+  }
+  auto entry = std::make_shared<Entry>();
+  entry->d_label = label;
+  entry->d_node = node;
+  entry->d_hash = hash;
+  d_root = insert(d_root, 0, entry, owner);
+}
+
+uint64_t DNSFilterEngine::NameTrie::newId()
+{
+  static std::atomic<uint64_t> s_lastId{0};
+  return ++s_lastId;
+}
+
+uint32_t DNSFilterEngine::NameTrie::labelHash(const std::string& label)
+{
+  return burtle((const unsigned char*)label.c_str(), label.size(), 0);
+}
+
+// returns node (which may be 0) with the name made up of the first pos labels set to pol
+DNSFilterEngine::NameTrie::node_t DNSFilterEngine::NameTrie::insert(const node_t& node, const vector<string>& labels, size_t pos, const Policy& pol, bool* added)
+{
+  auto ours = getWritable(node, d_id);
+  if(!pos) {
+    *added = !ours->d_set;
+    ours->d_set = true;
+    ours->d_pol = pol;
+    return ours;
+  }
+  const string& label = labels[pos-1];
+  uint32_t hash = labelHash(label);
+  const node_t* child = ours->d_children.findChild(label, hash);
+  node_t newChild = insert(child ? *child : node_t(), labels, pos-1, pol, added);
+  if(!child || newChild != *child)
+    ours->d_children.set(label, hash, newChild, d_id);
+  return ours;
+}
+
+// returns node without the name made up of the first pos labels, or 0 if nothing would be left in it. The name must be present
+DNSFilterEngine::NameTrie::node_t DNSFilterEngine::NameTrie::erase(const node_t& node, const vector<string>& labels, size_t pos)
+{
+  auto ours = getWritable(node, d_id);
+  if(!pos) {
+    ours->d_set = false;
+    ours->d_pol = Policy();
+  }
+  else {
+    const string& label = labels[pos-1];
+    uint32_t hash = labelHash(label);
+    const node_t* child = ours->d_children.findChild(label, hash);
+    node_t newChild = erase(*child, labels, pos-1);
+    if(newChild != *child)
+      ours->d_children.set(label, hash, newChild, d_id);
+  }
+  if(!ours->d_set && ours->d_children.empty())
+    return node_t();
+  return ours;
+}
+static vector<string> getLowerLabels(const DNSName& name)
+{
+  auto labels = name.getRawLabels();
+  for(auto& label : labels)
+    label = toLower(label);
+  return labels;
+}
+
+void DNSFilterEngine::NameTrie::insert(const DNSName& name, const Policy& pol)
+{
+  auto labels = getLowerLabels(name);
+  bool added = false;
+  d_root = insert(d_root, labels, labels.size(), pol, &added);
+  if(added)
+    d_size++;
+}
+
+bool DNSFilterEngine::NameTrie::erase(const DNSName& name)
+{
+  if(!find(name))
+    return false;
+  auto labels = getLowerLabels(name);
+  d_root = erase(d_root, labels, labels.size());
+  d_size--;
+  return true;
+}
+
+const DNSFilterEngine::NameTrie::Node* DNSFilterEngine::NameTrie::findNode(const DNSName& name) const
+{
+  const Node* node = d_root.get();
+  auto labels = getLowerLabels(name);
+  for(auto label = labels.rbegin(); node && label != labels.rend(); ++label)
+    node = node->d_children.find(*label, labelHash(*label));
+  return node;
+}
+
+const DNSFilterEngine::Policy* DNSFilterEngine::NameTrie::find(const DNSName& name) const
+{
+  const Node* node = findNode(name);
+  return node && node->d_set ? &node->d_pol : 0;
+}
+
+bool DNSFilterEngine::NameTrie::lookup(const DNSName& qname, Policy& pol) const
+{
+  /* for www.powerdns.com, we need to check:
+       www.powerdns.com.
+         powerdns.com.
+       *.powerdns.com.
+                com.
+              *.com.
+                   .
+                 *.
+     the first one that is present wins. We walk down from the root, so a deeper match
+     replaces what we found so far. The wildcard does not match the name it is next to */
+  if(!d_root)
+    return false;
+  static const string wildcard("*");
+  static const uint32_t wildcardHash = labelHash(wildcard);
+  auto labels = getLowerLabels(qname);
+  const Node* node = d_root.get();
+  const Policy* found = 0;
+  for(size_t pos = labels.size(); ; --pos) {
+    if(node->d_set)
+      found = &node->d_pol;
+    else if(pos) {
+      const Node* wild = node->d_children.find(wildcard, wildcardHash);
+      if(wild && wild->d_set)
+        found = &wild->d_pol;
+    }
+    if(!pos || !(node = node->d_children.find(labels[pos-1], labelHash(labels[pos-1]))))
+      break;
+  }
+  if(!found)
+    return false;
+  pol = *found;
+  return true;
 }
 
 DNSFilterEngine::Policy DNSFilterEngine::getProcessingPolicy(const DNSName& qname) const
@@ -44,7 +281,7 @@ DNSFilterEngine::Policy DNSFilterEngine::getProcessingPolicy(const DNSName& qnam
   //  cout<<"Got question for nameserver name "<<qname<<endl;
   Policy pol{PolicyKind::NoAction};
   for(const auto& z : d_zones) {
-    if(findNamedPolicy(z.propolName, qname, pol)) {
+    if(z->propolName.lookup(qname, pol)) {
       //      cerr<<"Had a hit on the nameserver ("<<qname<<") used to process the query"<<endl;
       return pol;
     }
@@ -59,16 +296,14 @@ DNSFilterEngine::Policy DNSFilterEngine::getQueryPolicy(const DNSName& qname, co
 
   Policy pol{PolicyKind::NoAction};
   for(const auto& z : d_zones) {
-    if(findNamedPolicy(z.qpolName, qname, pol)) {
+    if(z->qpolName.lookup(qname, pol)) {
       //      cerr<<"Had a hit on the name of the query"<<endl;
       return pol;
     }
-    
-    for(const auto& qa : z.qpolAddr) {
-      if(qa.first.match(ca)) {
-	//	cerr<<"Had a hit on the IP address ("<<ca.toString()<<") of the client"<<endl;
-	return qa.second;
-      }
+
+    if(const Policy* addrpol = z->qpolAddr.lookup(ca)) {
+      //	cerr<<"Had a hit on the IP address ("<<ca.toString()<<") of the client"<<endl;
+      return *addrpol;
     }
   }
 
@@ -90,11 +325,9 @@ DNSFilterEngine::Policy DNSFilterEngine::getPostPolicy(const vector<DNSRecord>&
       continue;
 
     for(const auto& z : d_zones) {
-      for(const auto& qa : z.postpolAddr) {
-	if(qa.first.match(ca)) {
-	  //	  cerr<<"Had a hit on IP address in answer"<<endl;
-	  return qa.second;
-	}
+      if(const Policy* addrpol = z->postpolAddr.lookup(ca)) {
+        //	  cerr<<"Had a hit on IP address in answer"<<endl;
+        return *addrpol;
       }
     }
   }
@@ -103,62 +336,92 @@ DNSFilterEngine::Policy DNSFilterEngine::getPostPolicy(const vector<DNSRecord>&
 
 void DNSFilterEngine::assureZones(int zone)
 {
-  if((int)d_zones.size() <= zone)
-    d_zones.resize(zone+1);
+  while((int)d_zones.size() <= zone)
+    d_zones.push_back(std::make_shared<Zone>());
+}
 
+DNSFilterEngine::Zone& DNSFilterEngine::getWritableZone(int zone)
+{
+  assureZones(zone);
+  // only we can share a zone we have to ourselves, so this can't change under our feet
+  if(d_zones[zone]->d_shared)
+    d_zones[zone] = std::make_shared<Zone>(*d_zones[zone]);
+  return *d_zones[zone];
 }
 
-void DNSFilterEngine::addClientTrigger(const Netmask& nm, Policy pol, int zone)
+void DNSFilterEngine::setZone(int zone, const DNSFilterEngine& source)
 {
   assureZones(zone);
-  d_zones[zone].qpolAddr.push_back({nm,pol});
+  if(zone < (int)source.d_zones.size()) {
+    d_zones[zone] = source.d_zones[zone];
+    d_zones[zone]->d_shared = true;
+  }
+  else
+    d_zones[zone] = std::make_shared<Zone>();
 }
 
-void DNSFilterEngine::addResponseTrigger(const Netmask& nm, Policy pol, int zone)
+void DNSFilterEngine::clear()
+{
+  d_zones.clear();
+}
+
+void DNSFilterEngine::clear(int zone)
 {
   assureZones(zone);
-  d_zones[zone].postpolAddr.push_back({nm,pol});
+  d_zones[zone] = std::make_shared<Zone>();
+}
+
+void DNSFilterEngine::addClientTrigger(const Netmask& nm, Policy pol, int zone)
+{
+  getWritableZone(zone).qpolAddr.insert(nm, pol);
+}
+
+void DNSFilterEngine::addResponseTrigger(const Netmask& nm, Policy pol, int zone)
+{
+  getWritableZone(zone).postpolAddr.insert(nm, pol);
 }
 
 void DNSFilterEngine::addQNameTrigger(const DNSName& n, Policy pol, int zone)
 {
-  assureZones(zone);
-  d_zones[zone].qpolName[n]=pol;
+  getWritableZone(zone).qpolName.insert(n, pol);
 }
 
 void DNSFilterEngine::addNSTrigger(const DNSName& n, Policy pol, int zone)
 {
-  assureZones(zone);
-  d_zones[zone].propolName[n]=pol;
+  getWritableZone(zone).propolName.insert(n, pol);
 }
 
+// the removals check first, so removing something that is not there does not copy a shared zone
 bool DNSFilterEngine::rmClientTrigger(const Netmask& nm, Policy pol, int zone)
 {
   assureZones(zone);
-
-  auto& qpols = d_zones[zone].qpolAddr;
-  qpols.erase(remove(qpols.begin(), qpols.end(),pair<Netmask,Policy>(nm,pol)), qpols.end());
-  return true;
+  const Policy* current = d_zones[zone]->qpolAddr.find(nm);
+  if(!current || !(*current == pol))
+    return false;
+  return getWritableZone(zone).qpolAddr.erase(nm);
 }
 
 bool DNSFilterEngine::rmResponseTrigger(const Netmask& nm, Policy pol, int zone)
 {
   assureZones(zone);
-  auto& postpols = d_zones[zone].postpolAddr;
-  postpols.erase(remove(postpols.begin(), postpols.end(),pair<Netmask,Policy>(nm,pol)), postpols.end());
-  return true;
+  const Policy* current = d_zones[zone]->postpolAddr.find(nm);
+  if(!current || !(*current == pol))
+    return false;
+  return getWritableZone(zone).postpolAddr.erase(nm);
 }
 
 bool DNSFilterEngine::rmQNameTrigger(const DNSName& n, Policy pol, int zone)
 {
   assureZones(zone);
-  d_zones[zone].qpolName.erase(n); // XXX verify we had identical policy?
-  return true;
+  if(!d_zones[zone]->qpolName.find(n))
+    return false;
+  return getWritableZone(zone).qpolName.erase(n); // XXX verify we had identical policy?
 }
 
 bool DNSFilterEngine::rmNSTrigger(const DNSName& n, Policy pol, int zone)
 {
   assureZones(zone);
-  d_zones[zone].propolName.erase(n); // XXX verify policy matched? =pol;
-  return true;
+  if(!d_zones[zone]->propolName.find(n))
+    return false;
+  return getWritableZone(zone).propolName.erase(n); // XXX verify policy matched? =pol;
 }
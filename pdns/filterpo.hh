@@ -2,7 +2,9 @@
 #include "iputils.hh"
 #include "dns.hh"
 #include "dnsparser.hh"
-#include <map>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
 
 /* This class implements a filtering policy that is able to fully implement RPZ, but is not bound to it.
    In other words, it is generic enough to support RPZ, but could get its data from other places.
@@ -37,6 +39,20 @@
 
    Finally, triggers are grouped in different zones. The "first" zone that has a match
    is consulted. Then within that zone, rules again have precedences. 
+
+   Within a zone, the most specific trigger wins. Names are kept in a trie of labels,
+   so www.powerdns.com finds www.powerdns.com, then powerdns.com or *.powerdns.com, then
+   com or *.com etc, in as many steps as it has labels. Netmasks are kept in a NetmaskTree,
+   the longest matching one wins. So the number of triggers hardly matters for the speed
+   of a lookup.
+
+   Both structures are persistent: a change copies the few nodes on the path to the
+   trigger and shares everything else with the previous version. Zones are shared between
+   copies of a DNSFilterEngine, a copy that changes a zone gets a zone of its own that
+   still shares all unchanged nodes. So copying an engine is cheap, and an update costs
+   in proportion to the number of triggers it changes, while whoever uses the original
+   keeps seeing it unchanged. This is what allows swapping in an updated engine with a
+   GlobalStateHolder.
 */
 
 
@@ -55,6 +71,11 @@ public:
   };
 
   DNSFilterEngine();
+  //! shares the zones of rhs, whichever of the two changes a zone afterwards gets a copy of it
+  DNSFilterEngine(const DNSFilterEngine& rhs);
+  DNSFilterEngine(DNSFilterEngine&& rhs) = default;
+  DNSFilterEngine& operator=(const DNSFilterEngine& rhs);
+  DNSFilterEngine& operator=(DNSFilterEngine&& rhs) = default;
   void clear();
   void clear(int zone);
   void addClientTrigger(const Netmask& nm, Policy pol, int zone=0);
@@ -72,14 +93,129 @@ public:
   Policy getProcessingPolicy(const DNSName& qname) const;
   Policy getPostPolicy(const vector<DNSRecord>& records) const;
 
+  //! makes zone 'zone' the same as zone 'zone' of 'source', without copying it
+  void setZone(int zone, const DNSFilterEngine& source);
+
 private:
-  void assureZones(int zone);
+  //! maps names to policies, a name also applies to everything below it unless there is something more specific
+  class NameTrie
+  {
+  public:
+    NameTrie() : d_id(newId()) {}
+    //! shares all nodes with rhs, neither will change a node the other can see
+    NameTrie(const NameTrie& rhs) : d_root(rhs.d_root), d_size(rhs.d_size), d_id(newId()) {}
+    NameTrie& operator=(const NameTrie& rhs) = delete;
+
+    void insert(const DNSName& name, const Policy& pol);
+    bool erase(const DNSName& name);
+    const Policy* find(const DNSName& name) const;
+    //! the policy of the most specific name or wildcard that covers qname
+    bool lookup(const DNSName& qname, Policy& pol) const;
+    size_t size() const
+    {
+      return d_size;
+    }
+  private:
+    /* Nodes remember the trie that created them. A trie only changes its own nodes in place, any
+       other node on the path to a change is copied first. A trie is only ever copied from a zone
+       that no engine changes anymore, so nodes it shares with a copy stay as they are */
+    struct Node;
+    typedef std::shared_ptr<const Node> node_t;
+
+    /* the children of a node by label: a hash array mapped trie, every level uses the next 5 bits of
+       the hash of a label to pick one of 32 slots, and only slots in use take space */
+    class Children
+    {
+    public:
+      const node_t* findChild(const std::string& label, uint32_t hash) const;
+      const Node* find(const std::string& label, uint32_t hash) const
+      {
+        const node_t* child = findChild(label, hash);
+        return child ? child->get() : 0;
+      }
+      //! sets the child for label, or removes it if node is 0
+      void set(const std::string& label, uint32_t hash, const node_t& node, uint64_t owner);
+      bool empty() const
+      {
+        return !d_root;
+      }
+    private:
+      struct Entry
+      {
+        std::string d_label;
+        node_t d_node;
+        uint32_t d_hash;
+      };
+      typedef std::shared_ptr<const Entry> entry_t;
+      struct Level;
+      typedef std::shared_ptr<const Level> level_t;
+      struct Slot
+      {
+        level_t d_level; // either a deeper level
+        entry_t d_entry; // or a child
+      };
+      struct Level
+      {
+        uint64_t d_owner;
+        uint32_t d_bitmap{0}; // which of the 32 slots are in use, unused once all bits of the hash are used
+        vector<Slot> d_slots; // one for every bit in d_bitmap in order, or all labels with the same hash
+      };
+      static const unsigned int s_bits = 5;
+
+      static unsigned int slotIndex(const Level& level, uint32_t bit)
+      {
+        return __builtin_popcount(level.d_bitmap & (bit - 1));
+      }
+      static level_t join(unsigned int shift, const entry_t& a, const entry_t& b, uint64_t owner);
+      static level_t insert(const level_t& level, unsigned int shift, const entry_t& entry, uint64_t owner);
+      static level_t erase(const level_t& level, unsigned int shift, const std::string& label, uint32_t hash, uint64_t owner);
+
+      level_t d_root;
+    };
+
+    struct Node
+    {
+      uint64_t d_owner;
+      Children d_children;
+      bool d_set{false};
+      Policy d_pol;
+    };
+
+    //! obj itself if owner created it, a copy of it otherwise or a new one if obj is 0
+    template<typename T>
+    static std::shared_ptr<T> getWritable(const std::shared_ptr<const T>& obj, uint64_t owner)
+    {
+      if(obj && obj->d_owner == owner)
+        return std::const_pointer_cast<T>(obj);
+      auto copy = obj ? std::make_shared<T>(*obj) : std::make_shared<T>();
+      copy->d_owner = owner;
+      return copy;
+    }
+    static uint64_t newId();
+    static uint32_t labelHash(const std::string& label);
+    node_t insert(const node_t& node, const vector<string>& labels, size_t pos, const Policy& pol, bool* added);
+    node_t erase(const node_t& node, const vector<string>& labels, size_t pos);
+    const Node* findNode(const DNSName& name) const;
+
+    node_t d_root;
+    size_t d_size{0};
+    uint64_t d_id;
+  };
+
   struct Zone {
-    std::map<DNSName, Policy> qpolName;
-    std::vector<pair<Netmask, Policy>> qpolAddr;
-    std::map<DNSName, Policy> propolName;
-    std::vector<pair<Netmask, Policy>> postpolAddr;
+    Zone() {}
+    Zone(const Zone& rhs) : qpolName(rhs.qpolName), qpolAddr(rhs.qpolAddr), propolName(rhs.propolName), postpolAddr(rhs.postpolAddr) {}
+
+    NameTrie qpolName;
+    NetmaskTree<Policy> qpolAddr;
+    NameTrie propolName;
+    NetmaskTree<Policy> postpolAddr;
+    //! set once more than one engine has this zone, after that nobody changes it
+    mutable std::atomic<bool> d_shared{false};
   };
-  vector<Zone> d_zones;
+  void assureZones(int zone);
+  //! the zone to change, copied first if another engine has it too. The copy shares all nodes with the original
+  Zone& getWritableZone(int zone);
+  vector<std::shared_ptr<Zone>> d_zones;
 
 };
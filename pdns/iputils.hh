@@ -364,21 +364,218 @@ private:
   uint8_t d_bits;
 };
 
+/** Maps netmasks to values, and finds the value of the longest netmask matching an address.
+
+    The masks are kept in a binary trie per address family, so a lookup takes at most as
+    many steps as there are bits in the address, however many masks there are. An IPv4
+    address mapped in IPv6 also matches the IPv4 masks, as if they were ::ffff:0:0/96 longer.
+
+    Nodes are never changed once they are in a tree, an insert or erase copies the nodes on
+    the path to the mask and shares all others with the previous version. So copying a tree
+    is cheap, and a change to a copy costs at most as many nodes as the mask has bits.
+*/
+template<typename T>
+class NetmaskTree
+{
+public:
+  NetmaskTree()
+  {
+    clear();
+  }
+
+  //! adds nm, replacing the value it had if it was present already
+  void insert(const Netmask& nm, const T& value)
+  {
+    node_t* tree = getTree(nm.getNetwork());
+    if(!tree)
+      return;
+    bool added = false;
+    *tree = insert(tree->get(), nm, 0, value, &added);
+    if(added)
+      d_size++;
+  }
+
+  //! removes nm, returns false if it was not present
+  bool erase(const Netmask& nm)
+  {
+    node_t* tree = getTree(nm.getNetwork());
+    if(!tree || !find(nm))
+      return false;
+    *tree = erase(tree->get(), nm, 0);
+    d_size--;
+    return true;
+  }
+
+  //! the value of exactly nm, or 0
+  const T* find(const Netmask& nm) const
+  {
+    const node_t* tree = getTree(nm.getNetwork());
+    if(!tree)
+      return 0;
+    const Node* node = tree->get();
+    unsigned int bits = std::min(nm.getBits(), maxBits(nm.getNetwork()));
+    for(unsigned int n = 0; node && n < bits; ++n)
+      node = node->child[getBit(nm.getNetwork(), n)].get();
+    return node && node->set ? &node->value : 0;
+  }
+
+  //! the value of the longest mask matching ip, or 0. Sets *bits to the length of that mask
+  const T* lookup(const ComboAddress& ip, int* bits=0) const
+  {
+    int found = -1;
+    const T* value = 0;
+    if(ip.sin4.sin_family == AF_INET) {
+      value = lookup(d_tree4.get(), ip, 32, &found);
+    }
+    else if(ip.sin6.sin6_family == AF_INET6) {
+      value = lookup(d_tree6.get(), ip, 128, &found);
+      if(ip.isMappedIPv4()) {
+        int found4 = -1;
+        const T* value4 = lookup(d_tree4.get(), ip.mapToIPv4(), 32, &found4);
+        if(value4 && found4 + 96 > found) {
+          value = value4;
+          found = found4 + 96;
+        }
+      }
+    }
+    if(value && bits)
+      *bits = found;
+    return value;
+  }
+
+  const T* lookup(const ComboAddress* ip, int* bits=0) const
+  {
+    return lookup(*ip, bits);
+  }
+
+  void clear()
+  {
+    d_tree4.reset();
+    d_tree6.reset();
+    d_size = 0;
+  }
+
+  bool empty() const
+  {
+    return !d_size;
+  }
+
+  size_t size() const
+  {
+    return d_size;
+  }
+
+private:
+  struct Node;
+  typedef std::shared_ptr<const Node> node_t;
+  struct Node
+  {
+    Node() : set(false), value() {}
+    node_t child[2];
+    bool set;  // whether a mask ends here
+    T value;
+  };
+
+  static int maxBits(const ComboAddress& ip)
+  {
+    return ip.sin4.sin_family == AF_INET ? 32 : 128;
+  }
+
+  node_t* getTree(const ComboAddress& ip)
+  {
+    if(ip.sin4.sin_family == AF_INET)
+      return &d_tree4;
+    if(ip.sin6.sin6_family == AF_INET6)
+      return &d_tree6;
+    return 0;
+  }
+
+  const node_t* getTree(const ComboAddress& ip) const
+  {
+    return const_cast<NetmaskTree*>(this)->getTree(ip);
+  }
+
+  static unsigned int getBit(const ComboAddress& ip, unsigned int n)
+  {
+    if(ip.sin4.sin_family == AF_INET)
+      return (ntohl(ip.sin4.sin_addr.s_addr) >> (31 - n)) & 1;
+    return (ip.sin6.sin6_addr.s6_addr[n / 8] >> (7 - n % 8)) & 1;
+  }
+
+  //! returns a copy of node (which may be 0) with nm set to value below it, n is the depth of node
+  static node_t insert(const Node* node, const Netmask& nm, unsigned int n, const T& value, bool* added)
+  {
+    auto copy = node ? std::make_shared<Node>(*node) : std::make_shared<Node>();
+    if(n == (unsigned int)std::min(nm.getBits(), maxBits(nm.getNetwork()))) {
+      *added = !copy->set;
+      copy->set = true;
+      copy->value = value;
+    }
+    else {
+      auto& child = copy->child[getBit(nm.getNetwork(), n)];
+      child = insert(child.get(), nm, n + 1, value, added);
+    }
+    return copy;
+  }
+
+  //! returns a copy of node without nm, or 0 if nothing would be left below it. nm must be present
+  static node_t erase(const Node* node, const Netmask& nm, unsigned int n)
+  {
+    auto copy = std::make_shared<Node>(*node);
+    if(n == (unsigned int)std::min(nm.getBits(), maxBits(nm.getNetwork()))) {
+      copy->set = false;
+      copy->value = T();
+    }
+    else {
+      auto& child = copy->child[getBit(nm.getNetwork(), n)];
+      child = erase(child.get(), nm, n + 1);
+    }
+    if(!copy->set && !copy->child[0] && !copy->child[1])
+      return node_t();
+    return copy;
+  }
+
+  //! returns the value of the longest mask below node matching ip and sets *bits to its length, or returns 0
+  static const T* lookup(const Node* node, const ComboAddress& ip, unsigned int maxBits, int* bits)
+  {
+    const T* value = 0;
+    for(unsigned int n = 0; node; ++n) {
+      if(node->set) {
+        value = &node->value;
+        *bits = n;
+      }
+      if(n == maxBits)
+        break;
+      node = node->child[getBit(ip, n)].get();
+    }
+    return value;
+  }
+
+  node_t d_tree4;
+  node_t d_tree6;
+  size_t d_size;
+};
+
 /** This class represents a group of supplemental Netmask classes. An IP address matchs
     if it is matched by zero or more of the Netmask classes within.
+
+    Masks can be negated by prefixing them with a '!', the longest matching mask decides,
+    so '10.0.0.0/8, !10.1.0.0/16' matches 10.2.3.4 but not 10.1.2.3.
 */
 class NetmaskGroup
 {
 public:
+  NetmaskGroup()
+  {
+    clear();
+  }
+
   //! If this IP address is matched by any of the classes within
 
   bool match(const ComboAddress *ip) const
   {
-    for(container_t::const_iterator i=d_masks.begin();i!=d_masks.end();++i)
-      if(i->match(ip) || (ip->isMappedIPv4() && i->match(ip->mapToIPv4()) ))
-        return true;
-
-    return false;
+    const int8_t* state = d_tree.lookup(ip);
+    return state && *state > 0;
   }
 
   bool match(const ComboAddress& ip) const
@@ -386,15 +583,28 @@ public:
     return match(&ip);
   }
 
-  //! Add this Netmask to the list of possible matches
+  //! Add this Netmask to the list of possible matches, or to the exceptions if it starts with a '!'
   void addMask(const string &ip)
   {
-    d_masks.push_back(Netmask(ip));
+    if(!ip.empty() && ip[0] == '!')
+      addMask(Netmask(ip.substr(1)), false);
+    else
+      addMask(Netmask(ip));
+  }
+
+  void addMask(const Netmask& nm, bool positive=true)
+  {
+    const ComboAddress& network = nm.getNetwork();
+    if(network.sin4.sin_family != AF_INET && network.sin6.sin6_family != AF_INET6)
+      return;
+    d_tree.insert(nm, positive ? 1 : -1);
+    d_masks.push_back(make_pair(nm, positive));
   }
 
   void clear()
   {
     d_masks.clear();
+    d_tree.clear();
   }
 
   bool empty()
@@ -413,7 +623,7 @@ public:
     for(container_t::const_iterator iter = d_masks.begin(); iter != d_masks.end(); ++iter) {
       if(iter != d_masks.begin())
         str <<", ";
-      str<<iter->toString();
+      str<<(iter->second ? "" : "!")<<iter->first.toString();
     }
     return str.str();
   }
@@ -421,7 +631,7 @@ public:
   void toStringVector(vector<string>* vec) const
   {
     for(container_t::const_iterator iter = d_masks.begin(); iter != d_masks.end(); ++iter) {
-      vec->push_back(iter->toString());
+      vec->push_back((iter->second ? "" : "!") + iter->first.toString());
     }
   }
 
@@ -435,8 +645,9 @@ public:
   }
 
 private:
-  typedef vector<Netmask> container_t;
+  typedef vector<pair<Netmask, bool> > container_t;
   container_t d_masks;
+  NetmaskTree<int8_t> d_tree; // 1 for a mask, -1 for a negated one
 };
 
 
@@ -3,10 +3,83 @@
 #include "dns_random.hh"
 #include "dnsrecords.hh"
 
+// CURRENT MASTER SOA
+// REPEAT:
+//   SOA WHERE THIS DELTA STARTS
+//   RECORDS TO REMOVE
+//   SOA WHERE THIS DELTA GOES
+//   RECORDS TO ADD
+// CURRENT MASTER SOA
+bool IXFRCollector::add(const DNSRecord& dr)
+{
+  if(d_complete || d_fullZone)
+    return true;
+  d_records.push_back(dr);
+  if(d_records.size() == 2 && d_masterSOA) {
+    /* a delta starts with the SOA of a serial we have, anything else means the master sends the whole zone in
+       an AXFR style response (RFC 1995 section 4), which is of no use as deltas */
+    if(dr.d_type != QType::SOA || std::dynamic_pointer_cast<SOARecordContent>(dr.d_content)->d_st.serial == d_masterSOA->d_st.serial) {
+      d_fullZone=true;
+      return true;
+    }
+  }
+  if(dr.d_type != QType::SOA)
+    return false;
+
+  auto sr = std::dynamic_pointer_cast<SOARecordContent>(dr.d_content);
+  if(!d_masterSOA) {
+    d_masterSOA=sr;
+    if(sr->d_st.serial == d_ourSerial) // we are up to date
+      d_complete=d_upToDate=true;
+  }
+  else if(sr->d_st.serial == d_masterSOA->d_st.serial) {
+    // the last delta also ends with the master SOA
+    if(++d_masterSOACount == 2)
+      d_complete=true;
+  }
+  return d_complete;
+}
+
+IXFRCollector::deltas_t IXFRCollector::getDeltas() const
+{
+  deltas_t ret;
+  if(!d_masterSOA)
+    throw std::runtime_error("No SOA in IXFR response for "+d_zone.toString());
+  if(d_fullZone)
+    throw std::runtime_error("Got a full zone instead of deltas in IXFR response for "+d_zone.toString());
+  // we only get here without the final SOA if the master hung up on us
+  if(!d_complete)
+    throw std::runtime_error("Incomplete IXFR response for "+d_zone.toString());
+  if(d_upToDate)
+    return ret;
+
+  for(unsigned int pos = 1;pos < d_records.size();) {
+    // an AXFR style response (RFC 1995 section 4) means the master has no deltas for us
+    if(d_records[pos].d_type != QType::SOA)
+      throw std::runtime_error("Got a full zone instead of deltas in IXFR response for "+d_zone.toString());
+    auto sr = std::dynamic_pointer_cast<SOARecordContent>(d_records[pos].d_content);
+    if(sr->d_st.serial == d_masterSOA->d_st.serial)
+      break;
+
+    vector<DNSRecord> remove, add;
+    remove.push_back(d_records[pos]); // this adds the SOA
+    for(pos++; pos < d_records.size() && d_records[pos].d_type != QType::SOA; ++pos) {
+      remove.push_back(d_records[pos]);
+    }
+    if(pos == d_records.size())
+      throw std::runtime_error("Truncated delta in IXFR response for "+d_zone.toString());
+
+    add.push_back(d_records[pos]); // this adds the new SOA
+    for(pos++; pos < d_records.size() && d_records[pos].d_type != QType::SOA; ++pos)  {
+      add.push_back(d_records[pos]);
+    }
+    ret.push_back(make_pair(remove,add));
+  }
+  return ret;
+}
 
 vector<pair<vector<DNSRecord>, vector<DNSRecord> > >   getIXFRDeltas(const ComboAddress& master, const DNSName& zone, const DNSRecord& oursr)
 {
-  vector<pair<vector<DNSRecord>, vector<DNSRecord> > >  ret;
   vector<uint8_t> packet;
   DNSPacketWriter pw(packet, zone, QType::IXFR);
   pw.getHeader()->qr=0;
@@ -15,7 +88,7 @@ vector<pair<vector<DNSRecord>, vector<DNSRecord> > >   getIXFRDeltas(const Combo
   pw.startRecord(zone, QType::SOA, 3600, QClass::IN, DNSResourceRecord::AUTHORITY);
   oursr.d_content->toPacket(pw);
   pw.commit();
-  
+
   uint16_t len=htons(packet.size());
   string msg((const char*)&len, 2);
   msg.append((const char*)&packet[0], packet.size());
@@ -26,15 +99,7 @@ vector<pair<vector<DNSRecord>, vector<DNSRecord> > >   getIXFRDeltas(const Combo
   //  cout<<"Connected"<<endl;
   s.writen(msg);
 
-  // CURRENT MASTER SOA
-  // REPEAT:
-  //   SOA WHERE THIS DELTA STARTS
-  //   RECORDS TO REMOVE
-  //   SOA WHERE THIS DELTA GOES
-  //   RECORDS TO ADD
-  // CURRENT MASTER SOA 
-  shared_ptr<SOARecordContent> masterSOA;
-  vector<DNSRecord> records;
+  IXFRCollector collector(zone, std::dynamic_pointer_cast<SOARecordContent>(oursr.d_content)->d_st.serial);
   for(;;) {
     if(s.read((char*)&len, 2)!=2)
       break;
@@ -42,47 +107,19 @@ vector<pair<vector<DNSRecord>, vector<DNSRecord> > >   getIXFRDeltas(const Combo
     //    cout<<"Got chunk of "<<len<<" bytes"<<endl;
     if(!len)
       break;
-    char reply[len]; 
+    char reply[len];
     readn2(s.getHandle(), reply, len);
     MOADNSParser mdp(string(reply, len));
     //    cout<<"Got a response, rcode: "<<mdp.d_header.rcode<<", got "<<mdp.d_answers.size()<<" answers"<<endl;
+    if(mdp.d_header.rcode)
+      throw std::runtime_error("Got an error response to IXFR query for "+zone.toString()+": "+RCode::to_s(mdp.d_header.rcode));
     for(auto& r: mdp.d_answers) {
       //      cout<<r.first.d_name<< " " <<r.first.d_content->getZoneRepresentation()<<endl;
       r.first.d_name = r.first.d_name.makeRelative(zone);
-      records.push_back(r.first);
-      if(r.first.d_type == QType::SOA) {
-	auto sr = std::dynamic_pointer_cast<SOARecordContent>(r.first.d_content);
-	if(!masterSOA) {
-	  if(sr->d_st.serial == std::dynamic_pointer_cast<SOARecordContent>(oursr.d_content)->d_st.serial) // we are up to date
-	    goto done;
-	  masterSOA=sr;
-
-	}
-	else if(sr->d_st.serial == masterSOA->d_st.serial)
-	  goto done;
-
-      }
+      if(collector.add(r.first))
+        return collector.getDeltas();
     }
   }
   //  cout<<"Got "<<records.size()<<" records"<<endl;
- done:;
-  for(unsigned int pos = 1;pos < records.size();) {
-    auto sr = std::dynamic_pointer_cast<SOARecordContent>(records[pos].d_content);
-    if(sr->d_st.serial == masterSOA->d_st.serial)
-      break;
-    
-    vector<DNSRecord> remove, add;
-    remove.push_back(records[pos]); // this adds the SOA
-    for(pos++; pos < records.size() && records[pos].d_type != QType::SOA; ++pos) {
-      remove.push_back(records[pos]);
-    }
-    sr = std::dynamic_pointer_cast<SOARecordContent>(records[pos].d_content);
-
-    add.push_back(records[pos]); // this adds the new SOA
-    for(pos++; pos < records.size() && records[pos].d_type != QType::SOA; ++pos)  {
-      add.push_back(records[pos]);
-    }
-    ret.push_back(make_pair(remove,add));
-  }
-  return ret;
+  return collector.getDeltas();
 }
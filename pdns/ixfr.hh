@@ -1,5 +1,38 @@
+#pragma once
 #include "namespaces.hh"
 #include "iputils.hh"
 #include "dnsparser.hh"
 
+class SOARecordContent;
+
+/* Collects the records of an IXFR response (RFC 1995), which may span many messages, and splits
+   them into deltas. Each delta is a pair of the records to remove and the records to add, both
+   starting with the SOA of the serial the delta goes from and to respectively. */
+class IXFRCollector
+{
+public:
+  typedef vector<pair<vector<DNSRecord>, vector<DNSRecord> > > deltas_t;
+
+  IXFRCollector(const DNSName& zone, uint32_t ourSerial) : d_zone(zone), d_ourSerial(ourSerial)
+  {
+  }
+
+  //! adds the next answer record, returns true once the response is complete or turns out to be a full zone
+  bool add(const DNSRecord& dr);
+  //! true if the master sent the whole zone instead of deltas (RFC 1995 section 4), known from the second record on
+  bool isFullZone() const { return d_fullZone; }
+  //! the deltas, none if we are up to date. Throws if the response is incomplete, or a full zone instead of deltas
+  deltas_t getDeltas() const;
+
+private:
+  vector<DNSRecord> d_records;
+  shared_ptr<SOARecordContent> d_masterSOA;
+  DNSName d_zone;
+  uint32_t d_ourSerial;
+  unsigned int d_masterSOACount{0};
+  bool d_complete{false};
+  bool d_upToDate{false};
+  bool d_fullZone{false};
+};
+
 vector<pair<vector<DNSRecord>, vector<DNSRecord> > >   getIXFRDeltas(const ComboAddress& master, const DNSName& zone, const DNSRecord& sr);
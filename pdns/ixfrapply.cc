@@ -0,0 +1,234 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "ixfrapply.hh"
+#include "base32.hh"
+#include "dnssecinfra.hh"
+#include "misc.hh"
+
+namespace {
+struct NameState
+{
+  set<uint16_t> types;
+  bool ent{false};
+};
+
+NameState getNameState(DNSBackend* db, int domain_id, const DNSName& qname)
+{
+  NameState ret;
+  DNSResourceRecord rr;
+  db->lookup(QType(QType::ANY), qname, 0, domain_id);
+  while(db->get(rr)) {
+    if(rr.qtype.getCode())
+      ret.types.insert(rr.qtype.getCode());
+    else
+      ret.ent=true;
+  }
+  return ret;
+}
+
+// the real records and empty non-terminals at and below qname
+void getSubZoneState(DNSBackend* db, int domain_id, const DNSName& qname, bool& foundReal, bool& foundEnt)
+{
+  foundReal=foundEnt=false;
+  DNSResourceRecord rr;
+  db->listSubZone(qname, domain_id);
+  while(db->get(rr)) {
+    if(rr.qtype.getCode())
+      foundReal=true;
+    else
+      foundEnt=true;
+  }
+}
+
+/* Fixes the auth flags, ordernames and empty non-terminals of the names an IXFR touched. Names below a
+   delegation that was added or removed are fixed too, as their auth flag changes */
+void rectifyNames(DomainInfo& di, set<DNSName> names, const set<DNSName>& delegations, bool isDnssecZone, bool haveNSEC3, bool narrow, const NSEC3PARAMRecordContent& ns3pr)
+{
+  DNSBackend* db=di.backend;
+  DNSResourceRecord rr;
+  for(const auto& delegation : delegations) {
+    db->listSubZone(delegation, di.id);
+    while(db->get(rr))
+      names.insert(rr.qname);
+  }
+
+  map<DNSName, bool> isDelegation;
+  auto hasNS = [&](const DNSName& qname) {
+    auto iter=isDelegation.find(qname);
+    if(iter != isDelegation.end())
+      return iter->second;
+    bool found=false;
+    db->lookup(QType(QType::NS), qname, 0, di.id);
+    while(db->get(rr))
+      found=true;
+    return isDelegation[qname]=found;
+  };
+
+  set<DNSName> insnonterm, delnonterm;
+  for(const auto& qname : names) {
+    NameState state=getNameState(db, di.id, qname);
+
+    bool auth=true, delegation=false;
+    if(qname != di.zone) {
+      delegation=hasNS(qname);
+      DNSName shorter(qname);
+      while(shorter.chopOff() && shorter != di.zone) {
+        if(hasNS(shorter)) {
+          auth=false;
+          break;
+        }
+      }
+    }
+
+    if(!state.types.empty()) {
+      if(isDnssecZone) {
+        DNSName ordername;
+        if(haveNSEC3) {
+          if(!narrow && (delegation ? (!(ns3pr.d_flags & 1) || state.types.count(QType::DS)) : auth))
+            ordername=DNSName(toBase32Hex(hashQNameWithSalt(ns3pr, qname)))+di.zone;
+        }
+        else if(auth)
+          ordername=qname;
+        db->updateDNSSECOrderNameAndAuth(di.id, di.zone, qname, ordername, auth && !delegation);
+        if(delegation && state.types.count(QType::DS))
+          db->updateDNSSECOrderNameAndAuth(di.id, di.zone, qname, ordername, true, QType::DS);
+      }
+      // names that move in or out of a delegation change their auth flag both ways
+      else if(db->updateDNSSECOrderNameAndAuth(di.id, di.zone, qname, DNSName(), auth && !delegation)) {
+        if(delegation && state.types.count(QType::DS))
+          db->updateDNSSECOrderNameAndAuth(di.id, di.zone, qname, DNSName(), true, QType::DS);
+      }
+      else {
+        // a backend without DNSSEC support gets the auth flags through the RRsets
+        for(auto qtype : state.types) {
+          bool rrauth = auth && (!delegation || qtype == QType::DS);
+          vector<DNSResourceRecord> rrset;
+          bool changed=false;
+          db->lookup(QType(qtype), qname, 0, di.id);
+          while(db->get(rr)) {
+            changed |= (rr.auth != rrauth);
+            rr.auth=rrauth;
+            rrset.push_back(rr);
+          }
+          if(changed)
+            db->replaceRRSet(di.id, qname, QType(qtype), rrset);
+        }
+      }
+    }
+
+    if(qname == di.zone)
+      continue;
+
+    bool exists=!state.types.empty();
+    if(exists) {
+      if(state.ent)
+        delnonterm.insert(qname);
+    }
+    else {
+      bool foundDeeper, foundEnt;
+      getSubZoneState(db, di.id, qname, foundDeeper, foundEnt);
+      if(foundDeeper && !state.ent)
+        insnonterm.insert(qname);
+      else if(!foundDeeper && state.ent)
+        delnonterm.insert(qname);
+      exists=foundDeeper;
+    }
+
+    DNSName shorter(qname);
+    while(shorter.chopOff() && shorter != di.zone) {
+      if(exists) {
+        // every name between this one and the apex needs records or an empty non-terminal
+        NameState above=getNameState(db, di.id, shorter);
+        if(!above.types.empty() || above.ent)
+          break;
+        insnonterm.insert(shorter);
+      }
+      else {
+        // this name is gone, so are the empty non-terminals above it that have nothing else below them
+        bool foundReal, foundEnt;
+        getSubZoneState(db, di.id, shorter, foundReal, foundEnt);
+        if(foundReal)
+          break;
+        if(foundEnt)
+          delnonterm.insert(shorter);
+      }
+    }
+  }
+
+  if(!insnonterm.empty() || !delnonterm.empty()) {
+    db->updateEmptyNonTerminals(di.id, di.zone, insnonterm, delnonterm, false);
+    if(haveNSEC3) {
+      for(const auto& ent : insnonterm) {
+        DNSName ordername;
+        if(!narrow)
+          ordername=DNSName(toBase32Hex(hashQNameWithSalt(ns3pr, ent)))+di.zone;
+        db->updateDNSSECOrderNameAndAuth(di.id, di.zone, ent, ordername, true);
+      }
+    }
+  }
+}
+
+uint32_t getSerial(const DNSRecord& dr)
+{
+  return std::dynamic_pointer_cast<SOARecordContent>(dr.d_content)->d_st.serial;
+}
+}
+
+uint32_t applyIXFRDeltas(DomainInfo& di, const IXFRCollector::deltas_t& deltas, bool isDnssecZone, bool haveNSEC3, bool narrow, const NSEC3PARAMRecordContent& ns3pr, bool directDNSKEY)
+{
+  uint32_t serial=di.serial;
+  set<DNSName> touched, delegations;
+  for(const auto& delta : deltas) {
+    if(getSerial(delta.first.front()) != serial)
+      throw PDNSException("delta goes from serial "+std::to_string(getSerial(delta.first.front()))+" instead of "+std::to_string(serial));
+
+    map<pair<DNSName,uint16_t>, pair<vector<DNSRecord>, vector<DNSRecord> > > grouped;
+    for(const auto& dr : delta.first)
+      grouped[make_pair(dr.d_name, dr.d_type)].first.push_back(dr);
+    for(const auto& dr : delta.second)
+      grouped[make_pair(dr.d_name, dr.d_type)].second.push_back(dr);
+
+    for(const auto& group : grouped) {
+      const DNSName& qname=group.first.first;
+      QType qtype(group.first.second);
+      if(qtype.getCode() == QType::NSEC || qtype.getCode() == QType::NSEC3 || qtype.getCode() == QType::NSEC3PARAM || qtype.getCode() == QType::RRSIG)
+        throw PDNSException("delta changes "+qtype.getName()+" records, the zone is presigned now");
+      if(isDnssecZone && qtype.getCode() == QType::DNSKEY && !directDNSKEY)
+        continue;
+
+      vector<DNSResourceRecord> rrset;
+      DNSResourceRecord rr;
+      if(qtype.getCode() != QType::SOA) { // the SOA is simply replaced, however we stored it
+        di.backend->lookup(qtype, qname, 0, di.id);
+        while(di.backend->get(rr))
+          rrset.push_back(rr);
+      }
+      for(const auto& dr : group.second.first) {
+        if(qtype.getCode() == QType::SOA)
+          continue;
+        string content=toLower(DNSResourceRecord(dr).getZoneRepresentation());
+        auto iter=find_if(rrset.begin(), rrset.end(), [&content](const DNSResourceRecord& ours) { return toLower(ours.getZoneRepresentation()) == content; });
+        if(iter == rrset.end())
+          throw PDNSException("delta removes "+qname.toString()+"|"+qtype.getName()+" '"+content+"', which we do not have");
+        rrset.erase(iter);
+      }
+      for(const auto& dr : group.second.second)
+        rrset.push_back(DNSResourceRecord(dr));
+      for(auto& ours : rrset) {
+        ours.domain_id=di.id;
+        ours.auth=true;
+      }
+
+      if(!di.backend->replaceRRSet(di.id, qname, qtype, rrset))
+        throw PDNSException("backend does not support replacing RRsets");
+      touched.insert(qname);
+      if(qtype.getCode() == QType::NS && qname != di.zone)
+        delegations.insert(qname);
+    }
+    serial=getSerial(delta.second.front());
+  }
+
+  rectifyNames(di, touched, delegations, isDnssecZone, haveNSEC3, narrow, ns3pr);
+  return serial;
+}
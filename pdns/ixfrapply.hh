@@ -0,0 +1,15 @@
+#ifndef PDNS_IXFRAPPLY_HH
+#define PDNS_IXFRAPPLY_HH
+#include "dnsbackend.hh"
+#include "dnsrecords.hh"
+#include "ixfr.hh"
+#include "namespaces.hh"
+
+/** Applies the deltas of an IXFR to the zone in di, which is at di.serial, and returns the serial it is at then.
+
+    Only the RRsets the deltas change are replaced, and only the names they touch are rectified, like a rectify
+    would do for them, but without going over the whole zone. The caller runs this in a transaction, and aborts
+    that when this throws because the deltas do not match what we have or the backend cannot replace RRsets. */
+uint32_t applyIXFRDeltas(DomainInfo& di, const IXFRCollector::deltas_t& deltas, bool isDnssecZone, bool haveNSEC3, bool narrow, const NSEC3PARAMRecordContent& ns3pr, bool directDNSKEY);
+
+#endif
@@ -84,6 +84,14 @@ public:
     d_readCallbacks[fd].d_ttd=tv;
   }
 
+  virtual void setWriteTTD(int fd, struct timeval tv, int timeout)
+  {
+    if(!d_writeCallbacks.count(fd))
+      throw FDMultiplexerException("attempt to timestamp fd not in the multiplexer");
+    tv.tv_sec += timeout;
+    d_writeCallbacks[fd].d_ttd=tv;
+  }
+
   virtual funcparam_t& getReadParameter(int fd) 
   {
     if(!d_readCallbacks.count(fd))
@@ -91,10 +99,12 @@ public:
     return d_readCallbacks[fd].d_parameter;
   }
 
-  virtual std::vector<std::pair<int, funcparam_t> > getTimeouts(const struct timeval& tv)
+  //! the fds on the read watch list, or on the write watch list, whose time is up
+  virtual std::vector<std::pair<int, funcparam_t> > getTimeouts(const struct timeval& tv, bool writes=false)
   {
     std::vector<std::pair<int, funcparam_t> > ret;
-    for(callbackmap_t::iterator i=d_readCallbacks.begin(); i!=d_readCallbacks.end(); ++i)
+    const callbackmap_t& cbmap = writes ? d_writeCallbacks : d_readCallbacks;
+    for(callbackmap_t::const_iterator i=cbmap.begin(); i!=cbmap.end(); ++i)
       if(i->second.d_ttd.tv_sec && boost::tie(tv.tv_sec, tv.tv_usec) > boost::tie(i->second.d_ttd.tv_sec, i->second.d_ttd.tv_usec)) 
         ret.push_back(std::make_pair(i->first, i->second.d_parameter));
     return ret;
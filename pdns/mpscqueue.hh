@@ -0,0 +1,184 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <boost/noncopyable.hpp>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "misc.hh"
+
+/**
+   A bounded queue that many threads push to, but only one thread pops from, without taking locks.
+
+   This is the bounded queue by Dmitry Vyukov, with a single consumer: each cell carries a sequence number
+   which tells a producer holding that ticket that the cell is free, or tells the consumer that it is filled.
+   Pushing never blocks, it fails if the queue is full.
+
+   The consumer waits for work in its multiplexer, on getDescriptor(). Producers only signal that descriptor
+   if the consumer announced it was going to sleep with prepareToSleep(), so a busy consumer is not woken up
+   for every single item, and picks up everything that arrived meanwhile in one go.
+   On Linux the descriptor is an eventfd, elsewhere it is a pipe.
+*/
+
+template<class T>
+class MPSCQueue : public boost::noncopyable
+{
+public:
+  explicit MPSCQueue(size_t capacity); //!< capacity gets rounded up to a power of two
+  ~MPSCQueue();
+  bool push(T&& t); //!< returns false if the queue is full, t is left alone then
+  bool pop(T* t);   //!< consumer only, returns false if the queue is empty
+  bool empty() const; //!< consumer only
+  //! consumer only, call before waiting on getDescriptor(). If items are pending already, the descriptor becomes readable right away
+  void prepareToSleep();
+  //! consumer only, call when done waiting, so producers stop signalling
+  void wokeUp()
+  {
+    d_sleeping.store(false, std::memory_order_relaxed);
+  }
+  //! consumer only, call when getDescriptor() became readable
+  void clearWakeup();
+  int getDescriptor() const
+  {
+    return d_fds[0];
+  }
+
+private:
+  struct Cell
+  {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  void wakeup();
+
+  std::unique_ptr<Cell[]> d_cells;
+  size_t d_mask;
+  std::atomic<size_t> d_enqueuePos{0};
+  size_t d_dequeuePos{0};
+  std::atomic<bool> d_sleeping{false};
+  int d_fds[2];
+};
+
+template<class T>
+MPSCQueue<T>::MPSCQueue(size_t capacity)
+{
+  size_t size = 2;
+  while(size < capacity)
+    size <<= 1;
+  d_cells.reset(new Cell[size]);
+  for(size_t n = 0; n < size; ++n)
+    d_cells[n].seq.store(n, std::memory_order_relaxed);
+  d_mask = size - 1;
+
+#ifdef __linux__
+  d_fds[0] = d_fds[1] = eventfd(0, EFD_NONBLOCK);
+  if(d_fds[0] < 0)
+    unixDie("Creating eventfd for queue");
+#else
+  if(pipe(d_fds) < 0)
+    unixDie("Creating pipe for queue");
+  setNonBlocking(d_fds[0]);
+  setNonBlocking(d_fds[1]);
+#endif
+}
+
+template<class T>
+MPSCQueue<T>::~MPSCQueue()
+{
+  close(d_fds[0]);
+  if(d_fds[1] != d_fds[0])
+    close(d_fds[1]);
+}
+
+template<class T>
+bool MPSCQueue<T>::push(T&& t)
+{
+  Cell* cell;
+  size_t pos = d_enqueuePos.load(std::memory_order_relaxed);
+  for(;;) {
+    cell = &d_cells[pos & d_mask];
+    size_t seq = cell->seq.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if(!diff) {
+      if(d_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    }
+    else if(diff < 0)
+      return false; // full, the consumer has not popped this cell yet
+    else
+      pos = d_enqueuePos.load(std::memory_order_relaxed);
+  }
+
+  cell->data = std::move(t);
+  cell->seq.store(pos + 1, std::memory_order_release);
+
+  // pairs with the fence in prepareToSleep(): either we see the consumer is about to sleep, or it sees our item
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(d_sleeping.load(std::memory_order_relaxed) && d_sleeping.exchange(false))
+    wakeup();
+  return true;
+}
+
+template<class T>
+bool MPSCQueue<T>::pop(T* t)
+{
+  Cell& cell = d_cells[d_dequeuePos & d_mask];
+  size_t seq = cell.seq.load(std::memory_order_acquire);
+  if(seq != d_dequeuePos + 1)
+    return false;
+
+  *t = std::move(cell.data);
+  cell.data = T(); // don't keep what was moved from alive until this cell gets reused
+  cell.seq.store(d_dequeuePos + d_mask + 1, std::memory_order_release);
+  d_dequeuePos++;
+  return true;
+}
+
+template<class T>
+bool MPSCQueue<T>::empty() const
+{
+  return d_cells[d_dequeuePos & d_mask].seq.load(std::memory_order_acquire) != d_dequeuePos + 1;
+}
+
+template<class T>
+void MPSCQueue<T>::prepareToSleep()
+{
+  d_sleeping.store(true);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(!empty() && d_sleeping.exchange(false)) // otherwise a producer got there first, and signalled already
+    wakeup();
+}
+
+template<class T>
+void MPSCQueue<T>::clearWakeup()
+{
+  d_sleeping.store(false);
+#ifdef __linux__
+  uint64_t value;
+  if(read(d_fds[0], &value, sizeof(value)) < 0 && errno != EAGAIN)
+    unixDie("read from queue eventfd");
+#else
+  char buf[64];
+  while(read(d_fds[0], buf, sizeof(buf)) > 0)
+    ;
+#endif
+}
+
+template<class T>
+void MPSCQueue<T>::wakeup()
+{
+#ifdef __linux__
+  uint64_t value = 1;
+  if(write(d_fds[1], &value, sizeof(value)) != sizeof(value))
+    unixDie("write to queue eventfd");
+#else
+  char c = 0;
+  if(write(d_fds[1], &c, 1) != 1 && errno != EAGAIN) // if the pipe is full, the consumer has plenty to wake up for
+    unixDie("write to queue pipe");
+#endif
+}
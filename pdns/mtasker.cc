@@ -25,6 +25,7 @@
 #endif
 #include "mtasker.hh"
 #include "misc.hh"
+#include <algorithm>
 #include <stdio.h>
 #include <iostream>
 
@@ -41,7 +42,7 @@
     code that would ordinarily require a statemachine, for which the author does not consider 
     himself smart enough.
 
-    This class does not perform any magic it only makes calls to makecontext() and swapcontext(). 
+    This class does not perform any magic, it only makes calls to pdns_makecontext() and pdns_swapcontext(), see mtasker_context.hh.
     Getting the details right however is complicated and MTasker does that for you.
 
     If preemptive multitasking or more advanced concepts such as semaphores, locks or mutexes
@@ -168,14 +169,14 @@ int main()
     \return returns -1 in case of error, 0 in case of timeout, 1 in case of an answer 
 */
 
-template<class EventKey, class EventVal>int MTasker<EventKey,EventVal>::waitEvent(EventKey &key, EventVal *val, unsigned int timeoutMsec, struct timeval* now)
+template<class EventKey, class EventVal, class Cmp>int MTasker<EventKey,EventVal,Cmp>::waitEvent(EventKey &key, EventVal *val, unsigned int timeoutMsec, struct timeval* now)
 {
   if(d_waiters.count(key)) { // there was already an exact same waiter
     return -1;
   }
 
   Waiter w;
-  w.context=new ucontext_t;
+  w.context=new pdns_ucontext_t;
   w.ttd.tv_sec = 0; w.ttd.tv_usec = 0;
   if(timeoutMsec) {
     struct timeval increment;
@@ -198,10 +199,7 @@ template<class EventKey, class EventVal>int MTasker<EventKey,EventVal>::waitEven
   unsigned int diff=d_threads[d_tid].dt.ndiff()/1000;
   d_threads[d_tid].totTime+=diff;
 #endif
-  if(swapcontext(d_waiters.find(key)->context,&d_kernel)) { // 'A' will return here when 'key' has arrived, hands over control to kernel first
-    perror("swapcontext");
-    exit(EXIT_FAILURE); // no way we can deal with this 
-  }
+  pdns_swapcontext(*d_waiters.find(key)->context, d_kernel); // 'A' will return here when 'key' has arrived, hands over control to kernel first
 #ifdef MTASKERTIMING
   d_threads[d_tid].dt.start();
 #endif
@@ -218,13 +216,10 @@ template<class EventKey, class EventVal>int MTasker<EventKey,EventVal>::waitEven
 //! yields control to the kernel or other threads
 /** Hands over control to the kernel, allowing other processes to run, or events to arrive */
 
-template<class Key, class Val>void MTasker<Key,Val>::yield()
+template<class Key, class Val, class Cmp>void MTasker<Key,Val,Cmp>::yield()
 {
   d_runQueue.push(d_tid);
-  if(swapcontext(d_threads[d_tid].context ,&d_kernel) < 0) { // give control to the kernel
-    perror("swapcontext in  yield");
-    exit(EXIT_FAILURE);
-  }
+  pdns_swapcontext(*d_threads[d_tid].context, d_kernel); // give control to the kernel
 }
 
 //! reports that an event took place for which threads may be waiting
@@ -235,7 +230,7 @@ template<class Key, class Val>void MTasker<Key,Val>::yield()
 
     WARNING: when passing val as zero, d_waitval is undefined, and hence waitEvent will return undefined!
 */
-template<class EventKey, class EventVal>int MTasker<EventKey,EventVal>::sendEvent(const EventKey& key, const EventVal* val)
+template<class EventKey, class EventVal, class Cmp>int MTasker<EventKey,EventVal,Cmp>::sendEvent(const EventKey& key, const EventVal* val)
 {
   typename waiters_t::iterator waiter=d_waiters.find(key);
 
@@ -248,49 +243,33 @@ template<class EventKey, class EventVal>int MTasker<EventKey,EventVal>::sendEven
   if(val)
     d_waitval=*val;
   
-  ucontext_t *userspace=waiter->context;
+  pdns_ucontext_t *userspace=waiter->context;
   d_tid=waiter->tid;         // set tid 
   d_eventkey=waiter->key;        // pass waitEvent the exact key it was woken for
   d_waiters.erase(waiter);             // removes the waitpoint 
-  if(swapcontext(&d_kernel,userspace)) { // swaps back to the above point 'A'
-    perror("swapcontext in sendEvent");
-    exit(EXIT_FAILURE);
-  }
+  pdns_swapcontext(d_kernel, *userspace); // swaps back to the above point 'A'
   delete userspace;
   return 1;
 }
 
-inline pair<uint32_t, uint32_t> splitPointer(void *ptr)
-{
-  uint64_t ll = (uint64_t) ptr;
-  return make_pair(ll >> 32, ll & 0xffffffff);
-}
-
-inline void* joinPtr(uint32_t val1, uint32_t val2)
-{
-  return (void*)(((uint64_t)val1 << 32) | (uint64_t)val2);
-}
-
 //! launches a new thread
 /** The kernel can call this to make a new thread, which starts at the function start and gets passed the val void pointer.
     \param start Pointer to the function which will form the start of the thread
     \param val A void pointer that can be used to pass data to the thread
 */
-template<class Key, class Val>void MTasker<Key,Val>::makeThread(tfunc_t *start, void* val)
+template<class Key, class Val, class Cmp>void MTasker<Key,Val,Cmp>::makeThread(tfunc_t *start, void* val)
 {
-  ucontext_t *uc=new ucontext_t;
-  getcontext(uc);
-  
+  char* stack = allocateStack(); // first, as this can throw
+  pdns_ucontext_t *uc=new pdns_ucontext_t;
   uc->uc_link = &d_kernel; // come back to kernel after dying
-  uc->uc_stack.ss_sp = new char[d_stacksize];
-  
-  uc->uc_stack.ss_size = d_stacksize;
-  pair<uint32_t, uint32_t> valpair = splitPointer(val);
-  pair<uint32_t, uint32_t> thispair = splitPointer(this);
+  uc->uc_stack = stack;
+  uc->uc_stacksize = d_stacksize;
 
-  makecontext (uc, (void (*)(void))threadWrapper, 6, thispair.first, thispair.second, start, d_maxtid, valpair.first, valpair.second);
+  ThreadInfo& ti = d_threads[d_maxtid];
+  ti.start = std::bind(threadWrapper, this, start, d_maxtid, val);
+  pdns_makecontext(*uc, ti.start);
 
-  d_threads[d_maxtid].context = uc;
+  ti.context = uc;
   d_runQueue.push(d_maxtid++); // will run at next schedule invocation
 }
 
@@ -305,23 +284,20 @@ template<class Key, class Val>void MTasker<Key,Val>::makeThread(tfunc_t *start,
     \return Returns if there is more work scheduled and recalling schedule now would be useful
       
 */
-template<class Key, class Val>bool MTasker<Key,Val>::schedule(struct timeval*  now)
+template<class Key, class Val, class Cmp>bool MTasker<Key,Val,Cmp>::schedule(struct timeval*  now)
 {
   if(!d_runQueue.empty()) {
     d_tid=d_runQueue.front();
 #ifdef MTASKERTIMING
     d_threads[d_tid].dt.start();
 #endif
-    if(swapcontext(&d_kernel, d_threads[d_tid].context)) {
-      perror("swapcontext in schedule");
-      exit(EXIT_FAILURE);
-    }
-      
+    pdns_swapcontext(d_kernel, *d_threads[d_tid].context);
+
     d_runQueue.pop();
     return true;
   }
   if(!d_zombiesQueue.empty()) {
-    delete[] (char *)d_threads[d_zombiesQueue.front()].context->uc_stack.ss_sp;
+    releaseStack(d_threads[d_zombiesQueue.front()].context->uc_stack);
     delete d_threads[d_zombiesQueue.front()].context;
     d_threads.erase(d_zombiesQueue.front());
     d_zombiesQueue.pop();
@@ -342,18 +318,17 @@ template<class Key, class Val>bool MTasker<Key,Val>::schedule(struct timeval*  n
       if(i->ttd.tv_sec && i->ttd < rnow) {
         d_waitstatus=TimeOut;
         d_eventkey=i->key;        // pass waitEvent the exact key it was woken for
-        ucontext_t* uc = i->context;
+        pdns_ucontext_t* uc = i->context;
         d_tid = i->tid;
         ttdindex.erase(i++);                  // removes the waitpoint 
 
-        if(swapcontext(&d_kernel, uc)) { // swaps back to the above point 'A'
-          perror("swapcontext in schedule2");
-          exit(EXIT_FAILURE);
-        }
+        pdns_swapcontext(d_kernel, *uc); // swaps back to the above point 'A'
         delete uc;
       }
       else if(i->ttd.tv_sec)
         break;
+      else
+        ++i;      // waits without a timeout
     }
   }
   return false;
@@ -363,7 +338,7 @@ template<class Key, class Val>bool MTasker<Key,Val>::schedule(struct timeval*  n
 /** Call this to check if no processes are running anymore
     \return true if no processes are left
  */
-template<class Key, class Val>bool MTasker<Key,Val>::noProcesses()
+template<class Key, class Val, class Cmp>bool MTasker<Key,Val,Cmp>::noProcesses()
 {
   return d_threads.empty();
 }
@@ -372,7 +347,7 @@ template<class Key, class Val>bool MTasker<Key,Val>::noProcesses()
 /** Call this to perhaps limit activities if too many threads are running
     \return number of processes running
  */
-template<class Key, class Val>unsigned int MTasker<Key,Val>::numProcesses()
+template<class Key, class Val, class Cmp>unsigned int MTasker<Key,Val,Cmp>::numProcesses()
 {
   return d_threads.size();
 }
@@ -384,7 +359,7 @@ template<class Key, class Val>unsigned int MTasker<Key,Val>::numProcesses()
 
     \param events Vector which is to be filled with keys threads are waiting for
 */
-template<class Key, class Val>void MTasker<Key,Val>::getEvents(std::vector<Key>& events)
+template<class Key, class Val, class Cmp>void MTasker<Key,Val,Cmp>::getEvents(std::vector<Key>& events)
 {
   events.clear();
   for(typename waiters_t::const_iterator i=d_waiters.begin();i!=d_waiters.end();++i) {
@@ -392,10 +367,8 @@ template<class Key, class Val>void MTasker<Key,Val>::getEvents(std::vector<Key>&
   }
 }
 
-template<class Key, class Val>void MTasker<Key,Val>::threadWrapper(uint32_t self1, uint32_t self2, tfunc_t *tf, int tid, uint32_t val1, uint32_t val2)
+template<class Key, class Val, class Cmp>void MTasker<Key,Val,Cmp>::threadWrapper(MTasker* self, tfunc_t *tf, int tid, void* val)
 {
-  void* val = joinPtr(val1, val2); 
-  MTasker* self = (MTasker*) joinPtr(self1, self2);
   self->d_threads[self->d_tid].startOfStack = self->d_threads[self->d_tid].highestStackSeen = (char*)&val;
   (*tf)(val);
   self->d_zombiesQueue.push(tid);
@@ -407,19 +380,19 @@ template<class Key, class Val>void MTasker<Key,Val>::threadWrapper(uint32_t self
 /** Processes can call this to get a numerical representation of their current thread ID.
     This can be useful for logging purposes.
 */
-template<class Key, class Val>int MTasker<Key,Val>::getTid()
+template<class Key, class Val, class Cmp>int MTasker<Key,Val,Cmp>::getTid()
 {
   return d_tid;
 }
 
 //! Returns the maximum stack usage so far of this MThread
-template<class Key, class Val>unsigned int MTasker<Key,Val>::getMaxStackUsage()
+template<class Key, class Val, class Cmp>unsigned int MTasker<Key,Val,Cmp>::getMaxStackUsage()
 {
   return d_threads[d_tid].startOfStack - d_threads[d_tid].highestStackSeen;
 }
 
 //! Returns the maximum stack usage so far of this MThread
-template<class Key, class Val>unsigned int MTasker<Key,Val>::getUsec()
+template<class Key, class Val, class Cmp>unsigned int MTasker<Key,Val,Cmp>::getUsec()
 {
 #ifdef MTASKERTIMING
   return d_threads[d_tid].totTime + d_threads[d_tid].dt.ndiff()/1000;
@@ -427,3 +400,70 @@ template<class Key, class Val>unsigned int MTasker<Key,Val>::getUsec()
   return 0;
 #endif
 }
+
+template<class Key, class Val, class Cmp>MTasker<Key,Val,Cmp>::~MTasker()
+{
+  for(char* stack : d_stackPool)
+    munmap(stack - getPageSize(), d_stacksize + getPageSize());
+}
+
+template<class Key, class Val, class Cmp>size_t MTasker<Key,Val,Cmp>::getPageSize()
+{
+  static const size_t pagesize = sysconf(_SC_PAGESIZE);
+  return pagesize;
+}
+
+//! hands out a stack from the pool, or maps a new one, with a guard page below it so an overflow crashes right away
+template<class Key, class Val, class Cmp>char* MTasker<Key,Val,Cmp>::allocateStack()
+{
+  if(++d_stacksInUse > d_stacksHighWater)
+    d_stacksHighWater = d_stacksInUse;
+
+  if(!d_stackPool.empty()) {
+    char* stack = d_stackPool.back();
+    d_stackPool.pop_back();
+    d_stackPoolLowWater = std::min(d_stackPoolLowWater, d_stackPool.size());
+    d_trimmedStacks = std::min(d_trimmedStacks, d_stackPool.size());
+    d_stackReuses++;
+    return stack;
+  }
+
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_STACK
+  flags |= MAP_STACK;
+#endif
+  void* area = mmap(0, d_stacksize + getPageSize(), PROT_READ | PROT_WRITE, flags, -1, 0);
+  if(area == MAP_FAILED) {
+    d_stacksInUse--;
+    throw std::bad_alloc();
+  }
+  if(mprotect(area, getPageSize(), PROT_NONE) < 0) {
+    munmap(area, d_stacksize + getPageSize());
+    d_stacksInUse--;
+    throw std::bad_alloc();
+  }
+  return (char*)area + getPageSize();
+}
+
+//! pools the stack of a dead thread as it is, the next thread reuses it without a system call
+template<class Key, class Val, class Cmp>void MTasker<Key,Val,Cmp>::releaseStack(char* stack)
+{
+  d_stacksInUse--;
+  if(d_stackPool.size() < d_maxPooledStacks)
+    d_stackPool.push_back(stack);
+  else
+    munmap(stack - getPageSize(), d_stacksize + getPageSize());
+}
+
+/** Gives the memory of the stacks that stayed in the pool since the previous call back to the kernel, keeping
+    the mapping and the guard page. The pool is used from the back, so those are the first ones, and the stacks
+    that threads keep reusing are left alone. */
+template<class Key, class Val, class Cmp>void MTasker<Key,Val,Cmp>::trimStackPool()
+{
+#ifdef MADV_DONTNEED
+  for(size_t n = d_trimmedStacks; n < d_stackPoolLowWater; ++n)
+    madvise(d_stackPool[n], d_stacksize, MADV_DONTNEED);
+#endif
+  d_trimmedStacks = std::max(d_trimmedStacks, d_stackPoolLowWater);
+  d_stackPoolLowWater = d_stackPool.size();
+}
@@ -23,38 +23,45 @@
 #define MTASKER_HH
 #include <stdint.h>
 #include <signal.h>
-#include <ucontext.h>
 #include <queue>
 #include <vector>
 #include <map>
+#include <new>
 #include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/hashed_index.hpp>
 #include <boost/multi_index/key_extractors.hpp>
 #include "namespaces.hh"
 #include "misc.hh"
+#include "mtasker_context.hh"
 using namespace ::boost::multi_index;
 
 // #define MTASKERTIMING 1
 
 struct KeyTag {};
+struct OrderedKeyTag {};
 
 //! The main MTasker class    
 /** The main MTasker class. See the main page for more information.
     \tparam EventKey Type of the key with which events are to be identified. Defaults to int.
     \tparam EventVal Type of the content or value of an event. Defaults to int. Cannot be set to void.
-    \note The EventKey needs to have an operator< defined because it is used as the key of an associative array
+    \tparam Cmp Ordering of the waiters in their OrderedKeyTag index, which may consider keys equivalent that are not equal, to find near matches
+    \note The EventKey needs operator== and a boost::hash, as events are looked up in a hash table
 */
-template<class EventKey=int, class EventVal=int> class MTasker
+template<class EventKey=int, class EventVal=int, class Cmp=std::less<EventKey> > class MTasker
 {
 private:
-  ucontext_t d_kernel;     
+  pdns_ucontext_t d_kernel;
   std::queue<int> d_runQueue;
   std::queue<int> d_zombiesQueue;
 
   struct ThreadInfo
   {
-	ucontext_t* context;
+	pdns_ucontext_t* context;
+	std::function<void(void)> start;
 	char* startOfStack;
 	char* highestStackSeen;
 #ifdef MTASKERTIMING
@@ -69,6 +76,14 @@ private:
   int d_maxtid;
   size_t d_stacksize;
 
+  std::vector<char*> d_stackPool; //!< stacks of dead threads, for new threads to reuse
+  size_t d_maxPooledStacks;
+  size_t d_stackPoolLowWater; //!< fewest stacks in the pool since the last trimStackPool()
+  size_t d_trimmedStacks; //!< the first d_trimmedStacks stacks of the pool hold no memory
+  size_t d_stacksInUse;
+  size_t d_stacksHighWater;
+  uint64_t d_stackReuses;
+
   EventVal d_waitval;
   enum waitstatusenum {Error=-1,TimeOut=0,Answer} d_waitstatus;
 
@@ -76,7 +91,7 @@ public:
   struct Waiter
   {
     EventKey key;
-    ucontext_t *context;
+    pdns_ucontext_t *context;
     struct timeval ttd;
     int tid;    
   };
@@ -84,22 +99,28 @@ public:
   typedef multi_index_container<
     Waiter,
     indexed_by <
-                ordered_unique<member<Waiter,EventKey,&Waiter::key> >,
-                ordered_non_unique<tag<KeyTag>, member<Waiter,struct timeval,&Waiter::ttd> >
+                hashed_unique<member<Waiter,EventKey,&Waiter::key> >,
+                ordered_non_unique<tag<KeyTag>, member<Waiter,struct timeval,&Waiter::ttd> >,
+                ordered_non_unique<tag<OrderedKeyTag>, member<Waiter,EventKey,&Waiter::key>, Cmp>
                >
   > waiters_t;
 
   waiters_t d_waiters;
 
   //! Constructor
-  /** Constructor with a small default stacksize. If any of your threads exceeds this stack, your application will crash. 
+  /** Constructor with a small default stacksize. If any of your threads exceeds this stack, your application will crash,
+      as every stack is followed by an inaccessible guard page. The stacksize is rounded up to whole pages.
       This limit applies solely to the stack, the heap is not limited in any way. If threads need to allocate a lot of data,
       the use of new/delete is suggested. 
+      Up to maxPooledStacks stacks of threads that died are kept around for new threads. The memory of those
+      that stay unused is given back to the kernel by trimStackPool(), which should be called now and then.
    */
-  MTasker(size_t stacksize=8192) : d_stacksize(stacksize)
+  MTasker(size_t stacksize=8192, size_t maxPooledStacks=64) : d_maxPooledStacks(maxPooledStacks), d_stackPoolLowWater(0), d_trimmedStacks(0), d_stacksInUse(0), d_stacksHighWater(0), d_stackReuses(0)
   {
     d_maxtid=0;
+    d_stacksize=(stacksize + getPageSize() - 1) & ~(getPageSize() - 1);
   }
+  ~MTasker();
 
   typedef void tfunc_t(void *); //!< type of the pointer that starts a thread 
   int waitEvent(EventKey &key, EventVal *val=0, unsigned int timeoutMsec=0, struct timeval* now=0);
@@ -113,9 +134,16 @@ public:
   int getTid(); 
   unsigned int getMaxStackUsage();
   unsigned int getUsec();
+  size_t getStackPoolSize() const { return d_stackPool.size(); } //!< number of stacks waiting for a new thread
+  size_t getStacksHighWater() const { return d_stacksHighWater; } //!< most stacks that were in use at the same time
+  uint64_t getStackReuses() const { return d_stackReuses; } //!< number of threads that got a stack from the pool
+  void trimStackPool();
 
 private:
-  static void threadWrapper(uint32_t self1, uint32_t self2, tfunc_t *tf, int tid, uint32_t val1, uint32_t val2);
+  static void threadWrapper(MTasker* self, tfunc_t *tf, int tid, void* val);
+  static size_t getPageSize();
+  char* allocateStack();
+  void releaseStack(char* stack);
   EventKey d_eventkey;   // for waitEvent, contains exact key it was awoken for
 };
 #include "mtasker.cc"
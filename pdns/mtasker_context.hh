@@ -0,0 +1,31 @@
+#pragma once
+#include <functional>
+#include <stddef.h>
+
+/* The context switching MTasker needs: running a function on a stack of its own, and
+   switching back and forth between such stacks.
+
+   There are two implementations, one of which gets linked in, chosen at configure time.
+   mtasker_ucontext.cc uses makecontext() and swapcontext(), which also save and restore the
+   signal mask, costing a system call for every switch. mtasker_fcontext.cc only swaps the
+   callee-saved registers and the stack pointer, and is available on x86-64 and aarch64. */
+
+struct pdns_ucontext_t
+{
+  pdns_ucontext_t();
+  ~pdns_ucontext_t();
+
+  void* uc_mcontext;          //!< saved state, belongs to the implementation
+  pdns_ucontext_t* uc_link;   //!< where to continue when the function started by pdns_makecontext() returns
+  char* uc_stack;             //!< belongs to the caller, needs to outlive the context
+  size_t uc_stacksize;
+
+private:
+  pdns_ucontext_t(const pdns_ucontext_t&);
+  pdns_ucontext_t& operator=(const pdns_ucontext_t&);
+};
+
+//! prepares ctx to call start() on ctx.uc_stack once it is switched to. uc_link and uc_stack need to be set already, start needs to stay around
+void pdns_makecontext(pdns_ucontext_t& ctx, std::function<void(void)>& start);
+//! saves the current context in octx, and continues with ctx
+void pdns_swapcontext(pdns_ucontext_t& octx, const pdns_ucontext_t& ctx);
@@ -0,0 +1,170 @@
+#include "mtasker_context.hh"
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Switching only saves what the ABI says a function call preserves, the other registers are
+   already saved by the compiler around the call to pdns_fcontext_jump().
+   The stack pointer of a suspended context points at these saved registers, the last one of which
+   is the return address. A fresh context gets a frame that 'returns' to pdns_fcontext_start, which
+   calls contextEntry() with the StartInfo stored at the top of its stack. */
+
+extern "C" {
+void pdns_fcontext_jump(void** from, void* to);
+void pdns_fcontext_start();
+}
+
+#ifdef __APPLE__
+#define PDNS_ASM_SYMBOL(name) "_" #name
+#define PDNS_ASM_TYPE(name)
+#else
+#define PDNS_ASM_SYMBOL(name) #name
+#define PDNS_ASM_TYPE(name) ".type " #name ", @function\n"
+#endif
+
+#if defined(__x86_64__)
+/* saves rbp, rbx, r15-r12 and the SSE and x87 control words. The new stack pointer is loaded
+   straight from the second argument, so the fresh context starts with r12 = contextEntry and
+   r13 = its StartInfo, with a stack that is 16 byte aligned when calling contextEntry */
+asm(".text\n"
+    ".globl " PDNS_ASM_SYMBOL(pdns_fcontext_jump) "\n"
+    PDNS_ASM_TYPE(pdns_fcontext_jump)
+    ".p2align 4\n"
+    PDNS_ASM_SYMBOL(pdns_fcontext_jump) ":\n"
+    "  pushq %rbp\n"
+    "  pushq %rbx\n"
+    "  pushq %r15\n"
+    "  pushq %r14\n"
+    "  pushq %r13\n"
+    "  pushq %r12\n"
+    "  subq $8, %rsp\n"
+    "  stmxcsr (%rsp)\n"
+    "  fnstcw 4(%rsp)\n"
+    "  movq %rsp, (%rdi)\n"
+    "  movq %rsi, %rsp\n"
+    "  ldmxcsr (%rsp)\n"
+    "  fldcw 4(%rsp)\n"
+    "  addq $8, %rsp\n"
+    "  popq %r12\n"
+    "  popq %r13\n"
+    "  popq %r14\n"
+    "  popq %r15\n"
+    "  popq %rbx\n"
+    "  popq %rbp\n"
+    "  ret\n"
+    ".globl " PDNS_ASM_SYMBOL(pdns_fcontext_start) "\n"
+    PDNS_ASM_TYPE(pdns_fcontext_start)
+    ".p2align 4\n"
+    PDNS_ASM_SYMBOL(pdns_fcontext_start) ":\n"
+    "  movq %r13, %rdi\n"
+    "  callq *%r12\n"
+    "  ud2\n"); // contextEntry() never returns
+
+static const size_t s_savedRegisters = 8; // control words, r12-r15, rbx, rbp, return address
+static const size_t s_entrySlot = 1, s_infoSlot = 2, s_returnSlot = 7;
+
+static void initSavedRegisters(void** frame)
+{
+  uint32_t* controlWords = (uint32_t*)frame;
+  controlWords[0] = 0x1F80; // default MXCSR
+  controlWords[1] = 0x037F; // default x87 control word
+}
+
+#elif defined(__aarch64__)
+/* saves d8-d15 and x19-x30, x30 being the return address. The fresh context starts with
+   x19 = contextEntry and x20 = its StartInfo */
+asm(".text\n"
+    ".globl " PDNS_ASM_SYMBOL(pdns_fcontext_jump) "\n"
+    PDNS_ASM_TYPE(pdns_fcontext_jump)
+    ".p2align 4\n"
+    PDNS_ASM_SYMBOL(pdns_fcontext_jump) ":\n"
+    "  sub sp, sp, #0xb0\n"
+    "  stp d8, d9, [sp, #0x00]\n"
+    "  stp d10, d11, [sp, #0x10]\n"
+    "  stp d12, d13, [sp, #0x20]\n"
+    "  stp d14, d15, [sp, #0x30]\n"
+    "  stp x19, x20, [sp, #0x40]\n"
+    "  stp x21, x22, [sp, #0x50]\n"
+    "  stp x23, x24, [sp, #0x60]\n"
+    "  stp x25, x26, [sp, #0x70]\n"
+    "  stp x27, x28, [sp, #0x80]\n"
+    "  stp x29, x30, [sp, #0x90]\n"
+    "  mov x4, sp\n"
+    "  str x4, [x0]\n"
+    "  mov sp, x1\n"
+    "  ldp d8, d9, [sp, #0x00]\n"
+    "  ldp d10, d11, [sp, #0x10]\n"
+    "  ldp d12, d13, [sp, #0x20]\n"
+    "  ldp d14, d15, [sp, #0x30]\n"
+    "  ldp x19, x20, [sp, #0x40]\n"
+    "  ldp x21, x22, [sp, #0x50]\n"
+    "  ldp x23, x24, [sp, #0x60]\n"
+    "  ldp x25, x26, [sp, #0x70]\n"
+    "  ldp x27, x28, [sp, #0x80]\n"
+    "  ldp x29, x30, [sp, #0x90]\n"
+    "  add sp, sp, #0xb0\n"
+    "  ret\n"
+    ".globl " PDNS_ASM_SYMBOL(pdns_fcontext_start) "\n"
+    PDNS_ASM_TYPE(pdns_fcontext_start)
+    ".p2align 4\n"
+    PDNS_ASM_SYMBOL(pdns_fcontext_start) ":\n"
+    "  mov x0, x20\n"
+    "  blr x19\n"
+    "  brk #0\n"); // contextEntry() never returns
+
+static const size_t s_savedRegisters = 22; // d8-d15, x19-x30
+static const size_t s_entrySlot = 8, s_infoSlot = 9, s_returnSlot = 19;
+
+static void initSavedRegisters(void**)
+{
+}
+
+#else
+#error "No hand-written context switching for this architecture, configure with --disable-fast-context-switch"
+#endif
+
+namespace {
+struct StartInfo
+{
+  std::function<void(void)>* start;
+  pdns_ucontext_t* link;
+};
+}
+
+static void contextEntry(StartInfo* info)
+{
+  (*info->start)();
+  void* finished; // this context will never be resumed
+  pdns_fcontext_jump(&finished, info->link->uc_mcontext);
+  abort();
+}
+
+pdns_ucontext_t::pdns_ucontext_t() : uc_mcontext(0), uc_link(0), uc_stack(0), uc_stacksize(0)
+{
+}
+
+pdns_ucontext_t::~pdns_ucontext_t()
+{
+}
+
+void pdns_makecontext(pdns_ucontext_t& ctx, std::function<void(void)>& start)
+{
+  uintptr_t top = ((uintptr_t)ctx.uc_stack + ctx.uc_stacksize) & ~(uintptr_t)15;
+  top -= (sizeof(StartInfo) + 15) & ~(size_t)15;
+  StartInfo* info = (StartInfo*)top;
+  info->start = &start;
+  info->link = ctx.uc_link;
+
+  void** frame = (void**)top - s_savedRegisters;
+  for(size_t n = 0; n < s_savedRegisters; ++n)
+    frame[n] = 0;
+  initSavedRegisters(frame);
+  frame[s_entrySlot] = (void*)&contextEntry;
+  frame[s_infoSlot] = info;
+  frame[s_returnSlot] = (void*)&pdns_fcontext_start;
+  ctx.uc_mcontext = frame;
+}
+
+void pdns_swapcontext(pdns_ucontext_t& octx, const pdns_ucontext_t& ctx)
+{
+  pdns_fcontext_jump(&octx.uc_mcontext, ctx.uc_mcontext);
+}
@@ -0,0 +1,45 @@
+#include "mtasker_context.hh"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ucontext.h>
+
+pdns_ucontext_t::pdns_ucontext_t() : uc_mcontext(new ucontext_t), uc_link(0), uc_stack(0), uc_stacksize(0)
+{
+}
+
+pdns_ucontext_t::~pdns_ucontext_t()
+{
+  delete static_cast<ucontext_t*>(uc_mcontext);
+}
+
+// makecontext() only passes ints, so pointers are handed over in two halves
+static void threadWrapper(uint32_t start1, uint32_t start2)
+{
+  std::function<void(void)>* start = (std::function<void(void)>*)(((uint64_t)start1 << 32) | (uint64_t)start2);
+  (*start)();
+  // we now jump to uc_link, automatically
+}
+
+void pdns_makecontext(pdns_ucontext_t& ctx, std::function<void(void)>& start)
+{
+  ucontext_t* uc = static_cast<ucontext_t*>(ctx.uc_mcontext);
+  if(getcontext(uc)) {
+    perror("getcontext");
+    exit(EXIT_FAILURE);
+  }
+  uc->uc_link = static_cast<ucontext_t*>(ctx.uc_link->uc_mcontext);
+  uc->uc_stack.ss_sp = ctx.uc_stack;
+  uc->uc_stack.ss_size = ctx.uc_stacksize;
+
+  uint64_t ptr = (uint64_t)&start;
+  makecontext(uc, (void (*)(void))threadWrapper, 2, (uint32_t)(ptr >> 32), (uint32_t)(ptr & 0xffffffff));
+}
+
+void pdns_swapcontext(pdns_ucontext_t& octx, const pdns_ucontext_t& ctx)
+{
+  if(swapcontext(static_cast<ucontext_t*>(octx.uc_mcontext), static_cast<ucontext_t*>(ctx.uc_mcontext))) {
+    perror("swapcontext");
+    exit(EXIT_FAILURE); // no way we can deal with this
+  }
+}
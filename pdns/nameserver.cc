@@ -280,27 +280,41 @@ void UDPNameserver::send(DNSPacket *p)
   string buffer=p->getString();
   g_rs.submitResponse(*p, true);
 
+  DLOG(L<<Logger::Notice<<"Sending a packet to "<< p->getRemote() <<" ("<< buffer.length()<<" octets)"<<endl);
+  if(buffer.length() > p->getMaxReplyLen()) {
+    L<<Logger::Error<<"Weird, trying to send a message that needs truncation, "<< buffer.length()<<" > "<<p->getMaxReplyLen()<<endl;
+  }
+  sendBuffer(buffer, p->getSocket(), p->d_remote, p->d_anyLocal.get_ptr());
+}
+
+void UDPNameserver::send(const string& answer, const DNSName& qname, uint16_t qtype, int sock, const ComboAddress& remote, const ComboAddress* local)
+{
+  const struct dnsheader* dh = (const struct dnsheader*)answer.c_str();
+  g_rs.submitResponse(qname, qtype, remote, answer, !dh->ancount && !dh->nscount && !dh->arcount, true);
+
+  DLOG(L<<Logger::Notice<<"Sending a packet to "<< remote.toStringWithPort() <<" ("<< answer.length()<<" octets)"<<endl);
+  sendBuffer(answer, sock, remote, local);
+}
+
+void UDPNameserver::sendBuffer(const string& buffer, int sock, const ComboAddress& remote, const ComboAddress* local)
+{
   struct msghdr msgh;
   struct iovec iov;
   char cbuf[256];
 
-  fillMSGHdr(&msgh, &iov, cbuf, 0, (char*)buffer.c_str(), buffer.length(), &p->d_remote);
+  fillMSGHdr(&msgh, &iov, cbuf, 0, (char*)buffer.c_str(), buffer.length(), const_cast<ComboAddress*>(&remote));
 
-  if(p->d_anyLocal) {
-    addCMsgSrcAddr(&msgh, cbuf, p->d_anyLocal.get_ptr());
+  if(local) {
+    addCMsgSrcAddr(&msgh, cbuf, local);
   }
   else {
     msgh.msg_control=NULL;
   }
-  DLOG(L<<Logger::Notice<<"Sending a packet to "<< p->getRemote() <<" ("<< buffer.length()<<" octets)"<<endl);
-  if(buffer.length() > p->getMaxReplyLen()) {
-    L<<Logger::Error<<"Weird, trying to send a message that needs truncation, "<< buffer.length()<<" > "<<p->getMaxReplyLen()<<endl;
-  }
-  if(sendmsg(p->getSocket(), &msgh, 0) < 0)
-    L<<Logger::Error<<"Error sending reply with sendmsg (socket="<<p->getSocket()<<", dest="<<p->d_remote.toStringWithPort()<<"): "<<strerror(errno)<<endl;
+  if(sendmsg(sock, &msgh, 0) < 0)
+    L<<Logger::Error<<"Error sending reply with sendmsg (socket="<<sock<<", dest="<<remote.toStringWithPort()<<"): "<<strerror(errno)<<endl;
 }
 
-DNSPacket *UDPNameserver::receive(DNSPacket *prefilled)
+DNSPacket *UDPNameserver::receive(DNSPacket *prefilled, const fastpath_t& fastpath)
 {
   ComboAddress remote;
   extern StatBag S;
@@ -353,6 +367,21 @@ DNSPacket *UDPNameserver::receive(DNSPacket *prefilled)
   if(remote.sin4.sin_port == 0) // would generate error on responding. sin4 also works for ipv6
     return 0;
   
+  ComboAddress dest;
+  bool haveDest = HarvestDestinationAddress(&msgh, &dest);
+
+  DTime dt;
+  struct timeval recvtv;
+  if(HarvestTimestamp(&msgh, &recvtv)) {
+    dt.setTimeval(recvtv);
+  }
+  else
+    dt.set(); // timing
+
+  // give the caller a chance to answer straight from the wire, without parsing the query
+  if(fastpath && fastpath(mesg, len, sock, remote, haveDest ? &dest : 0, dt))
+    return 0;
+
   DNSPacket *packet;
   if(prefilled)  // they gave us a preallocated packet
     packet=prefilled;
@@ -362,18 +391,12 @@ DNSPacket *UDPNameserver::receive(DNSPacket *prefilled)
   packet->setSocket(sock);
   packet->setRemote(&remote);
 
-  ComboAddress dest;
-  if(HarvestDestinationAddress(&msgh, &dest)) {
+  if(haveDest) {
 //    cerr<<"Setting d_anyLocal to '"<<dest.toString()<<"'"<<endl;
     packet->d_anyLocal = dest;
   }            
 
-  struct timeval recvtv;
-  if(HarvestTimestamp(&msgh, &recvtv)) {
-    packet->d_dt.setTimeval(recvtv);
-  }
-  else
-    packet->d_dt.set(); // timing    
+  packet->d_dt = dt;
 
   if(packet->parse(mesg, len)<0) {
     S.inc("corrupt-packets");
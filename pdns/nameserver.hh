@@ -31,6 +31,7 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <vector>
+#include <functional>
 #include <boost/foreach.hpp>
 #include "statbag.hh"
 #include "namespaces.hh"
@@ -81,8 +82,13 @@ class UDPNameserver
 {
 public:
   UDPNameserver( bool additional_socket = false );  //!< Opens the socket
-  DNSPacket *receive(DNSPacket *prefilled=0); //!< call this in a while or for(;;) loop to get packets
+  /** Gets the raw query, the socket it came in on, the remote and local addresses and the receive time.
+      Returns true if it took care of the query, in which case receive() does not parse it and returns 0 */
+  typedef std::function<bool(const char* packet, int len, int sock, const ComboAddress& remote, const ComboAddress* local, DTime& dt)> fastpath_t;
+
+  DNSPacket *receive(DNSPacket *prefilled=0, const fastpath_t& fastpath=fastpath_t()); //!< call this in a while or for(;;) loop to get packets
   void send(DNSPacket *); //!< send a DNSPacket. Will call DNSPacket::truncate() if over 512 bytes
+  void send(const string& answer, const DNSName& qname, uint16_t qtype, int sock, const ComboAddress& remote, const ComboAddress* local); //!< send an answer that is ready to go, like one from the packet cache
   inline bool canReusePort() {
 #ifdef SO_REUSEPORT
     return d_can_reuseport;
@@ -97,6 +103,7 @@ private:
   bool d_can_reuseport;
 #endif
   vector<int> d_sockets;
+  void sendBuffer(const string& buffer, int sock, const ComboAddress& remote, const ComboAddress* local);
   void bindIPv4();
   void bindIPv6();
   vector<pollfd> d_rfds;
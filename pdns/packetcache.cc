@@ -28,16 +28,20 @@
 #include "arguments.hh"
 #include "statbag.hh"
 #include <map>
+#include <sched.h>
 #include <boost/algorithm/string.hpp>
 #include <boost/foreach.hpp>
 
 extern StatBag S;
 
-PacketCache::PacketCache()
+PacketCache::PacketCache() : d_maps(s_numShards)
 {
-  d_maps.resize(1024);
   BOOST_FOREACH(MapCombo& mc, d_maps) {
     pthread_rwlock_init(&mc.d_mut, 0);
+    for(auto& bucket : mc.d_buckets)
+      bucket = nullptr;
+    mc.d_epoch = 0;
+    mc.d_readers[0] = mc.d_readers[1] = 0;
   }
 
   d_ttl=-1;
@@ -96,19 +100,9 @@ int PacketCache::get(DNSPacket *p, DNSPacket *cached, bool recursive)
 
   unsigned int age=0;
   string value;
-  bool haveSomething;
-  {
-    MapCombo& mc=getMap(pcReverse(p->qdomain));
-    TryReadLock l(&mc.d_mut); // take a readlock here
-    if(!l.gotIt()) {
-      S.inc("deferred-cache-lookup");
-      return 0;
-    }
-
-    uint16_t maxReplyLen = p->d_tcp ? 0xffff : p->getMaxReplyLen();
-    haveSomething=getEntryLocked(p->qdomain, p->qtype, PacketCache::PACKETCACHE, value, -1, recursive, maxReplyLen, p->d_dnssecOk, p->hasEDNS(), &age);
-  }
-  if(haveSomething) {
+  uint16_t maxReplyLen = p->d_tcp ? 0xffff : p->getMaxReplyLen();
+  CacheEntry key = makeKey(p->qdomain, p->qtype, PacketCache::PACKETCACHE, -1, recursive, maxReplyLen, p->d_dnssecOk, p->hasEDNS());
+  if(getEntryLockFree(key, value, &age)) {
     (*d_statnumhit)++;
     if (recursive)
       ageDNSPacket(value, age);
@@ -125,6 +119,77 @@ int PacketCache::get(DNSPacket *p, DNSPacket *cached, bool recursive)
   return 0; // bummer
 }
 
+/* This is get() for the common case of a plain UDP query, without building a DNSPacket first.
+   Only the header, the question and a possible OPT record are looked at, and any query
+   that does not fit the mold (more than one question, compressed names, EDNS options,
+   trailing data..) is left to get(), as is any query with RD set when skipRecursive is true.
+   Misses are not counted here since the query will go through get() afterwards. */
+bool PacketCache::getRaw(const char* packet, int len, bool skipRecursive, string& response, DNSName* qname, uint16_t* qtype, bool* dnssecOk)
+{
+  if(d_ttl<0)
+    getTTLS();
+
+  if(!d_ttl || len < (int)sizeof(dnsheader))
+    return false;
+
+  const struct dnsheader* dh = (const struct dnsheader*)packet;
+  if(dh->qr || dh->opcode != Opcode::Query || (dh->rd && skipRecursive) ||
+     ntohs(dh->qdcount) != 1 || dh->ancount || dh->nscount || ntohs(dh->arcount) > 1)
+    return false;
+
+  const unsigned char* p = (const unsigned char*)packet;
+  int pos = sizeof(dnsheader);
+  for(;;) { // the qname, which can't be compressed as it is the first one
+    if(pos >= len || (p[pos] & 0xc0))
+      return false;
+    if(!p[pos++])
+      break;
+    pos += p[pos-1];
+  }
+  unsigned int qnameLen = pos - sizeof(dnsheader);
+  if(qnameLen > 255 || pos + 4 > len)
+    return false;
+  uint16_t qt = p[pos] << 8 | p[pos+1];
+  if((p[pos+2] << 8 | p[pos+3]) != QClass::IN)
+    return false;
+  pos += 4;
+
+  bool hasEDNS = false, doBit = false;
+  unsigned int maxReplyLen = 512;
+  if(dh->arcount) {
+    // root, type, class (payload size), ttl (extended rcode, version, flags), rdlength
+    if(pos + 11 != len || p[pos] || (p[pos+1] << 8 | p[pos+2]) != QType::OPT || p[pos+6] || p[pos+9] || p[pos+10])
+      return false;
+    hasEDNS = true;
+    doBit = (p[pos+7] << 8 | p[pos+8]) & EDNSOpts::DNSSECOK;
+    maxReplyLen = std::min((uint16_t)(p[pos+3] << 8 | p[pos+4]), DNSPacket::s_udpTruncationThreshold);
+  }
+  else if(pos != len)
+    return false;
+
+  if(!((++d_ops) % 300000)) {
+    cleanup();
+  }
+
+  CacheEntry key = makeKey(DNSName(packet, len, sizeof(dnsheader), false), QType(qt), PacketCache::PACKETCACHE, -1, false, maxReplyLen, doBit, hasEDNS);
+  if(!getEntryLockFree(key, response))
+    return false;
+  if(response.size() < sizeof(dnsheader) + qnameLen)
+    return false;
+  (*d_statnumhit)++;
+
+  // the ID and RD bit of the query, and its question for the case of the name
+  struct dnsheader* rdh = (struct dnsheader*)&response[0];
+  rdh->id = dh->id;
+  rdh->rd = dh->rd;
+  response.replace(sizeof(dnsheader), qnameLen, packet + sizeof(dnsheader), qnameLen);
+
+  *qname = key.qname;
+  *qtype = qt;
+  *dnssecOk = doBit;
+  return true;
+}
+
 void PacketCache::getTTLS()
 {
   d_ttl=::arg().asNum("cache-ttl");
@@ -172,33 +237,66 @@ void PacketCache::insert(const DNSName &qname, const QType& qtype, CacheEntryTyp
     return;
   
   //cerr<<"Inserting qname '"<<qname<<"', cet: "<<(int)cet<<", qtype: "<<qtype.getName()<<", ttl: "<<ttl<<", maxreplylen: "<<maxReplyLen<<", hasEDNS: "<<EDNS<<endl;
-  CacheEntry val;
-  val.created=time(0);
-  val.ttd=val.created+ttl;
-  val.qname=pcReverse(qname);
-  val.qtype=qtype.getCode();
-  val.value=value;
-  val.ctype=cet;
-  val.meritsRecursion=meritsRecursion;
-  val.maxReplyLen = maxReplyLen;
-  val.dnssecOk = dnssecOk;
-  val.zoneID = zoneID;
-  val.hasEDNS = EDNS;
+  auto val = std::make_shared<CacheEntry>(makeKey(qname, qtype, cet, zoneID, meritsRecursion, maxReplyLen, dnssecOk, EDNS));
+  val->created=time(0);
+  val->ttd=val->created+ttl;
+  val->value=value;
   
-  MapCombo& mc = getMap(val.qname);
+  MapCombo& mc = getMap(val->hash);
   TryWriteLock l(&mc.d_mut);
   if(l.gotIt()) { 
-    bool success;
-    cmap_t::iterator place;
-    tie(place, success)=mc.d_map.insert(val);
-
-    if(!success)
-      mc.d_map.replace(place, val);
+    auto& idx = mc.d_map.get<HashTag>();
+    auto range = idx.equal_range(val->hash);
+    for(auto iter = range.first; iter != range.second; ++iter) {
+      if(keyMatches(**iter, *val)) {
+        entry_t old = *iter;
+        idx.replace(iter, val);
+        mc.replaceInBucket(val->hash, old, val);
+        mc.reclaim();
+        return;
+      }
+    }
+    mc.d_map.insert(val);
+    mc.replaceInBucket(val->hash, entry_t(), val);
   }
   else 
     S.inc("deferred-cache-inserts"); 
 }
 
+PacketCache::CacheEntry PacketCache::makeKey(const DNSName &qname, const QType& qtype, CacheEntryType cet, int zoneID, bool meritsRecursion,
+  unsigned int maxReplyLen, bool dnssecOk, bool hasEDNS)
+{
+  CacheEntry key;
+  key.qname=qname;
+  key.qtype=qtype.getCode();
+  key.ctype=cet;
+  key.zoneID=zoneID;
+  key.meritsRecursion=meritsRecursion;
+  key.maxReplyLen=maxReplyLen;
+  key.dnssecOk=dnssecOk;
+  key.hasEDNS=hasEDNS;
+  setHash(key);
+  return key;
+}
+
+// hashes all the fields of the key, the name case insensitively
+void PacketCache::setHash(CacheEntry& key)
+{
+  uint32_t fields[4];
+  fields[0] = (uint32_t)key.qtype << 16 | key.ctype;
+  fields[1] = key.zoneID;
+  fields[2] = key.maxReplyLen;
+  fields[3] = key.meritsRecursion | key.dnssecOk << 1 | key.hasEDNS << 2;
+  key.hash = burtle((const unsigned char*)fields, sizeof(fields), key.qname.hash());
+}
+
+bool PacketCache::keyMatches(const CacheEntry& lhs, const CacheEntry& rhs)
+{
+  return lhs.hash == rhs.hash && lhs.qtype == rhs.qtype && lhs.ctype == rhs.ctype && lhs.zoneID == rhs.zoneID &&
+    lhs.meritsRecursion == rhs.meritsRecursion && lhs.maxReplyLen == rhs.maxReplyLen && lhs.dnssecOk == rhs.dnssecOk &&
+    lhs.hasEDNS == rhs.hasEDNS && lhs.qname == rhs.qname;
+}
+
 /* clears the entire packetcache. */
 int PacketCache::purge()
 {
@@ -206,7 +304,11 @@ int PacketCache::purge()
   BOOST_FOREACH(MapCombo& mc, d_maps) {
     WriteLock l(&mc.d_mut);
     delcount+=mc.d_map.size();
+    for(auto& bucket : mc.d_buckets)
+      bucket = nullptr;
+    mc.d_retired.insert(mc.d_retired.end(), mc.d_map.begin(), mc.d_map.end());
     mc.d_map.clear();
+    mc.reclaim();
   }
   *d_statnumentries=AtomicCounter(0);
   return delcount;
@@ -217,34 +319,37 @@ int PacketCache::purge(const string &match)
 {
   int delcount=0;
 
+  bool suffix = ends_with(match, "$");
+  DNSName qname(suffix ? match.substr(0, match.size()-1) : match);
+
   BOOST_FOREACH(MapCombo& mc, d_maps) {
     WriteLock l(&mc.d_mut);
-    
-    if(ends_with(match, "$")) {
-      string prefix(match);
-      prefix.resize(prefix.size()-1);
+    auto& idx = mc.d_map.get<NameTag>();
 
-      string zone = pcReverse(DNSName(prefix));
+    if(suffix) {
+      // in canonical order, everything below a name directly follows it
+      auto iter = idx.lower_bound(qname);
+      auto start = iter;
 
-      cmap_t::const_iterator iter = mc.d_map.lower_bound(tie(zone));
-      cmap_t::const_iterator start=iter;
-
-      for(; iter != mc.d_map.end(); ++iter) {
-	if(iter->qname.compare(0, zone.size(), zone) != 0) {
+      for(; iter != idx.end(); ++iter) {
+	if(!(*iter)->qname.isPartOf(qname)) {
 	  break;
 	}
+	mc.replaceInBucket((*iter)->hash, *iter, entry_t());
 	delcount++;
       }
-      mc.d_map.erase(start, iter);
+      idx.erase(start, iter);
     }
   
     else {
-      string qname = pcReverse(DNSName(match));
-      
-      delcount+=mc.d_map.count(tie(qname));
-      pair<cmap_t::iterator, cmap_t::iterator> range = mc.d_map.equal_range(tie(qname));
-      mc.d_map.erase(range.first, range.second);
+      auto range = idx.equal_range(qname);
+      for(auto iter = range.first; iter != range.second; ++iter) {
+	mc.replaceInBucket((*iter)->hash, *iter, entry_t());
+	delcount++;
+      }
+      idx.erase(range.first, range.second);
     }
+    mc.reclaim();
   }
   *d_statnumentries-=delcount; // XXX FIXME NEEDS TO BE ADJUSTED
   return delcount;
@@ -260,42 +365,80 @@ bool PacketCache::getEntry(const DNSName &qname, const QType& qtype, CacheEntryT
     cleanup();
   }
 
-  MapCombo& mc=getMap(pcReverse(qname));
-
-  TryReadLock l(&mc.d_mut); // take a readlock here
-  if(!l.gotIt()) {
-    S.inc( "deferred-cache-lookup");
-    return false;
-  }
-
-  return getEntryLocked(qname, qtype, cet, value, zoneID, meritsRecursion, maxReplyLen, dnssecOk, hasEDNS, age);
+  CacheEntry key = makeKey(qname, qtype, cet, zoneID, meritsRecursion, maxReplyLen, dnssecOk, hasEDNS);
+  return getEntryLockFree(key, value, age);
 }
 
 
-bool PacketCache::getEntryLocked(const DNSName &qname, const QType& qtype, CacheEntryType cet, string& value, int zoneID, bool meritsRecursion,
-  unsigned int maxReplyLen, bool dnssecOK, bool hasEDNS, unsigned int *age)
+/* Takes no lock: entries are never changed, and those a writer takes out of the bucket while
+   we walk it are only freed once we are done. */
+bool PacketCache::getEntryLockFree(const CacheEntry& key, string& value, unsigned int *age)
 {
-  uint16_t qt = qtype.getCode();
   //cerr<<"Lookup for maxReplyLen: "<<maxReplyLen<<endl;
-  string pcqname = pcReverse(qname);
-  MapCombo& mc=getMap(pcqname);
-  cmap_t::const_iterator i=mc.d_map.find(tie(pcqname, qt, cet, zoneID, meritsRecursion, maxReplyLen, dnssecOK, hasEDNS, *age));
+  MapCombo& mc=getMap(key.hash);
+  ReadSection rs(mc);
   time_t now=time(0);
-  bool ret=(i!=mc.d_map.end() && i->ttd > now);
-  if(ret) {
+  for(const CacheEntry* entry = mc.getBucket(key.hash); entry; entry = entry->link.next) {
+    if(!keyMatches(*entry, key))
+      continue;
+    if(entry->ttd <= now)
+      return false;
     if (age)
-      *age = now - i->created;
-    value = i->value;
+      *age = now - entry->created;
+    value = entry->value;
+    return true;
   }
 
-  return ret;
+  return false;
 }
 
+PacketCache::ReadSection::ReadSection(MapCombo& mc) : d_mc(mc)
+{
+  // a writer may flip the epoch between our reading it and counting ourselves in, try again then
+  for(;;) {
+    d_epoch = mc.d_epoch & 1;
+    mc.d_readers[d_epoch]++;
+    if((mc.d_epoch & 1) == d_epoch)
+      break;
+    mc.d_readers[d_epoch]--;
+  }
+}
 
-string PacketCache::pcReverse(DNSName content)
+void PacketCache::MapCombo::replaceInBucket(uint32_t hash, const entry_t& old, const entry_t& replacement)
 {
-  string ret=content.labelReverse().toDNSString();
-  return ret.substr(0, ret.size()-1);
+  std::atomic<const CacheEntry*>* link = &getBucket(hash); // only writers change it, and we hold the write lock
+  if(old) {
+    while(*link && *link != old.get())
+      link = &(*link).load()->link.next;
+    if(*link) {
+      // lookups that are on 'old' go on with the rest of the bucket
+      if(replacement) {
+        replacement->link.next = old->link.next.load();
+        *link = replacement.get();
+      }
+      else {
+        *link = old->link.next.load();
+      }
+      d_retired.push_back(old);
+      return;
+    }
+    link = &getBucket(hash);
+  }
+  if(replacement) {
+    replacement->link.next = link->load();
+    *link = replacement.get();
+  }
+}
+
+void PacketCache::MapCombo::reclaim()
+{
+  if(d_retired.empty())
+    return;
+  // lookups that start from now on count themselves in the other counter, and can't find what we retired
+  unsigned int old = d_epoch++ & 1;
+  while(d_readers[old])
+    sched_yield(); // lookups are short
+  d_retired.clear();
 }
 
 map<char,int> PacketCache::getCounts()
@@ -306,13 +449,13 @@ map<char,int> PacketCache::getCounts()
     ReadLock l(&mc.d_mut);
     
     for(cmap_t::const_iterator iter = mc.d_map.begin() ; iter != mc.d_map.end(); ++iter) {
-      if(iter->ctype == PACKETCACHE)
-	if(iter->meritsRecursion)
+      if((*iter)->ctype == PACKETCACHE)
+	if((*iter)->meritsRecursion)
 	  recursivePackets++;
 	else
 	  nonRecursivePackets++;
-      else if(iter->ctype == QUERYCACHE) {
-	if(iter->value.empty())
+      else if((*iter)->ctype == QUERYCACHE) {
+	if((*iter)->value.empty())
 	  negQueryCacheEntries++;
 	else
 	  queryCacheEntries++;
@@ -370,11 +513,12 @@ void PacketCache::cleanup()
   //unsigned int totErased=0;
   BOOST_FOREACH(MapCombo& mc, d_maps) {
     WriteLock wl(&mc.d_mut);
-    typedef cmap_t::nth_index<1>::type sequence_t;
-    sequence_t& sidx=mc.d_map.get<1>();
+    typedef cmap_t::index<SequenceTag>::type sequence_t;
+    sequence_t& sidx=mc.d_map.get<SequenceTag>();
     unsigned int erased=0, lookedAt=0;
     for(sequence_t::iterator i=sidx.begin(); i != sidx.end(); lookedAt++) {
-      if(i->ttd < now) {
+      if((*i)->ttd < now) {
+	mc.replaceInBucket((*i)->hash, *i, entry_t());
 	sidx.erase(i++);
 	erased++;
       }
@@ -388,6 +532,7 @@ void PacketCache::cleanup()
       if(lookedAt > lookAt / d_maps.size())
 	break;
     }
+    mc.reclaim();
     //totErased += erased;
   }
   //  if(totErased)
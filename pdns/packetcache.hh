@@ -25,9 +25,15 @@
 #include <string>
 #include <utility>
 #include <map>
-#include <map>
+#include <memory>
+#include <atomic>
 #include "dns.hh"
 #include <boost/version.hpp>
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include <boost/multi_index/key_extractors.hpp>
 #include "namespaces.hh"
 using namespace ::boost::multi_index;
 
@@ -43,8 +49,15 @@ using namespace ::boost::multi_index;
 
     Locking! 
 
-    The cache itself is protected by a read/write lock. Because deleting is a two step process, which 
-    first marks and then sweeps, a second lock is present to prevent simultaneous inserts and deletes.
+    The cache is split in shards, each protected by a read/write lock. An entry is found through
+    a hash over all the fields of its key, which also selects the shard and a bucket within it.
+    Lookups don't take that lock: a bucket is a singly linked list of immutable entries, which
+    writers, holding the write lock, change by swapping a single pointer. An entry that was taken
+    out of its bucket is only freed once the lookups that may still be looking at it are done:
+    lookups count themselves in one of two reader counters of the shard, writers flip the shard
+    to the other counter and wait for the old one to drain. Lookups never wait, not for an insert
+    nor for a cleanup, they only touch the counter of their shard.
+    The lock protects the indexes used for cleaning and purging, which are only used by writers.
 */
 
 class PacketCache : public boost::noncopyable
@@ -62,6 +75,8 @@ public:
   int get(DNSPacket *p, DNSPacket *q, bool recursive); //!< We return a dynamically allocated copy out of our cache. You need to delete it. You also need to spoof in the right ID with the DNSPacket.spoofID() method.
   bool getEntry(const DNSName &qname, const QType& qtype, CacheEntryType cet, string& entry, int zoneID=-1,
     bool meritsRecursion=false, unsigned int maxReplyLen=512, bool dnssecOk=false, bool hasEDNS=false, unsigned int *age=0);
+  //! looks up a UDP query straight from the wire. On a hit, response is ready to be sent and qname, qtype & dnssecOk describe the query
+  bool getRaw(const char* packet, int len, bool skipRecursive, string& response, DNSName* qname, uint16_t* qtype, bool* dnssecOk);
 
   int size(); //!< number of entries in the cache
   void cleanup(); //!< force the cache to preen itself from expired packets
@@ -70,18 +85,24 @@ public:
 
   map<char,int> getCounts();
 private:
-  bool getEntryLocked(const DNSName &content, const QType& qtype, CacheEntryType cet, string& entry, int zoneID=-1,
-    bool meritsRecursion=false, unsigned int maxReplyLen=512, bool dnssecOk=false, bool hasEDNS=false, unsigned int *age=0);
-  string pcReverse(DNSName content);
   struct CacheEntry
   {
-    CacheEntry() { qtype = ctype = 0; zoneID = -1; meritsRecursion=false; dnssecOk=false; hasEDNS=false; created=0; ttd=0; maxReplyLen=512;}
+    CacheEntry() { hash = 0; qtype = ctype = 0; zoneID = -1; meritsRecursion=false; dnssecOk=false; hasEDNS=false; created=0; ttd=0; maxReplyLen=512;}
+
+    //! the next entry in the same bucket, only changed by writers holding the lock of the shard
+    struct Link
+    {
+      Link() : next(nullptr) {}
+      Link(const Link&) : next(nullptr) {} // a copy is in no bucket
+      mutable std::atomic<const CacheEntry*> next;
+    };
 
-    string qname;
+    DNSName qname;
     string value;
     time_t created;
     time_t ttd;
 
+    uint32_t hash;
     uint16_t qtype;
     uint16_t ctype;
     int zoneID;
@@ -90,43 +111,73 @@ private:
     bool meritsRecursion;
     bool dnssecOk;
     bool hasEDNS;
+
+    Link link;
   };
 
+  typedef std::shared_ptr<CacheEntry> entry_t; // never changed once it is in the cache, except for its link
+
+  bool getEntryLockFree(const CacheEntry& key, string& entry, unsigned int *age=0);
+  static void setHash(CacheEntry& key);
+  static bool keyMatches(const CacheEntry& lhs, const CacheEntry& rhs);
+  static CacheEntry makeKey(const DNSName &qname, const QType& qtype, CacheEntryType cet, int zoneID, bool meritsRecursion, unsigned int maxReplyLen, bool dnssecOk, bool hasEDNS);
+
   void getTTLS();
 
+  struct HashTag{};
+  struct SequenceTag{};
+  struct NameTag{};
+
   typedef multi_index_container<
-    CacheEntry,
+    entry_t,
     indexed_by <
-                ordered_unique<
-                      composite_key< 
-                        CacheEntry,
-                        member<CacheEntry,string,&CacheEntry::qname>,
-                        member<CacheEntry,uint16_t,&CacheEntry::qtype>,
-                        member<CacheEntry,uint16_t, &CacheEntry::ctype>,
-                        member<CacheEntry,int, &CacheEntry::zoneID>,
-                        member<CacheEntry,bool, &CacheEntry::meritsRecursion>,
-                        member<CacheEntry,unsigned int, &CacheEntry::maxReplyLen>,
-                        member<CacheEntry,bool, &CacheEntry::dnssecOk>,
-                        member<CacheEntry,bool, &CacheEntry::hasEDNS>
-                        >,
-                        composite_key_compare<std::less<string>, std::less<uint16_t>, std::less<uint16_t>, std::less<int>, std::less<bool>, 
-                          std::less<unsigned int>, std::less<bool>, std::less<bool> >
-                            >,
-                           sequenced<>
-                           >
+                hashed_non_unique<tag<HashTag>, member<CacheEntry,uint32_t,&CacheEntry::hash> >,
+                sequenced<tag<SequenceTag> >,
+                ordered_non_unique<tag<NameTag>, member<CacheEntry,DNSName,&CacheEntry::qname>, CanonDNSNameCompare>
+               >
   > cmap_t;
 
 
+  static const unsigned int s_numShards = 1024;
+  static const unsigned int s_bucketsPerShard = 256;
+
   struct MapCombo
   {
     pthread_rwlock_t d_mut;    
     cmap_t d_map;
+    std::atomic<const CacheEntry*> d_buckets[s_bucketsPerShard]; // the entries of d_map by hash
+    vector<entry_t> d_retired; // out of their bucket, but lookups may still be looking at them
+    std::atomic<unsigned int> d_epoch;
+    std::atomic<unsigned int> d_readers[2];
+
+    std::atomic<const CacheEntry*>& getBucket(uint32_t hash)
+    {
+      return d_buckets[hash / s_numShards % s_bucketsPerShard];
+    }
+    //! swaps entry 'old' in the bucket for 'replacement', either can be empty. Needs the write lock
+    void replaceInBucket(uint32_t hash, const entry_t& old, const entry_t& replacement);
+    //! frees the retired entries once no lookup can see them anymore. Needs the write lock
+    void reclaim();
+  };
+
+  //! counts a lookup in as a reader of the shard, for as long as it exists
+  class ReadSection : public boost::noncopyable
+  {
+  public:
+    explicit ReadSection(MapCombo& mc);
+    ~ReadSection()
+    {
+      d_mc.d_readers[d_epoch]--;
+    }
+  private:
+    MapCombo& d_mc;
+    unsigned int d_epoch;
   };
 
   vector<MapCombo> d_maps;
-  MapCombo& getMap(const std::string& qname) 
+  MapCombo& getMap(uint32_t hash)
   {
-    return d_maps[burtle((const unsigned char*)qname.c_str(), qname.length(), 0) % d_maps.size()];
+    return d_maps[hash % d_maps.size()];
   }
 
   AtomicCounter d_ops;
@@ -45,6 +45,7 @@
 #include "dnsproxy.hh"
 #include "version.hh"
 #include "common_startup.hh"
+#include "signingpipe.hh"
 
 #if 0
 #undef DLOG
@@ -68,6 +69,7 @@ PacketHandler::PacketHandler():B(s_programname), d_dk(&B)
   d_doRecursion= ::arg().mustDo("recursor");
   d_logDNSDetails= ::arg().mustDo("log-dns-details");
   d_doIPv6AdditionalProcessing = ::arg().mustDo("do-ipv6-additional-processing");
+  d_signingLiveAnswers = ::arg().mustDo("signing-live-answers");
   d_sendRootReferral = ::arg().mustDo("send-root-referral")
                             ? ( pdns_iequals(::arg()["send-root-referral"], "lean") ? LEAN_ROOT_REFERRAL : FULL_ROOT_REFERRAL )
                             : NO_ROOT_REFERRAL;
@@ -1505,8 +1507,12 @@ DNSPacket *PacketHandler::questionOrRecurse(DNSPacket *p, bool *shouldRecurse)
         break;
       }
     }
-    if(p->d_dnssecOk)
-      addRRSigs(d_dk, B, authSet, r->getRRS());
+    if(p->d_dnssecOk) {
+      if(d_signingLiveAnswers)
+        SigningPool::instance().sign(d_dk, B, authSet, r->getRRS());
+      else
+        addRRSigs(d_dk, B, authSet, r->getRRS());
+    }
       
     r->wrapup(); // needed for inserting in cache
     if(!noCache)
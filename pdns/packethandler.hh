@@ -107,6 +107,7 @@ private:
   bool d_logDNSDetails;
   bool d_doIPv6AdditionalProcessing;
   bool d_doDNAME;
+  bool d_signingLiveAnswers;
   int d_sendRootReferral;
   AuthLua* d_pdl;
 
@@ -70,9 +70,11 @@
 #include "version.hh"
 #include "responsestats.hh"
 #include "secpoll-recursor.hh"
+#include "rec-snapshot.hh"
 #include "dnsname.hh"
 #include "filterpo.hh"
 #include "rpzloader.hh"
+#include "mpscqueue.hh"
 #ifndef RECURSOR
 #include "statbag.hh"
 StatBag S;
@@ -93,15 +95,27 @@ __thread addrringbuf_t* t_remotes, *t_servfailremotes, *t_largeanswerremotes;
 __thread boost::circular_buffer<pair<DNSName, uint16_t> >* t_queryring, *t_servfailqueryring;
 __thread shared_ptr<Regex>* t_traceRegex;
 
-DNSFilterEngine g_dfe;
+GlobalStateHolder<DNSFilterEngine> g_dfe;
+__thread LocalStateHolder<DNSFilterEngine>* t_dfe;
 
 RecursorControlChannel s_rcc; // only active in thread 0
 
+// a function for a thread to run, or a question handed to it by the distributor if func is empty
+struct ThreadMSG
+{
+  pipefunc_t func;
+  bool wantAnswer;
+  string question;
+  ComboAddress fromaddr;
+  ComboAddress destaddr;
+  struct timeval tv;
+  int fd;
+};
+
 // for communicating with our threads
 struct ThreadPipeSet
 {
-  int writeToThread;
-  int readToThread;
+  std::shared_ptr<MPSCQueue<ThreadMSG> > queue;
   int writeFromThread;
   int readFromThread;
 };
@@ -113,11 +127,13 @@ SyncRes::domainmap_t* g_initialDomainMap; // new threads needs this to be setup
 #include "namespaces.hh"
 
 __thread MemRecursorCache* t_RC;
+MemRecursorCache* g_sharedRC;
 __thread RecursorPacketCache* t_packetCache;
 RecursorStats g_stats;
 bool g_quiet;
 
 bool g_weDistributeQueries; // if true, only 1 thread listens on the incoming query sockets
+static vector<string> g_snapshotParts; // one per worker thread, each loads its own and then clears it
 
 __thread NetmaskGroup* t_allowFrom;
 static NetmaskGroup* g_initialAllowFrom; // new thread needs to be setup with this
@@ -174,6 +190,7 @@ struct DNSComboWriter {
   }
 
   struct timeval d_now;
+  string d_query; // the query as received, to insert the answer in the packet cache
   ComboAddress d_remote, d_local;
   bool d_tcp;
   int d_socket;
@@ -445,7 +462,7 @@ int asendto(const char *data, int len, int flags,
   pident.type = qtype;
 
   // see if there is an existing outstanding request we can chain on to, using partial equivalence function
-  pair<MT_t::waiters_t::iterator, MT_t::waiters_t::iterator> chain=MT->d_waiters.equal_range(pident, PacketIDBirthdayCompare());
+  auto chain=MT->d_waiters.get<OrderedKeyTag>().equal_range(pident);
 
   for(; chain.first != chain.second; chain.first++) {
     if(chain.first->key.fd > -1) { // don't chain onto existing chained waiter!
@@ -659,7 +676,7 @@ void startDoResolve(void *p)
 
     // if there is a RecursorLua active, and it 'took' the query in preResolve, we don't launch beginResolve
 
-    dfepol = g_dfe.getQueryPolicy(dc->d_mdp.d_qname, dc->d_remote);
+    dfepol = (*t_dfe)->getQueryPolicy(dc->d_mdp.d_qname, dc->d_remote);
 
     switch(dfepol.d_kind) {
     case DNSFilterEngine::PolicyKind::NoAction:
@@ -708,7 +725,7 @@ void startDoResolve(void *p)
         res = RCode::ServFail;
       }
 
-      dfepol = g_dfe.getPostPolicy(ret); 
+      dfepol = (*t_dfe)->getPostPolicy(ret);
       switch(dfepol.d_kind) {
       case DNSFilterEngine::PolicyKind::NoAction:
 	break;
@@ -826,7 +843,7 @@ void startDoResolve(void *p)
         msgh.msg_control=NULL;
       sendmsg(dc->d_socket, &msgh, 0);
       if(!SyncRes::s_nopacketcache && !variableAnswer ) {
-        t_packetCache->insertResponsePacket(string((const char*)&*packet.begin(), packet.size()),
+        t_packetCache->insertResponsePacket(dc->d_query, string((const char*)&*packet.begin(), packet.size()),
                                             g_now.tv_sec,
                                             min(minTTL,
                                                 (pw.getHeader()->rcode == RCode::ServFail) ? SyncRes::s_packetcacheservfailttl : SyncRes::s_packetcachettl
@@ -917,6 +934,49 @@ void startDoResolve(void *p)
   g_stats.maxMThreadStackUsage = max(MT->getMaxStackUsage(), g_stats.maxMThreadStackUsage);
 }
 
+struct PrefetchJob
+{
+  DNSName qname;
+  QType qtype;
+};
+
+static void doPrefetch(void* p)
+{
+  PrefetchJob* job=(PrefetchJob*)p;
+  try {
+    struct timeval now;
+    Utility::gettimeofday(&now, 0);
+    SyncRes sr(now);
+    sr.setId(MT->getTid());
+    sr.setRefresh();
+    sr.d_doDNSSEC=true; // or the refreshed entry would lose its signatures
+    vector<DNSRecord> ret;
+    sr.beginResolve(job->qname, job->qtype, 1, ret);
+  }
+  catch(ImmediateServFailException& e) {
+    if(g_logCommonErrors)
+      L<<Logger::Notice<<"Prefetch of '"<<job->qname<<"|"<<job->qtype.getName()<<"' failed: "<<e.reason<<endl;
+  }
+  catch(PDNSException& ae) {
+    L<<Logger::Error<<"Prefetch of '"<<job->qname<<"|"<<job->qtype.getName()<<"' failed: "<<ae.reason<<endl;
+  }
+  catch(std::exception& e) {
+    L<<Logger::Error<<"STL error prefetching '"<<job->qname<<"|"<<job->qtype.getName()<<"': "<<e.what()<<endl;
+  }
+  delete job;
+}
+
+// called from SyncRes::doCacheCheck(), the refresh runs after the query that triggered it
+void schedulePrefetch(const DNSName& qname, const QType& qtype)
+{
+  if(MT->numProcesses() > g_maxMThreads) // the entry is still valid, so we may as well skip it
+    return;
+  PrefetchJob* job=new PrefetchJob;
+  job->qname=qname;
+  job->qtype=qtype;
+  MT->makeThread(doPrefetch, job);
+}
+
 void makeControlChannelSocket(int processNum=-1)
 {
   string sockname=::arg()["socket-dir"]+"/"+s_programname;
@@ -1137,6 +1197,8 @@ string* doProcessUDPQuestion(const std::string& question, const ComboAddress& fr
   dc->setSocket(fd);
   dc->setRemote(&fromaddr);
   dc->setLocal(destaddr);
+  if(!SyncRes::s_nopacketcache)
+    dc->d_query=question;
 
   dc->d_tcp=false;
   MT->makeThread(startDoResolve, (void*) dc); // deletes dc
@@ -1144,6 +1206,35 @@ string* doProcessUDPQuestion(const std::string& question, const ComboAddress& fr
 }
 
 
+//! answers a NOTIFY for an RPZ from its master and has it checked for updates, returns false for any other NOTIFY
+static bool handleRPZNotify(const string& question, const ComboAddress& fromaddr, struct msghdr* msgh, int fd)
+{
+  MOADNSParser mdp(question);
+  if(mdp.d_qtype != QType::SOA || !notifyRPZTracker(mdp.d_qname, fromaddr))
+    return false;
+
+  L<<Logger::Notice<<"Received NOTIFY for RPZ "<<mdp.d_qname<<" from "<<fromaddr.toString()<<endl;
+  vector<uint8_t> packet;
+  DNSPacketWriter pw(packet, mdp.d_qname, mdp.d_qtype, mdp.d_qclass, Opcode::Notify);
+  pw.getHeader()->id=mdp.d_header.id;
+  pw.getHeader()->qr=1;
+  pw.getHeader()->aa=1;
+
+  ComboAddress dest;
+  memset(&dest, 0, sizeof(dest));
+  HarvestDestinationAddress(msgh, &dest);
+  struct msghdr reply;
+  struct iovec iov;
+  char cbuf[256];
+  fillMSGHdr(&reply, &iov, cbuf, 0, (char*)&*packet.begin(), packet.size(), const_cast<ComboAddress*>(&fromaddr));
+  if(dest.sin4.sin_family)
+    addCMsgSrcAddr(&reply, cbuf, &dest);
+  else
+    reply.msg_control=NULL;
+  sendmsg(fd, &reply, 0);
+  return true;
+}
+
 void handleNewUDPQuestion(int fd, FDMultiplexer::funcparam_t& var)
 {
   int len;
@@ -1183,6 +1274,9 @@ void handleNewUDPQuestion(int fd, FDMultiplexer::funcparam_t& var)
         if(g_logCommonErrors)
           L<<Logger::Error<<"Ignoring answer from "<<fromaddr.toString()<<" on server socket!"<<endl;
       }
+      else if(dh->opcode == Opcode::Notify && handleRPZNotify(string(data, len), fromaddr, &msgh, fd)) {
+        // answered, and the RPZ will be updated
+      }
       else if(dh->opcode) {
         if(g_logCommonErrors)
           L<<Logger::Error<<"Ignoring non-query opcode "<<dh->opcode<<" from "<<fromaddr.toString()<<" on server socket!"<<endl;
@@ -1195,7 +1289,7 @@ void handleNewUDPQuestion(int fd, FDMultiplexer::funcparam_t& var)
 	memset(&dest, 0, sizeof(dest)); // this makes sure we igore this address if not returned by recvmsg above
 	HarvestDestinationAddress(&msgh, &dest);
         if(g_weDistributeQueries)
-          distributeAsyncFunction(question, boost::bind(doProcessUDPQuestion, question, fromaddr, dest, tv, fd));
+          distributeQuestion(question, fromaddr, dest, tv, fd);
         else
           doProcessUDPQuestion(question, fromaddr, dest, tv, fd);
       }
@@ -1394,12 +1488,12 @@ void doStats(void)
   static time_t lastOutputTime;
   static uint64_t lastQueryCount;
 
-  uint64_t cacheHits = broadcastAccFunction<uint64_t>(pleaseGetCacheHits);
-  uint64_t cacheMisses = broadcastAccFunction<uint64_t>(pleaseGetCacheMisses);
+  uint64_t cacheHits = doGetCacheHits();
+  uint64_t cacheMisses = doGetCacheMisses();
 
   if(g_stats.qcounter && (cacheHits + cacheMisses) && SyncRes::s_queries && SyncRes::s_outqueries) {
     L<<Logger::Warning<<"stats: "<<g_stats.qcounter<<" questions, "<<
-      broadcastAccFunction<uint64_t>(pleaseGetCacheSize)<< " cache entries, "<<
+      doGetCacheSize()<< " cache entries, "<<
       broadcastAccFunction<uint64_t>(pleaseGetNegCacheSize)<<" negative entries, "<<
       (int)((cacheHits*100.0)/(cacheHits+cacheMisses))<<"% cache hits"<<endl;
 
@@ -1433,7 +1527,7 @@ void doStats(void)
 
 static void houseKeeping(void *)
 {
-  static __thread time_t last_stat, last_rootupdate, last_prune, last_secpoll;
+  static __thread time_t last_stat, last_rootupdate, last_prune, last_secpoll, last_snapshot;
   static __thread int cleanCounter=0;
   static __thread bool s_running;  // houseKeeping can get suspended in secpoll, and be restarted, which makes us do duplicate work
   try {
@@ -1447,7 +1541,10 @@ static void houseKeeping(void *)
     if(now.tv_sec - last_prune > (time_t)(5 + t_id)) {
       DTime dt;
       dt.setTimeval(now);
-      t_RC->doPrune(); // this function is local to a thread, so fine anyhow
+      if(!g_sharedRC)
+        t_RC->doPrune(::arg().asNum("max-cache-entries") / g_numThreads); // this function is local to a thread, so fine anyhow
+      else if(!t_id)
+        g_sharedRC->doPrune(::arg().asNum("max-cache-entries"));
       t_packetCache->doPruneTo(::arg().asNum("max-packetcache-entries") / g_numWorkerThreads);
 
       pruneCollection(t_sstorage->negcache, ::arg().asNum("max-cache-entries") / (g_numWorkerThreads * 10), 200);
@@ -1460,6 +1557,7 @@ static void houseKeeping(void *)
 	  else
 	    ++i;
       }
+      MT->trimStackPool();
       last_prune=time(0);
     }
 
@@ -1507,6 +1605,14 @@ static void houseKeeping(void *)
 	}
 	catch(...) {}
       }
+
+      if(!last_snapshot)
+        last_snapshot=now.tv_sec; // no point in overwriting the snapshot we just loaded
+      time_t snapshotInterval=::arg().asNum("cache-snapshot-interval");
+      if(snapshotInterval && now.tv_sec - last_snapshot >= snapshotInterval && !::arg()["cache-snapshot-file"].empty()) {
+        writeCacheSnapshot(::arg()["cache-snapshot-file"], true);
+        last_snapshot=now.tv_sec;
+      }
     }
     s_running=false;
   }
@@ -1518,17 +1624,16 @@ static void houseKeeping(void *)
     }
 }
 
+static const size_t s_threadQueueSize = 4096;  // per thread, distributed questions beyond this are dropped
+static const unsigned int s_threadQueueBatch = 1024; // most messages a thread handles before looking at its sockets again
+
 void makeThreadPipes()
 {
   for(unsigned int n=0; n < g_numThreads; ++n) {
     struct ThreadPipeSet tps;
-    int fd[2];
-    if(pipe(fd) < 0)
-      unixDie("Creating pipe for inter-thread communications");
-
-    tps.readToThread = fd[0];
-    tps.writeToThread = fd[1];
+    tps.queue = std::make_shared<MPSCQueue<ThreadMSG> >(s_threadQueueSize);
 
+    int fd[2];
     if(pipe(fd) < 0)
       unixDie("Creating pipe for inter-thread communications");
     tps.readFromThread = fd[0];
@@ -1538,11 +1643,15 @@ void makeThreadPipes()
   }
 }
 
-struct ThreadMSG
+// functions must get through, so wait for the thread to make room if needed
+static void sendThreadFunction(ThreadPipeSet& tps, const pipefunc_t& func, bool wantAnswer)
 {
-  pipefunc_t func;
-  bool wantAnswer;
-};
+  ThreadMSG tmsg;
+  tmsg.func = func;
+  tmsg.wantAnswer = wantAnswer;
+  while(!tps.queue->push(std::move(tmsg)))
+    sched_yield();
+}
 
 void broadcastFunction(const pipefunc_t& func, bool skipSelf)
 {
@@ -1555,11 +1664,7 @@ void broadcastFunction(const pipefunc_t& func, bool skipSelf)
       continue;
     }
 
-    ThreadMSG* tmsg = new ThreadMSG();
-    tmsg->func = func;
-    tmsg->wantAnswer = true;
-    if(write(tps.writeToThread, &tmsg, sizeof(tmsg)) != sizeof(tmsg))
-      unixDie("write to thread pipe returned wrong size or error");
+    sendThreadFunction(tps, func, true);
 
     string* resp;
     if(read(tps.readFromThread, &resp, sizeof(resp)) != sizeof(resp))
@@ -1573,35 +1678,36 @@ void broadcastFunction(const pipefunc_t& func, bool skipSelf)
 }
 
 uint32_t g_disthashseed;
-void distributeAsyncFunction(const string& packet, const pipefunc_t& func)
+void distributeQuestion(const string& question, const ComboAddress& fromaddr, const ComboAddress& destaddr, struct timeval tv, int fd)
 {
-  unsigned int hash = hashQuestion(packet.c_str(), packet.length(), g_disthashseed);
+  unsigned int hash = hashQuestion(question.c_str(), question.length(), g_disthashseed);
   unsigned int target = 1 + (hash % (g_pipes.size()-1));
 
   if(target == t_id) {
-    func();
+    doProcessUDPQuestion(question, fromaddr, destaddr, tv, fd);
     return;
   }
-  ThreadPipeSet& tps = g_pipes[target];
-  ThreadMSG* tmsg = new ThreadMSG();
-  tmsg->func = func;
-  tmsg->wantAnswer = false;
 
-  if(write(tps.writeToThread, &tmsg, sizeof(tmsg)) != sizeof(tmsg))
-    unixDie("write to thread pipe returned wrong size or error");
+  ThreadMSG tmsg;
+  tmsg.wantAnswer = false;
+  tmsg.question = question;
+  tmsg.fromaddr = fromaddr;
+  tmsg.destaddr = destaddr;
+  tmsg.tv = tv;
+  tmsg.fd = fd;
+  if(!g_pipes[target].queue->push(std::move(tmsg)))
+    g_stats.distributionQueueDrops++; // that thread is hopelessly behind already
 }
 
-void handlePipeRequest(int fd, FDMultiplexer::funcparam_t& var)
+static void handleThreadMessage(ThreadMSG& tmsg)
 {
-  ThreadMSG* tmsg;
-
-  if(read(fd, &tmsg, sizeof(tmsg)) != sizeof(tmsg)) { // fd == readToThread
-    unixDie("read from thread pipe returned wrong size or error");
-  }
-
   void *resp=0;
   try {
-    resp = tmsg->func();
+    if(!tmsg.func) {
+      doProcessUDPQuestion(tmsg.question, tmsg.fromaddr, tmsg.destaddr, tmsg.tv, tmsg.fd);
+      return;
+    }
+    resp = tmsg.func();
   }
   catch(std::exception& e) {
     L<<Logger::Error<<"PIPE function we executed created exception: "<<e.what()<<endl; // but what if they wanted an answer.. we send 0
@@ -1609,11 +1715,22 @@ void handlePipeRequest(int fd, FDMultiplexer::funcparam_t& var)
   catch(PDNSException& e) {
     L<<Logger::Error<<"PIPE function we executed created PDNS exception: "<<e.reason<<endl; // but what if they wanted an answer.. we send 0
   }
-  if(tmsg->wantAnswer)
+  if(tmsg.wantAnswer)
     if(write(g_pipes[t_id].writeFromThread, &resp, sizeof(resp)) != sizeof(resp))
       unixDie("write to thread pipe returned wrong size or error");
+}
 
-  delete tmsg;
+static void drainThreadQueue()
+{
+  ThreadMSG tmsg;
+  for(unsigned int n = 0; n < s_threadQueueBatch && g_pipes[t_id].queue->pop(&tmsg); ++n)
+    handleThreadMessage(tmsg);
+}
+
+void handlePipeRequest(int fd, FDMultiplexer::funcparam_t& var)
+{
+  g_pipes[t_id].queue->clearWakeup(); // fd == queue->getDescriptor()
+  drainThreadQueue();
 }
 
 template<class T> void *voider(const boost::function<T*()>& func)
@@ -1658,13 +1775,7 @@ template<class T> T broadcastAccFunction(const boost::function<T*()>& func, bool
       continue;
     }
 
-    ThreadMSG* tmsg = new ThreadMSG();
-    tmsg->func = boost::bind(voider<T>, func);
-    tmsg->wantAnswer = true;
-
-    if(write(tps.writeToThread, &tmsg, sizeof(tmsg)) != sizeof(tmsg))
-      unixDie("write to thread pipe returned wrong size or error");
-
+    sendThreadFunction(tps, boost::bind(voider<T>, func), true);
 
     T* resp;
     if(read(tps.readFromThread, &resp, sizeof(resp)) != sizeof(resp))
@@ -1683,6 +1794,7 @@ template string broadcastAccFunction(const boost::function<string*()>& fun, bool
 template uint64_t broadcastAccFunction(const boost::function<uint64_t*()>& fun, bool skipSelf); // explicit instantiation
 template vector<ComboAddress> broadcastAccFunction(const boost::function<vector<ComboAddress> *()>& fun, bool skipSelf); // explicit instantiation
 template vector<pair<DNSName,uint16_t> > broadcastAccFunction(const boost::function<vector<pair<DNSName, uint16_t> > *()>& fun, bool skipSelf); // explicit instantiation
+template SnapshotPart broadcastAccFunction(const boost::function<SnapshotPart*()>& fun, bool skipSelf); // explicit instantiation
 
 void handleRCC(int fd, FDMultiplexer::funcparam_t& var)
 {
@@ -1840,20 +1952,24 @@ void handleUDPServerResponse(int fd, FDMultiplexer::funcparam_t& var)
 retryWithName:
 
   if(!MT->sendEvent(pident, &packet)) {
-    // we do a full scan for outstanding queries on unexpected answers. not too bad since we only accept them on the right port number, which is hard enough to guess
-    for(MT_t::waiters_t::iterator mthread=MT->d_waiters.begin(); mthread!=MT->d_waiters.end(); ++mthread) {
-      if(pident.fd==mthread->key.fd && mthread->key.remote==pident.remote &&  mthread->key.type == pident.type &&
-         pident.domain == mthread->key.domain) {
+    // everything but the id matches: a near miss
+    auto range=MT->d_waiters.get<OrderedKeyTag>().equal_range(pident);
+    for(auto mthread=range.first; mthread!=range.second; ++mthread) {
+      if(pident.fd==mthread->key.fd)
         mthread->key.nearMisses++;
-      }
+    }
 
-      // be a bit paranoid here since we're weakening our matching
-      if(pident.domain.empty() && !mthread->key.domain.empty() && !pident.type && mthread->key.type &&
-         pident.id  == mthread->key.id && mthread->key.remote == pident.remote) {
-        // cerr<<"Empty response, rest matches though, sending to a waiter"<<endl;
-        pident.domain = mthread->key.domain;
-        pident.type = mthread->key.type;
-        goto retryWithName; // note that this only passes on an error, lwres will still reject the packet
+    // answers without a question are rare, so for those we do a full scan of the outstanding queries
+    if(pident.domain.empty() && !pident.type) {
+      for(MT_t::waiters_t::iterator mthread=MT->d_waiters.begin(); mthread!=MT->d_waiters.end(); ++mthread) {
+        // be a bit paranoid here since we're weakening our matching
+        if(!mthread->key.domain.empty() && mthread->key.type &&
+           pident.id  == mthread->key.id && mthread->key.remote == pident.remote) {
+          // cerr<<"Empty response, rest matches though, sending to a waiter"<<endl;
+          pident.domain = mthread->key.domain;
+          pident.type = mthread->key.type;
+          goto retryWithName; // note that this only passes on an error, lwres will still reject the packet
+        }
       }
     }
     g_stats.unexpectedCount++; // if we made it here, it really is an unexpected answer
@@ -2145,6 +2261,8 @@ int serviceMain(int argc, char*argv[])
   SyncRes::s_maxnegttl=::arg().asNum("max-negative-ttl");
   SyncRes::s_maxcachettl=::arg().asNum("max-cache-ttl");
   SyncRes::s_packetcachettl=::arg().asNum("packetcache-ttl");
+  SyncRes::s_prefetchttlperc=::arg().asNum("prefetch-ttl-percentage");
+  SyncRes::s_prefetchminhits=::arg().asNum("prefetch-min-hits");
   SyncRes::s_packetcacheservfailttl=::arg().asNum("packetcache-servfail-ttl");
   SyncRes::s_serverdownmaxfails=::arg().asNum("server-down-max-fails");
   SyncRes::s_serverdownthrottletime=::arg().asNum("server-down-throttle-time");
@@ -2221,9 +2339,17 @@ int serviceMain(int argc, char*argv[])
   g_numWorkerThreads = ::arg().asNum("threads");
   makeThreadPipes();
 
+  if(::arg().asNum("record-cache-shards") > 0) {
+    g_sharedRC = new MemRecursorCache(::arg().asNum("record-cache-shards"), true);
+    L<<Logger::Warning<<"Sharing the record cache between all threads, using "<<::arg().asNum("record-cache-shards")<<" shards"<<endl;
+  }
+
   g_tcpTimeout=::arg().asNum("client-tcp-timeout");
   g_maxTCPPerClient=::arg().asNum("max-tcp-per-client");
 
+  if(!::arg()["cache-snapshot-file"].empty())
+    g_snapshotParts=splitCacheSnapshot(::arg()["cache-snapshot-file"], g_numWorkerThreads);
+
   if(g_numThreads == 1) {
     L<<Logger::Warning<<"Operating unthreaded"<<endl;
     recursorThread(0);
@@ -2251,9 +2377,21 @@ try
   t_allowFrom = g_initialAllowFrom;
   t_udpclientsocks = new UDPClientSocks();
   t_tcpClientCounts = new tcpClientCounts_t();
+  if(g_sharedRC)
+    t_RC = g_sharedRC;
   primeHints();
 
+  // every worker loads its share of the snapshot, the distributor has no use for one
+  if(!g_snapshotParts.empty() && (!g_weDistributeQueries || t_id)) {
+    string& part=g_snapshotParts[g_weDistributeQueries ? t_id - 1 : t_id];
+    uint64_t loaded=loadCacheSnapshot(part);
+    string().swap(part);
+    if(loaded)
+      L<<Logger::Warning<<"Loaded "<<loaded<<" entries from cache snapshot '"<<::arg()["cache-snapshot-file"]<<"'"<<endl;
+  }
+
   t_packetCache = new RecursorPacketCache();
+  t_dfe = new LocalStateHolder<DNSFilterEngine>(g_dfe.getLocal());
 
   L<<Logger::Warning<<"Done priming cache with root hints"<<endl;
 
@@ -2289,7 +2427,7 @@ try
     t_servfailqueryring->set_capacity(ringsize);
   }
 
-  MT=new MTasker<PacketID,string>(::arg().asNum("stack-size"));
+  MT=new MT_t(::arg().asNum("stack-size"), g_maxMThreads); // a burst of queries should not need new stacks next time
 
   PacketID pident;
 
@@ -2308,7 +2446,7 @@ try
     L<<Logger::Error<<"Enabled '"<< t_fdm->getName() << "' multiplexer"<<endl;
   }
 
-  t_fdm->addReadFD(g_pipes[t_id].readToThread, handlePipeRequest);
+  t_fdm->addReadFD(g_pipes[t_id].queue->getDescriptor(), handlePipeRequest);
 
   if(!g_weDistributeQueries || !t_id)  // if we distribute queries, only t_id = 0 listens
     for(deferredAdd_t::const_iterator i=deferredAdd.begin(); i!=deferredAdd.end(); ++i)
@@ -2357,7 +2495,11 @@ try
       last_carbon = g_now.tv_sec;
     }
 
+    // pick up what other threads queued while we were busy, they only wake us up once we go to sleep
+    drainThreadQueue();
+    g_pipes[t_id].queue->prepareToSleep();
     t_fdm->run(&g_now);
+    g_pipes[t_id].queue->wokeUp();
     // 'run' updates g_now for us
 
     if(!g_weDistributeQueries || !t_id) { // if pdns distributes queries, only tid 0 should do this
@@ -2452,9 +2594,14 @@ int main(int argc, char **argv)
     ::arg().set("server-down-throttle-time","Number of seconds to throttle all queries to a server after being marked as down")="60";
     ::arg().set("hint-file", "If set, load root hints from this file")="";
     ::arg().set("max-cache-entries", "If set, maximum number of entries in the main cache")="1000000";
+    ::arg().set("record-cache-shards", "If set, all threads share a single record cache split in this many shards")="0";
     ::arg().set("max-negative-ttl", "maximum number of seconds to keep a negative cached entry in memory")="3600";
     ::arg().set("max-cache-ttl", "maximum number of seconds to keep a cached entry in memory")="86400";
     ::arg().set("packetcache-ttl", "maximum number of seconds to keep a cached entry in packetcache")="3600";
+    ::arg().set("cache-snapshot-file", "if set, save the caches to this file periodically and on quit-nicely, and load them from it at startup")="";
+    ::arg().set("cache-snapshot-interval", "seconds between writing cache snapshots, 0 to only write one on quit-nicely")="600";
+    ::arg().set("prefetch-ttl-percentage", "refresh popular records in the background when this percentage of their TTL is left, 0 to disable")="0";
+    ::arg().set("prefetch-min-hits", "number of cache hits a record needs before it is prefetched")="10";
     ::arg().set("max-packetcache-entries", "maximum number of entries to keep in the packetcache")="500000";
     ::arg().set("packetcache-servfail-ttl", "maximum number of seconds to keep a cached servfail entry in packetcache")="60";
     ::arg().set("server-id", "Returned when queried for 'server.id' TXT or NSID, defaults to hostname")="";
@@ -0,0 +1,284 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <fcntl.h>
+#include "rec-snapshot.hh"
+#include "syncres.hh"
+#include "recursor_cache.hh"
+#include "dnsparser.hh"
+#include "logger.hh"
+#include "misc.hh"
+
+static void dumpNegCacheSnapshot(SnapshotWriter& sw, time_t now, uint64_t& count)
+{
+  for(const auto& neg : t_sstorage->negcache) {
+    if(neg.d_ttd <= now)
+      continue;
+    sw.put8((uint8_t)SnapshotKind::Negative);
+    sw.putName(neg.d_name);
+    sw.putName(neg.d_qname);
+    sw.put16(neg.d_qtype.getCode());
+    sw.put32(neg.d_ttd);
+    count++;
+  }
+}
+
+static void dumpNSSpeedsSnapshot(SnapshotWriter& sw, uint64_t& count)
+{
+  for(auto& speed : t_sstorage->nsSpeeds) {
+    if(speed.second.d_collection.empty())
+      continue;
+    sw.put8((uint8_t)SnapshotKind::Speed);
+    sw.putName(speed.first);
+    sw.put16(speed.second.d_collection.size());
+    for(auto& ewma : speed.second.d_collection) {
+      sw.putAddress(ewma.first);
+      sw.put32((uint32_t)ewma.second.peek());
+    }
+    count++;
+  }
+}
+
+// the record cache is dumped once by writeCacheSnapshot() if it is shared
+static SnapshotPart* pleaseDumpSnapshot()
+{
+  SnapshotWriter sw;
+  time_t now=time(0);
+  SnapshotPart* part=new SnapshotPart;
+  if(!g_sharedRC)
+    part->d_count+=t_RC->doDumpSnapshot(sw, now);
+  dumpNegCacheSnapshot(sw, now, part->d_count);
+  dumpNSSpeedsSnapshot(sw, part->d_count);
+  part->d_data=sw.str();
+  part->d_threads=1;
+  return part;
+}
+
+static std::atomic<bool> s_writingSnapshot;
+
+// removes the temporary file again if anything goes wrong, so fname keeps the previous snapshot
+static bool writeSnapshotFile(const string& fname, const SnapshotPart& snapshot)
+{
+  string tmpname=fname+".tmp";
+  int fd=open(tmpname.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0660);
+  if(fd < 0) {
+    L<<Logger::Error<<"Unable to open '"<<tmpname<<"' for writing a cache snapshot: "<<stringerror()<<endl;
+    return false;
+  }
+
+  if(writen2(fd, s_snapshotMagic) < 0 || writen2(fd, snapshot.d_data) < 0 || fsync(fd) < 0) {
+    L<<Logger::Error<<"Error writing cache snapshot to '"<<tmpname<<"': "<<stringerror()<<endl;
+    close(fd);
+    unlink(tmpname.c_str());
+    return false;
+  }
+  if(close(fd) < 0) {
+    L<<Logger::Error<<"Error closing cache snapshot '"<<tmpname<<"': "<<stringerror()<<endl;
+    unlink(tmpname.c_str());
+    return false;
+  }
+
+  if(rename(tmpname.c_str(), fname.c_str()) < 0) {
+    L<<Logger::Error<<"Unable to rename '"<<tmpname<<"' to '"<<fname<<"': "<<stringerror()<<endl;
+    unlink(tmpname.c_str());
+    return false;
+  }
+  L<<Logger::Info<<"Wrote "<<snapshot.d_count<<" entries to cache snapshot '"<<fname<<"'"<<endl;
+  return true;
+}
+
+static void writeSnapshotInBackground(const string& fname, const SnapshotPart& snapshot)
+{
+  writeSnapshotFile(fname, snapshot);
+  s_writingSnapshot=false;
+}
+
+bool writeCacheSnapshot(const string& fname, bool background)
+{
+  if(s_writingSnapshot) {
+    if(background) {
+      L<<Logger::Warning<<"Not taking a cache snapshot, the previous one is still being written to '"<<fname<<"'"<<endl;
+      return false;
+    }
+    while(s_writingSnapshot) // it would write the same temporary file
+      usleep(100000);
+  }
+
+  SnapshotPart snapshot;
+  try {
+    if(g_sharedRC) {
+      SnapshotWriter sw;
+      snapshot.d_count=g_sharedRC->doDumpSnapshot(sw, time(0));
+      snapshot.d_data=sw.str();
+    }
+    snapshot+=broadcastAccFunction<SnapshotPart>(pleaseDumpSnapshot);
+  }
+  catch(std::exception& e) {
+    L<<Logger::Error<<"Error taking cache snapshot: "<<e.what()<<endl;
+    return false;
+  }
+  catch(PDNSException& ae) {
+    L<<Logger::Error<<"Error taking cache snapshot: "<<ae.reason<<endl;
+    return false;
+  }
+  // a thread that failed is not in the total, its error was logged already
+  if(snapshot.d_threads != g_numThreads) {
+    L<<Logger::Error<<"Not writing cache snapshot to '"<<fname<<"', "<<(g_numThreads - snapshot.d_threads)<<" threads could not dump their caches"<<endl;
+    return false;
+  }
+
+  if(!background)
+    return writeSnapshotFile(fname, snapshot);
+  s_writingSnapshot=true;
+  std::thread t(writeSnapshotInBackground, fname, std::move(snapshot));
+  t.detach();
+  return true;
+}
+
+// with load unset, the entry is only read past, as is the content of the records
+static void loadRecord(SnapshotReader& sr, time_t now, bool load, uint64_t& count)
+{
+  DNSName qname=sr.getName();
+  uint16_t qtype=sr.get16();
+  bool auth=sr.get8();
+  uint32_t ttd=sr.get32();
+
+  vector<DNSRecord> records;
+  uint16_t num=sr.get16();
+  for(uint16_t n=0; n < num; ++n) {
+    DNSRecord dr;
+    dr.d_name=qname;
+    dr.d_type=qtype;
+    dr.d_class=1;
+    dr.d_ttl=ttd;
+    dr.d_place=DNSResourceRecord::ANSWER;
+    string content=sr.getString();
+    if(load)
+      dr.d_content=DNSRecordContent::unserialize(qname, qtype, content);
+    records.push_back(dr);
+  }
+
+  vector<shared_ptr<RRSIGRecordContent>> signatures;
+  num=sr.get16();
+  for(uint16_t n=0; n < num; ++n) {
+    string content=sr.getString();
+    if(!load)
+      continue;
+    auto rrsig=std::dynamic_pointer_cast<RRSIGRecordContent>(DNSRecordContent::unserialize(qname, QType::RRSIG, content));
+    if(rrsig)
+      signatures.push_back(rrsig);
+  }
+
+  if(load && ttd > now && !records.empty()) {
+    t_RC->replace(now, qname, QType(qtype), records, signatures, auth);
+    count++;
+  }
+}
+
+static void loadNegative(SnapshotReader& sr, time_t now, bool load, uint64_t& count)
+{
+  NegCacheEntry ne;
+  ne.d_name=sr.getName();
+  ne.d_qname=sr.getName();
+  ne.d_qtype=QType(sr.get16());
+  ne.d_ttd=sr.get32();
+  if(load && ne.d_ttd > now) {
+    replacing_insert(t_sstorage->negcache, ne);
+    count++;
+  }
+}
+
+static void loadNSSpeed(SnapshotReader& sr, struct timeval* now, bool load, uint64_t& count)
+{
+  DNSName name=sr.getName();
+  uint16_t num=sr.get16();
+  SyncRes::DecayingEwmaCollection* collection=load ? &t_sstorage->nsSpeeds[name] : 0;
+  for(uint16_t n=0; n < num; ++n) {
+    ComboAddress remote=sr.getAddress();
+    uint32_t usecs=sr.get32();
+    if(load)
+      collection->submit(remote, usecs, now);
+  }
+  if(load)
+    count++;
+}
+
+static void loadEntry(SnapshotReader& sr, struct timeval* now, bool load, uint64_t& count)
+{
+  switch((SnapshotKind)sr.get8()) {
+  case SnapshotKind::Record:
+    loadRecord(sr, now->tv_sec, load, count);
+    break;
+  case SnapshotKind::Negative:
+    loadNegative(sr, now->tv_sec, load, count);
+    break;
+  case SnapshotKind::Speed:
+    loadNSSpeed(sr, now, load, count);
+    break;
+  default:
+    throw std::runtime_error("unknown entry type");
+  }
+}
+
+vector<string> splitCacheSnapshot(const string& fname, unsigned int parts)
+{
+  vector<string> ret(parts);
+  std::ifstream ifs(fname.c_str(), std::ios::binary);
+  if(!ifs) {
+    if(errno != ENOENT)
+      L<<Logger::Error<<"Unable to open cache snapshot '"<<fname<<"': "<<stringerror()<<endl;
+    return ret;
+  }
+  string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+  if(data.compare(0, s_snapshotMagic.size(), s_snapshotMagic)) {
+    L<<Logger::Error<<"Not loading '"<<fname<<"', it is not a cache snapshot of this version"<<endl;
+    return ret;
+  }
+
+  struct timeval now;
+  Utility::gettimeofday(&now, 0);
+  uint64_t entries=0, unused=0;
+  SnapshotReader sr(data, s_snapshotMagic.size());
+  try {
+    while(!sr.eof()) {
+      // every entry starts with a name, right after its kind
+      string::size_type start=sr.getPos();
+      SnapshotReader nr(data, start + 1);
+      string& part=ret[nr.getName().hash() % parts];
+      loadEntry(sr, &now, false, unused);
+      part.append(data, start, sr.getPos() - start);
+      entries++;
+    }
+  }
+  catch(std::exception& e) {
+    L<<Logger::Error<<"Error reading cache snapshot '"<<fname<<"', stopped after "<<entries<<" entries: "<<e.what()<<endl;
+  }
+  catch(PDNSException& ae) {
+    L<<Logger::Error<<"Error reading cache snapshot '"<<fname<<"', stopped after "<<entries<<" entries: "<<ae.reason<<endl;
+  }
+  return ret;
+}
+
+uint64_t loadCacheSnapshot(const string& part)
+{
+  struct timeval now;
+  Utility::gettimeofday(&now, 0);
+  uint64_t count=0;
+  SnapshotReader sr(part);
+  try {
+    while(!sr.eof())
+      loadEntry(sr, &now, true, count);
+  }
+  catch(std::exception& e) {
+    L<<Logger::Error<<"Error loading cache snapshot, stopped after "<<count<<" entries: "<<e.what()<<endl;
+  }
+  catch(PDNSException& ae) {
+    L<<Logger::Error<<"Error loading cache snapshot, stopped after "<<count<<" entries: "<<ae.reason<<endl;
+  }
+  return count;
+}
@@ -0,0 +1,193 @@
+#ifndef PDNS_REC_SNAPSHOT_HH
+#define PDNS_REC_SNAPSHOT_HH
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+#include "dnsname.hh"
+#include "iputils.hh"
+#include "namespaces.hh"
+
+/* A cache snapshot is a binary file with the contents of the record cache, the negative cache
+   and the nameserver speeds, so a restarted recursor does not have to start from scratch.
+
+   It starts with s_snapshotMagic, followed by entries that each start with a SnapshotKind byte.
+   Integers are in network byte order, names in DNS wire format and strings are prefixed with
+   a 16 bit length. Expiry times are absolute, so whatever time passed since the snapshot was
+   written is taken into account automatically when it is loaded. */
+
+static const std::string s_snapshotMagic("PDNSRCS\x01", 8);
+
+enum class SnapshotKind : uint8_t { Record='R', Negative='N', Speed='S' };
+
+class SnapshotWriter
+{
+public:
+  void put8(uint8_t val)
+  {
+    d_buf.append(1, (char)val);
+  }
+
+  void put16(uint16_t val)
+  {
+    put8(val >> 8);
+    put8(val & 0xff);
+  }
+
+  void put32(uint32_t val)
+  {
+    put16(val >> 16);
+    put16(val & 0xffff);
+  }
+
+  void putString(const std::string& str)
+  {
+    if(str.size() > 0xffff)
+      throw std::runtime_error("string of "+std::to_string(str.size())+" bytes is too long for a cache snapshot");
+    put16(str.size());
+    d_buf.append(str);
+  }
+
+  void putName(const DNSName& name)
+  {
+    d_buf.append(name.toDNSString());
+  }
+
+  void putAddress(const ComboAddress& ca)
+  {
+    if(ca.sin4.sin_family == AF_INET) {
+      put8(4);
+      d_buf.append((const char*)&ca.sin4.sin_addr.s_addr, 4);
+    }
+    else {
+      put8(6);
+      d_buf.append((const char*)&ca.sin6.sin6_addr.s6_addr, 16);
+    }
+    put16(ntohs(ca.sin4.sin_port));
+  }
+
+  const std::string& str() const
+  {
+    return d_buf;
+  }
+
+private:
+  std::string d_buf;
+};
+
+//! reads what SnapshotWriter wrote, throws a std::runtime_error when it runs out of data
+class SnapshotReader
+{
+public:
+  SnapshotReader(const std::string& data, std::string::size_type pos=0) : d_data(data), d_pos(pos)
+  {
+  }
+
+  bool eof() const
+  {
+    return d_pos >= d_data.size();
+  }
+
+  std::string::size_type getPos() const
+  {
+    return d_pos;
+  }
+
+  uint8_t get8()
+  {
+    need(1);
+    return (uint8_t)d_data[d_pos++];
+  }
+
+  uint16_t get16()
+  {
+    uint16_t ret=get8();
+    return (ret << 8) | get8();
+  }
+
+  uint32_t get32()
+  {
+    uint32_t ret=get16();
+    return (ret << 16) | get16();
+  }
+
+  std::string getString()
+  {
+    uint16_t len=get16();
+    need(len);
+    std::string ret=d_data.substr(d_pos, len);
+    d_pos+=len;
+    return ret;
+  }
+
+  DNSName getName()
+  {
+    need(1);
+    unsigned int consumed=0;
+    DNSName ret(d_data.c_str(), d_data.size() - d_pos, d_pos, false, 0, 0, &consumed);
+    need(consumed);
+    d_pos+=consumed;
+    return ret;
+  }
+
+  ComboAddress getAddress()
+  {
+    ComboAddress ret;
+    uint8_t version=get8();
+    if(version == 4) {
+      need(4);
+      ret.sin4.sin_family=AF_INET;
+      memcpy(&ret.sin4.sin_addr.s_addr, &d_data[d_pos], 4);
+      d_pos+=4;
+    }
+    else if(version == 6) {
+      need(16);
+      memset(&ret.sin6, 0, sizeof(ret.sin6));
+      ret.sin6.sin6_family=AF_INET6;
+      memcpy(&ret.sin6.sin6_addr.s6_addr, &d_data[d_pos], 16);
+      d_pos+=16;
+    }
+    else
+      throw std::runtime_error("unknown address family "+std::to_string(version)+" in cache snapshot");
+    ret.sin4.sin_port=htons(get16());
+    return ret;
+  }
+
+private:
+  void need(std::string::size_type len)
+  {
+    if(d_data.size() - d_pos < len)
+      throw std::runtime_error("cache snapshot is truncated");
+  }
+
+  const std::string& d_data;
+  std::string::size_type d_pos;
+};
+
+//! what the threads contribute to a snapshot, added up by broadcastAccFunction()
+struct SnapshotPart
+{
+  SnapshotPart& operator+=(const SnapshotPart& rhs)
+  {
+    d_data.append(rhs.d_data);
+    d_count+=rhs.d_count;
+    d_threads+=rhs.d_threads;
+    return *this;
+  }
+
+  std::string d_data;
+  uint64_t d_count{0};
+  unsigned int d_threads{0}; //!< to tell if one of them failed
+};
+
+/** writes a snapshot of the caches of all threads to fname, via a temporary file. Call from thread 0.
+    The threads add their part in memory, with background set, the file is then written by a thread of
+    its own, so thread 0 does not wait for the disk. Returns false if the snapshot could not be taken */
+bool writeCacheSnapshot(const std::string& fname, bool background=false);
+/** reads the snapshot in fname once and splits its entries in parts, by the hash of their name, so every
+    thread can load its share. Entries for the same name end up in the same part */
+std::vector<std::string> splitCacheSnapshot(const std::string& fname, unsigned int parts);
+//! adds a part made by splitCacheSnapshot() to the caches of the calling thread, returns the number of entries loaded
+uint64_t loadCacheSnapshot(const std::string& part);
+#endif
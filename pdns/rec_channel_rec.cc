@@ -29,6 +29,7 @@
 #include "responsestats.hh"
 
 #include "secpoll-recursor.hh"
+#include "rec-snapshot.hh"
 #include "pubsuffix.hh"
 #include "namespaces.hh"
 pthread_mutex_t g_carbon_config_lock=PTHREAD_MUTEX_INITIALIZER;
@@ -157,12 +158,36 @@ static uint64_t dumpNegCache(SyncRes::negcache_t& negcache, int fd)
 
 static uint64_t* pleaseDump(int fd)
 {
-  return new uint64_t(t_RC->doDump(fd) + dumpNegCache(t_sstorage->negcache, fd));
+  return new uint64_t((g_sharedRC ? 0 : t_RC->doDump(fd)) + dumpNegCache(t_sstorage->negcache, fd));
 }
 
+static uint64_t dumpNSSpeeds(int fd)
+{
+  FILE* fp=fdopen(dup(fd), "w");
+  if(!fp)
+    return 0;
+  fprintf(fp, "; nsspeed dump from thread follows\n;\n");
+  uint64_t count=0;
+
+  for(SyncRes::nsspeeds_t::iterator i = t_sstorage->nsSpeeds.begin() ; i!= t_sstorage->nsSpeeds.end(); ++i)
+  {
+    count++;
+    fprintf(fp, "%s -> ", i->first.toString().c_str());
+    for(SyncRes::DecayingEwmaCollection::collection_t::iterator j = i->second.d_collection.begin(); j!= i->second.d_collection.end(); ++j)
+    {
+      // typedef vector<pair<ComboAddress, DecayingEwma> > collection_t;
+      fprintf(fp, "%s/%f ", j->first.toString().c_str(), j->second.peek());
+    }
+    fprintf(fp, "\n");
+  }
+  fclose(fp);
+  return count;
+}
+
+
 static uint64_t* pleaseDumpNSSpeeds(int fd)
 {
-  return new uint64_t(t_RC->doDumpNSSpeeds(fd));
+  return new uint64_t(dumpNSSpeeds(fd));
 }
 
 template<typename T>
@@ -201,7 +226,9 @@ string doDumpCache(T begin, T end)
     return "Error opening dump file for writing: "+string(strerror(errno))+"\n";
   uint64_t total = 0;
   try {
-    total = broadcastAccFunction<uint64_t>(boost::bind(pleaseDump, fd));
+    if(g_sharedRC) // dump it once, not from every thread
+      total = g_sharedRC->doDump(fd);
+    total += broadcastAccFunction<uint64_t>(boost::bind(pleaseDump, fd));
   }
   catch(...){}
   
@@ -232,6 +259,13 @@ uint64_t* pleaseWipeCache(const DNSName& canon, bool subtree)
   return new uint64_t(t_RC->doWipeCache(canon, subtree));
 }
 
+uint64_t doWipeRecordCache(const DNSName& canon, bool subtree)
+{
+  if(g_sharedRC) // wipe it once, not from every thread
+    return g_sharedRC->doWipeCache(canon, subtree);
+  return broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeCache, canon, subtree));
+}
+
 uint64_t* pleaseWipePacketCache(const DNSName& canon, bool subtree)
 {
   return new uint64_t(t_packetCache->doWipePacketCache(canon,0xffff, subtree));
@@ -272,7 +306,7 @@ string doWipeCache(T begin, T end)
     else 
       canon=DNSName(*i);
     
-    count+= broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeCache, canon, subtree));
+    count+= doWipeRecordCache(canon, subtree);
     pcount+= broadcastAccFunction<uint64_t>(boost::bind(pleaseWipePacketCache, canon, subtree));
     countNeg+=broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeAndCountNegCache, canon, subtree));
   }
@@ -407,6 +441,36 @@ static uint64_t getConcurrentQueries()
   return broadcastAccFunction<uint64_t>(pleaseGetConcurrentQueries);
 }
 
+uint64_t* pleaseGetStackPoolSize()
+{
+  return new uint64_t(MT->getStackPoolSize());
+}
+
+static uint64_t getStackPoolSize()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetStackPoolSize);
+}
+
+uint64_t* pleaseGetStackReuses()
+{
+  return new uint64_t(MT->getStackReuses());
+}
+
+static uint64_t getStackReuses()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetStackReuses);
+}
+
+uint64_t* pleaseGetStacksHighWater()
+{
+  return new uint64_t(MT->getStacksHighWater());
+}
+
+static uint64_t getStacksHighWater()
+{
+  return broadcastAccFunction<uint64_t>(pleaseGetStacksHighWater);
+}
+
 uint64_t* pleaseGetCacheSize()
 {
   return new uint64_t(t_RC->size());
@@ -420,6 +484,8 @@ uint64_t* pleaseGetCacheBytes()
 
 uint64_t doGetCacheSize()
 {
+  if(g_sharedRC)
+    return g_sharedRC->size();
   return broadcastAccFunction<uint64_t>(pleaseGetCacheSize);
 }
 
@@ -431,6 +497,8 @@ uint64_t doGetAvgLatencyUsec()
 
 uint64_t doGetCacheBytes()
 {
+  if(g_sharedRC)
+    return g_sharedRC->bytes();
   return broadcastAccFunction<uint64_t>(pleaseGetCacheBytes);
 }
 
@@ -441,6 +509,8 @@ uint64_t* pleaseGetCacheHits()
 
 uint64_t doGetCacheHits()
 {
+  if(g_sharedRC)
+    return g_sharedRC->cacheHits;
   return broadcastAccFunction<uint64_t>(pleaseGetCacheHits);
 }
 
@@ -451,9 +521,35 @@ uint64_t* pleaseGetCacheMisses()
 
 uint64_t doGetCacheMisses()
 {
+  if(g_sharedRC)
+    return g_sharedRC->cacheMisses;
   return broadcastAccFunction<uint64_t>(pleaseGetCacheMisses);
 }
 
+static uint64_t* pleaseGetCacheLockAcquisitions()
+{
+  return new uint64_t(t_RC->getLockAcquisitions());
+}
+
+static uint64_t doGetCacheLockAcquisitions()
+{
+  if(g_sharedRC)
+    return g_sharedRC->getLockAcquisitions();
+  return broadcastAccFunction<uint64_t>(pleaseGetCacheLockAcquisitions);
+}
+
+static uint64_t* pleaseGetCacheLockContentions()
+{
+  return new uint64_t(t_RC->getLockContentions());
+}
+
+static uint64_t doGetCacheLockContentions()
+{
+  if(g_sharedRC)
+    return g_sharedRC->getLockContentions();
+  return broadcastAccFunction<uint64_t>(pleaseGetCacheLockContentions);
+}
+
 
 uint64_t* pleaseGetPacketCacheSize()
 {
@@ -522,6 +618,8 @@ RecursorControlParser::RecursorControlParser()
   addGetStat("cache-misses", doGetCacheMisses); 
   addGetStat("cache-entries", doGetCacheSize); 
   addGetStat("cache-bytes", doGetCacheBytes); 
+  addGetStat("cache-lock-acquisitions", doGetCacheLockAcquisitions);
+  addGetStat("cache-lock-contentions", doGetCacheLockContentions);
   
   addGetStat("packetcache-hits", doGetPacketCacheHits);
   addGetStat("packetcache-misses", doGetPacketCacheMisses); 
@@ -570,6 +668,7 @@ RecursorControlParser::RecursorControlParser()
 
   addGetStat("resource-limits", &g_stats.resourceLimits);
   addGetStat("over-capacity-drops", &g_stats.overCapacityDrops);
+  addGetStat("distribution-queue-drops", &g_stats.distributionQueueDrops);
   addGetStat("policy-drops", &g_stats.policyDrops);
   addGetStat("no-packet-error", &g_stats.noPacketError);
   addGetStat("dlg-only-drops", &SyncRes::s_nodelegated);
@@ -582,6 +681,9 @@ RecursorControlParser::RecursorControlParser()
   addGetStat("failed-host-entries", boost::bind(getFailedHostsSize));
 
   addGetStat("concurrent-queries", boost::bind(getConcurrentQueries)); 
+  addGetStat("mthread-stack-pool-size", boost::bind(getStackPoolSize));
+  addGetStat("mthread-stack-reuses", boost::bind(getStackReuses));
+  addGetStat("mthread-stacks-high-water", boost::bind(getStacksHighWater));
   addGetStat("security-status", &g_security_status);
   addGetStat("outgoing-timeouts", &SyncRes::s_outgoingtimeouts);
   addGetStat("outgoing4-timeouts", &SyncRes::s_outgoing4timeouts);
@@ -594,6 +696,8 @@ RecursorControlParser::RecursorControlParser()
   addGetStat("throttled-out", &SyncRes::s_throttledqueries);
   addGetStat("unreachables", &SyncRes::s_unreachables);
   addGetStat("chain-resends", &g_stats.chainResends);
+  addGetStat("prefetches", &SyncRes::s_prefetches);
+  addGetStat("prefetch-hits", &SyncRes::s_prefetchhits);
   addGetStat("tcp-clients", boost::bind(TCPConnection::getCurrentConnections));
 
 #ifdef __linux__
@@ -620,6 +724,8 @@ RecursorControlParser::RecursorControlParser()
 static void doExitGeneric(bool nicely)
 {
   L<<Logger::Error<<"Exiting on user request"<<endl;
+  if(nicely && !::arg()["cache-snapshot-file"].empty())
+    writeCacheSnapshot(::arg()["cache-snapshot-file"]);
   extern RecursorControlChannel s_rcc;
   s_rcc.~RecursorControlChannel(); 
 
@@ -9,43 +9,92 @@
 #include "namespaces.hh"
 #include "lock.hh"
 #include "dnswriter.hh"
+#include "dnsrecords.hh"
 
 RecursorPacketCache::RecursorPacketCache()
 {
   d_hits = d_misses = 0;
 }
 
-int RecursorPacketCache::doWipePacketCache(const DNSName& name, uint16_t qtype, bool subtree)
+/* Fills in the fields of key that identify the answer to queryPacket, and its hash. Returns false
+   for queries we don't cache, like ones with more than one question or with additional records
+   that don't start with an OPT record. */
+bool RecursorPacketCache::getKey(const std::string& queryPacket, Entry* key)
 {
-  vector<uint8_t> packet;
-  DNSPacketWriter pw(packet, name, 0);
-  pw.getHeader()->rd=1;
-  Entry e;
-  e.d_packet.assign((const char*)&*packet.begin(), packet.size());
+  if(queryPacket.size() < sizeof(dnsheader))
+    return false;
+  const struct dnsheader* dh = (const struct dnsheader*)queryPacket.c_str();
+  if(ntohs(dh->qdcount) != 1 || dh->ancount || dh->nscount)
+    return false;
 
-  // so the idea is, we search for a packet with qtype=0, which is ahead of anything with that name
+  unsigned int consumed=0;
+  try {
+    key->d_name=DNSName(queryPacket.c_str(), queryPacket.size(), sizeof(dnsheader), false, 0, 0, &consumed);
+  }
+  catch(std::exception& e) {
+    return false;
+  }
+  const unsigned char* p = (const unsigned char*)queryPacket.c_str();
+  size_t pos = sizeof(dnsheader) + consumed;
+  if(pos + 4 > queryPacket.size())
+    return false;
+  key->d_type = p[pos] << 8 | p[pos+1];
+  key->d_class = p[pos+2] << 8 | p[pos+3];
+  pos += 4;
+
+  key->d_flags = dh->opcode << 2 | dh->rd << 1 | dh->cd;
+  key->d_ednsSize = 0;
+  key->d_dnssecOK = false;
+  if(dh->arcount) {
+    // root, type, class (buffer size), ttl (extended rcode, version, flags)
+    if(pos + 11 > queryPacket.size() || p[pos] || (p[pos+1] << 8 | p[pos+2]) != QType::OPT)
+      return false;
+    key->d_ednsSize = std::max(p[pos+3] << 8 | p[pos+4], 512);
+    key->d_dnssecOK = (p[pos+7] << 8 | p[pos+8]) & EDNSOpts::DNSSECOK;
+  }
 
-  int count=0;
-  for(packetCache_t::iterator iter = d_packetCache.lower_bound(e); iter != d_packetCache.end(); ) {
-    const struct dnsheader* packet = reinterpret_cast<const struct dnsheader*>((*iter).d_packet.c_str());
-    if(packet->qdcount==0)
-      break;
-    uint16_t t;
+  uint32_t fields[3];
+  fields[0] = (uint32_t)key->d_type << 16 | key->d_class;
+  fields[1] = (uint32_t)key->d_flags << 16 | key->d_ednsSize;
+  fields[2] = key->d_dnssecOK;
+  key->d_qhash = burtle((const unsigned char*)fields, sizeof(fields), key->d_name.hash());
+  return true;
+}
+
+// the hash queryPacket is filed under, returns false if it can't be cached
+bool RecursorPacketCache::getQueryHash(const std::string& queryPacket, uint32_t* hash)
+{
+  Entry key;
+  if(!getKey(queryPacket, &key))
+    return false;
+  *hash = key.d_qhash;
+  return true;
+}
 
-    DNSName found(iter->d_packet.c_str(), iter->d_packet.size(), 12, false, &t);
-    //    cout<<"At record "<<found<<" while searching for "<<name<<", subtree= "<<subtree<<endl;
+bool RecursorPacketCache::keyMatches(const Entry& lhs, const Entry& rhs)
+{
+  return lhs.d_qhash == rhs.d_qhash && lhs.d_type == rhs.d_type && lhs.d_class == rhs.d_class && lhs.d_flags == rhs.d_flags &&
+    lhs.d_ednsSize == rhs.d_ednsSize && lhs.d_dnssecOK == rhs.d_dnssecOK && lhs.d_name == rhs.d_name;
+}
+
+int RecursorPacketCache::doWipePacketCache(const DNSName& name, uint16_t qtype, bool subtree)
+{
+  auto& idx = d_packetCache.get<NameTag>();
+  int count=0;
+  for(auto iter = idx.lower_bound(name); iter != idx.end(); ) {
+    //    cout<<"At record "<<iter->d_name<<" while searching for "<<name<<", subtree= "<<subtree<<endl;
     if(subtree) {
-      if(!found.isPartOf(name)) {   // this is case insensitive
+      if(!iter->d_name.isPartOf(name)) {   // this is case insensitive
 	break;
       }
     }
     else {
-      if(found != name)
+      if(iter->d_name != name)
 	break;
     }
 
-    if(t==qtype || qtype==0xffff) {
-      iter=d_packetCache.erase(iter);
+    if(iter->d_type==qtype || qtype==0xffff) {
+      iter=idx.erase(iter);
       count++;
     }
     else
@@ -59,11 +108,19 @@ bool RecursorPacketCache::getResponsePacket(const std::string& queryPacket, time
   std::string* responsePacket, uint32_t* age)
 {
   struct Entry e;
-  e.d_packet=queryPacket;
-  
-  packetCache_t::const_iterator iter = d_packetCache.find(e);
-  
-  if(iter == d_packetCache.end()) {
+  if(!getKey(queryPacket, &e)) {
+    d_misses++;
+    return false;
+  }
+
+  auto range = d_packetCache.equal_range(e.d_qhash);
+  auto iter = range.first;
+  for(; iter != range.second; ++iter) {
+    if(keyMatches(*iter, e))
+      break;
+  }
+
+  if(iter == range.second) {
     d_misses++;
     return false;
   }
@@ -96,21 +153,25 @@ bool RecursorPacketCache::getResponsePacket(const std::string& queryPacket, time
   return false;
 }
 
-void RecursorPacketCache::insertResponsePacket(const std::string& responsePacket, time_t now, uint32_t ttl)
+void RecursorPacketCache::insertResponsePacket(const std::string& queryPacket, const std::string& responsePacket, time_t now, uint32_t ttl)
 {
   struct Entry e;
+  if(!getKey(queryPacket, &e))
+    return;
   e.d_packet = responsePacket;
   e.d_ttd = now+ttl;
   e.d_creation = now;
-  packetCache_t::iterator iter = d_packetCache.find(e);
-  
-  if(iter != d_packetCache.end()) {
-    iter->d_packet = responsePacket;
-    iter->d_ttd = now + ttl;
-    iter->d_creation = now;
+
+  auto range = d_packetCache.equal_range(e.d_qhash);
+  for(auto iter = range.first; iter != range.second; ++iter) {
+    if(keyMatches(*iter, e)) {
+      iter->d_packet = responsePacket;
+      iter->d_ttd = now + ttl;
+      iter->d_creation = now;
+      return;
+    }
   }
-  else 
-    d_packetCache.insert(e);
+  d_packetCache.insert(e);
 }
 
 uint64_t RecursorPacketCache::size()
@@ -6,21 +6,28 @@
 #include "dns.hh"
 #include "namespaces.hh"
 #include <iostream>
+#include "dnsname.hh"
 #include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/tuple/tuple_comparison.hpp>
 #include <boost/multi_index/sequenced_index.hpp>
+#include <boost/multi_index/key_extractors.hpp>
 
 
 using namespace ::boost::multi_index;
 
-//! Stores whole packets, ready for lobbing back at the client. Not threadsafe.
+/** Stores whole packets, ready for lobbing back at the client. Not threadsafe.
+
+    Packets are found through a hash of the parts of the query the answer depends on:
+    the question (name case insensitively), the opcode, the RD and CD bits, and the EDNS
+    buffer size and DO bit. Only entries with the same hash are compared field by field. */
 class RecursorPacketCache
 {
 public:
   RecursorPacketCache();
   bool getResponsePacket(const std::string& queryPacket, time_t now, std::string* responsePacket, uint32_t* age);
-  void insertResponsePacket(const std::string& responsePacket, time_t now, uint32_t ttd);
+  void insertResponsePacket(const std::string& queryPacket, const std::string& responsePacket, time_t now, uint32_t ttd);
   void doPruneTo(unsigned int maxSize=250000);
   int doWipePacketCache(const DNSName& name, uint16_t qtype=0xffff, bool subtree=false);
   
@@ -28,6 +35,7 @@ public:
   uint64_t d_hits, d_misses;
   uint64_t size();
   uint64_t bytes();
+  static bool getQueryHash(const std::string& queryPacket, uint32_t* hash);
 
 private:
 
@@ -37,38 +45,37 @@ private:
     mutable uint32_t d_creation;
     mutable std::string d_packet; // "I know what I am doing"
 
-    inline bool operator<(const struct Entry& rhs) const;
-    
+    DNSName d_name;
+    uint32_t d_qhash;
+    uint16_t d_type;
+    uint16_t d_class;
+    uint16_t d_flags;    // opcode, RD and CD of the query
+    uint16_t d_ednsSize; // 0 if the query had no EDNS
+    bool d_dnssecOK;
+
     uint32_t getTTD() const
     {
       return d_ttd;
     }
   };
- 
+
+  struct HashTag{};
+  struct SequenceTag{};
+  struct NameTag{};
+
   typedef multi_index_container<
     Entry,
     indexed_by  <
-                  ordered_unique<identity<Entry> >, 
-                  sequenced<> 
+                  hashed_non_unique<tag<HashTag>, member<Entry,uint32_t,&Entry::d_qhash> >,
+                  sequenced<tag<SequenceTag> >,
+                  ordered_non_unique<tag<NameTag>, member<Entry,DNSName,&Entry::d_name>, CanonDNSNameCompare>
                >
   > packetCache_t;
   
+  static bool getKey(const std::string& queryPacket, Entry* key);
+  static bool keyMatches(const Entry& lhs, const Entry& rhs);
+
    packetCache_t d_packetCache;
 };
 
-// needs to take into account: qname, qtype, opcode, rd, qdcount, EDNS size
-inline bool RecursorPacketCache::Entry::operator<(const struct RecursorPacketCache::Entry &rhs) const
-{
-  const struct dnsheader* 
-    dh=(const struct dnsheader*) d_packet.c_str(), 
-    *rhsdh=(const struct dnsheader*)rhs.d_packet.c_str();
-  if(boost::make_tuple(dh->opcode, dh->rd, dh->qdcount) < 
-     boost::make_tuple(rhsdh->opcode, rhsdh->rd, rhsdh->qdcount))
-    return true;
-
-  return dnspacketLessThan(d_packet, rhs.d_packet);
-}
-
-
-
 #endif
@@ -6,14 +6,33 @@
 #include <iostream>
 #include "dnsrecords.hh"
 #include "arguments.hh"
-#include "syncres.hh"
 #include "recursor_cache.hh"
 #include "cachecleaner.hh"
+#include "rec-snapshot.hh"
 #include "namespaces.hh"
 
+std::unique_lock<std::mutex> MemRecursorCache::lockShard(Shard& shard)
+{
+  if(!d_shared)
+    return std::unique_lock<std::mutex>();
+
+  std::unique_lock<std::mutex> lock(shard.d_mutex, std::try_to_lock);
+  if(!lock.owns_lock()) {
+    lock.lock();
+    shard.d_contended++;
+  }
+  shard.d_acquired++;
+  return lock;
+}
+
 unsigned int MemRecursorCache::size()
 {
-  return (unsigned int)d_cache.size();
+  unsigned int ret=0;
+  for(auto& shard : d_shards) {
+    auto lock=lockShard(shard);
+    ret+=(unsigned int)shard.d_cache.size();
+  }
+  return ret;
 }
 
 // this function is too slow to poll!
@@ -21,33 +40,59 @@ unsigned int MemRecursorCache::bytes()
 {
   unsigned int ret=0;
 
-  for(cache_t::const_iterator i=d_cache.begin(); i!=d_cache.end(); ++i) {
-    ret+=sizeof(struct CacheEntry);
-    ret+=(unsigned int)i->d_qname.toString().length();
-    for(auto j=i->d_records.begin(); j!= i->d_records.end(); ++j)
-      ret+= sizeof(*j); // XXX WRONG we don't know the stored size! j->size();
+  for(auto& shard : d_shards) {
+    auto lock=lockShard(shard);
+    for(cache_t::const_iterator i=shard.d_cache.begin(); i!=shard.d_cache.end(); ++i) {
+      ret+=sizeof(struct CacheEntry);
+      ret+=(unsigned int)i->d_qname.toString().length();
+      for(auto j=i->d_records.begin(); j!= i->d_records.end(); ++j)
+        ret+= sizeof(*j); // XXX WRONG we don't know the stored size! j->size();
+    }
   }
   return ret;
 }
 
-int MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt, vector<DNSRecord>* res, vector<std::shared_ptr<RRSIGRecordContent>>* signatures)
+uint64_t MemRecursorCache::getLockAcquisitions()
+{
+  uint64_t ret=0;
+  for(auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard.d_mutex);
+    ret+=shard.d_acquired;
+  }
+  return ret;
+}
+
+uint64_t MemRecursorCache::getLockContentions()
+{
+  uint64_t ret=0;
+  for(auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard.d_mutex);
+    ret+=shard.d_contended;
+  }
+  return ret;
+}
+
+int MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt, vector<DNSRecord>* res, vector<std::shared_ptr<RRSIGRecordContent>>* signatures, EntryState* state)
 {
   unsigned int ttd=0;
   //  cerr<<"looking up "<< qname<<"|"+qt.getName()<<"\n";
 
-  if(!d_cachecachevalid || d_cachedqname!= qname) {
+  Shard& shard=getShard(qname);
+  auto lock=lockShard(shard);
+
+  if(!shard.d_cachecachevalid || shard.d_cachedqname!= qname) {
     //    cerr<<"had cache cache miss"<<endl;
-    d_cachedqname=qname;
-    d_cachecache=d_cache.equal_range(tie(qname));
-    d_cachecachevalid=true;
+    shard.d_cachedqname=qname;
+    shard.d_cachecache=shard.d_cache.equal_range(tie(qname));
+    shard.d_cachecachevalid=true;
   }
   //  else cerr<<"had cache cache hit!"<<endl;
 
   if(res)
     res->clear();
 
-  if(d_cachecache.first!=d_cachecache.second) {
-    for(cache_t::const_iterator i=d_cachecache.first; i != d_cachecache.second; ++i)
+  if(shard.d_cachecache.first!=shard.d_cachecache.second) {
+    for(cache_t::const_iterator i=shard.d_cachecache.first; i != shard.d_cachecache.second; ++i)
       if(i->d_ttd > now && (i->d_qtype == qt.getCode() || qt.getCode()==QType::ANY ||
 			    (qt.getCode()==QType::ADDR && (i->d_qtype == QType::A || i->d_qtype == QType::AAAA) ) )
          ) {
@@ -68,11 +113,16 @@ int MemRecursorCache::get(time_t now, const DNSName &qname, const QType& qt, vec
       
 	if(signatures)  // if you do an ANY lookup you are hosed XXXX
 	  *signatures=i->d_signatures;
+        if(state) {
+          state->hits=++i->d_hits;
+          state->origTTL=i->d_origTTL;
+          state->prefetched=i->d_prefetched;
+        }
         if(res) {
           if(res->empty())
-            moveCacheItemToFront(d_cache, i);
+            moveCacheItemToFront(shard.d_cache, i);
           else
-            moveCacheItemToBack(d_cache, i);
+            moveCacheItemToBack(shard.d_cache, i);
         }
         if(qt.getCode()!=QType::ANY && qt.getCode()!=QType::ADDR) // normally if we have a hit, we are done
           break;
@@ -114,15 +164,30 @@ bool MemRecursorCache::attemptToRefreshNSTTL(const QType& qt, const vector<DNSRe
   return true;
 }
 
-void MemRecursorCache::replace(time_t now, const DNSName &qname, const QType& qt,  const vector<DNSRecord>& content, const vector<shared_ptr<RRSIGRecordContent>>& signatures, bool auth)
+// marks a live entry as being refreshed, returns false if it is gone or somebody else got there recently
+bool MemRecursorCache::claimPrefetch(time_t now, const DNSName &qname, const QType& qt)
 {
-  d_cachecachevalid=false;
+  Shard& shard=getShard(qname);
+  auto lock=lockShard(shard);
+
+  cache_t::const_iterator i=shard.d_cache.find(boost::make_tuple(qname, qt.getCode()));
+  if(i == shard.d_cache.end() || i->d_ttd <= now)
+    return false;
+  return i->d_prefetch.claim(now);
+}
+
+void MemRecursorCache::replace(time_t now, const DNSName &qname, const QType& qt,  const vector<DNSRecord>& content, const vector<shared_ptr<RRSIGRecordContent>>& signatures, bool auth, bool prefetched)
+{
+  Shard& shard=getShard(qname);
+  auto lock=lockShard(shard);
+
+  shard.d_cachecachevalid=false;
   boost::tuple<DNSName, uint16_t> key=boost::make_tuple(qname, qt.getCode());
-  cache_t::iterator stored=d_cache.find(key);
+  cache_t::iterator stored=shard.d_cache.find(key);
   uint32_t maxTTD=UINT_MAX;
 
-  if(stored == d_cache.end()) {
-    stored=d_cache.insert(CacheEntry(key,CacheEntry::records_t(), auth)).first;
+  if(stored == shard.d_cache.end()) {
+    stored=shard.d_cache.insert(CacheEntry(key,CacheEntry::records_t(), auth)).first;
   }
   
   CacheEntry ce=*stored;
@@ -194,35 +259,49 @@ void MemRecursorCache::replace(time_t now, const DNSName &qname, const QType& qt
     */
   }
 
-  d_cache.replace(stored, ce);
+  ce.d_hits=0;
+  ce.d_prefetched=prefetched;
+  ce.d_prefetch.clear();
+  ce.d_origTTL=ce.d_ttd > now ? ce.d_ttd - now : 0;
+
+  shard.d_cache.replace(stored, ce);
 }
 
 int MemRecursorCache::doWipeCache(const DNSName& name, bool sub, uint16_t qtype)
 {
   int count=0;
-  d_cachecachevalid=false;
   pair<cache_t::iterator, cache_t::iterator> range;
 
   if(!sub) {
+    Shard& shard=getShard(name);
+    auto lock=lockShard(shard);
+    shard.d_cachecachevalid=false;
+
     if(qtype==0xffff)
-      range=d_cache.equal_range(tie(name));
+      range=shard.d_cache.equal_range(tie(name));
     else
-      range=d_cache.equal_range(tie(name, qtype));
+      range=shard.d_cache.equal_range(tie(name, qtype));
     for(cache_t::const_iterator i=range.first; i != range.second; ) {
       count++;
-      d_cache.erase(i++);
+      shard.d_cache.erase(i++);
     }
   }
   else {
-    for(auto iter = d_cache.lower_bound(tie(name)); iter != d_cache.end(); ) {
-      if(!iter->d_qname.isPartOf(name))
-	break;
-      if(iter->d_qtype == qtype || qtype == 0xffff) {
-	count++;
-	d_cache.erase(iter++);
+    // names below 'name' can be in any shard
+    for(auto& shard : d_shards) {
+      auto lock=lockShard(shard);
+      shard.d_cachecachevalid=false;
+
+      for(auto iter = shard.d_cache.lower_bound(tie(name)); iter != shard.d_cache.end(); ) {
+        if(!iter->d_qname.isPartOf(name))
+          break;
+        if(iter->d_qtype == qtype || qtype == 0xffff) {
+          count++;
+          shard.d_cache.erase(iter++);
+        }
+        else 
+          iter++;
       }
-      else 
-	iter++;
     }
   }
   return count;
@@ -230,9 +309,12 @@ int MemRecursorCache::doWipeCache(const DNSName& name, bool sub, uint16_t qtype)
 
 bool MemRecursorCache::doAgeCache(time_t now, const DNSName& name, uint16_t qtype, int32_t newTTL)
 {
-  cache_t::iterator iter = d_cache.find(tie(name, qtype));
+  Shard& shard=getShard(name);
+  auto lock=lockShard(shard);
+
+  cache_t::iterator iter = shard.d_cache.find(tie(name, qtype));
   uint32_t maxTTD=std::numeric_limits<uint32_t>::min();
-  if(iter == d_cache.end()) {
+  if(iter == shard.d_cache.end()) {
     return false;
   }
 
@@ -246,7 +328,7 @@ bool MemRecursorCache::doAgeCache(time_t now, const DNSName& name, uint16_t qtyp
     return false;  // would be dead anyhow
 
   if(maxTTL > newTTL) {
-    d_cachecachevalid=false;
+    shard.d_cachecachevalid=false;
 
     uint32_t newTTD = now + newTTL;
 
@@ -255,32 +337,35 @@ bool MemRecursorCache::doAgeCache(time_t now, const DNSName& name, uint16_t qtyp
       ce.d_ttd = newTTD;
   
 
-    d_cache.replace(iter, ce);
+    shard.d_cache.replace(iter, ce);
     return true;
   }
   return false;
 }
 
-uint64_t MemRecursorCache::doDumpNSSpeeds(int fd)
+// live entries only, in the format loadCacheSnapshot() expects
+uint64_t MemRecursorCache::doDumpSnapshot(SnapshotWriter& sw, time_t now)
 {
-  FILE* fp=fdopen(dup(fd), "w");
-  if(!fp)
-    return 0;
-  fprintf(fp, "; nsspeed dump from thread follows\n;\n");
   uint64_t count=0;
-
-  for(SyncRes::nsspeeds_t::iterator i = t_sstorage->nsSpeeds.begin() ; i!= t_sstorage->nsSpeeds.end(); ++i)
-  {
-    count++;
-    fprintf(fp, "%s -> ", i->first.toString().c_str());
-    for(SyncRes::DecayingEwmaCollection::collection_t::iterator j = i->second.d_collection.begin(); j!= i->second.d_collection.end(); ++j)
-    {
-      // typedef vector<pair<ComboAddress, DecayingEwma> > collection_t;
-      fprintf(fp, "%s/%f ", j->first.toString().c_str(), j->second.peek());
+  for(auto& shard : d_shards) {
+    auto lock=lockShard(shard);
+    for(const auto& i : shard.d_cache) {
+      if(i.d_ttd <= now || i.d_records.empty())
+        continue;
+      sw.put8((uint8_t)SnapshotKind::Record);
+      sw.putName(i.d_qname);
+      sw.put16(i.d_qtype);
+      sw.put8(i.d_auth);
+      sw.put32(i.d_ttd);
+      sw.put16(i.d_records.size());
+      for(const auto& j : i.d_records)
+        sw.putString(j->serialize(i.d_qname));
+      sw.put16(i.d_signatures.size());
+      for(const auto& j : i.d_signatures)
+        sw.putString(j->serialize(i.d_qname));
+      count++;
     }
-    fprintf(fp, "\n");
   }
-  fclose(fp);
   return count;
 }
 
@@ -292,18 +377,21 @@ uint64_t MemRecursorCache::doDump(int fd)
   }
   fprintf(fp, "; main record cache dump from thread follows\n;\n");
 
-  auto& sidx=d_cache.get<0>();
-
   uint64_t count=0;
   time_t now=time(0);
-  for(auto i=sidx.cbegin(); i != sidx.cend(); ++i) {
-    for(auto j=i->d_records.cbegin(); j != i->d_records.cend(); ++j) {
-      count++;
-      try {
-        fprintf(fp, "%s %d IN %s %s\n", i->d_qname.toString().c_str(), (int32_t)(i->d_ttd - now), DNSRecordContent::NumberToType(i->d_qtype).c_str(), (*j)->getZoneRepresentation().c_str());
-      }
-      catch(...) {
-        fprintf(fp, "; error printing '%s'\n", i->d_qname.toString().c_str());
+  for(auto& shard : d_shards) {
+    auto lock=lockShard(shard);
+    auto& sidx=shard.d_cache.get<0>();
+
+    for(auto i=sidx.cbegin(); i != sidx.cend(); ++i) {
+      for(auto j=i->d_records.cbegin(); j != i->d_records.cend(); ++j) {
+        count++;
+        try {
+          fprintf(fp, "%s %d IN %s %s\n", i->d_qname.toString().c_str(), (int32_t)(i->d_ttd - now), DNSRecordContent::NumberToType(i->d_qtype).c_str(), (*j)->getZoneRepresentation().c_str());
+        }
+        catch(...) {
+          fprintf(fp, "; error printing '%s'\n", i->d_qname.toString().c_str());
+        }
       }
     }
   }
@@ -311,10 +399,12 @@ uint64_t MemRecursorCache::doDump(int fd)
   return count;
 }
 
-void MemRecursorCache::doPrune(void)
+void MemRecursorCache::doPrune(unsigned int maxCached)
 {
-  d_cachecachevalid=false;
-
-  unsigned int maxCached=::arg().asNum("max-cache-entries") / g_numThreads;
-  pruneCollection(d_cache, maxCached);
+  unsigned int perShard=maxCached / d_shards.size();
+  for(auto& shard : d_shards) {
+    auto lock=lockShard(shard);
+    shard.d_cachecachevalid=false;
+    pruneCollection(shard.d_cache, perShard);
+  }
 }
@@ -2,6 +2,8 @@
 #define RECURSOR_CACHE_HH
 #include <string>
 #include <set>
+#include <atomic>
+#include <mutex>
 #include "dns.hh"
 #include "qtype.hh"
 #include "misc.hh"
@@ -23,33 +25,74 @@
 #include "namespaces.hh"
 using namespace ::boost::multi_index;
 
+class SnapshotWriter;
+
+/* Marks a cache entry as being refreshed by a prefetch. The mark lapses by itself, so a prefetch
+   that fails, or that was never started because there were too many mthreads, does not keep the
+   entry from being prefetched again. */
+class PrefetchClaim
+{
+public:
+  //! how long a prefetch may take before somebody else can try again
+  static const uint32_t s_maxSeconds=10;
+
+  bool claim(time_t now)
+  {
+    if(d_until > now)
+      return false;
+    d_until=now + s_maxSeconds;
+    return true;
+  }
+  void clear()
+  {
+    d_until=0;
+  }
+private:
+  uint32_t d_until{0};
+};
+
+/* The record cache is split in shards, each with its own lock, and a name always lives in the
+   same shard so all its types can be found at once. Each thread normally has a cache of its own
+   with a single shard, but with record-cache-shards set all threads share one (g_sharedRC), and
+   then the number of lock acquisitions that had to wait is counted per shard to see how well it scales.
+   A cache that is not shared never takes a lock. */
 class MemRecursorCache : public boost::noncopyable //  : public RecursorCache
 {
 public:
-  MemRecursorCache() : d_cachecachevalid(false)
+  MemRecursorCache(size_t shards=1, bool shared=false) : d_shards(shards ? shards : 1), d_shared(shared)
   {
-    cacheHits = cacheMisses = 0;
   }
+  //! what get() tells about the entry it found, to decide whether it is worth prefetching
+  struct EntryState
+  {
+    uint32_t hits{0};        //!< number of times the entry was returned since it was stored
+    uint32_t origTTL{0};     //!< the TTL it was stored with
+    bool prefetched{false};  //!< stored by a prefetch, before it expired
+  };
+
   unsigned int size();
   unsigned int bytes();
-  int get(time_t, const DNSName &qname, const QType& qt, vector<DNSRecord>* res, vector<std::shared_ptr<RRSIGRecordContent>>* signatures=0);
+  int get(time_t, const DNSName &qname, const QType& qt, vector<DNSRecord>* res, vector<std::shared_ptr<RRSIGRecordContent>>* signatures=0, EntryState* state=0);
 
-  void replace(time_t, const DNSName &qname, const QType& qt,  const vector<DNSRecord>& content, const vector<shared_ptr<RRSIGRecordContent>>& signatures, bool auth);
-  void doPrune(void);
+  void replace(time_t, const DNSName &qname, const QType& qt,  const vector<DNSRecord>& content, const vector<shared_ptr<RRSIGRecordContent>>& signatures, bool auth, bool prefetched=false);
+  bool claimPrefetch(time_t now, const DNSName &qname, const QType& qt);
+  void doPrune(unsigned int maxCached);
   void doSlash(int perc);
   uint64_t doDump(int fd);
-  uint64_t doDumpNSSpeeds(int fd);
+  uint64_t doDumpSnapshot(SnapshotWriter& sw, time_t now);
 
   int doWipeCache(const DNSName& name, bool sub, uint16_t qtype=0xffff);
   bool doAgeCache(time_t now, const DNSName& name, uint16_t qtype, int32_t newTTL);
-  uint64_t cacheHits, cacheMisses;
+  uint64_t getLockAcquisitions();
+  uint64_t getLockContentions();
+  std::atomic<uint64_t> cacheHits{0}, cacheMisses{0};
 
 private:
 
   struct CacheEntry
   {
     CacheEntry(const boost::tuple<DNSName, uint16_t>& key, const vector<shared_ptr<DNSRecordContent>>& records, bool auth) : 
-      d_qname(key.get<0>()), d_qtype(key.get<1>()), d_auth(auth), d_records(records), d_ttd(0)
+      d_qname(key.get<0>()), d_qtype(key.get<1>()), d_auth(auth), d_records(records), d_ttd(0), d_origTTL(0), d_hits(0), d_prefetched(false)
     {}
 
     typedef vector<std::shared_ptr<DNSRecordContent>> records_t;
@@ -64,6 +107,10 @@ private:
     bool d_auth;
     records_t d_records;
     uint32_t d_ttd;
+    uint32_t d_origTTL;
+    mutable uint32_t d_hits;        // these only drive prefetching, so lookups may update them in place
+    bool d_prefetched;
+    mutable PrefetchClaim d_prefetch;
   };
 
   typedef multi_index_container<
@@ -81,10 +128,25 @@ private:
                >
   > cache_t;
 
-  cache_t d_cache;
-  pair<cache_t::iterator, cache_t::iterator> d_cachecache;
-  DNSName d_cachedqname;
-  bool d_cachecachevalid;
-  bool attemptToRefreshNSTTL(const QType& qt, const vector<DNSRecord>& content, const CacheEntry& stored);
+  struct Shard
+  {
+    std::mutex d_mutex;
+    cache_t d_cache;
+    pair<cache_t::iterator, cache_t::iterator> d_cachecache;
+    DNSName d_cachedqname;
+    bool d_cachecachevalid{false};
+    uint64_t d_acquired{0};
+    uint64_t d_contended{0};
+  };
+
+  vector<Shard> d_shards;
+  bool d_shared;
+
+  Shard& getShard(const DNSName& qname)
+  {
+    return d_shards[qname.hash() % d_shards.size()];
+  }
+  std::unique_lock<std::mutex> lockShard(Shard& shard);
+  static bool attemptToRefreshNSTTL(const QType& qt, const vector<DNSRecord>& content, const CacheEntry& stored);
 };
 #endif
@@ -30,7 +30,6 @@
 #include "dnsrecords.hh"
 #include <boost/foreach.hpp>
 #include <thread>
-#include "ixfr.hh"
 #include "rpzloader.hh"
 
 extern int g_argc;
@@ -255,7 +254,7 @@ string reloadAuthAndForwards()
   
     for(SyncRes::domainmap_t::const_iterator i = t_sstorage->domainmap->begin(); i != t_sstorage->domainmap->end(); ++i) {
       for(SyncRes::AuthDomain::records_t::const_iterator j = i->second.d_records.begin(); j != i->second.d_records.end(); ++j) 
-        broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeCache, j->d_name, false));
+        doWipeRecordCache(j->d_name);
     }
 
     string configname=::arg()["config-dir"]+"/recursor.conf";
@@ -295,7 +294,7 @@ string reloadAuthAndForwards()
     
     // purge again - new zones need to blank out the cache
     for(SyncRes::domainmap_t::const_iterator i = newDomainMap->begin(); i != newDomainMap->end(); ++i) {
-        broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeCache, i->first, true));
+        doWipeRecordCache(i->first, true);
         broadcastAccFunction<uint64_t>(boost::bind(pleaseWipePacketCache, i->first, true));
         broadcastAccFunction<uint64_t>(boost::bind(pleaseWipeAndCountNegCache, i->first, true));
     }
@@ -316,82 +315,42 @@ string reloadAuthAndForwards()
   return "reloading failed, see log\n";
 }
 
-void ixfrTracker(const ComboAddress& master, const DNSName& zone, shared_ptr<SOARecordContent> oursr) 
-{
-  for(;;) {
-    DNSRecord dr;
-    dr.d_content=oursr;
-
-    sleep(oursr->d_st.refresh);
-    
-
-    L<<Logger::Info<<"Getting IXFR deltas for "<<zone<<" from "<<master.toStringWithPort()<<", our serial: "<<std::dynamic_pointer_cast<SOARecordContent>(dr.d_content)->d_st.serial<<endl;
-
-    auto deltas = getIXFRDeltas(master, zone, dr);
-    if(deltas.empty())
-      continue;
-    L<<Logger::Info<<"Processing "<<deltas.size()<<" deltas for RPZ "<<zone<<endl;
-
-    int totremove=0, totadd=0;
-    for(const auto& delta : deltas) {
-      const auto& remove = delta.first;
-      const auto& add = delta.second;
-      
-      for(const auto& rr : remove) { // should always contain the SOA
-	totremove++;
-	if(rr.d_type == QType::SOA) {
-	  auto oldsr = std::dynamic_pointer_cast<SOARecordContent>(rr.d_content);
-	  if(oldsr->d_st.serial == oursr->d_st.serial) {
-	    //	    cout<<"Got good removal of SOA serial "<<oldsr->d_st.serial<<endl;
-	  }
-	  else
-	    cerr<<"GOT WRONG SOA SERIAL REMOVAL, SHOULD TRIGGER WHOLE RELOAD"<<endl;
-	}
-	else {
-	  L<<Logger::Info<<"Had removal of "<<rr.d_name<<endl;
-	  RPZRecordToPolicy(rr, g_dfe, false, 0);
-	}
-      }
-
-      for(const auto& rr : add) { // should always contain the new SOA
-	totadd++;
-	if(rr.d_type == QType::SOA) {
-	  auto newsr = std::dynamic_pointer_cast<SOARecordContent>(rr.d_content);
-	  //	  L<<Logger::Info<<"New SOA serial for "<<zone<<": "<<newsr->d_st.serial<<endl;
-	  oursr = newsr;
-	}
-	else {
-	  L<<Logger::Info<<"Had addition of "<<rr.d_name<<endl;
-	  RPZRecordToPolicy(rr, g_dfe, true, 0);
-	}
-      }
-    }
-    L<<Logger::Info<<"Had "<<totremove<<" RPZ removals, "<<totadd<<" additions for "<<zone<<" New serial: "<<oursr->d_st.serial<<endl;
-  }
-}
-
-
 void loadRPZFiles()
 {
+  // everything is loaded into a copy first, so nobody sees a half loaded policy
+  DNSFilterEngine dfe;
   vector<string> fnames;
   stringtok(fnames, ::arg()["rpz-files"],",");
   int count=0;
   for(const auto& f : fnames) {
-    loadRPZFromFile(f, g_dfe, count++);
+    loadRPZFromFile(f, dfe, count++);
   }
 
   fnames.clear();
   stringtok(fnames, ::arg()["rpz-masters"],",");
 
+  struct RPZMaster
+  {
+    ComboAddress master;
+    DNSName zone;
+    int place;
+    shared_ptr<SOARecordContent> sr;
+  };
+  vector<RPZMaster> masters;
   for(const auto& f : fnames) {
     auto s = splitField(f, ':');
     ComboAddress master(s.first, 53);
     DNSName zone(s.second);
-    auto sr=loadRPZFromServer(master,zone, g_dfe, count++);
-    std::thread t(ixfrTracker, master, zone, sr);
-    t.detach();
+    int place=count++;
+    auto sr=loadRPZFromServer(master, zone, dfe, place);
+    masters.push_back({master, zone, place, sr});
   }
+  g_dfe.setState(dfe);
 
+  for(const auto& m : masters) {
+    std::thread t(RPZIXFRTracker, m.master, m.zone, m.place, m.sr);
+    t.detach();
+  }
 }
 
 SyncRes::domainmap_t* parseAuthAndForwards()
@@ -192,29 +192,32 @@ static int parseResult(MOADNSParser& mdp, const DNSName& origQname, uint16_t ori
       throw ResolverException(string("resolver: received an answer to another question (")+mdp.d_qname.toString()+"!="+ origQname.toString()+".)");
   }
     
-  vector<DNSResourceRecord> ret;
-  DNSResourceRecord rr;
-  for(MOADNSParser::answers_t::const_iterator i=mdp.d_answers.begin(); i!=mdp.d_answers.end(); ++i) {
-    rr.qname = i->first.d_name;
-    rr.qtype = i->first.d_type;
-    rr.ttl = i->first.d_ttl;
-    rr.content = i->first.d_content->getZoneRepresentation();
-    switch(rr.qtype.getCode()) {
-      case QType::SRV:
-      case QType::MX:
-        if (rr.content.size() >= 2 && *(rr.content.rbegin()+1) == ' ')
-          break;
-      case QType::CNAME:
-      case QType::NS:
-        if(!rr.content.empty())
-          boost::erase_tail(rr.content, 1);
-    }
-    result->push_back(rr);
-  }
+  for(MOADNSParser::answers_t::const_iterator i=mdp.d_answers.begin(); i!=mdp.d_answers.end(); ++i)
+    result->push_back(Resolver::toResourceRecord(i->first));
   
   return 0;
 }
 
+DNSResourceRecord Resolver::toResourceRecord(const DNSRecord& dr)
+{
+  DNSResourceRecord rr;
+  rr.qname = dr.d_name;
+  rr.qtype = dr.d_type;
+  rr.ttl = dr.d_ttl;
+  rr.content = dr.d_content->getZoneRepresentation();
+  switch(rr.qtype.getCode()) {
+    case QType::SRV:
+    case QType::MX:
+      if (rr.content.size() >= 2 && *(rr.content.rbegin()+1) == ' ')
+        break;
+    case QType::CNAME:
+    case QType::NS:
+      if(!rr.content.empty())
+        boost::erase_tail(rr.content, 1);
+  }
+  return rr;
+}
+
 bool Resolver::tryGetSOASerial(DNSName *domain, uint32_t *theirSerial, uint32_t *theirInception, uint32_t *theirExpire, uint16_t* id)
 {
   struct pollfd *fds = new struct pollfd[locals.size()];
@@ -364,8 +367,9 @@ AXFRRetriever::AXFRRetriever(const ComboAddress& remote,
         const DNSName& tsigkeyname,
         const DNSName& tsigalgorithm, 
         const string& tsigsecret,
-        const ComboAddress* laddr)
-: d_tsigkeyname(tsigkeyname), d_tsigsecret(tsigsecret), d_tsigPos(0), d_nonSignedMessages(0)
+        const ComboAddress* laddr,
+        SOARecordContent* ixfrFrom)
+: d_ixfr(ixfrFrom != NULL), d_tsigkeyname(tsigkeyname), d_tsigsecret(tsigsecret), d_tsigPos(0), d_nonSignedMessages(0), d_receivedBytes(0)
 {
   ComboAddress local;
   if (laddr != NULL) {
@@ -387,8 +391,13 @@ AXFRRetriever::AXFRRetriever(const ComboAddress& remote,
     d_soacount = 0;
   
     vector<uint8_t> packet;
-    DNSPacketWriter pw(packet, domain, QType::AXFR);
+    DNSPacketWriter pw(packet, domain, ixfrFrom ? QType::IXFR : QType::AXFR);
     pw.getHeader()->id = dns_random(0xffff);
+    if(ixfrFrom) {
+      pw.startRecord(domain, QType::SOA, 0, QClass::IN, DNSResourceRecord::AUTHORITY);
+      ixfrFrom->toPacket(pw);
+      pw.commit();
+    }
   
     if(!tsigkeyname.empty()) {
       if (tsigalgorithm == DNSName("hmac-md5"))
@@ -439,7 +448,7 @@ AXFRRetriever::~AXFRRetriever()
 
 int AXFRRetriever::getChunk(Resolver::res_t &res, vector<DNSRecord>* records) // Implementation is making sure RFC2845 4.4 is followed.
 {
-  if(d_soacount > 1)
+  if(d_soacount > 1 && !d_ixfr)
     return false;
 
   // d_sock is connected and is about to spit out a packet
@@ -556,6 +565,7 @@ void AXFRRetriever::timeoutReadn(uint16_t bytes)
     if(numread==0)
       throw ResolverException("Remote nameserver closed TCP connection");
     n+=numread;
+    d_receivedBytes+=numread;
   }
 }
 
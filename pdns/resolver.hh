@@ -75,6 +75,9 @@ public:
   
   //! convenience function that calls resolve above
   void getSoaSerial(const string &, const DNSName &, uint32_t *);
+
+  //! a record from an answer, as resolve() and AXFRRetriever::getChunk() return it
+  static DNSResourceRecord toResourceRecord(const DNSRecord& dr);
   
 private:
   std::map<std::string, int> locals;
@@ -88,9 +91,13 @@ class AXFRRetriever : public boost::noncopyable
         const DNSName& tsigkeyname=DNSName(),
         const DNSName& tsigalgorithm=DNSName(),
         const string& tsigsecret=string(),
-        const ComboAddress* laddr = NULL);
+        const ComboAddress* laddr = NULL,
+        SOARecordContent* ixfrFrom = NULL);
 	~AXFRRetriever();
     int getChunk(Resolver::res_t &res, vector<DNSRecord>* records=0);  
+    uint64_t getReceivedBytes() const { return d_receivedBytes; }
+    //! the master answered our IXFR with the whole zone, which ends at its second SOA like an AXFR
+    void setFullZone() { d_ixfr=false; }
   
   private:
     void connect();
@@ -101,6 +108,7 @@ class AXFRRetriever : public boost::noncopyable
     string d_domain;
     int d_sock;
     int d_soacount;
+    bool d_ixfr; // the caller decides when an IXFR response is complete
     ComboAddress d_remote;
     
     DNSName d_tsigkeyname;
@@ -109,6 +117,7 @@ class AXFRRetriever : public boost::noncopyable
     string d_signData;
     uint32_t d_tsigPos;
     uint d_nonSignedMessages; // RFC2845 4.4
+    uint64_t d_receivedBytes;
     TSIGRecordContent d_trc;
 };
 
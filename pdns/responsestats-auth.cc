@@ -8,7 +8,11 @@ extern StatBag S;
  *  when udpOrTCP is true, it is udp
  */
 void ResponseStats::submitResponse(DNSPacket &p, bool udpOrTCP) {
-  const string& buf=p.getString();
+  submitResponse(p.qdomain, p.qtype.getCode(), p.d_remote, p.getString(), p.isEmpty(), udpOrTCP);
+}
+
+void ResponseStats::submitResponse(const DNSName& qname, uint16_t qtype, const ComboAddress& remote, const string& buf, bool isEmpty, bool udpOrTCP) {
+  const struct dnsheader* dh = (const struct dnsheader*)buf.c_str();
   static AtomicCounter &udpnumanswered=*S.getPointer("udp-answers");
   static AtomicCounter &udpnumanswered4=*S.getPointer("udp4-answers");
   static AtomicCounter &udpnumanswered6=*S.getPointer("udp6-answers");
@@ -22,18 +26,18 @@ void ResponseStats::submitResponse(DNSPacket &p, bool udpOrTCP) {
   static AtomicCounter &tcpbytesanswered4=*S.getPointer("tcp4-answers-bytes");
   static AtomicCounter &tcpbytesanswered6=*S.getPointer("tcp6-answers-bytes");
 
-  if(p.d.aa) {
-    if (p.d.rcode==RCode::NXDomain)
-      S.ringAccount("nxdomain-queries",p.qdomain.toString()+"/"+p.qtype.getName());
-  } else if (p.isEmpty()) {
-    S.ringAccount("unauth-queries",p.qdomain.toString()+"/"+p.qtype.getName());
-    S.ringAccount("remotes-unauth",p.d_remote);
+  if(dh->aa) {
+    if (dh->rcode==RCode::NXDomain)
+      S.ringAccount("nxdomain-queries",qname.toString()+"/"+QType(qtype).getName());
+  } else if (isEmpty) {
+    S.ringAccount("unauth-queries",qname.toString()+"/"+QType(qtype).getName());
+    S.ringAccount("remotes-unauth",remote);
   }
 
   if (udpOrTCP) { // udp
     udpnumanswered++;
     udpbytesanswered+=buf.length();
-    if(p.d_remote.sin4.sin_family==AF_INET) {
+    if(remote.sin4.sin_family==AF_INET) {
       udpnumanswered4++;
       udpbytesanswered4+=buf.length();
     } else {
@@ -43,7 +47,7 @@ void ResponseStats::submitResponse(DNSPacket &p, bool udpOrTCP) {
   } else { //tcp
     tcpnumanswered++;
     tcpbytesanswered+=buf.length();
-    if(p.d_remote.sin4.sin_family==AF_INET) {
+    if(remote.sin4.sin_family==AF_INET) {
       tcpnumanswered4++;
       tcpbytesanswered4+=buf.length();
     } else {
@@ -52,5 +56,5 @@ void ResponseStats::submitResponse(DNSPacket &p, bool udpOrTCP) {
     }
   }
 
-  submitResponse(p.qtype.getCode(), buf.length(), udpOrTCP);
+  submitResponse(qtype, buf.length(), udpOrTCP);
 }
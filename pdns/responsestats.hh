@@ -8,6 +8,7 @@ public:
   ResponseStats();
 
   void submitResponse(DNSPacket &p, bool udpOrTCP);
+  void submitResponse(const DNSName& qname, uint16_t qtype, const ComboAddress& remote, const string& answer, bool isEmpty, bool udpOrTCP);
   void submitResponse(uint16_t qtype, uint16_t respsize, bool udpOrTCP);
   map<uint16_t, uint64_t> getQTypeResponseCounts();
   map<uint16_t, uint64_t> getSizeResponseCounts();
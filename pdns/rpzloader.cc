@@ -5,6 +5,9 @@
 #include "syncres.hh"
 #include "resolver.hh"
 #include "logger.hh"
+#include "ixfr.hh"
+#include <condition_variable>
+#include <mutex>
 
 static Netmask makeNetmaskFromRPZ(const DNSName& name)
 {
@@ -60,33 +63,33 @@ void RPZRecordToPolicy(const DNSRecord& dr, DNSFilterEngine& target, bool addOrR
   if(dr.d_name.isPartOf(rpzNSDname)) {
     DNSName filt=dr.d_name.makeRelative(rpzNSDname);
     if(addOrRemove)
-      g_dfe.addNSTrigger(filt, pol);
+      target.addNSTrigger(filt, pol, place);
     else
-      g_dfe.rmNSTrigger(filt, pol);
+      target.rmNSTrigger(filt, pol, place);
   } else 	if(dr.d_name.isPartOf(rpzClientIP)) {
 
     auto nm=makeNetmaskFromRPZ(dr.d_name);
 
     if(addOrRemove)
-      g_dfe.addClientTrigger(nm, pol);
+      target.addClientTrigger(nm, pol, place);
     else
-      g_dfe.rmClientTrigger(nm, pol);
+      target.rmClientTrigger(nm, pol, place);
     
   } else 	if(dr.d_name.isPartOf(rpzIP)) {
     // cerr<<"Should apply answer content IP policy: "<<dr.d_name<<endl;
     auto nm=makeNetmaskFromRPZ(dr.d_name);
     if(addOrRemove)
-      g_dfe.addResponseTrigger(nm, pol);
+      target.addResponseTrigger(nm, pol, place);
     else
-      g_dfe.rmResponseTrigger(nm, pol);
+      target.rmResponseTrigger(nm, pol, place);
   } else if(dr.d_name.isPartOf(rpzNSIP)) {
     cerr<<"Should apply to nameserver IP address policy HAVE NOTHING HERE"<<endl;
 
   } else {
     if(addOrRemove)
-      g_dfe.addQNameTrigger(dr.d_name, pol);
+      target.addQNameTrigger(dr.d_name, pol, place);
     else
-      g_dfe.rmQNameTrigger(dr.d_name, pol);
+      target.rmQNameTrigger(dr.d_name, pol, place);
   }
 }
 
@@ -119,6 +122,8 @@ shared_ptr<SOARecordContent> loadRPZFromServer(const ComboAddress& master, const
       last=time(0);
     }
   }
+  if(!sr)
+    throw PDNSException("No SOA record in RPZ zone '"+zone.toString()+"' from "+master.toStringWithPort());
   L<<Logger::Info<<"Done: "<<nrecords<<" policy records active, SOA: "<<sr->getZoneRepresentation()<<endl;
   return sr;
 }
@@ -153,3 +158,138 @@ int loadRPZFromFile(const std::string& fname, DNSFilterEngine& target, int place
   
   return place;
 }
+
+namespace {
+struct RPZTracker
+{
+  ComboAddress master;
+  std::mutex lock;
+  std::condition_variable cond;
+  bool notified{false};
+};
+}
+
+static std::mutex s_rpzTrackersLock;
+static std::map<DNSName, std::shared_ptr<RPZTracker>> s_rpzTrackers;
+
+bool notifyRPZTracker(const DNSName& zone, const ComboAddress& from)
+{
+  std::shared_ptr<RPZTracker> tracker;
+  {
+    std::lock_guard<std::mutex> l(s_rpzTrackersLock);
+    auto iter = s_rpzTrackers.find(zone);
+    if(iter == s_rpzTrackers.end() || !ComboAddress::addressOnlyEqual()(iter->second->master, from))
+      return false;
+    tracker = iter->second;
+  }
+  std::lock_guard<std::mutex> l(tracker->lock);
+  tracker->notified = true;
+  tracker->cond.notify_one();
+  return true;
+}
+
+// applies the deltas to zone 'place' of target, returns false if they do not start at our serial
+static bool applyRPZDeltas(const vector<pair<vector<DNSRecord>, vector<DNSRecord> > >& deltas, DNSFilterEngine& target, int place, shared_ptr<SOARecordContent>& oursr, unsigned int& totremove, unsigned int& totadd)
+{
+  for(const auto& delta : deltas) {
+    const auto& remove = delta.first;
+    const auto& add = delta.second;
+
+    for(const auto& rr : remove) { // should always contain the SOA
+      if(rr.d_type == QType::SOA) {
+        auto oldsr = std::dynamic_pointer_cast<SOARecordContent>(rr.d_content);
+        if(oldsr->d_st.serial != oursr->d_st.serial)
+          return false;
+      }
+      else {
+        totremove++;
+        RPZRecordToPolicy(rr, target, false, place);
+      }
+    }
+
+    for(const auto& rr : add) { // should always contain the new SOA
+      if(rr.d_type == QType::SOA) {
+        oursr = std::dynamic_pointer_cast<SOARecordContent>(rr.d_content);
+      }
+      else {
+        totadd++;
+        RPZRecordToPolicy(rr, target, true, place);
+      }
+    }
+  }
+  return true;
+}
+
+void RPZIXFRTracker(const ComboAddress& master, const DNSName& zone, int place, shared_ptr<SOARecordContent> oursr)
+{
+  auto tracker = std::make_shared<RPZTracker>();
+  tracker->master = master;
+  {
+    std::lock_guard<std::mutex> l(s_rpzTrackersLock);
+    s_rpzTrackers[zone] = tracker;
+  }
+
+  // the updates are applied to our own copy of the zone, which is then swapped into g_dfe
+  DNSFilterEngine ours;
+  ours.setZone(place, g_dfe.getCopy());
+
+  for(;;) {
+    {
+      std::unique_lock<std::mutex> l(tracker->lock);
+      tracker->cond.wait_for(l, std::chrono::seconds(std::max(oursr->d_st.refresh, (uint32_t)1)), [&tracker]() { return tracker->notified; });
+      tracker->notified = false;
+    }
+
+    DNSRecord dr;
+    dr.d_content=oursr;
+    L<<Logger::Info<<"Getting IXFR deltas for "<<zone<<" from "<<master.toStringWithPort()<<", our serial: "<<oursr->d_st.serial<<endl;
+
+    bool reload = false;
+    try {
+      auto deltas = getIXFRDeltas(master, zone, dr);
+      if(deltas.empty())
+        continue;
+      L<<Logger::Info<<"Processing "<<deltas.size()<<" deltas for RPZ "<<zone<<endl;
+
+      auto newsr = oursr;
+      unsigned int totremove=0, totadd=0;
+      if(applyRPZDeltas(deltas, ours, place, newsr, totremove, totadd)) {
+        oursr = newsr;
+        L<<Logger::Info<<"Had "<<totremove<<" RPZ removals, "<<totadd<<" additions for "<<zone<<" New serial: "<<oursr->d_st.serial<<endl;
+      }
+      else {
+        L<<Logger::Error<<"IXFR deltas for RPZ "<<zone<<" do not start at our serial "<<oursr->d_st.serial<<", reloading the zone"<<endl;
+        reload = true;
+      }
+    }
+    catch(std::exception& e) {
+      L<<Logger::Error<<"Unable to get IXFR deltas for RPZ "<<zone<<" from "<<master.toStringWithPort()<<", reloading the zone: "<<e.what()<<endl;
+      reload = true;
+    }
+    catch(PDNSException& pe) {
+      L<<Logger::Error<<"Unable to get IXFR deltas for RPZ "<<zone<<" from "<<master.toStringWithPort()<<", reloading the zone: "<<pe.reason<<endl;
+      reload = true;
+    }
+
+    if(reload) {
+      // a half applied set of deltas is thrown away along with the rest of our copy
+      try {
+        DNSFilterEngine fresh;
+        oursr = loadRPZFromServer(master, zone, fresh, place);
+        ours.setZone(place, fresh);
+      }
+      catch(std::exception& e) {
+        L<<Logger::Error<<"Unable to reload RPZ "<<zone<<" from "<<master.toStringWithPort()<<", keeping serial "<<oursr->d_st.serial<<": "<<e.what()<<endl;
+        ours.setZone(place, g_dfe.getCopy());
+        continue;
+      }
+      catch(PDNSException& pe) {
+        L<<Logger::Error<<"Unable to reload RPZ "<<zone<<" from "<<master.toStringWithPort()<<", keeping serial "<<oursr->d_st.serial<<": "<<pe.reason<<endl;
+        ours.setZone(place, g_dfe.getCopy());
+        continue;
+      }
+    }
+
+    g_dfe.modify([&ours, place](DNSFilterEngine& dfe) { dfe.setZone(place, ours); });
+  }
+}
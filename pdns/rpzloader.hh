@@ -6,3 +6,7 @@
 int loadRPZFromFile(const std::string& fname, DNSFilterEngine& target, int place);
 std::shared_ptr<SOARecordContent> loadRPZFromServer(const ComboAddress& master, const DNSName& zone, DNSFilterEngine& target, int place);
 void RPZRecordToPolicy(const DNSRecord& dr, DNSFilterEngine& target, bool addOrRemove, int place);
+//! keeps zone 'place' of g_dfe up to date with IXFR from master, never returns
+void RPZIXFRTracker(const ComboAddress& master, const DNSName& zone, int place, std::shared_ptr<SOARecordContent> oursr);
+//! makes the tracker of zone check for updates now, returns false if zone is not an RPZ from 'from'
+bool notifyRPZTracker(const DNSName& zone, const ComboAddress& from);
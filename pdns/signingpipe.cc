@@ -3,109 +3,198 @@
 #endif
 #include "signingpipe.hh"
 #include "misc.hh"
-#include <poll.h>
 #include <boost/foreach.hpp>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netinet/tcp.h>
-#include <sched.h>
+#include <thread>
 
-// deal with partial reads
-namespace {
-int readn(int fd, void* buffer, unsigned int len)
+SigningPool& SigningPool::instance()
+{
+  static SigningPool* pool = new SigningPool(); // never destroyed, the threads live on until we exit
+  return *pool;
+}
+
+void SigningPool::start(unsigned int workers)
+{
+  std::call_once(d_started, [this, workers]() {
+    d_numworkers = std::max(workers, 1U);
+    for(unsigned int n=0; n < d_numworkers; ++n)
+      std::thread(&SigningPool::worker, this).detach();
+  });
+}
+
+void SigningPool::submit(const shared_ptr<Client>& client, unsigned int id, const set<DNSName>& authSet, chunk_t& chunk, bool live)
+{
+  start(1);
+  {
+    std::lock_guard<std::mutex> l(client->d_lock);
+    client->d_outstanding++;
+  }
+
+  Batch batch;
+  batch.client=client;
+  batch.authSet=authSet;
+  batch.chunk.swap(chunk);
+  batch.id=id;
+
+  std::lock_guard<std::mutex> l(d_lock);
+  d_queuedRecords+=batch.chunk.size();
+  (live ? d_live : d_queue).push_back(std::move(batch));
+  d_cond.notify_one();
+}
+
+uint64_t SigningPool::getQueued()
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  return d_queuedRecords;
+}
+
+void SigningPool::worker()
 {
-  unsigned int pos=0;
-  int res;
+  // made on first use, and again after a failure, so a broken backend connection does not stick
+  std::unique_ptr<DNSSECKeeper> dk;
+  std::unique_ptr<UeberBackend> db;
+
   for(;;) {
-    res = read(fd, (char*)buffer + pos, len - pos);
-    if(res == 0) {
-      if(pos)
-        throw runtime_error("Signing Pipe remote shut down in the middle of a message");
-      else {
-        //cerr<<"Got decent EOF on "<<fd<<endl;
-        return 0;
-      }
+    Batch batch;
+    {
+      std::unique_lock<std::mutex> l(d_lock);
+      while(d_live.empty() && d_queue.empty())
+        d_cond.wait(l);
+      std::deque<Batch>& queue = d_live.empty() ? d_queue : d_live;
+      batch=std::move(queue.front());
+      queue.pop_front();
+      d_queuedRecords-=batch.chunk.size();
     }
-      
-    if(res < 0) {
-      if(errno == EAGAIN || errno == EINTR) {
-        if(pos==0)
-          return -1;
-        waitForData(fd, -1); 
-        continue;
+
+    string error;
+    try {
+      if(!db) {
+        db.reset(new UeberBackend("key-only"));
+        dk.reset(new DNSSECKeeper());
       }
-      unixDie("Reading from socket in Signing Pipe loop");
+      addRRSigs(*dk, *db, batch.authSet, batch.chunk);
     }
-  
-    pos+=res;
-    if(pos == len)
-      break;
+    catch(PDNSException& pe) {
+      error=pe.reason;
+    }
+    catch(std::exception& e) {
+      error=e.what();
+    }
+    if(!error.empty()) {
+      L<<Logger::Error<<"Signing thread failed to sign "<<batch.chunk.size()<<" records: "<<error<<endl;
+      dk.reset();
+      db.reset();
+    }
+    ++d_signedBatches;
+    batch.client->done(batch.id, batch.chunk, error);
   }
-  return len;
+}
+
+namespace {
+bool placeTypeLessThan(const DNSResourceRecord& a, const DNSResourceRecord& b)
+{
+  return tie(a.d_place, a.qtype) < tie(b.d_place, b.qtype);
 }
 }
 
+void SigningPool::sign(DNSSECKeeper& dk, UeberBackend& db, const set<DNSName>& authSet, chunk_t& rrs)
+{
+  if(d_numworkers < 2) {
+    addRRSigs(dk, db, authSet, rrs);
+    return;
+  }
+
+  // split into RRsets the same way addRRSigs does
+  vector<chunk_t> rrsets;
+  vector<bool> signable;
+  unsigned int toSign=0;
+  stable_sort(rrs.begin(), rrs.end(), placeTypeLessThan);
+  for(const auto& rr : rrs) {
+    if(rrsets.empty() || rrsets.back().front().qtype.getCode() != rr.qtype.getCode() || rrsets.back().front().qname != rr.qname) {
+      rrsets.push_back(chunk_t());
+      signable.push_back(false);
+    }
+    if(!signable.back() && (rr.auth || rr.qtype.getCode() == QType::DS)) {
+      signable.back()=true;
+      toSign++;
+    }
+    rrsets.back().push_back(rr);
+  }
+
+  // presigned signatures come from the records, which only the backend of the caller can give us
+  bool here = toSign < 2;
+  for(auto zone = authSet.begin(); !here && zone != authSet.end(); ++zone)
+    here = dk.isPresigned(*zone);
+
+  if(here) {
+    addRRSigs(dk, db, authSet, rrs);
+    return;
+  }
+
+  auto client=std::make_shared<Client>();
+  for(unsigned int n=0; n < rrsets.size(); ++n)
+    if(signable[n])
+      submit(client, n, authSet, rrsets[n], true);
 
-// used to pass information to the new thread
-struct StartHelperStruct
+  unsigned int id;
+  chunk_t chunk;
+  while(client->getSigned(id, chunk, true))
+    rrsets[id].swap(chunk);
+
+  rrs.clear();
+  for(const auto& rrset : rrsets)
+    rrs.insert(rrs.end(), rrset.begin(), rrset.end());
+}
+
+void SigningPool::Client::done(unsigned int id, chunk_t& chunk, const string& error)
 {
-  StartHelperStruct(ChunkedSigningPipe* csp, int id, int fd) : d_csp(csp), d_id(id), d_fd(fd){}
-  ChunkedSigningPipe* d_csp;
-  int d_id;
-  int d_fd;
-};
-
-// used to launch the new thread
-void* ChunkedSigningPipe::helperWorker(void* p)
-try
+  std::lock_guard<std::mutex> l(d_lock);
+  d_outstanding--;
+  if(!error.empty())
+    d_error=error;
+  d_signed.push_back(make_pair(id, chunk_t()));
+  d_signed.back().second.swap(chunk);
+  d_cond.notify_all();
+}
+
+bool SigningPool::Client::getSigned(unsigned int& id, chunk_t& chunk, bool wait)
 {
-  StartHelperStruct shs=*(StartHelperStruct*)p;
-  delete (StartHelperStruct*)p;
-  
-  shs.d_csp->worker(shs.d_id, shs.d_fd);
-  return 0;
+  std::unique_lock<std::mutex> l(d_lock);
+  while(wait && d_signed.empty() && d_outstanding)
+    d_cond.wait(l);
+  if(!d_error.empty())
+    throw runtime_error("Unable to sign: "+d_error);
+  if(d_signed.empty())
+    return false;
+  id=d_signed.front().first;
+  chunk.swap(d_signed.front().second);
+  d_signed.pop_front();
+  return true;
 }
-catch(...) {
-  L<<Logger::Error<<"Unknown exception in signing thread occurred"<<endl;
-  return 0;
+
+unsigned int SigningPool::Client::getOutstanding()
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  return d_outstanding;
 }
 
 ChunkedSigningPipe::ChunkedSigningPipe(const DNSName& signerName, bool mustSign, const string& servers, unsigned int workers)
-  : d_queued(0), d_outstanding(0), d_numworkers(workers), d_submitted(0), d_signer(signerName),
-    d_maxchunkrecords(100), d_tids(d_numworkers), d_mustSign(mustSign), d_final(false)
+  : d_queued(0), d_outstanding(0), d_numworkers(std::max(workers, 1U)), d_submitted(0), d_signer(signerName),
+    d_maxchunkrecords(100), d_mustSign(mustSign), d_final(false)
 {
   d_rrsetToSign = new rrset_t;
   d_chunks.push_back(vector<DNSResourceRecord>()); // load an empty chunk
   
   if(!d_mustSign)
     return;
-  
-  int fds[2];
-  
-  for(unsigned int n=0; n < d_numworkers; ++n) {
-    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) 
-      throw runtime_error("Unable to create communication socket in for ChunkedSigningPipe");
-    setCloseOnExec(fds[0]);
-    setCloseOnExec(fds[1]);
-    pthread_create(&d_tids[n], 0, helperWorker, (void*) new StartHelperStruct(this, n, fds[1]));
-    setNonBlocking(fds[0]);
-    d_sockets.push_back(fds[0]);
-  }
+
+  SigningPool::instance().start(d_numworkers);
+  d_client = std::make_shared<SigningPool::Client>();
 }
 
 ChunkedSigningPipe::~ChunkedSigningPipe()
 {
+  // batches still in the pool hold on to d_client, and are thrown away once signed
   delete d_rrsetToSign;
-  if(!d_mustSign)
-    return;
-  BOOST_FOREACH(int fd, d_sockets) {
-    close(fd); // this will trigger all threads to exit
-  }
-    
-  void* res;
-  BOOST_FOREACH(pthread_t& tid, d_tids) {
-    pthread_join(tid, &res);
-  }
   //cout<<"Did: "<<d_signed<<", records (!= chunks) submitted: "<<d_submitted<<endl;
 }
 
@@ -142,36 +231,6 @@ bool ChunkedSigningPipe::submit(const DNSResourceRecord& rr)
   return !d_chunks.empty() && d_chunks.front().size() >= d_maxchunkrecords; // "you can send more"
 }
 
-pair<vector<int>, vector<int> > ChunkedSigningPipe::waitForRW(bool rd, bool wr, int seconds)
-{
-  vector<pollfd> pfds;
-  
-  for(unsigned int n = 0; n < d_sockets.size(); ++n) {    
-    if(d_eof.count(d_sockets[n]))  
-      continue;
-    struct pollfd pfd;
-    memset(&pfd, 0, sizeof(pfd));
-    pfd.fd = d_sockets[n];
-    if(rd)
-      pfd.events |= POLLIN;
-    if(wr)
-      pfd.events |= POLLOUT;
-    pfds.push_back(pfd);
-  }
-  
-  int res = poll(&pfds[0], pfds.size(), (seconds < 0) ? -1 : (seconds * 1000)); // -1 = infinite
-  if(res < 0)
-    unixDie("polling for activity from signers, "+lexical_cast<string>(d_sockets.size()));
-  pair<vector<int>, vector<int> > vects;
-  for(unsigned int n = 0; n < pfds.size(); ++n) 
-    if(pfds[n].revents & POLLIN)
-      vects.first.push_back(pfds[n].fd);
-    else if(pfds[n].revents & POLLOUT)
-      vects.second.push_back(pfds[n].fd);
-  
-  return vects;
-}
-
 void ChunkedSigningPipe::addSignedToChunks(chunk_t* signedChunk)
 {
   chunk_t::const_iterator from = signedChunk->begin();
@@ -198,71 +257,42 @@ void ChunkedSigningPipe::sendRRSetToWorker() // it sounds so socialist!
     d_rrsetToSign->clear();
     return;
   }
-  
-  if(d_final && !d_outstanding) // nothing to do!
-    return;
-  
-  bool wantRead, wantWrite;
-  
-  wantWrite = !d_rrsetToSign->empty();
-  wantRead = d_outstanding || wantWrite;  // if we wrote, we want to read
-  
-  pair<vector<int>, vector<int> > rwVect;
-  
-  rwVect = waitForRW(wantRead, wantWrite, -1); // wait for something to happen  
-  
-  if(wantWrite && !rwVect.second.empty()) {
-    random_shuffle(rwVect.second.begin(), rwVect.second.end()); // pick random available worker
-    writen2(*rwVect.second.begin(), &d_rrsetToSign, sizeof(d_rrsetToSign));
-    d_rrsetToSign = new rrset_t;
-    d_outstanding++;
-    d_queued++;
-    wantWrite=false;
-  } 
-  
-  if(wantRead) {
-    while(d_outstanding) {
-      chunk_t* chunk;
-      
-      BOOST_FOREACH(int fd, rwVect.first) {
-        if(d_eof.count(fd))
-          continue;
-        
-        while(d_outstanding) {
-          int res = readn(fd, &chunk, sizeof(chunk));
-          if(!res) {
-            d_eof.insert(fd);
-            break;
-          }
-          if(res < 0) {
-            if(errno != EAGAIN && errno != EINTR)
-              unixDie("Error reading signed chunk from thread");
-            else
-              break;
-          }
-          
-          --d_outstanding;
-          
-          addSignedToChunks(chunk);
-          
-          delete chunk;
-        }
-      }
-      if(!d_outstanding || !d_final)
-        break;
-      rwVect = waitForRW(1, 0, -1); // wait for something to happen  
-    }
-  }
-  
-  if(wantWrite) {  // our optimization above failed, we now wait synchronously
-    rwVect = waitForRW(0, wantWrite, -1); // wait for something to happen  
-    random_shuffle(rwVect.second.begin(), rwVect.second.end()); // pick random available worker
-    writen2(*rwVect.second.begin(), &d_rrsetToSign, sizeof(d_rrsetToSign));
-    d_rrsetToSign = new rrset_t;
-    d_outstanding++;
-    d_queued++;
+
+  // RRsets go to the pool in batches, one RRset per batch costs more in handing over than in signing
+  d_batch.insert(d_batch.end(), d_rrsetToSign->begin(), d_rrsetToSign->end());
+  d_rrsetToSign->clear();
+  if(d_batch.size() >= d_maxchunkrecords || (d_final && !d_batch.empty()))
+    sendBatch();
+
+  collectSigned(d_final ? 0 : d_outstanding);
+}
+
+void ChunkedSigningPipe::sendBatch()
+{
+  // keep all threads busy, without moving the whole zone into the pool
+  collectSigned(2 * d_numworkers - 1);
+
+  set<DNSName> authSet;
+  authSet.insert(d_signer);
+  SigningPool::instance().submit(d_client, 0, authSet, d_batch);
+  d_batch.clear();
+  d_outstanding++;
+  d_queued++;
+}
+
+void ChunkedSigningPipe::collectSigned(unsigned int maxOutstanding)
+{
+  // takes what is signed already, and waits for more while over maxOutstanding
+  unsigned int id;
+  chunk_t chunk;
+  while(d_outstanding && d_client->getSigned(id, chunk, (unsigned int)d_outstanding > maxOutstanding)) {
+    --d_outstanding;
+    for(const auto& rr : chunk)
+      if(rr.qtype.getCode() == QType::RRSIG)
+        ++d_signed;
+    addSignedToChunks(&chunk);
+    chunk.clear();
   }
-  
 }
 
 unsigned int ChunkedSigningPipe::getReady()
@@ -273,39 +303,6 @@ unsigned int ChunkedSigningPipe::getReady()
    }
    return sum;
 }
-void ChunkedSigningPipe::worker(int id, int fd)
-try
-{
-  DNSSECKeeper dk;
-  UeberBackend db("key-only");
-  
-  chunk_t* chunk;
-  int res;
-  for(;;) {
-    res = readn(fd, &chunk, sizeof(chunk));
-    if(!res)
-      break;
-    if(res < 0)
-      unixDie("reading object pointer to sign from pdns");
-    set<DNSName> authSet;
-    authSet.insert(d_signer);
-    addRRSigs(dk, db, authSet, *chunk);
-    ++d_signed;
-    
-    writen2(fd, &chunk, sizeof(chunk));
-  }
-  close(fd);
-}
-catch(PDNSException& pe)
-{
-  L<<Logger::Error<<"Signing thread died because of PDNSException: "<<pe.reason<<endl;
-  close(fd);
-}
-catch(std::exception& e)
-{
-  L<<Logger::Error<<"Signing thread died because of std::exception: "<<e.what()<<endl;
-  close(fd);
-}
 
 void ChunkedSigningPipe::flushToSign()
 {
@@ -319,11 +316,6 @@ vector<DNSResourceRecord> ChunkedSigningPipe::getChunk(bool final)
     // this means we should keep on reading until d_outstanding == 0
     d_final = true;
     flushToSign();
-    
-    BOOST_FOREACH(int fd, d_sockets) {
-      shutdown(fd, SHUT_WR); // perhaps this transmits EOF the other side
-      //cerr<<"shutdown of "<<fd<<endl;
-    }
   }
   if(d_final)
     flushToSign(); // should help us wait
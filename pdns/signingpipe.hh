@@ -1,7 +1,10 @@
 #ifndef PDNS_SIGNINGPIPE
 #define PDNS_SIGNINGPIPE
 #include <vector>
-#include <pthread.h>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <stdio.h>
 #include "dnsseckeeper.hh"
 #include "dns.hh"
@@ -9,6 +12,73 @@
 void writeLStringToSocket(int fd, const string& msg);
 bool readLStringFromSocket(int fd, string& msg);
 
+/** A process-wide pool of signing threads, started once and shared by all outgoing AXFRs and by live
+ *  answers. Each thread keeps its own DNSSECKeeper and key backend for as long as the process runs.
+ *  Work comes in batches of many RRsets, live answers are taken before AXFR batches.
+ */
+class SigningPool
+{
+public:
+  typedef vector<DNSResourceRecord> chunk_t;
+
+  //! The batches of one user of the pool, they come back signed in no particular order
+  class Client
+  {
+  public:
+    //! a signed batch and the id it was submitted with, returns false if none is ready. With wait, waits while any are outstanding
+    bool getSigned(unsigned int& id, chunk_t& chunk, bool wait);
+    unsigned int getOutstanding();
+  private:
+    friend class SigningPool;
+    void done(unsigned int id, chunk_t& chunk, const string& error);
+
+    std::mutex d_lock;
+    std::condition_variable d_cond;
+    std::deque<pair<unsigned int, chunk_t> > d_signed;
+    string d_error;
+    unsigned int d_outstanding{0};
+  };
+
+  static SigningPool& instance();
+  //! launches the threads, only the first call does anything
+  void start(unsigned int workers);
+  unsigned int getWorkers() const
+  {
+    return d_numworkers;
+  }
+
+  //! hands records to the pool, to be signed like addRRSigs does, batches marked live go first
+  void submit(const shared_ptr<Client>& client, unsigned int id, const set<DNSName>& authSet, chunk_t& chunk, bool live=false);
+  //! signs like addRRSigs, spreading answers with several RRsets to sign over the pool, the rest is done right here. Only used with signing-live-answers
+  void sign(DNSSECKeeper& dk, UeberBackend& db, const set<DNSName>& authSet, chunk_t& rrs);
+
+  uint64_t getQueued(); //!< records waiting for a signing thread
+  uint64_t getBatches() const //!< batches signed so far
+  {
+    return d_signedBatches;
+  }
+
+private:
+  struct Batch
+  {
+    shared_ptr<Client> client;
+    set<DNSName> authSet;
+    chunk_t chunk;
+    unsigned int id;
+  };
+
+  SigningPool() {}
+  void worker();
+
+  std::mutex d_lock;
+  std::condition_variable d_cond;
+  std::deque<Batch> d_live, d_queue;
+  std::once_flag d_started;
+  uint64_t d_queuedRecords{0};
+  AtomicCounter d_signedBatches;
+  std::atomic<unsigned int> d_numworkers{0};
+};
+
 /** input: DNSResourceRecords ordered in qname,qtype (we emit a signature chunk on a break)
  *  output: "chunks" of those very same DNSResourceRecords, interleaved with signatures
  */
@@ -19,6 +89,7 @@ public:
   typedef vector<DNSResourceRecord> rrset_t; 
   typedef rrset_t chunk_t; // for now
   
+  //! numWorkers sizes the SigningPool if it was not started yet, we keep twice that many batches in it at most
   ChunkedSigningPipe(const DNSName& signerName, bool mustSign, /* FIXME servers is unused? */ const string& servers=string(), unsigned int numWorkers=3);
   ~ChunkedSigningPipe();
   bool submit(const DNSResourceRecord& rr);
@@ -32,25 +103,21 @@ private:
   void flushToSign();	
   void dedupRRSet();
   void sendRRSetToWorker(); // dispatch RRSET to worker
+  void sendBatch();
+  void collectSigned(unsigned int maxOutstanding);
   void addSignedToChunks(chunk_t* signedChunk);
-  pair<vector<int>, vector<int> > waitForRW(bool rd, bool wr, int seconds);
-
-  void worker(int n, int fd);
-  
-  static void* helperWorker(void* p);
 
   unsigned int d_numworkers;
   int d_submitted;
 
   rrset_t* d_rrsetToSign;
+  chunk_t d_batch; // RRsets waiting to go to the pool together
   std::deque< std::vector<DNSResourceRecord> > d_chunks;
   DNSName d_signer;
   
   chunk_t::size_type d_maxchunkrecords;
   
-  std::vector<int> d_sockets;
-  std::set<int> d_eof;
-  vector<pthread_t> d_tids;
+  shared_ptr<SigningPool::Client> d_client;
   bool d_mustSign;
   bool d_final;
 };
@@ -35,6 +35,8 @@
 #include "ueberbackend.hh"
 #include "packethandler.hh"
 #include "resolver.hh"
+#include "ixfr.hh"
+#include "ixfrapply.hh"
 #include "logger.hh"
 #include "dns.hh"
 #include "arguments.hh"
@@ -50,35 +52,97 @@
 using boost::scoped_ptr;
 
 
-void CommunicatorClass::addSuckRequest(const DNSName &domain, const string &master)
+void CommunicatorClass::addSuckRequest(const DNSName &domain, const string &master, bool priority)
 {
-  Lock l(&d_lock);
   SuckRequest sr;
   sr.domain = domain;
   sr.master = master;
-  pair<UniQueue::iterator, bool>  res;
+  d_suckdomains.add(sr, priority);
+}
+
+/** Brings the zone in di up to date with an IXFR from remote. Only the RRsets the deltas change are replaced, in one
+    transaction, and only the names they touch are rectified. Returns true with the serial we are at now. Returns false
+    if the master sends the whole zone instead, retriever is then left to read the rest of it, after the records in
+    fullZone. Throws if that did not work out, after rolling back, so the caller can do an AXFR instead */
+bool CommunicatorClass::ixfrSuck(const DNSName &domain, const string &remote, DomainInfo& di, DNSSECKeeper& dk, const DNSName& tsigkeyname, const DNSName& tsigalgorithm, const string& tsigsecret, const ComboAddress* laddr, uint64_t& bytes, uint32_t& serial, std::unique_ptr<AXFRRetriever>& retriever, Resolver::res_t& fullZone)
+{
+  struct soatimes st;
+  memset(&st, 0, sizeof(st));
+  st.serial=di.serial;
+  SOARecordContent oursoa(DNSName("."), DNSName("."), st); // the master only looks at the serial
+
+  retriever.reset(new AXFRRetriever(ComboAddress(remote, 53), domain, tsigkeyname, tsigalgorithm, tsigsecret, laddr, &oursoa));
+  IXFRCollector collector(domain, di.serial);
+  Resolver::res_t unused;
+  vector<DNSRecord> chunk, received; // received holds what came in until we know what kind of response this is
+  unsigned int added=0;
+  bool complete=false;
+  while(!complete && retriever->getChunk(unused, &chunk)) {
+    bytes=retriever->getReceivedBytes();
+    if(added < 2)
+      received.insert(received.end(), chunk.begin(), chunk.end());
+    for(const auto& dr : chunk) {
+      if(dr.d_type == QType::OPT || dr.d_type == QType::TSIG) // ignore EDNS0 & TSIG
+        continue;
+      if(!dr.d_name.isPartOf(domain))
+        throw PDNSException("remote tried to sneak in out-of-zone data '"+dr.d_name.toString()+"'|"+DNSRecordContent::NumberToType(dr.d_type));
+      ++added;
+      if((complete=collector.add(dr)))
+        break;
+    }
+  }
+  if(collector.isFullZone()) {
+    retriever->setFullZone();
+    for(const auto& dr : received)
+      fullZone.push_back(Resolver::toResourceRecord(dr));
+    return false;
+  }
+  IXFRCollector::deltas_t deltas=collector.getDeltas();
+  if(deltas.empty()) {
+    di.backend->setFresh(di.id);
+    serial=di.serial;
+    return true;
+  }
 
-  res=d_suckdomains.push_back(sr);
+  bool isDnssecZone=dk.isSecuredZone(domain);
+  NSEC3PARAMRecordContent ns3pr;
+  bool narrow=false;
+  bool haveNSEC3=isDnssecZone && dk.getNSEC3PARAM(domain, &ns3pr, &narrow);
 
-  if(res.second) {
-    d_suck_sem.post();
+  if(!di.backend->startTransaction(domain, -1))
+    throw PDNSException("backend does not support transactions");
+  try {
+    serial=applyIXFRDeltas(di, deltas, isDnssecZone, haveNSEC3, narrow, ns3pr, ::arg().mustDo("direct-dnskey"));
+    di.backend->commitTransaction();
+    di.backend->setFresh(di.id);
+    PC.purge(domain.toString()+"$");
+    return true;
+  }
+  catch(...) {
+    di.backend->abortTransaction();
+    throw;
   }
 }
 
-void CommunicatorClass::suck(const DNSName &domain,const string &remote)
+/** Transfers domain from remote. Returns MasterFailed if the master failed us, so the scheduler backs off from it,
+    and LocalFailed if we failed ourselves, bytes is set to what we received. B is created if needed, and dropped
+    after a backend error */
+CommunicatorClass::XfrResult CommunicatorClass::suck(const DNSName &domain, const string &remote, std::unique_ptr<UeberBackend>& B, uint64_t& bytes)
 {
   L<<Logger::Error<<"Initiating transfer of '"<<domain<<"' from remote '"<<remote<<"'"<<endl;
-  UeberBackend B; // fresh UeberBackend
+  if(!B)
+    B.reset(new UeberBackend);
 
   DomainInfo di;
   di.backend=0;
   bool transaction=false;
+  XfrResult result=XfrResult::Done;
   try {
-    DNSSECKeeper dk (&B); // reuse our UeberBackend copy for DNSSECKeeper
+    DNSSECKeeper dk (B.get()); // reuse our UeberBackend copy for DNSSECKeeper
 
-    if(!B.getDomainInfo(domain, di) || !di.backend) { // di.backend and B are mostly identical
+    if(!B->getDomainInfo(domain, di) || !di.backend) { // di.backend and B are mostly identical
       L<<Logger::Error<<"Can't determine backend for domain '"<<domain<<"'"<<endl;
-      return;
+      return XfrResult::LocalFailed;
     }
     uint32_t domain_id=di.id;
 
@@ -87,43 +151,71 @@ void CommunicatorClass::suck(const DNSName &domain,const string &remote)
     string tsigsecret;
     if(dk.getTSIGForAccess(domain, remote, &tsigkeyname)) {
       string tsigsecret64;
-      if(B.getTSIGKey(tsigkeyname, &tsigalgorithm, &tsigsecret64)) {
+      if(B->getTSIGKey(tsigkeyname, &tsigalgorithm, &tsigsecret64)) {
         B64Decode(tsigsecret64, tsigsecret);
       } else {
         L<<Logger::Error<<"TSIG key '"<<tsigkeyname<<"' for domain '"<<domain<<"' not found"<<endl;
-        return;
+        return XfrResult::LocalFailed;
       }
     }
 
 
     scoped_ptr<AuthLua> pdl;
     vector<string> scripts;
-    if(B.getDomainMetadata(domain, "LUA-AXFR-SCRIPT", scripts) && !scripts.empty()) {
+    if(B->getDomainMetadata(domain, "LUA-AXFR-SCRIPT", scripts) && !scripts.empty()) {
       try {
         pdl.reset(new AuthLua(scripts[0]));
         L<<Logger::Info<<"Loaded Lua script '"<<scripts[0]<<"' to edit the incoming AXFR of '"<<domain<<"'"<<endl;
       }
       catch(std::exception& e) {
         L<<Logger::Error<<"Failed to load Lua editing script '"<<scripts[0]<<"' for incoming AXFR of '"<<domain<<"': "<<e.what()<<endl;
-        return;
+        return XfrResult::LocalFailed;
       }
     }
 
     vector<string> localaddr;
     ComboAddress laddr;
-    if(B.getDomainMetadata(domain, "AXFR-SOURCE", localaddr) && !localaddr.empty()) {
+    if(B->getDomainMetadata(domain, "AXFR-SOURCE", localaddr) && !localaddr.empty()) {
       try {
         laddr = ComboAddress(localaddr[0]);
         L<<Logger::Info<<"AXFR source for domain '"<<domain<<"' set to "<<localaddr[0]<<endl;
       }
       catch(std::exception& e) {
         L<<Logger::Error<<"Failed to load AXFR source '"<<localaddr[0]<<"' for incoming AXFR of '"<<domain<<"': "<<e.what()<<endl;
-        return;
+        return XfrResult::LocalFailed;
       }
     } else {
       laddr.sin4.sin_family = 0;
     }
 
+    // a master without deltas for us sends the whole zone in reply to an IXFR, we import that like an AXFR
+    std::unique_ptr<AXFRRetriever> retriever;
+    Resolver::res_t recs;
+
+    // presigned zones and zones with a Lua script to edit them are always transferred as a whole
+    if(di.serial && ::arg().mustDo("slave-ixfr") && !pdl && !dk.isPresigned(domain)) {
+      try {
+        uint32_t serial;
+        if(ixfrSuck(domain, remote, di, dk, tsigkeyname, tsigalgorithm, tsigsecret, (laddr.sin4.sin_family == 0) ? NULL : &laddr, bytes, serial, retriever, recs)) {
+          L<<Logger::Error<<"IXFR done for '"<<domain<<"', zone at serial number "<<serial<<endl;
+          if(::arg().mustDo("slave-renotify"))
+            notifyDomain(domain);
+          return XfrResult::Done;
+        }
+        L<<Logger::Warning<<"Remote '"<<remote<<"' has no deltas for '"<<domain<<"', importing the full zone it sends instead"<<endl;
+      }
+      catch(PDNSException &e) {
+        L<<Logger::Warning<<"IXFR of '"<<domain<<"' from remote '"<<remote<<"' failed, falling back to AXFR: "<<e.reason<<endl;
+        retriever.reset();
+        recs.clear();
+      }
+      catch(std::exception &e) {
+        L<<Logger::Warning<<"IXFR of '"<<domain<<"' from remote '"<<remote<<"' failed, falling back to AXFR: "<<e.what()<<endl;
+        retriever.reset();
+        recs.clear();
+      }
+    }
+
     bool hadDnssecZone = false;
     bool hadPresigned = false;
     bool hadNSEC3 = false;
@@ -152,9 +244,13 @@ void CommunicatorClass::suck(const DNSName &domain,const string &remote)
     vector<DNSResourceRecord> rrs;
 
     ComboAddress raddr(remote, 53);
-    AXFRRetriever retriever(raddr, domain, tsigkeyname, tsigalgorithm, tsigsecret, (laddr.sin4.sin_family == 0) ? NULL : &laddr);
-    Resolver::res_t recs;
-    while(retriever.getChunk(recs)) {
+    uint64_t ixfrBytes=0;
+    if(!retriever) {
+      ixfrBytes=bytes;
+      retriever.reset(new AXFRRetriever(raddr, domain, tsigkeyname, tsigalgorithm, tsigsecret, (laddr.sin4.sin_family == 0) ? NULL : &laddr));
+    }
+    for(;!recs.empty() || retriever->getChunk(recs); recs.clear()) {
+      bytes=ixfrBytes+retriever->getReceivedBytes();
       if(first) {
         L<<Logger::Error<<"AXFR started for '"<<domain<<"'"<<endl;
         first=false;
@@ -390,13 +486,16 @@ void CommunicatorClass::suck(const DNSName &domain,const string &remote)
       notifyDomain(domain);
   }
   catch(DBException &re) {
+    result=XfrResult::LocalFailed;
     L<<Logger::Error<<"Unable to feed record during incoming AXFR of '" << domain<<"': "<<re.reason<<endl;
     if(di.backend && transaction) {
       L<<Logger::Error<<"Aborting possible open transaction for domain '"<<domain<<"' AXFR"<<endl;
       di.backend->abortTransaction();
     }
+    B.reset(); // the next transfer gets a fresh backend
   }
   catch(MOADNSException &re) {
+    result=XfrResult::MasterFailed;
     L<<Logger::Error<<"Unable to parse record during incoming AXFR of '"<<domain<<"' (MOADNSException): "<<re.what()<<endl;
     if(di.backend && transaction) {
       L<<Logger::Error<<"Aborting possible open transaction for domain '"<<domain<<"' AXFR"<<endl;
@@ -404,13 +503,16 @@ void CommunicatorClass::suck(const DNSName &domain,const string &remote)
     }
   }
   catch(std::exception &re) {
+    result=XfrResult::LocalFailed;
     L<<Logger::Error<<"Unable to parse record during incoming AXFR of '"<<domain<<"' (std::exception): "<<re.what()<<endl;
     if(di.backend && transaction) {
       L<<Logger::Error<<"Aborting possible open transaction for domain '"<<domain<<"' AXFR"<<endl;
       di.backend->abortTransaction();
     }
+    B.reset(); // the next transfer gets a fresh backend
   }
   catch(ResolverException &re) {
+    result=XfrResult::MasterFailed;
     L<<Logger::Error<<"Unable to AXFR zone '"<<domain<<"' from remote '"<<remote<<"' (resolver): "<<re.reason<<endl;
     if(di.backend && transaction) {
       L<<Logger::Error<<"Aborting possible open transaction for domain '"<<domain<<"' AXFR"<<endl;
@@ -418,12 +520,15 @@ void CommunicatorClass::suck(const DNSName &domain,const string &remote)
     }
   }
   catch(PDNSException &ae) {
+    result=XfrResult::LocalFailed;
     L<<Logger::Error<<"Unable to AXFR zone '"<<domain<<"' from remote '"<<remote<<"' (PDNSException): "<<ae.reason<<endl;
     if(di.backend && transaction) {
       L<<Logger::Error<<"Aborting possible open transaction for domain '"<<domain<<"' AXFR"<<endl;
       di.backend->abortTransaction();
     }
+    B.reset(); // the next transfer gets a fresh backend
   }
+  return result;
 }
 namespace {
 struct QueryInfo
@@ -552,14 +657,12 @@ void CommunicatorClass::slaveRefresh(PacketHandler *P)
     }
   }
 
+  bool notified=!rdomains.empty(); // their transfers go before those of the unfresh domains
   if(rdomains.empty()) // if we have priority domains, check them first
     B->getUnfreshSlaveInfos(&rdomains);
 
   DNSSECKeeper dk(B); // NOW HEAR THIS! This DK uses our B backend, so no interleaved access!
   {
-    Lock l(&d_lock);
-    domains_by_name_t& nameindex=boost::multi_index::get<IDTag>(d_suckdomains);
-
     BOOST_FOREACH(DomainInfo& di, rdomains) {
       std::vector<std::string> localaddr;
       SuckRequest sr;
@@ -568,7 +671,7 @@ void CommunicatorClass::slaveRefresh(PacketHandler *P)
         continue;
       // remove unfresh domains already queued for AXFR, no sense polling them again
       sr.master=*di.masters.begin();
-      if(nameindex.count(sr)) {
+      if(d_suckdomains.isQueued(sr)) {
         continue;
       }
       DomainNotificationInfo dni;
@@ -603,17 +706,15 @@ void CommunicatorClass::slaveRefresh(PacketHandler *P)
   if(sdomains.empty())
   {
     if(d_slaveschanged) {
-      Lock l(&d_lock);
-      L<<Logger::Warning<<"No new unfresh slave domains, "<<d_suckdomains.size()<<" queued for AXFR already"<<endl;
+      L<<Logger::Warning<<"No new unfresh slave domains, "<<d_suckdomains.getQueued()<<" queued for AXFR already"<<endl;
     }
     d_slaveschanged = !rdomains.empty();
     return;
   }
   else {
-    Lock l(&d_lock);
     L<<Logger::Warning<<sdomains.size()<<" slave domain"<<(sdomains.size()>1 ? "s" : "")<<" need"<<
       (sdomains.size()>1 ? "" : "s")<<
-      " checking, "<<d_suckdomains.size()<<" queued for AXFR"<<endl;
+      " checking, "<<d_suckdomains.getQueued()<<" queued for AXFR"<<endl;
   }
 
   SlaveSenderReceiver ssr;
@@ -675,13 +776,13 @@ void CommunicatorClass::slaveRefresh(PacketHandler *P)
         }
         else {
           L<<Logger::Warning<<"Domain '"<< di.zone<<"' is fresh, but RRSIGS differ, so DNSSEC stale"<<endl;
-          addSuckRequest(di.zone, *di.masters.begin());
+          addSuckRequest(di.zone, *di.masters.begin(), notified);
         }
       }
     }
     else {
       L<<Logger::Warning<<"Domain '"<< di.zone<<"' is stale, master serial "<<theirserial<<", our serial "<< ourserial <<endl;
-      addSuckRequest(di.zone, *di.masters.begin());
+      addSuckRequest(di.zone, *di.masters.begin(), notified);
     }
   }
 }
@@ -4,6 +4,8 @@
 #include "misc.hh"
 #include "dnswriter.hh"
 #include "dnsrecords.hh"
+#include "mtasker.hh"
+#include "filterpo.hh"
 #include <boost/format.hpp>
 #ifndef RECURSOR
 #include "statbag.hh"
@@ -819,6 +821,101 @@ struct B64DecodeTest
 };
 
 
+struct NetmaskGroupMatchTest
+{
+  explicit NetmaskGroupMatchTest(unsigned int masks) : d_masks(masks), d_v4("192.0.2.1"), d_v6("2001:db8::1"), d_mapped("::ffff:198.51.100.1")
+  {
+    for(unsigned int n = 0; n < masks; ++n) {
+      d_nmg.addMask(Netmask(ComboAddress(std::to_string(10 + n % 100)+"."+std::to_string(n / 100 % 256)+"."+std::to_string(n * 7 % 256)+".0"), 24));
+      d_nmg.addMask(Netmask(ComboAddress("2001:db8:"+std::to_string(1 + n % 9999)+"::"), 48));
+    }
+  }
+
+  string getName() const
+  {
+    return (boost::format("netmaskgroup match, %d masks") % d_masks).str();
+  }
+
+  void operator()() const
+  {
+    g_ret = d_nmg.match(d_v4) || d_nmg.match(d_v6) || d_nmg.match(d_mapped);
+  }
+
+  unsigned int d_masks;
+  NetmaskGroup d_nmg;
+  ComboAddress d_v4, d_v6, d_mapped;
+};
+
+// a synthetic RPZ: half of the triggers are names, a quarter wildcards and a quarter client netmasks
+struct RPZLookupTest
+{
+  explicit RPZLookupTest(unsigned int triggers) : d_triggers(triggers), d_hit("host40.zone40.example."), d_miss("www.powerdns.com."), d_wildhit("a.b.zone7.example."), d_client("198.51.100.1")
+  {
+    for(unsigned int n = 0; n < triggers; ++n) {
+      string zone = "zone" + std::to_string(n % 10000) + ".example.";
+      switch(n % 4) {
+      case 0:
+      case 1:
+        d_dfe.addQNameTrigger(DNSName("host" + std::to_string(n) + "." + zone), {DNSFilterEngine::PolicyKind::NXDOMAIN});
+        break;
+      case 2:
+        d_dfe.addQNameTrigger(DNSName("*.sub" + std::to_string(n) + "." + zone), {DNSFilterEngine::PolicyKind::NODATA});
+        break;
+      case 3:
+        d_dfe.addClientTrigger(Netmask(ComboAddress(std::to_string(10 + n / 16777216 % 100) + "." + std::to_string(n / 65536 % 256) + "." + std::to_string(n / 256 % 256) + "." + std::to_string(n % 256)), 32), {DNSFilterEngine::PolicyKind::Drop});
+        break;
+      }
+    }
+    d_dfe.addQNameTrigger(DNSName("*.zone7.example."), {DNSFilterEngine::PolicyKind::NODATA});
+    if(d_dfe.getQueryPolicy(d_hit, d_client).d_kind != DNSFilterEngine::PolicyKind::NXDOMAIN)
+      throw std::runtime_error("RPZ lookup test: "+d_hit.toString()+" is not a trigger");
+  }
+
+  string getName() const
+  {
+    return (boost::format("RPZ lookup, %d triggers") % d_triggers).str();
+  }
+
+  void operator()() const
+  {
+    g_ret = d_dfe.getQueryPolicy(d_hit, d_client).d_kind == DNSFilterEngine::PolicyKind::NoAction &&
+      d_dfe.getQueryPolicy(d_miss, d_client).d_kind == DNSFilterEngine::PolicyKind::NoAction &&
+      d_dfe.getQueryPolicy(d_wildhit, d_client).d_kind == DNSFilterEngine::PolicyKind::NoAction;
+  }
+
+  unsigned int d_triggers;
+  DNSFilterEngine d_dfe;
+  DNSName d_hit, d_miss, d_wildhit;
+  ComboAddress d_client;
+};
+
+static void yieldForever(void* p)
+{
+  MTasker<>* mt = reinterpret_cast<MTasker<>*>(p);
+  for(;;)
+    mt->yield();
+}
+
+struct MTaskerSwitchTest
+{
+  MTaskerSwitchTest() : d_mt(std::make_shared<MTasker<> >())
+  {
+    d_mt->makeThread(yieldForever, d_mt.get());
+  }
+
+  string getName() const
+  {
+    return "mtasker yield and resume, 2 context switches";
+  }
+
+  void operator()() const
+  {
+    d_mt->schedule();
+  }
+
+  std::shared_ptr<MTasker<> > d_mt;
+};
+
 struct NOPTest
 {
   string getName() const
@@ -918,6 +1015,15 @@ try
   doRun(VStringtokTest());  
   doRun(StringAppendTest());  
 
+  doRun(NetmaskGroupMatchTest(10));
+  doRun(NetmaskGroupMatchTest(1000));
+  doRun(NetmaskGroupMatchTest(20000));
+
+  doRun(MTaskerSwitchTest());
+
+  doRun(RPZLookupTest(1000));
+  doRun(RPZLookupTest(1000000));
+
   cerr<<"Total runs: " << g_totalRuns<<endl;
 
 }
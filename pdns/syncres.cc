@@ -53,6 +53,8 @@ __thread SyncRes::StaticStorage* t_sstorage;
 unsigned int SyncRes::s_maxnegttl;
 unsigned int SyncRes::s_maxcachettl;
 unsigned int SyncRes::s_packetcachettl;
+unsigned int SyncRes::s_prefetchttlperc;
+unsigned int SyncRes::s_prefetchminhits;
 unsigned int SyncRes::s_packetcacheservfailttl;
 unsigned int SyncRes::s_serverdownmaxfails;
 unsigned int SyncRes::s_serverdownthrottletime;
@@ -66,6 +68,8 @@ uint64_t SyncRes::s_throttledqueries;
 uint64_t SyncRes::s_dontqueries;
 uint64_t SyncRes::s_nodelegated;
 uint64_t SyncRes::s_unreachables;
+uint64_t SyncRes::s_prefetches;
+uint64_t SyncRes::s_prefetchhits;
 unsigned int SyncRes::s_minimumTTL;
 bool SyncRes::s_doIPv6;
 bool SyncRes::s_nopacketcache;
@@ -110,7 +114,7 @@ void accountAuthLatency(int usec, int family)
 
 SyncRes::SyncRes(const struct timeval& now) :  d_outqueries(0), d_tcpoutqueries(0), d_throttledqueries(0), d_timeouts(0), d_unreachables(0),
 					       d_totUsec(0), d_doDNSSEC(false), d_now(now),
-					       d_cacheonly(false), d_nocache(false), d_doEDNS0(false), d_lm(s_lm)
+					       d_cacheonly(false), d_nocache(false), d_refresh(false), d_doEDNS0(false), d_lm(s_lm)
                                                  
 { 
   if(!t_sstorage) {
@@ -408,7 +412,7 @@ int SyncRes::doResolve(const DNSName &qname, const QType &qtype, vector<DNSRecor
     if(doCNAMECacheCheck(qname,qtype,ret,depth,res)) // will reroute us if needed
       return res;
 
-    if(doCacheCheck(qname,qtype,ret,depth,res)) // we done
+    if(!(d_refresh && !depth) && doCacheCheck(qname,qtype,ret,depth,res)) // we done
       return res;
   }
 
@@ -760,7 +764,8 @@ bool SyncRes::doCacheCheck(const DNSName &qname, const QType &qtype, vector<DNSR
   bool found=false, expired=false;
   vector<std::shared_ptr<RRSIGRecordContent>> signatures;
   uint32_t ttl=0;
-  if(t_RC->get(d_now.tv_sec, sqname, sqt, &cset, d_doDNSSEC ? &signatures : 0) > 0) {
+  MemRecursorCache::EntryState state;
+  if(t_RC->get(d_now.tv_sec, sqname, sqt, &cset, d_doDNSSEC ? &signatures : 0, &state) > 0) {
     LOG(prefix<<sqname.toString()<<": Found cache hit for "<<sqt.getName()<<": ");
     for(auto j=cset.cbegin() ; j != cset.cend() ; ++j) {
       LOG(j->d_content->getZoneRepresentation());
@@ -794,8 +799,19 @@ bool SyncRes::doCacheCheck(const DNSName &qname, const QType &qtype, vector<DNSR
   
     LOG(endl);
     if(found && !expired) {
-      if(!giveNegative)
+      if(!giveNegative) {
         res=0;
+        if(state.prefetched)
+          s_prefetchhits++;
+        // a popular entry that is about to expire gets refreshed in the background, so the next query does not have to wait for it
+        if(s_prefetchttlperc && !d_refresh && state.hits >= s_prefetchminhits &&
+           (uint64_t)ttl * 100 <= (uint64_t)state.origTTL * s_prefetchttlperc &&
+           t_RC->claimPrefetch(d_now.tv_sec, sqname, sqt)) {
+          LOG(prefix<<sqname.toString()<<": scheduling prefetch of "<<sqt.getName()<<", "<<ttl<<" of "<<state.origTTL<<" seconds left"<<endl);
+          s_prefetches++;
+          schedulePrefetch(sqname, sqt);
+        }
+      }
       return true;
     }
     else
@@ -921,7 +937,7 @@ int SyncRes::doResolveAt(set<DNSName> nameservers, DNSName auth, bool flawedNSSe
 	;
 
 	// XXX NEED TO HANDLE OTHER POLICY KINDS HERE!
-	if(g_dfe.getProcessingPolicy(*tns).d_kind != DNSFilterEngine::PolicyKind::NoAction)
+	if((*t_dfe)->getProcessingPolicy(*tns).d_kind != DNSFilterEngine::PolicyKind::NoAction)
 	  throw ImmediateServFailException("Dropped because of policy");
 
         if(!isCanonical(*tns)) {
@@ -1169,7 +1185,7 @@ int SyncRes::doResolveAt(set<DNSName> nameservers, DNSName auth, bool flawedNSSe
 
 	//	cout<<"Have "<<i->second.records.size()<<" records and "<<i->second.signatures.size()<<" signatures for "<<i->first.first.toString();
 	//	cout<<'|'<<DNSRecordContent::NumberToType(i->first.second.getCode())<<endl;
-        t_RC->replace(d_now.tv_sec, i->first.first, i->first.second, i->second.records, i->second.signatures, lwr.d_aabit);
+        t_RC->replace(d_now.tv_sec, i->first.first, i->first.second, i->second.records, i->second.signatures, lwr.d_aabit, d_refresh && i->first.first == qname && i->first.second == qtype);
       }
       set<DNSName> nsset;
       LOG(prefix<<qname.toString()<<": determining status after receiving this packet"<<endl);
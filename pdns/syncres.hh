@@ -19,12 +19,15 @@
 #include "recpacketcache.hh"
 #include <boost/tuple/tuple.hpp>
 #include <boost/optional.hpp>
+#include <boost/functional/hash.hpp>
 #include <boost/tuple/tuple_comparison.hpp>
 #include "mtasker.hh"
 #include "iputils.hh"
 #include "filterpo.hh"
+#include "sholder.hh"
 
-extern DNSFilterEngine g_dfe;
+extern GlobalStateHolder<DNSFilterEngine> g_dfe;
+extern __thread LocalStateHolder<DNSFilterEngine>* t_dfe;
 
 void primeHints(void);
 class RecursorLua;
@@ -272,6 +275,12 @@ public:
     d_nocache=state;
   }
 
+  //! resolve the question even if it is in the cache, and mark the answer as prefetched
+  void setRefresh(bool state=true)
+  {
+    d_refresh=state;
+  }
+
   void setDoEDNS0(bool state=true)
   {
     d_doEDNS0=state;
@@ -302,6 +311,8 @@ public:
   static uint64_t s_tcpoutqueries;
   static uint64_t s_nodelegated;
   static uint64_t s_unreachables;
+  static uint64_t s_prefetches;
+  static uint64_t s_prefetchhits;
   static unsigned int s_minimumTTL;
   static bool s_doIPv6;
   static unsigned int s_maxqperq;
@@ -425,6 +436,8 @@ public:
   static unsigned int s_maxnegttl;
   static unsigned int s_maxcachettl;
   static unsigned int s_packetcachettl;
+  static unsigned int s_prefetchttlperc;
+  static unsigned int s_prefetchminhits;
   static unsigned int s_packetcacheservfailttl;
   static unsigned int s_serverdownmaxfails;
   static unsigned int s_serverdownthrottletime;
@@ -463,6 +476,7 @@ private:
   string d_prefix;
   bool d_cacheonly;
   bool d_nocache;
+  bool d_refresh;
   bool d_doEDNS0;
 
   static LogMode s_lm;
@@ -487,6 +501,7 @@ class Socket;
 /* external functions, opaque to us */
 int asendtcp(const string& data, Socket* sock);
 int arecvtcp(string& data, int len, Socket* sock, bool incompleteOkay);
+void schedulePrefetch(const DNSName& qname, const QType& qtype);
 
 
 struct PacketID
@@ -525,8 +540,31 @@ struct PacketID
 
     return tie(domain, fd, id) < tie(b.domain, b.fd, b.id);
   }
+
+  bool operator==(const PacketID& b) const
+  {
+    int ourSock= sock ? sock->getHandle() : 0;
+    int bSock = b.sock ? b.sock->getHandle() : 0;
+    return tie(id, fd, type, ourSock, remote, domain) == tie(b.id, b.fd, b.type, bSock, b.remote, b.domain);
+  }
 };
 
+// consistent with operator==, so MTasker can find waiters in a hash table
+inline size_t hash_value(const PacketID& pid)
+{
+  size_t seed = pid.domain.hash();
+  boost::hash_combine(seed, pid.id);
+  boost::hash_combine(seed, pid.type);
+  boost::hash_combine(seed, pid.fd);
+  boost::hash_combine(seed, pid.sock ? pid.sock->getHandle() : 0);
+  boost::hash_combine(seed, pid.remote.sin4.sin_port);
+  if(pid.remote.sin4.sin_family == AF_INET)
+    boost::hash_combine(seed, pid.remote.sin4.sin_addr.s_addr);
+  else
+    boost::hash_combine(seed, burtle((const unsigned char*)&pid.remote.sin6.sin6_addr.s6_addr, 16, 0));
+  return seed;
+}
+
 struct PacketIDBirthdayCompare: public std::binary_function<PacketID, PacketID, bool>
 {
   bool operator()(const PacketID& a, const PacketID& b) const
@@ -538,12 +576,13 @@ struct PacketIDBirthdayCompare: public std::binary_function<PacketID, PacketID,
     if( tie(a.remote, ourSock, a.type) > tie(b.remote, bSock, b.type))
       return false;
 
-    return pdns_ilexicographical_compare(a.domain.toString(), b.domain.toString()); // FIXME400
+    return a.domain < b.domain; // case insensitive, like DNSName::operator==
   }
 };
 extern __thread MemRecursorCache* t_RC;
+extern MemRecursorCache* g_sharedRC; // if set, t_RC points here for all threads
 extern __thread RecursorPacketCache* t_packetCache;
-typedef MTasker<PacketID,string> MT_t;
+typedef MTasker<PacketID,string,PacketIDBirthdayCompare> MT_t;
 extern __thread MT_t* MT;
 
 struct RecursorStats
@@ -570,6 +609,7 @@ struct RecursorStats
   uint64_t spoofCount;
   uint64_t resourceLimits;
   uint64_t overCapacityDrops;
+  uint64_t distributionQueueDrops;
   uint64_t ipv6queries;
   uint64_t chainResends;
   uint64_t nsSetInvalidations;
@@ -633,7 +673,7 @@ ComboAddress parseIPAndPort(const std::string& input, uint16_t port);
 ComboAddress getQueryLocalAddress(int family, uint16_t port);
 typedef boost::function<void*(void)> pipefunc_t;
 void broadcastFunction(const pipefunc_t& func, bool skipSelf = false);
-void distributeAsyncFunction(const std::string& question, const pipefunc_t& func);
+void distributeQuestion(const std::string& question, const ComboAddress& fromaddr, const ComboAddress& destaddr, struct timeval tv, int fd);
 
 int directResolve(const DNSName& qname, const QType& qtype, int qclass, vector<DNSRecord>& ret);
 
@@ -647,11 +687,15 @@ uint64_t* pleaseGetCacheSize();
 uint64_t* pleaseGetNegCacheSize();
 uint64_t* pleaseGetCacheHits();
 uint64_t* pleaseGetCacheMisses();
+uint64_t doGetCacheSize();
+uint64_t doGetCacheHits();
+uint64_t doGetCacheMisses();
 uint64_t* pleaseGetConcurrentQueries();
 uint64_t* pleaseGetThrottleSize();
 uint64_t* pleaseGetPacketCacheHits();
 uint64_t* pleaseGetPacketCacheSize();
 uint64_t* pleaseWipeCache(const DNSName& canon, bool subtree=false);
+uint64_t doWipeRecordCache(const DNSName& canon, bool subtree=false);
 uint64_t* pleaseWipePacketCache(const DNSName& canon, bool subtree);
 uint64_t* pleaseWipeAndCountNegCache(const DNSName& canon, bool subtree=false);
 void doCarbonDump(void*);
@@ -36,6 +36,7 @@
 #include "tcpreceiver.hh"
 #include "sstuff.hh"
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
 #include <errno.h>
 #include <signal.h>
 #include "base64.hh"
@@ -54,6 +55,7 @@
 #include "communicator.hh"
 #include "namespaces.hh"
 #include "signingpipe.hh"
+#include "mplexer.hh"
 extern PacketCache PC;
 extern StatBag S;
 
@@ -68,60 +70,13 @@ PacketHandler *TCPNameserver::s_P;
 int TCPNameserver::s_timeout;
 NetmaskGroup TCPNameserver::d_ng;
 
-void TCPNameserver::go()
-{
-  L<<Logger::Error<<"Creating backend connection for TCP"<<endl;
-  s_P=0;
-  try {
-    s_P=new PacketHandler;
-  }
-  catch(PDNSException &ae) {
-    L<<Logger::Error<<Logger::NTLog<<"TCP server is unable to launch backends - will try again when questions come in"<<endl;
-    L<<Logger::Error<<"TCP server is unable to launch backends - will try again when questions come in: "<<ae.reason<<endl;
-  }
-  pthread_create(&d_tid, 0, launcher, static_cast<void *>(this));
-}
-
 void *TCPNameserver::launcher(void *data)
 {
   static_cast<TCPNameserver *>(data)->thread();
   return 0;
 }
 
-// throws PDNSException if things didn't go according to plan, returns 0 if really 0 bytes were read
-int readnWithTimeout(int fd, void* buffer, unsigned int n, bool throwOnEOF=true)
-{
-  unsigned int bytes=n;
-  char *ptr = (char*)buffer;
-  int ret;
-  while(bytes) {
-    ret=read(fd, ptr, bytes);
-    if(ret < 0) {
-      if(errno==EAGAIN) {
-        ret=waitForData(fd, 5);
-        if(ret < 0)
-          throw NetworkError("Waiting for data read");
-        if(!ret)
-          throw NetworkError("Timeout reading data");
-        continue;
-      }
-      else
-        throw NetworkError("Reading data: "+stringerror());
-    }
-    if(!ret) {
-      if(!throwOnEOF && n == bytes)
-        return 0;
-      else
-        throw NetworkError("Did not fulfill read from TCP due to EOF");
-    }
-    
-    ptr += ret;
-    bytes -= ret;
-  }
-  return n;
-}
-
-// ditto
+// throws NetworkError if things didn't go according to plan
 void writenWithTimeout(int fd, const void *buffer, unsigned int n)
 {
   unsigned int bytes=n;
@@ -150,227 +105,559 @@ void writenWithTimeout(int fd, const void *buffer, unsigned int n)
   }
 }
 
-void connectWithTimeout(int fd, struct sockaddr* remote, size_t socklen)
+//! p as it goes over TCP, with its length in front, and counted in the response statistics
+static string makeTCPMessage(DNSPacket& p)
 {
-  int err;
-  Utility::socklen_t len=sizeof(err);
-
-  if((err=connect(fd, remote, socklen))<0 && errno!=EINPROGRESS)
-    throw NetworkError("connect: "+stringerror());
-
-  if(!err)
-    goto done;
-  
-  err=waitForRWData(fd, false, 5, 0);
-  if(err == 0)
-    throw NetworkError("Timeout connecting to remote");
-  if(err < 0)
-    throw NetworkError("Error connecting to remote");
-
-  if(getsockopt(fd, SOL_SOCKET,SO_ERROR,(char *)&err,&len)<0)
-    throw NetworkError("Error connecting to remote: "+stringerror()); // Solaris
-
-  if(err)
-    throw NetworkError("Error connecting to remote: "+string(strerror(err)));
+  g_rs.submitResponse(p, false);
 
- done:
-  ;
+  uint16_t len=htons(p.getString().length());
+  string buffer((const char*)&len, 2);
+  buffer.append(p.getString());
+  return buffer;
 }
 
 void TCPNameserver::sendPacket(shared_ptr<DNSPacket> p, int outsock)
 {
-  g_rs.submitResponse(*p, false);
-
-  uint16_t len=htons(p->getString().length());
-  string buffer((const char*)&len, 2);
-  buffer.append(p->getString());
+  string buffer=makeTCPMessage(*p);
   writenWithTimeout(outsock, buffer.c_str(), buffer.length());
 }
 
 
-void TCPNameserver::getQuestion(int fd, char *mesg, int pktlen, const ComboAddress &remote)
-try
+static void incTCPAnswerCount(const ComboAddress& remote)
 {
-  readnWithTimeout(fd, mesg, pktlen);
+  S.inc("tcp-answers");
+  if(remote.sin4.sin_family == AF_INET6)
+    S.inc("tcp6-answers");
+  else
+    S.inc("tcp4-answers");
 }
-catch(NetworkError& ae) {
-  throw NetworkError("Error reading DNS data from TCP client "+remote.toString()+": "+ae.what());
+
+static FDMultiplexer* getMultiplexer()
+{
+  for(const auto& i : FDMultiplexer::getMultiplexerMap()) {
+    try {
+      return i.second();
+    }
+    catch(FDMultiplexerException &fe) {
+      L<<Logger::Error<<"Non-fatal error initializing possible multiplexer ("<<fe.what()<<"), falling back"<<endl;
+    }
+    catch(...) {
+      L<<Logger::Error<<"Non-fatal error initializing possible multiplexer"<<endl;
+    }
+  }
+  throw PDNSException("No working multiplexer found for the TCP server");
 }
 
-static void proxyQuestion(shared_ptr<DNSPacket> packet)
+struct TCPNameserver::Connection
 {
-  int sock=socket(AF_INET, SOCK_STREAM, 0);
-  
-  setCloseOnExec(sock);
-  if(sock < 0)
-    throw NetworkError("Error making TCP connection socket to recursor: "+stringerror());
+  Connection(int fd, const ComboAddress& remote) : d_fd(fd), d_remote(remote)
+  {}
+  //! no questions are read while an answer is being written or waited for, so they get answered in order
+  bool isBusy() const
+  {
+    return !d_outbuffer.empty() || d_recursorFD >= 0;
+  }
+  int d_fd;
+  ComboAddress d_remote;
+  string d_buffer; //!< what was read but not answered yet
+  string d_outbuffer; //!< what was answered but not taken by the client yet
+  bool d_reading{false}; //!< d_fd is on the read watch list
+  int d_recursorFD{-1}; //!< connection to the recursor, while it answers a question for us
+  string d_recursorBuffer; //!< the question for the recursor, then its answer
+  size_t d_recursorWritten{0};
+  bool d_recursorSent{false}; //!< the whole question went out, we wait for the answer
+};
+
+/** A worker answers the questions on its share of the TCP connections with its own PacketHandler,
+    waiting for data on all of them at once. It never blocks on a single client: what a client does
+    not take right away is written when it has room for more, and questions that go to the recursor
+    are sent and answered from the same loop. A zone transfer takes long and needs backends of its
+    own anyway, so its connection gets a thread of its own, which hands the connection back when done. */
+class TCPNameserver::Worker
+{
+public:
+  Worker()
+  {
+    if(pipe(d_pipe) < 0)
+      throw PDNSException("Unable to create pipe for TCP worker: "+stringerror());
+    setCloseOnExec(d_pipe[0]);
+    setCloseOnExec(d_pipe[1]);
+  }
 
-  setNonBlocking(sock);
-  ServiceTuple st;
-  st.port=53;
-  parseService(::arg()["recursor"],st);
+  void go()
+  {
+    pthread_create(&d_tid, 0, launcher, static_cast<void *>(this));
+  }
+
+  //! hands c to this worker, may be called from any thread
+  void addConnection(Connection* c)
+  {
+    if(write(d_pipe[1], &c, sizeof(c)) != sizeof(c)) {
+      L<<Logger::Error<<"Unable to pass TCP connection from "<<c->d_remote.toString()<<" to a worker: "<<stringerror()<<endl;
+      dropConnection(c);
+    }
+  }
+
+  static void dropConnection(Connection* c)
+  {
+    closesocket(c->d_fd);
+    delete c;
+    d_connectionroom_sem->post();
+  }
 
+private:
+  struct TransferJob
+  {
+    Worker* d_worker;
+    Connection* d_conn;
+    shared_ptr<DNSPacket> d_packet;
+  };
+
+  static void *launcher(void *data)
+  {
+    static_cast<Worker *>(data)->run();
+    return 0;
+  }
+  static void *doTransfer(void *data);
+  void run();
+  void handleNewConnection(int fd, FDMultiplexer::funcparam_t& param);
+  void handleReadable(int fd, FDMultiplexer::funcparam_t& param);
+  void handleWritable(int fd, FDMultiplexer::funcparam_t& param);
+  void handleRecursorWritable(int fd, FDMultiplexer::funcparam_t& param);
+  void handleRecursorReadable(int fd, FDMultiplexer::funcparam_t& param);
+  void resume(Connection* c);
+  void pause(Connection* c);
+  void answerBuffered(Connection* c);
+  bool answerQuestion(Connection* c, const char* mesg, uint16_t len);
+  void queueAnswer(Connection* c, const string& answer);
+  void proxyQuestion(Connection* c, DNSPacket& packet);
+  void closeConnection(Connection* c);
+
+  int d_pipe[2];
+  pthread_t d_tid;
+  FDMultiplexer* d_fdm{0};
+  std::unique_ptr<PacketHandler> d_P;
+  ComboAddress d_recursor;
+  bool d_logDNSQueries{false};
+};
+
+void TCPNameserver::go()
+{
+  L<<Logger::Error<<"Creating backend connection for TCP"<<endl;
+  s_P=0;
   try {
-    ComboAddress recursor(st.host, st.port);
-    connectWithTimeout(sock, (struct sockaddr*)&recursor, recursor.getSocklen());
-    const string &buffer=packet->getString();
-    
-    uint16_t len=htons(buffer.length()), slen;
-    
-    writenWithTimeout(sock, &len, 2);
-    writenWithTimeout(sock, buffer.c_str(), buffer.length());
-    
-    readnWithTimeout(sock, &len, 2);
-    len=ntohs(len);
+    s_P=new PacketHandler;
+  }
+  catch(PDNSException &ae) {
+    L<<Logger::Error<<Logger::NTLog<<"TCP server is unable to launch backends - will try again when questions come in"<<endl;
+    L<<Logger::Error<<"TCP server is unable to launch backends - will try again when questions come in: "<<ae.reason<<endl;
+  }
+  for(auto worker : d_workers)
+    worker->go();
+  pthread_create(&d_tid, 0, launcher, static_cast<void *>(this));
+}
 
-    char answer[len];
-    readnWithTimeout(sock, answer, len);
+void TCPNameserver::Worker::run()
+{
+  try {
+    d_fdm=getMultiplexer();
+    d_logDNSQueries=::arg().mustDo("log-dns-queries");
+    if(!::arg()["recursor"].empty()) {
+      ServiceTuple st;
+      st.port=53;
+      parseService(::arg()["recursor"], st);
+      d_recursor=ComboAddress(st.host, st.port);
+    }
+    d_fdm->addReadFD(d_pipe[0], boost::bind(&Worker::handleNewConnection, this, _1, _2));
 
-    slen=htons(len);
-    writenWithTimeout(packet->getSocket(), &slen, 2);
-    
-    writenWithTimeout(packet->getSocket(), answer, len);
+    struct timeval now;
+    for(;;) {
+      d_fdm->run(&now); // wakes up twice a second at least
+
+      for(const auto& expired : d_fdm->getTimeouts(now)) {
+        Connection* c=boost::any_cast<Connection*>(expired.second);
+        if(expired.first == c->d_fd)
+          DLOG(L<<"Closing idle TCP connection from "<<c->d_remote.toString()<<endl);
+        else
+          L<<Logger::Info<<"Timeout waiting for the recursor to answer a question from TCP client "<<c->d_remote.toString()<<endl;
+        closeConnection(c);
+      }
+      for(const auto& expired : d_fdm->getTimeouts(now, true)) {
+        Connection* c=boost::any_cast<Connection*>(expired.second);
+        if(expired.first == c->d_fd)
+          L<<Logger::Info<<"Closing TCP connection from "<<c->d_remote.toString()<<", the client does not read its answers"<<endl;
+        else
+          L<<Logger::Info<<"Timeout sending a question from TCP client "<<c->d_remote.toString()<<" to the recursor"<<endl;
+        closeConnection(c);
+      }
+    }
+  }
+  catch(std::exception& e) {
+    L<<Logger::Error<<"TCP worker thread dying because of fatal error: "<<e.what()<<endl;
   }
-  catch(NetworkError& ae) {
-    close(sock);
-    throw NetworkError("While proxying a question to recursor "+st.host+": " +ae.what());
+  catch(PDNSException& ae) {
+    L<<Logger::Error<<"TCP worker thread dying because of fatal error: "<<ae.reason<<endl;
   }
-  close(sock);
-  return;
+  exit(1); // take rest of server with us
 }
 
+void TCPNameserver::Worker::handleNewConnection(int fd, FDMultiplexer::funcparam_t& param)
+{
+  Connection* c;
+  if(read(fd, &c, sizeof(c)) != sizeof(c))
+    return;
 
-static void incTCPAnswerCount(const ComboAddress& remote)
+  // a connection handed back after a transfer may have had the next question waiting already
+  resume(c);
+}
+
+//! waits for the next question on c, and answers those that are there already
+void TCPNameserver::Worker::resume(Connection* c)
 {
-  S.inc("tcp-answers");
-  if(remote.sin4.sin_family == AF_INET6)
-    S.inc("tcp6-answers");
-  else
-    S.inc("tcp4-answers");
+  struct timeval now;
+  gettimeofday(&now, 0);
+  d_fdm->addReadFD(c->d_fd, boost::bind(&Worker::handleReadable, this, _1, _2), c);
+  d_fdm->setReadTTD(c->d_fd, now, s_timeout);
+  c->d_reading=true;
+  answerBuffered(c);
 }
-void *TCPNameserver::doConnection(void *data)
+
+//! stops reading questions from c, as it is busy with one
+void TCPNameserver::Worker::pause(Connection* c)
 {
-  shared_ptr<DNSPacket> packet;
-  // Fix gcc-4.0 error (on AMD64)
-  int fd=(int)(long)data; // gotta love C (generates a harmless warning on opteron)
-  pthread_detach(pthread_self());
-  setNonBlocking(fd);
-  try {
-    int mesgsize=65535;
-    scoped_array<char> mesg(new char[mesgsize]);
-    
-    DLOG(L<<"TCP Connection accepted on fd "<<fd<<endl);
-    bool logDNSQueries= ::arg().mustDo("log-dns-queries");
-    for(;;) {
-      ComboAddress remote;
-      socklen_t remotelen=sizeof(remote);
-      if(getpeername(fd, (struct sockaddr *)&remote, &remotelen) < 0) {
-        L<<Logger::Warning<<"Received question from socket which had no remote address, dropping ("<<stringerror()<<")"<<endl;
-        break;
-      }
+  if(c->d_reading) {
+    d_fdm->removeReadFD(c->d_fd);
+    c->d_reading=false;
+  }
+}
 
-      uint16_t pktlen;
-      if(!readnWithTimeout(fd, &pktlen, 2, false))
-        break;
-      else
-        pktlen=ntohs(pktlen);
+void TCPNameserver::Worker::closeConnection(Connection* c)
+{
+  pause(c);
+  if(!c->d_outbuffer.empty())
+    d_fdm->removeWriteFD(c->d_fd);
+  if(c->d_recursorFD >= 0) {
+    if(c->d_recursorSent)
+      d_fdm->removeReadFD(c->d_recursorFD);
+    else
+      d_fdm->removeWriteFD(c->d_recursorFD);
+    closesocket(c->d_recursorFD);
+  }
+  dropConnection(c);
+}
 
-      // this check will always be false *if* no one touches
-      // the mesg array. pktlen can be maximum of 65535 as
-      // it is 2 byte unsigned variable. In getQuestion, we 
-      // write to 0 up to pktlen-1 so 65535 is just right. 
+void TCPNameserver::Worker::handleReadable(int fd, FDMultiplexer::funcparam_t& param)
+{
+  Connection* c=boost::any_cast<Connection*>(param);
+
+  char buf[16384];
+  ssize_t len=read(fd, buf, sizeof(buf));
+  if(len < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if(len <= 0) {
+    if(len < 0)
+      L<<Logger::Info<<"Error reading from TCP client "<<c->d_remote.toString()<<": "<<stringerror()<<endl;
+    closeConnection(c);
+    return;
+  }
+  c->d_buffer.append(buf, len);
 
-      // do not remove this check as it will catch if someone
-      // decreases the mesg buffer size for some reason. 
-      if(pktlen > mesgsize) {
-        L<<Logger::Warning<<"Received an overly large question from "<<remote.toString()<<", dropping"<<endl;
-        break;
-      }
-      
-      getQuestion(fd, mesg.get(), pktlen, remote);
-      S.inc("tcp-queries");      
-      if(remote.sin4.sin_family == AF_INET6)
-        S.inc("tcp6-queries");
-      else
-        S.inc("tcp4-queries");
+  struct timeval now;
+  gettimeofday(&now, 0);
+  d_fdm->setReadTTD(fd, now, s_timeout);
+  answerBuffered(c);
+}
 
-      packet=shared_ptr<DNSPacket>(new DNSPacket);
-      packet->setRemote(&remote);
-      packet->d_tcp=true;
-      packet->setSocket(fd);
-      if(packet->parse(mesg.get(), pktlen)<0)
-        break;
-      
-      if(packet->qtype.getCode()==QType::AXFR) {
-        if(doAXFR(packet->qdomain, packet, fd))
-          incTCPAnswerCount(remote);
-        continue;
-      }
+void TCPNameserver::Worker::answerBuffered(Connection* c)
+{
+  while(!c->isBusy() && c->d_buffer.size() >= 2) {
+    uint16_t pktlen=(((unsigned char)c->d_buffer[0]) << 8) + (unsigned char)c->d_buffer[1];
+    if(c->d_buffer.size() - 2 < pktlen)
+      break;
+    string mesg=c->d_buffer.substr(2, pktlen);
+    c->d_buffer.erase(0, 2+pktlen);
+    if(!answerQuestion(c, mesg.c_str(), pktlen)) // c is no longer ours
+      return;
+  }
+}
 
-      if(packet->qtype.getCode()==QType::IXFR) {
-        if(doIXFR(packet, fd))
-          incTCPAnswerCount(remote);
-        continue;
-      }
+//! returns false if c was closed or handed to a transfer thread
+bool TCPNameserver::Worker::answerQuestion(Connection* c, const char* mesg, uint16_t pktlen)
+try
+{
+  S.inc("tcp-queries");
+  if(c->d_remote.sin4.sin_family == AF_INET6)
+    S.inc("tcp6-queries");
+  else
+    S.inc("tcp4-queries");
+
+  shared_ptr<DNSPacket> packet=shared_ptr<DNSPacket>(new DNSPacket);
+  packet->setRemote(&c->d_remote);
+  packet->d_tcp=true;
+  packet->setSocket(c->d_fd);
+  if(packet->parse(mesg, pktlen)<0) {
+    closeConnection(c);
+    return false;
+  }
 
-      shared_ptr<DNSPacket> reply; 
-      shared_ptr<DNSPacket> cached= shared_ptr<DNSPacket>(new DNSPacket);
-      if(logDNSQueries)  {
-        string remote;
-        if(packet->hasEDNSSubnet()) 
-          remote = packet->getRemote() + "<-" + packet->getRealRemote().toString();
-        else
-          remote = packet->getRemote();
-        L << Logger::Notice<<"TCP Remote "<< remote <<" wants '" << packet->qdomain<<"|"<<packet->qtype.getName() << 
-        "', do = " <<packet->d_dnssecOk <<", bufsize = "<< packet->getMaxReplyLen()<<": ";
-      }
+  if(packet->qtype.getCode()==QType::AXFR || packet->qtype.getCode()==QType::IXFR) {
+    pause(c);
+    TransferJob* job=new TransferJob{this, c, packet};
+    pthread_t tid;
+    if(pthread_create(&tid, 0, &doTransfer, static_cast<void *>(job))) {
+      L<<Logger::Error<<"Error creating thread: "<<stringerror()<<endl;
+      delete job;
+      dropConnection(c);
+    }
+    return false;
+  }
 
+  shared_ptr<DNSPacket> reply;
+  shared_ptr<DNSPacket> cached= shared_ptr<DNSPacket>(new DNSPacket);
+  if(d_logDNSQueries)  {
+    string remote;
+    if(packet->hasEDNSSubnet())
+      remote = packet->getRemote() + "<-" + packet->getRealRemote().toString();
+    else
+      remote = packet->getRemote();
+    L << Logger::Notice<<"TCP Remote "<< remote <<" wants '" << packet->qdomain<<"|"<<packet->qtype.getName() <<
+    "', do = " <<packet->d_dnssecOk <<", bufsize = "<< packet->getMaxReplyLen()<<": ";
+  }
 
-      if(!packet->d.rd && packet->couldBeCached() && PC.get(packet.get(), cached.get(), false)) { // short circuit - does the PacketCache recognize this question?
-        if(logDNSQueries)
-          L<<"packetcache HIT"<<endl;
-        cached->setRemote(&packet->d_remote);
-        cached->d.id=packet->d.id;
-        cached->d.rd=packet->d.rd; // copy in recursion desired bit 
-        cached->commitD(); // commit d to the packet                        inlined
+  if(!packet->d.rd && packet->couldBeCached() && PC.get(packet.get(), cached.get(), false)) { // short circuit - does the PacketCache recognize this question?
+    if(d_logDNSQueries)
+      L<<"packetcache HIT"<<endl;
+    cached->setRemote(&packet->d_remote);
+    cached->d.id=packet->d.id;
+    cached->d.rd=packet->d.rd; // copy in recursion desired bit
+    cached->commitD(); // commit d to the packet                        inlined
 
-        if(LPE) LPE->police(&(*packet), &(*cached), true);
+    if(LPE) LPE->police(&(*packet), &(*cached), true);
 
-        sendPacket(cached, fd); // presigned, don't do it again
-        continue;
-      }
-      if(logDNSQueries)
-          L<<"packetcache MISS"<<endl;  
-      {
-        Lock l(&s_plock);
-        if(!s_P) {
-          L<<Logger::Error<<"TCP server is without backend connections, launching"<<endl;
-          s_P=new PacketHandler;
-        }
-        bool shouldRecurse;
+    queueAnswer(c, makeTCPMessage(*cached)); // presigned, don't do it again
+    return true;
+  }
+  if(d_logDNSQueries)
+    L<<"packetcache MISS"<<endl;
 
-        reply=shared_ptr<DNSPacket>(s_P->questionOrRecurse(packet.get(), &shouldRecurse)); // we really need to ask the backend :-)
+  if(!d_P) {
+    L<<Logger::Error<<"TCP worker is without backend connections, launching"<<endl;
+    d_P.reset(new PacketHandler);
+  }
+  bool shouldRecurse;
 
-        if(LPE) LPE->police(&(*packet), &(*reply), true);
+  reply=shared_ptr<DNSPacket>(d_P->questionOrRecurse(packet.get(), &shouldRecurse)); // we really need to ask the backend :-)
 
-        if(shouldRecurse) {
-          proxyQuestion(packet);
-          continue;
-        }
-      }
+  if(LPE) LPE->police(&(*packet), &(*reply), true);
 
-      if(!reply)  // unable to write an answer?
-        break;
+  if(shouldRecurse) {
+    proxyQuestion(c, *packet);
+    return true;
+  }
+
+  if(!reply) { // unable to write an answer?
+    closeConnection(c);
+    return false;
+  }
+
+  queueAnswer(c, makeTCPMessage(*reply));
+  return true;
+}
+catch(DBException &e) {
+  d_P.reset(); // on next question, backend will be recycled
+  L<<Logger::Error<<"TCP worker unable to answer a question because of a backend error, cycling"<<endl;
+  closeConnection(c);
+  return false;
+}
+catch(PDNSException &ae) {
+  d_P.reset();
+  L<<Logger::Error<<"TCP nameserver had error, cycling backend: "<<ae.reason<<endl;
+  closeConnection(c);
+  return false;
+}
+catch(NetworkError &e) {
+  L<<Logger::Info<<"TCP connection from "<<c->d_remote.toString()<<" closed because of network error: "<<e.what()<<endl;
+  closeConnection(c);
+  return false;
+}
+catch(std::exception &e) {
+  L<<Logger::Error<<"TCP connection from "<<c->d_remote.toString()<<" closed because of STL error: "<<e.what()<<endl;
+  closeConnection(c);
+  return false;
+}
+
+//! writes what the client takes of answer right away, the rest when it has room for more
+void TCPNameserver::Worker::queueAnswer(Connection* c, const string& answer)
+{
+  size_t written=0;
+  if(c->d_outbuffer.empty()) {
+    ssize_t ret=write(c->d_fd, answer.c_str(), answer.length());
+    if(ret < 0 && errno != EAGAIN && errno != EINTR)
+      throw NetworkError("Writing data: "+stringerror());
+    if(ret > 0)
+      written=ret;
+    if(written == answer.length())
+      return;
+
+    pause(c); // an fd can only be on one watch list
+    d_fdm->addWriteFD(c->d_fd, boost::bind(&Worker::handleWritable, this, _1, _2), c);
+    struct timeval now;
+    gettimeofday(&now, 0);
+    d_fdm->setWriteTTD(c->d_fd, now, s_timeout);
+  }
+  c->d_outbuffer.append(answer, written, string::npos);
+}
 
-      sendPacket(reply, fd);
+void TCPNameserver::Worker::handleWritable(int fd, FDMultiplexer::funcparam_t& param)
+{
+  Connection* c=boost::any_cast<Connection*>(param);
+
+  ssize_t len=write(fd, c->d_outbuffer.c_str(), c->d_outbuffer.length());
+  if(len < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if(len <= 0) {
+    L<<Logger::Info<<"Error writing to TCP client "<<c->d_remote.toString()<<": "<<stringerror()<<endl;
+    closeConnection(c);
+    return;
+  }
+  c->d_outbuffer.erase(0, len);
+
+  struct timeval now;
+  gettimeofday(&now, 0);
+  if(!c->d_outbuffer.empty()) {
+    d_fdm->setWriteTTD(fd, now, s_timeout);
+    return;
+  }
+  d_fdm->removeWriteFD(fd);
+  resume(c);
+}
+
+//! sends the question in packet to the recursor, its answer goes to c when it comes in
+void TCPNameserver::Worker::proxyQuestion(Connection* c, DNSPacket& packet)
+{
+  int sock=socket(d_recursor.sin4.sin_family, SOCK_STREAM, 0);
+  if(sock < 0)
+    throw NetworkError("Error making TCP connection socket to recursor: "+stringerror());
+  setCloseOnExec(sock);
+  setNonBlocking(sock);
+
+  if(connect(sock, (struct sockaddr*)&d_recursor, d_recursor.getSocklen()) < 0 && errno != EINPROGRESS) {
+    string reason=stringerror();
+    closesocket(sock);
+    throw NetworkError("While proxying a question to recursor "+d_recursor.toStringWithPort()+": connect: "+reason);
+  }
+
+  const string& buffer=packet.getString();
+  uint16_t len=htons(buffer.length());
+  c->d_recursorBuffer.assign((const char*)&len, 2);
+  c->d_recursorBuffer.append(buffer);
+  c->d_recursorWritten=0;
+  c->d_recursorSent=false;
+  c->d_recursorFD=sock;
+
+  pause(c);
+  d_fdm->addWriteFD(sock, boost::bind(&Worker::handleRecursorWritable, this, _1, _2), c);
+  struct timeval now;
+  gettimeofday(&now, 0);
+  d_fdm->setWriteTTD(sock, now, 5);
+}
+
+void TCPNameserver::Worker::handleRecursorWritable(int fd, FDMultiplexer::funcparam_t& param)
+{
+  Connection* c=boost::any_cast<Connection*>(param);
+
+  if(!c->d_recursorWritten) { // we are connected now, or not
+    int err;
+    Utility::socklen_t len=sizeof(err);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, (char *)&err, &len) < 0)
+      err=errno;
+    if(err) {
+      L<<Logger::Info<<"Error connecting to recursor "<<d_recursor.toStringWithPort()<<" for TCP client "<<c->d_remote.toString()<<": "<<strerror(err)<<endl;
+      closeConnection(c);
+      return;
     }
   }
+
+  ssize_t ret=write(fd, c->d_recursorBuffer.c_str() + c->d_recursorWritten, c->d_recursorBuffer.length() - c->d_recursorWritten);
+  if(ret < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if(ret <= 0) {
+    L<<Logger::Info<<"Error writing to recursor "<<d_recursor.toStringWithPort()<<" for TCP client "<<c->d_remote.toString()<<": "<<stringerror()<<endl;
+    closeConnection(c);
+    return;
+  }
+  c->d_recursorWritten+=ret;
+  if(c->d_recursorWritten < c->d_recursorBuffer.length())
+    return;
+
+  d_fdm->removeWriteFD(fd);
+  c->d_recursorBuffer.clear();
+  c->d_recursorSent=true;
+  d_fdm->addReadFD(fd, boost::bind(&Worker::handleRecursorReadable, this, _1, _2), c);
+  struct timeval now;
+  gettimeofday(&now, 0);
+  d_fdm->setReadTTD(fd, now, 5);
+}
+
+void TCPNameserver::Worker::handleRecursorReadable(int fd, FDMultiplexer::funcparam_t& param)
+{
+  Connection* c=boost::any_cast<Connection*>(param);
+
+  char buf[16384];
+  ssize_t len=read(fd, buf, sizeof(buf));
+  if(len < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if(len <= 0) {
+    L<<Logger::Info<<"Error reading from recursor "<<d_recursor.toStringWithPort()<<" for TCP client "<<c->d_remote.toString()<<": "<<(len ? stringerror() : "EOF")<<endl;
+    closeConnection(c);
+    return;
+  }
+  c->d_recursorBuffer.append(buf, len);
+  if(c->d_recursorBuffer.size() < 2)
+    return;
+  uint16_t anslen=(((unsigned char)c->d_recursorBuffer[0]) << 8) + (unsigned char)c->d_recursorBuffer[1];
+  if(c->d_recursorBuffer.size() - 2 < anslen)
+    return;
+
+  string answer=c->d_recursorBuffer.substr(0, 2+anslen);
+  d_fdm->removeReadFD(fd);
+  closesocket(fd);
+  c->d_recursorFD=-1;
+  c->d_recursorBuffer.clear();
+  try {
+    queueAnswer(c, answer);
+  }
+  catch(NetworkError& e) {
+    L<<Logger::Info<<"TCP connection from "<<c->d_remote.toString()<<" closed because of network error: "<<e.what()<<endl;
+    closeConnection(c);
+    return;
+  }
+  if(!c->isBusy())
+    resume(c);
+}
+
+void *TCPNameserver::Worker::doTransfer(void *data)
+{
+  pthread_detach(pthread_self());
+  std::unique_ptr<TransferJob> job(static_cast<TransferJob*>(data));
+  shared_ptr<DNSPacket> packet=job->d_packet;
+  Connection* c=job->d_conn;
+  try {
+    int ret;
+    if(packet->qtype.getCode()==QType::AXFR)
+      ret=doAXFR(packet->qdomain, packet, c->d_fd);
+    else
+      ret=doIXFR(packet, c->d_fd);
+    if(ret)
+      incTCPAnswerCount(c->d_remote);
+    job->d_worker->addConnection(c);
+    return 0;
+  }
   catch(DBException &e) {
     Lock l(&s_plock);
     delete s_P;
     s_P = 0;
-
-    L<<Logger::Error<<"TCP Connection Thread unable to answer a question because of a backend error, cycling"<<endl;
+    L<<Logger::Error<<"TCP transfer thread unable to answer a question because of a backend error, cycling"<<endl;
   }
   catch(PDNSException &ae) {
     Lock l(&s_plock);
@@ -379,19 +666,16 @@ void *TCPNameserver::doConnection(void *data)
     L<<Logger::Error<<"TCP nameserver had error, cycling backend: "<<ae.reason<<endl;
   }
   catch(NetworkError &e) {
-    L<<Logger::Info<<"TCP Connection Thread died because of network error: "<<e.what()<<endl;
+    L<<Logger::Info<<"TCP transfer thread died because of network error: "<<e.what()<<endl;
   }
-
   catch(std::exception &e) {
-    L<<Logger::Error<<"TCP Connection Thread died because of STL error: "<<e.what()<<endl;
+    L<<Logger::Error<<"TCP transfer thread died because of STL error: "<<e.what()<<endl;
   }
   catch( ... )
   {
-    L << Logger::Error << "TCP Connection Thread caught unknown exception." << endl;
+    L << Logger::Error << "TCP transfer thread caught unknown exception." << endl;
   }
-  d_connectionroom_sem->post();
-  closesocket(fd);
-
+  dropConnection(c);
   return 0;
 }
 
@@ -647,6 +931,20 @@ int TCPNameserver::doAXFR(const DNSName &target, shared_ptr<DNSPacket> q, int ou
   outpacket = getFreshAXFRPacket(q);
   
   ChunkedSigningPipe csp(target, securedZone, "", ::arg().asNum("signing-threads", 1));
+
+  // sends out what the signing pipe has ready, or everything it holds when flushing
+  auto sendChunks = [&](bool flush) {
+    for(;;) {
+      outpacket->getRRS() = csp.getChunk(flush);
+      if(outpacket->getRRS().empty())
+        break;
+      if(!tsigkeyname.empty())
+        outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true);
+      sendPacket(outpacket, outsock);
+      trc.d_mac=outpacket->d_trc.d_mac;
+      outpacket=getFreshAXFRPacket(q);
+    }
+  };
   
   typedef map<string, NSECXEntry> nsecxrepo_t;
   nsecxrepo_t nsecxrepo;
@@ -719,234 +1017,328 @@ int TCPNameserver::doAXFR(const DNSName &target, shared_ptr<DNSPacket> q, int ou
     csp.submit(rr);
   }
   
-  // now start list zone
-  if(!(sd.db->list(target, sd.domain_id))) {  
-    L<<Logger::Error<<"Backend signals error condition"<<endl;
-    outpacket->setRcode(2); // 'SERVFAIL'
-    sendPacket(outpacket,outsock);
-    return 0;
-  }
+  unsigned int udiff;
+  DTime dt;
+  dt.set();
+  int records=0;
 
+  /* Unsigned zones, and signed zones the backend lists in NSEC(3) order with their stored rectification,
+     are sent out while we read them. Anything else has to be collected, rectified and sorted first.
+     NSEC3 opt-out zones are collected too: rectify stores no ordername for their delegation NS records,
+     so those come first or last instead of next to the DS that puts NS in the NSEC3 bitmap. */
+  const bool optOutZone = NSEC3Zone && ns3pr.d_flags;
+  if(!securedZone || (!presignedZone && !optOutZone && ::arg().mustDo("disable-axfr-rectify") && sd.db->listOrdered(target, sd.domain_id))) {
+    if(!securedZone && !sd.db->list(target, sd.domain_id)) {
+      L<<Logger::Error<<"Backend signals error condition"<<endl;
+      outpacket->setRcode(2); // 'SERVFAIL'
+      sendPacket(outpacket,outsock);
+      return 0;
+    }
 
-  const bool rectify = !(presignedZone || ::arg().mustDo("disable-axfr-rectify"));
-  set<DNSName> qnames, nsset, terms;
-  vector<DNSResourceRecord> rrs;
+    // only the name we are collecting types for, and the one before it in the chain, are kept
+    string keyname, orderkey, firstkey, pendingkey;
+    NSECXEntry ne, pending;
+    bool haveKey=false;
+
+    auto sendNSECX = [&](const string& from, const NSECXEntry& entry, const string& next) {
+      DNSResourceRecord nrr;
+      if(NSEC3Zone) {
+        NSEC3RecordContent n3rc;
+        n3rc.d_set = entry.d_set;
+        if (n3rc.d_set.size() && (n3rc.d_set.size() != 1 || !n3rc.d_set.count(QType::NS)))
+          n3rc.d_set.insert(QType::RRSIG);
+        n3rc.d_salt=ns3pr.d_salt;
+        n3rc.d_flags = ns3pr.d_flags;
+        n3rc.d_iterations = ns3pr.d_iterations;
+        n3rc.d_algorithm = 1; // SHA1, fixed in PowerDNS for now
+        n3rc.d_nexthash = next;
+        nrr.qname = DNSName(toBase32Hex(from))+DNSName(sd.qname);
+        nrr.content = n3rc.getZoneRepresentation();
+        nrr.qtype = QType::NSEC3;
+      }
+      else {
+        NSECRecordContent nrc;
+        nrc.d_set = entry.d_set;
+        nrc.d_set.insert(QType::RRSIG);
+        nrc.d_set.insert(QType::NSEC);
+        nrc.d_next = DNSName(labelReverse(next));
+        nrr.qname = DNSName(labelReverse(from));
+        nrr.content = nrc.getZoneRepresentation();
+        nrr.qtype = QType::NSEC;
+      }
+      nrr.ttl = sd.default_ttl;
+      nrr.d_place = DNSResourceRecord::ANSWER;
+      nrr.auth=true;
+      if(csp.submit(nrr))
+        sendChunks(false);
+    };
+
+    // the name we collected types for is complete, so the one before it now knows its next name
+    auto closeEntry = [&]() {
+      if(NSEC3Zone && !ne.d_auth)
+        return;
+      if(firstkey.empty())
+        firstkey=keyname;
+      else
+        sendNSECX(pendingkey, pending, keyname);
+      pendingkey=keyname;
+      pending=ne;
+    };
+
+    if(!::arg().mustDo("direct-dnskey")) {
+      // the CDNSKEY and CDS records we created earlier
+      cds.insert(cds.end(), cdnskey.begin(), cdnskey.end());
+      for(auto& crr : cds) {
+        if(securedZone)
+          nsecxrepo[NSEC3Zone ? hashQNameWithSalt(ns3pr, crr.qname) : labelReverse(crr.qname.toString())].d_set.insert(crr.qtype.getCode());
+        if(csp.submit(crr))
+          sendChunks(false);
+      }
+    }
 
-  // Add the CDNSKEY and CDS records we created earlier
-  for (auto const &rr : cds)
-    rrs.push_back(rr);
+    while(sd.db->get(rr)) {
+      if(!rr.qname.isPartOf(target)) {
+        if (rr.qtype.getCode())
+          L<<Logger::Warning<<"Zone '"<<target<<"' contains out-of-zone data '"<<rr.qname<<"|"<<rr.qtype.getName()<<"', ignoring"<<endl;
+        continue;
+      }
 
-  for (auto const &rr : cdnskey)
-    rrs.push_back(rr);
+      if(rr.qtype.getCode() == QType::RRSIG)
+        continue;
 
-  while(sd.db->get(rr)) {
-    if(rr.qname.isPartOf(target)) {
-      if (rectify) {
-        if (rr.qtype.getCode()) {
-          qnames.insert(rr.qname);
-          if(rr.qtype.getCode() == QType::NS && rr.qname!=target)
-            nsset.insert(rr.qname);
-        } else {
-          // remove existing ents
-          continue;
+      if(::arg().mustDo("direct-dnskey") && (rr.qtype.getCode() == QType::DNSKEY || rr.qtype.getCode() == QType::CDNSKEY || rr.qtype.getCode() == QType::CDS))
+        continue;
+
+      records++;
+      if(securedZone && (rr.auth || rr.qtype.getCode() == QType::NS) && (NSEC3Zone || rr.qtype.getCode())) {
+        string key = NSEC3Zone ? hashQNameWithSalt(ns3pr, rr.qname) : labelReverse(rr.qname.toString());
+        if(!haveKey || key != keyname) {
+          string order = NSEC3Zone ? key : toLower(key);
+          if(haveKey && order <= orderkey) {
+            L<<Logger::Error<<"AXFR of domain '"<<target<<"' to "<<q->getRemote()<<" aborted: backend did not list '"<<rr.qname<<"' in NSEC"<<(NSEC3Zone ? "3" : "")<<" order, is the zone rectified?"<<endl;
+            return 0;
+          }
+          if(haveKey)
+            closeEntry();
+          // the apex may have DNSKEY and NSEC3PARAM types already
+          nsecxrepo_t::const_iterator iter = nsecxrepo.find(key);
+          ne = iter != nsecxrepo.end() ? iter->second : NSECXEntry();
+          keyname = key;
+          orderkey = order;
+          haveKey = true;
         }
+        ne.d_ttl = sd.default_ttl;
+        ne.d_auth = (ne.d_auth || rr.auth || NSEC3Zone);
+        if (rr.qtype.getCode())
+          ne.d_set.insert(rr.qtype.getCode());
       }
-      rrs.push_back(rr);
-    } else {
-      if (rr.qtype.getCode())
-        L<<Logger::Warning<<"Zone '"<<target<<"' contains out-of-zone data '"<<rr.qname<<"|"<<rr.qtype.getName()<<"', ignoring"<<endl;
-      continue;
+
+      if (!rr.qtype.getCode())
+        continue; // skip empty non-terminals
+
+      if(rr.qtype.getCode() == QType::SOA)
+        continue; // skip SOA - would indicate end of AXFR
+
+      if(csp.submit(rr))
+        sendChunks(false);
+    }
+
+    if(haveKey) {
+      closeEntry();
+      if(!firstkey.empty())
+        sendNSECX(pendingkey, pending, firstkey);
     }
   }
+  else {
+    // now start list zone
+    if(!(sd.db->list(target, sd.domain_id))) {  
+      L<<Logger::Error<<"Backend signals error condition"<<endl;
+      outpacket->setRcode(2); // 'SERVFAIL'
+      sendPacket(outpacket,outsock);
+      return 0;
+    }
 
-  if(rectify) {
-    // set auth
-    BOOST_FOREACH(DNSResourceRecord &rr, rrs) {
-      rr.auth=true;
-      if (rr.qtype.getCode() != QType::NS || rr.qname!=target) {
-        DNSName shorter(rr.qname);
-        do {
-          if (shorter==target) // apex is always auth
+
+    const bool rectify = !(presignedZone || ::arg().mustDo("disable-axfr-rectify"));
+    set<DNSName> qnames, nsset, terms;
+    vector<DNSResourceRecord> rrs;
+
+    // Add the CDNSKEY and CDS records we created earlier
+    for (auto const &rr : cds)
+      rrs.push_back(rr);
+
+    for (auto const &rr : cdnskey)
+      rrs.push_back(rr);
+
+    while(sd.db->get(rr)) {
+      if(rr.qname.isPartOf(target)) {
+        if (rectify) {
+          if (rr.qtype.getCode()) {
+            qnames.insert(rr.qname);
+            if(rr.qtype.getCode() == QType::NS && rr.qname!=target)
+              nsset.insert(rr.qname);
+          } else {
+            // remove existing ents
             continue;
-          if(nsset.count(shorter) && !(rr.qname==shorter && rr.qtype.getCode() == QType::DS))
-            rr.auth=false;
-        } while(shorter.chopOff());
-      } else
+          }
+        }
+        rrs.push_back(rr);
+      } else {
+        if (rr.qtype.getCode())
+          L<<Logger::Warning<<"Zone '"<<target<<"' contains out-of-zone data '"<<rr.qname<<"|"<<rr.qtype.getName()<<"', ignoring"<<endl;
         continue;
+      }
     }
 
-    if(NSEC3Zone) {
-      // ents are only required for NSEC3 zones
-      uint32_t maxent = ::arg().asNum("max-ent-entries");
-      map<DNSName,bool> nonterm;
+    if(rectify) {
+      // set auth
       BOOST_FOREACH(DNSResourceRecord &rr, rrs) {
-        DNSName shorter(rr.qname);
-        while(shorter != target && shorter.chopOff()) {
-          if(!qnames.count(shorter)) {
-            if(!(maxent)) {
-              L<<Logger::Warning<<"Zone '"<<target<<"' has too many empty non terminals."<<endl;
-              return 0;
+        rr.auth=true;
+        if (rr.qtype.getCode() != QType::NS || rr.qname!=target) {
+          DNSName shorter(rr.qname);
+          do {
+            if (shorter==target) // apex is always auth
+              continue;
+            if(nsset.count(shorter) && !(rr.qname==shorter && rr.qtype.getCode() == QType::DS))
+              rr.auth=false;
+          } while(shorter.chopOff());
+        } else
+          continue;
+      }
+
+      if(NSEC3Zone) {
+        // ents are only required for NSEC3 zones
+        uint32_t maxent = ::arg().asNum("max-ent-entries");
+        map<DNSName,bool> nonterm;
+        BOOST_FOREACH(DNSResourceRecord &rr, rrs) {
+          DNSName shorter(rr.qname);
+          while(shorter != target && shorter.chopOff()) {
+            if(!qnames.count(shorter)) {
+              if(!(maxent)) {
+                L<<Logger::Warning<<"Zone '"<<target<<"' has too many empty non terminals."<<endl;
+                return 0;
+              }
+              if (!nonterm.count(shorter)) {
+                nonterm.insert(pair<DNSName, bool>(shorter, rr.auth));
+                --maxent;
+              } else if (rr.auth)
+                nonterm[shorter]=true;
             }
-            if (!nonterm.count(shorter)) {
-              nonterm.insert(pair<DNSName, bool>(shorter, rr.auth));
-              --maxent;
-            } else if (rr.auth)
-              nonterm[shorter]=true;
           }
         }
-      }
 
-      pair<DNSName,bool> nt;
-      BOOST_FOREACH(nt, nonterm) {
-        DNSResourceRecord rr;
-        rr.qname=nt.first;
-        rr.qtype="TYPE0";
-        rr.auth=(nt.second || !ns3pr.d_flags);
-        rrs.push_back(rr);
+        pair<DNSName,bool> nt;
+        BOOST_FOREACH(nt, nonterm) {
+          DNSResourceRecord rr;
+          rr.qname=nt.first;
+          rr.qtype="TYPE0";
+          rr.auth=(nt.second || !ns3pr.d_flags);
+          rrs.push_back(rr);
+        }
       }
     }
-  }
 
 
-  /* now write all other records */
+    /* now write all other records */
   
-  string keyname;
-  set<string> ns3rrs;
-  unsigned int udiff;
-  DTime dt;
-  dt.set();
-  int records=0;
-  BOOST_FOREACH(DNSResourceRecord &rr, rrs) {
-    if (rr.qtype.getCode() == QType::RRSIG) {
-      RRSIGRecordContent rrc(rr.content);
-      if(presignedZone && rrc.d_type == QType::NSEC3)
-        ns3rrs.insert(fromBase32Hex(makeRelative(rr.qname.toString(), target.toString())));
-      continue;
-    }
+    string keyname;
+    set<string> ns3rrs;
+    BOOST_FOREACH(DNSResourceRecord &rr, rrs) {
+      if (rr.qtype.getCode() == QType::RRSIG) {
+        RRSIGRecordContent rrc(rr.content);
+        if(presignedZone && rrc.d_type == QType::NSEC3)
+          ns3rrs.insert(fromBase32Hex(makeRelative(rr.qname.toString(), target.toString())));
+        continue;
+      }
 
-    // only skip the DNSKEY, CDNSKEY and CDS if direct-dnskey is enabled, to avoid changing behaviour
-    // when it is not enabled.
-    if(::arg().mustDo("direct-dnskey") && (rr.qtype.getCode() == QType::DNSKEY || rr.qtype.getCode() == QType::CDNSKEY || rr.qtype.getCode() == QType::CDS))
-      continue;
+      // only skip the DNSKEY, CDNSKEY and CDS if direct-dnskey is enabled, to avoid changing behaviour
+      // when it is not enabled.
+      if(::arg().mustDo("direct-dnskey") && (rr.qtype.getCode() == QType::DNSKEY || rr.qtype.getCode() == QType::CDNSKEY || rr.qtype.getCode() == QType::CDS))
+        continue;
 
-    records++;
-    if(securedZone && (rr.auth || rr.qtype.getCode() == QType::NS)) {
-      if (NSEC3Zone || rr.qtype.getCode()) {
-        keyname = NSEC3Zone ? hashQNameWithSalt(ns3pr, rr.qname) : labelReverse(rr.qname.toString());
-        NSECXEntry& ne = nsecxrepo[keyname];
-        ne.d_ttl = sd.default_ttl;
-        ne.d_auth = (ne.d_auth || rr.auth || (NSEC3Zone && (!ns3pr.d_flags || (presignedZone && ns3pr.d_flags))));
-        if (rr.qtype.getCode()) {
-          ne.d_set.insert(rr.qtype.getCode());
+      records++;
+      if(securedZone && (rr.auth || rr.qtype.getCode() == QType::NS)) {
+        if (NSEC3Zone || rr.qtype.getCode()) {
+          keyname = NSEC3Zone ? hashQNameWithSalt(ns3pr, rr.qname) : labelReverse(rr.qname.toString());
+          NSECXEntry& ne = nsecxrepo[keyname];
+          ne.d_ttl = sd.default_ttl;
+          ne.d_auth = (ne.d_auth || rr.auth || (NSEC3Zone && (!ns3pr.d_flags || (presignedZone && ns3pr.d_flags))));
+          if (rr.qtype.getCode()) {
+            ne.d_set.insert(rr.qtype.getCode());
+          }
         }
       }
-    }
 
-    if (!rr.qtype.getCode())
-      continue; // skip empty non-terminals
-
-    if(rr.qtype.getCode() == QType::SOA)
-      continue; // skip SOA - would indicate end of AXFR
-
-    if(csp.submit(rr)) {
-      for(;;) {
-        outpacket->getRRS() = csp.getChunk();
-        if(!outpacket->getRRS().empty()) {
-          if(!tsigkeyname.empty()) 
-            outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true);
-          sendPacket(outpacket, outsock);
-          trc.d_mac=outpacket->d_trc.d_mac;
-          outpacket=getFreshAXFRPacket(q);
-        }
-        else
-          break;
-      }
+      if (!rr.qtype.getCode())
+        continue; // skip empty non-terminals
+
+      if(rr.qtype.getCode() == QType::SOA)
+        continue; // skip SOA - would indicate end of AXFR
+
+      if(csp.submit(rr))
+        sendChunks(false);
     }
-  }
-  /*
-  udiff=dt.udiffNoReset();
-  cerr<<"Starting NSEC: "<<csp.d_signed/(udiff/1000000.0)<<" sigs/s, "<<csp.d_signed<<" / "<<udiff/1000000.0<<endl;
-  cerr<<"Outstanding: "<<csp.d_outstanding<<", "<<csp.d_queued - csp.d_signed << endl;
-  cerr<<"Ready for consumption: "<<csp.getReady()<<endl;
-  */
-  if(securedZone) {
-    if(NSEC3Zone) {
-      for(nsecxrepo_t::const_iterator iter = nsecxrepo.begin(); iter != nsecxrepo.end(); ++iter) {
-        if(iter->second.d_auth && (!presignedZone || !ns3pr.d_flags || ns3rrs.count(iter->first))) {
-          NSEC3RecordContent n3rc;
-          n3rc.d_set = iter->second.d_set;
-          if (n3rc.d_set.size() && (n3rc.d_set.size() != 1 || !n3rc.d_set.count(QType::NS)))
-            n3rc.d_set.insert(QType::RRSIG);
-          n3rc.d_salt=ns3pr.d_salt;
-          n3rc.d_flags = ns3pr.d_flags;
-          n3rc.d_iterations = ns3pr.d_iterations;
-          n3rc.d_algorithm = 1; // SHA1, fixed in PowerDNS for now
-          nsecxrepo_t::const_iterator inext = iter;
-          inext++;
-          if(inext == nsecxrepo.end())
-            inext = nsecxrepo.begin();
-          while((!inext->second.d_auth || (presignedZone && ns3pr.d_flags && !ns3rrs.count(inext->first)))  && inext != iter)
-          {
+    /*
+    udiff=dt.udiffNoReset();
+    cerr<<"Starting NSEC: "<<csp.d_signed/(udiff/1000000.0)<<" sigs/s, "<<csp.d_signed<<" / "<<udiff/1000000.0<<endl;
+    cerr<<"Outstanding: "<<csp.d_outstanding<<", "<<csp.d_queued - csp.d_signed << endl;
+    cerr<<"Ready for consumption: "<<csp.getReady()<<endl;
+    */
+    if(securedZone) {
+      if(NSEC3Zone) {
+        for(nsecxrepo_t::const_iterator iter = nsecxrepo.begin(); iter != nsecxrepo.end(); ++iter) {
+          if(iter->second.d_auth && (!presignedZone || !ns3pr.d_flags || ns3rrs.count(iter->first))) {
+            NSEC3RecordContent n3rc;
+            n3rc.d_set = iter->second.d_set;
+            if (n3rc.d_set.size() && (n3rc.d_set.size() != 1 || !n3rc.d_set.count(QType::NS)))
+              n3rc.d_set.insert(QType::RRSIG);
+            n3rc.d_salt=ns3pr.d_salt;
+            n3rc.d_flags = ns3pr.d_flags;
+            n3rc.d_iterations = ns3pr.d_iterations;
+            n3rc.d_algorithm = 1; // SHA1, fixed in PowerDNS for now
+            nsecxrepo_t::const_iterator inext = iter;
             inext++;
             if(inext == nsecxrepo.end())
               inext = nsecxrepo.begin();
-          }
-          n3rc.d_nexthash = inext->first;
-          rr.qname = DNSName(toBase32Hex(iter->first))+DNSName(sd.qname);
-
-          rr.ttl = sd.default_ttl;
-          rr.content = n3rc.getZoneRepresentation();
-          rr.qtype = QType::NSEC3;
-          rr.d_place = DNSResourceRecord::ANSWER;
-          rr.auth=true;
-          if(csp.submit(rr)) {
-            for(;;) {
-              outpacket->getRRS() = csp.getChunk();
-              if(!outpacket->getRRS().empty()) {
-                if(!tsigkeyname.empty())
-                  outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true);
-                sendPacket(outpacket, outsock);
-                trc.d_mac=outpacket->d_trc.d_mac;
-                outpacket=getFreshAXFRPacket(q);
-              }
-              else
-                break;
+            while((!inext->second.d_auth || (presignedZone && ns3pr.d_flags && !ns3rrs.count(inext->first)))  && inext != iter)
+            {
+              inext++;
+              if(inext == nsecxrepo.end())
+                inext = nsecxrepo.begin();
             }
+            n3rc.d_nexthash = inext->first;
+            rr.qname = DNSName(toBase32Hex(iter->first))+DNSName(sd.qname);
+
+            rr.ttl = sd.default_ttl;
+            rr.content = n3rc.getZoneRepresentation();
+            rr.qtype = QType::NSEC3;
+            rr.d_place = DNSResourceRecord::ANSWER;
+            rr.auth=true;
+            if(csp.submit(rr))
+              sendChunks(false);
           }
         }
       }
-    }
-    else for(nsecxrepo_t::const_iterator iter = nsecxrepo.begin(); iter != nsecxrepo.end(); ++iter) {
-      NSECRecordContent nrc;
-      nrc.d_set = iter->second.d_set;
-      nrc.d_set.insert(QType::RRSIG);
-      nrc.d_set.insert(QType::NSEC);
-      if(boost::next(iter) != nsecxrepo.end()) {
-        nrc.d_next = DNSName(labelReverse(boost::next(iter)->first));
-      }
-      else
-        nrc.d_next=DNSName(labelReverse(nsecxrepo.begin()->first));
+      else for(nsecxrepo_t::const_iterator iter = nsecxrepo.begin(); iter != nsecxrepo.end(); ++iter) {
+        NSECRecordContent nrc;
+        nrc.d_set = iter->second.d_set;
+        nrc.d_set.insert(QType::RRSIG);
+        nrc.d_set.insert(QType::NSEC);
+        if(boost::next(iter) != nsecxrepo.end()) {
+          nrc.d_next = DNSName(labelReverse(boost::next(iter)->first));
+        }
+        else
+          nrc.d_next=DNSName(labelReverse(nsecxrepo.begin()->first));
   
-      rr.qname = DNSName(labelReverse(iter->first));
+        rr.qname = DNSName(labelReverse(iter->first));
   
-      rr.ttl = sd.default_ttl;
-      rr.content = nrc.getZoneRepresentation();
-      rr.qtype = QType::NSEC;
-      rr.d_place = DNSResourceRecord::ANSWER;
-      rr.auth=true;
-      if(csp.submit(rr)) {
-        for(;;) {
-          outpacket->getRRS() = csp.getChunk();
-          if(!outpacket->getRRS().empty()) {
-            if(!tsigkeyname.empty())
-              outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true); 
-            sendPacket(outpacket, outsock);
-            trc.d_mac=outpacket->d_trc.d_mac;
-            outpacket=getFreshAXFRPacket(q);
-          }
-          else
-            break;
-        }
+        rr.ttl = sd.default_ttl;
+        rr.content = nrc.getZoneRepresentation();
+        rr.qtype = QType::NSEC;
+        rr.d_place = DNSResourceRecord::ANSWER;
+        rr.auth=true;
+        if(csp.submit(rr))
+          sendChunks(false);
       }
     }
   }
@@ -956,18 +1348,7 @@ int TCPNameserver::doAXFR(const DNSName &target, shared_ptr<DNSPacket> q, int ou
   cerr<<"Outstanding: "<<csp.d_outstanding<<", "<<csp.d_queued - csp.d_signed << endl;
   cerr<<"Ready for consumption: "<<csp.getReady()<<endl;
   * */
-  for(;;) { 
-    outpacket->getRRS() = csp.getChunk(true); // flush the pipe
-    if(!outpacket->getRRS().empty()) {
-      if(!tsigkeyname.empty())
-        outpacket->setTSIGDetails(trc, tsigkeyname, tsigsecret, trc.d_mac, true); // first answer is 'normal'
-      sendPacket(outpacket, outsock);
-      trc.d_mac=outpacket->d_trc.d_mac;
-      outpacket=getFreshAXFRPacket(q);
-    }
-    else 
-      break;
-  }
+  sendChunks(true); // flush the pipe
   
   udiff=dt.udiffNoReset();
   if(securedZone) 
@@ -1113,6 +1494,8 @@ int TCPNameserver::doIXFR(shared_ptr<DNSPacket> q, int outsock)
 
 TCPNameserver::~TCPNameserver()
 {
+  for(auto worker : d_workers)
+    delete worker;
   delete d_connectionroom_sem;
 }
 
@@ -1121,7 +1504,12 @@ TCPNameserver::TCPNameserver()
 //  sem_init(&d_connectionroom_sem,0,::arg().asNum("max-tcp-connections"));
   d_connectionroom_sem = new Semaphore( ::arg().asNum( "max-tcp-connections" ));
   d_tid=0;
-  s_timeout=10;
+  s_timeout=::arg().asNum("tcp-idle-timeout");
+  unsigned int workers=::arg().asNum("tcp-threads");
+  if(!workers)
+    workers=1;
+  for(unsigned int n=0; n < workers; ++n)
+    d_workers.push_back(new Worker);
   vector<string>locals;
   stringtok(locals,::arg()["local-address"]," ,");
 
@@ -1221,14 +1609,14 @@ TCPNameserver::TCPNameserver()
 }
 
 
-//! Start of TCP operations thread, we launch a new thread for each incoming TCP question
+//! Start of TCP operations thread, which hands each incoming TCP connection to a worker
 void TCPNameserver::thread()
 {
   try {
     for(;;) {
       int fd;
-      struct sockaddr_in remote;
-      Utility::socklen_t addrlen=sizeof(remote);
+      ComboAddress remote;
+      Utility::socklen_t addrlen;
 
       int ret=poll(&d_prfds[0], d_prfds.size(), -1); // blocks, forever if need be
       if(ret <= 0)
@@ -1238,7 +1626,7 @@ void TCPNameserver::thread()
       BOOST_FOREACH(const struct pollfd& pfd, d_prfds) {
         if(pfd.revents == POLLIN) {
           sock = pfd.fd;
-          addrlen=sizeof(remote);
+          addrlen=sizeof(remote.sin6);
 
           if((fd=accept(sock, (sockaddr*)&remote, &addrlen))<0) {
             L<<Logger::Error<<"TCP question accept error: "<<strerror(errno)<<endl;
@@ -1249,7 +1637,6 @@ void TCPNameserver::thread()
             }
           }
           else {
-            pthread_t tid;
             d_connectionroom_sem->wait(); // blocks if no connections are available
 
             int room;
@@ -1257,10 +1644,9 @@ void TCPNameserver::thread()
             if(room<1)
               L<<Logger::Warning<<Logger::NTLog<<"Limit of simultaneous TCP connections reached - raise max-tcp-connections"<<endl;
 
-            if(pthread_create(&tid, 0, &doConnection, reinterpret_cast<void*>(fd))) {
-              L<<Logger::Error<<"Error creating thread: "<<stringerror()<<endl;
-              d_connectionroom_sem->post();
-            }
+            setNonBlocking(fd);
+            setCloseOnExec(fd);
+            d_workers[d_nextWorker++ % d_workers.size()]->addConnection(new Connection(fd, remote));
           }
         }
       }
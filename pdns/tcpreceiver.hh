@@ -48,14 +48,13 @@ public:
   ~TCPNameserver();
   void go();
 private:
+  class Worker;
+  struct Connection;
 
   static void sendPacket(std::shared_ptr<DNSPacket> p, int outsock);
-  static int readLength(int fd, ComboAddress *remote);
-  static void getQuestion(int fd, char *mesg, int pktlen, const ComboAddress& remote);
   static int doAXFR(const DNSName &target, std::shared_ptr<DNSPacket> q, int outsock);
   static int doIXFR(std::shared_ptr<DNSPacket> q, int outsock);
   static bool canDoAXFR(std::shared_ptr<DNSPacket> q);
-  static void *doConnection(void *data);
   static void *launcher(void *data);
   void thread(void);
   static pthread_mutex_t s_plock;
@@ -66,7 +65,9 @@ private:
 
   vector<int>d_sockets;
   vector<struct pollfd> d_prfds;
-  static int s_timeout;
+  vector<Worker*> d_workers;
+  unsigned int d_nextWorker{0};
+  static int s_timeout; //!< seconds a connection may be idle
 };
 
 #endif /* PDNS_TCPRECEIVER_HH */
@@ -0,0 +1,121 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist-idstate.hh"
+
+BOOST_AUTO_TEST_SUITE(dnsdistidstate_cc)
+
+static void setQName(IDQNames& qnames, unsigned int slot, const DNSName& qname)
+{
+  string wire = qname.toDNSString();
+  qnames.set(slot, wire.c_str(), wire.size());
+}
+
+BOOST_AUTO_TEST_CASE(test_PickSkipsBusySlots) {
+  vector<IDState> idStates(16);
+  std::atomic<uint64_t> idOffset{0};
+  bool reused;
+
+  BOOST_CHECK_EQUAL(pickIDState(idStates, idOffset, reused), 0);
+  BOOST_CHECK(!reused);
+  BOOST_CHECK_EQUAL(pickIDState(idStates, idOffset, reused), 1);
+  BOOST_CHECK(!reused);
+
+  // everything waits for an answer except slot 12
+  for(auto& ids : idStates)
+    ids.origFD = 1;
+  idStates[12].origFD = -1;
+
+  // 8 probes, 2 to 9, then slot 9 is reused
+  BOOST_CHECK_EQUAL(pickIDState(idStates, idOffset, reused), 9);
+  BOOST_CHECK(reused);
+  // 10 and 11 are skipped
+  BOOST_CHECK_EQUAL(pickIDState(idStates, idOffset, reused), 12);
+  BOOST_CHECK(!reused);
+  BOOST_CHECK_EQUAL(idOffset.load(), 13);
+
+  // wraps around
+  idStates[0].origFD = -1;
+  BOOST_CHECK_EQUAL(pickIDState(idStates, idOffset, reused), 0);
+  BOOST_CHECK(!reused);
+}
+
+BOOST_AUTO_TEST_CASE(test_Timeouts) {
+  vector<IDState> idStates(4);
+  IDQNames qnames;
+  qnames.resize(4);
+  Rings rings(100, 1);
+
+  idStates[1].origFD = 1;
+  idStates[1].qtype = QType::AAAA;
+  setQName(qnames, 1, DNSName("www.powerdns.com."));
+  idStates[3].origFD = 1;
+  idStates[3].qtype = QType::A;
+  setQName(qnames, 3, DNSName("powerdns.com."));
+
+  BOOST_CHECK_EQUAL(expireIDStates(idStates, qnames, rings), 0);
+  BOOST_CHECK_EQUAL(expireIDStates(idStates, qnames, rings), 0);
+  // an answer for slot 3
+  idStates[3].origFD = -1;
+  idStates[3].age = 0;
+  BOOST_CHECK_EQUAL(expireIDStates(idStates, qnames, rings), 0);
+  BOOST_CHECK_EQUAL(expireIDStates(idStates, qnames, rings), 1);
+  BOOST_CHECK_EQUAL(idStates[1].origFD, -1);
+  BOOST_CHECK_EQUAL(idStates[1].age, 0);
+  BOOST_CHECK_EQUAL(expireIDStates(idStates, qnames, rings), 0);
+
+  // without the qnames, timeouts are recorded all the same
+  idStates[2].origFD = 1;
+  idStates[2].qtype = QType::MX;
+  for(int n = 0; n < 4; ++n)
+    expireIDStates(idStates, IDQNames(), rings);
+
+  vector<Rings::Response> responses;
+  rings.forEachResponse([&responses](const Rings::Response& r) { responses.push_back(r); });
+  BOOST_REQUIRE_EQUAL(responses.size(), 2);
+  BOOST_CHECK_EQUAL(responses[0].name, DNSName("www.powerdns.com."));
+  BOOST_CHECK_EQUAL(responses[0].qtype, QType::AAAA);
+  BOOST_CHECK_EQUAL(responses[0].usec, 2000000);
+  BOOST_CHECK(responses[1].name.empty());
+  BOOST_CHECK_EQUAL(responses[1].qtype, QType::MX);
+}
+
+BOOST_AUTO_TEST_CASE(test_QNames) {
+  IDQNames qnames;
+  BOOST_CHECK(qnames.empty());
+  BOOST_CHECK(qnames.get(0).empty());
+  qnames.resize(2);
+  BOOST_CHECK(!qnames.empty());
+  BOOST_CHECK(qnames.get(0).empty());
+
+  // as it was in the query
+  string wire("\003www\010PowerDNS\003com", 17);
+  wire.append(1, 0);
+  qnames.set(1, wire.c_str(), wire.size());
+  BOOST_CHECK_EQUAL(qnames.get(1).toString(), "www.PowerDNS.com.");
+  BOOST_CHECK(qnames.get(0).empty());
+  BOOST_CHECK(qnames.get(2).empty());
+
+  // a shorter name replaces a longer one entirely
+  setQName(qnames, 1, DNSName("a."));
+  BOOST_CHECK_EQUAL(qnames.get(1), DNSName("a."));
+  setQName(qnames, 1, DNSName("."));
+  BOOST_CHECK_EQUAL(qnames.get(1), DNSName("."));
+
+  // garbage is not kept
+  string garbage(300, 'x');
+  qnames.set(1, garbage.c_str(), garbage.size());
+  BOOST_CHECK(qnames.get(1).empty());
+}
+
+// the slot itself stays small, the qname is kept apart
+BOOST_AUTO_TEST_CASE(test_Size) {
+  BOOST_CHECK_LE(sizeof(IDState), 136);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,153 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist-cache.hh"
+#include "dnswriter.hh"
+
+BOOST_AUTO_TEST_SUITE(dnsdistpacketcache_cc)
+
+static void makeQueryAndResponse(const DNSName& qname, uint16_t id, uint32_t ttl, vector<uint8_t>& query, vector<uint8_t>& response)
+{
+  DNSPacketWriter pwQ(query, qname, QType::A, QClass::IN, 0);
+  pwQ.getHeader()->rd = 1;
+  pwQ.getHeader()->id = id;
+
+  DNSPacketWriter pwR(response, qname, QType::A, QClass::IN, 0);
+  pwR.getHeader()->rd = 1;
+  pwR.getHeader()->ra = 1;
+  pwR.getHeader()->qr = 1;
+  pwR.getHeader()->id = id;
+  pwR.startRecord(qname, QType::A, ttl, QClass::IN, DNSResourceRecord::ANSWER);
+  pwR.xfr32BitInt(0x01020304);
+  pwR.commit();
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheSimple) {
+  DNSDistPacketCache PC(20000);
+
+  size_t counter=0;
+  size_t skipped=0;
+  for(counter = 0; counter < 10000; ++counter) {
+    DNSName a=DNSName(std::to_string(counter))+DNSName("hello");
+    vector<uint8_t> query, response;
+    makeQueryAndResponse(a, counter, 7200, query, response);
+
+    char responseBuf[4096];
+    uint16_t responseBufSize = sizeof(responseBuf);
+    uint32_t key = 0;
+    bool found = PC.get((const char*) query.data(), query.size(), a, QType::A, QClass::IN, a.wirelength(), responseBuf, &responseBufSize, &key);
+    BOOST_CHECK_EQUAL(found, false);
+
+    PC.insert(key, a, QType::A, QClass::IN, (const char*) response.data(), response.size());
+
+    found = PC.get((const char*) query.data(), query.size(), a, QType::A, QClass::IN, a.wirelength(), responseBuf, &responseBufSize, &key, true);
+    if(found) {
+      BOOST_CHECK_EQUAL(responseBufSize, response.size());
+      BOOST_CHECK_EQUAL(memcmp(responseBuf, response.data(), response.size()), 0);
+    }
+    else {
+      skipped++;
+    }
+  }
+  /* entries are spread over shards with a fixed capacity, so a few might not fit */
+  BOOST_CHECK_EQUAL(PC.getSize() + skipped, counter);
+
+  size_t deleted=0;
+  for(size_t delcounter=0; delcounter < counter/1000; ++delcounter) {
+    DNSName a=DNSName(std::to_string(delcounter))+DNSName("hello");
+    size_t before = PC.getSize();
+    PC.expungeByName(a);
+    deleted += before - PC.getSize();
+  }
+  BOOST_CHECK_EQUAL(PC.getSize(), counter - skipped - deleted);
+
+  PC.expungeByName(DNSName("hello."), QType::ANY, true);
+  BOOST_CHECK_EQUAL(PC.getSize(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheIDAndTTL) {
+  DNSDistPacketCache PC(100, 86400, 0);
+  DNSName a("powerdns.com.");
+
+  vector<uint8_t> query, response;
+  makeQueryAndResponse(a, 42, 3600, query, response);
+  uint32_t key = DNSDistPacketCache::getKey((const char*) query.data(), query.size(), a.wirelength());
+  BOOST_CHECK_EQUAL(DNSDistPacketCache::getMinTTL((const char*) response.data(), response.size()), 3600);
+  PC.insert(key, a, QType::A, QClass::IN, (const char*) response.data(), response.size());
+
+  /* same question, different ID and case: must be a hit, with the ID and qname of the new query */
+  vector<uint8_t> otherQuery, otherResponse;
+  DNSName upper("PowerDNS.COM.");
+  makeQueryAndResponse(upper, 4242, 3600, otherQuery, otherResponse);
+  BOOST_CHECK_EQUAL(DNSDistPacketCache::getKey((const char*) otherQuery.data(), otherQuery.size(), upper.wirelength()), key);
+
+  char responseBuf[4096];
+  uint16_t responseBufSize = sizeof(responseBuf);
+  BOOST_REQUIRE(PC.get((const char*) otherQuery.data(), otherQuery.size(), upper, QType::A, QClass::IN, upper.wirelength(), responseBuf, &responseBufSize, nullptr));
+  BOOST_CHECK_EQUAL(responseBufSize, response.size());
+  BOOST_CHECK_EQUAL(((struct dnsheader*)responseBuf)->id, 4242);
+  BOOST_CHECK_EQUAL(memcmp(responseBuf + sizeof(dnsheader), otherQuery.data() + sizeof(dnsheader), upper.wirelength()), 0);
+  BOOST_CHECK_EQUAL(DNSDistPacketCache::getMinTTL(responseBuf, responseBufSize) <= 3600, true);
+
+  /* a different qtype must not match */
+  BOOST_CHECK(!PC.get((const char*) query.data(), query.size(), a, QType::AAAA, QClass::IN, a.wirelength(), responseBuf, &responseBufSize, nullptr));
+  BOOST_CHECK_EQUAL(PC.getLookupCollisions(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheExpiry) {
+  DNSDistPacketCache PC(100, 86400, 0, 1);
+  DNSName shortLived("short.powerdns.com."), longLived("long.powerdns.com."), uncacheable("zero.powerdns.com.");
+
+  vector<uint8_t> shortQuery, shortResponse, longQuery, longResponse, zeroQuery, zeroResponse;
+  makeQueryAndResponse(shortLived, 1, 1, shortQuery, shortResponse);
+  makeQueryAndResponse(longLived, 2, 3600, longQuery, longResponse);
+  makeQueryAndResponse(uncacheable, 3, 0, zeroQuery, zeroResponse);
+
+  char responseBuf[4096];
+  uint16_t responseBufSize = sizeof(responseBuf);
+  uint32_t shortKey = 0, longKey = 0, zeroKey = 0;
+  BOOST_CHECK(!PC.get((const char*) shortQuery.data(), shortQuery.size(), shortLived, QType::A, QClass::IN, shortLived.wirelength(), responseBuf, &responseBufSize, &shortKey));
+  BOOST_CHECK(!PC.get((const char*) longQuery.data(), longQuery.size(), longLived, QType::A, QClass::IN, longLived.wirelength(), responseBuf, &responseBufSize, &longKey));
+  BOOST_CHECK(!PC.get((const char*) zeroQuery.data(), zeroQuery.size(), uncacheable, QType::A, QClass::IN, uncacheable.wirelength(), responseBuf, &responseBufSize, &zeroKey));
+  BOOST_CHECK_EQUAL(PC.getMisses(), 3);
+
+  PC.insert(shortKey, shortLived, QType::A, QClass::IN, (const char*) shortResponse.data(), shortResponse.size());
+  PC.insert(longKey, longLived, QType::A, QClass::IN, (const char*) longResponse.data(), longResponse.size());
+  /* a zero TTL answer is never cached */
+  PC.insert(zeroKey, uncacheable, QType::A, QClass::IN, (const char*) zeroResponse.data(), zeroResponse.size());
+  BOOST_CHECK_EQUAL(PC.getSize(), 2);
+
+  BOOST_CHECK(PC.get((const char*) shortQuery.data(), shortQuery.size(), shortLived, QType::A, QClass::IN, shortLived.wirelength(), responseBuf, &responseBufSize, nullptr));
+  BOOST_CHECK_EQUAL(PC.getHits(), 1);
+
+  /* an entry is valid up to and including the second its TTL runs out */
+  sleep(2);
+
+  responseBufSize = sizeof(responseBuf);
+  BOOST_CHECK(!PC.get((const char*) shortQuery.data(), shortQuery.size(), shortLived, QType::A, QClass::IN, shortLived.wirelength(), responseBuf, &responseBufSize, nullptr));
+  responseBufSize = sizeof(responseBuf);
+  BOOST_REQUIRE(PC.get((const char*) longQuery.data(), longQuery.size(), longLived, QType::A, QClass::IN, longLived.wirelength(), responseBuf, &responseBufSize, nullptr));
+  BOOST_CHECK(DNSDistPacketCache::getMinTTL(responseBuf, responseBufSize) <= 3598);
+  BOOST_CHECK_EQUAL(PC.getHits(), 2);
+  BOOST_CHECK_EQUAL(PC.getMisses(), 4);
+
+  /* the expired entry stays until it is purged */
+  BOOST_CHECK_EQUAL(PC.getSize(), 2);
+  PC.purgeExpired();
+  BOOST_CHECK_EQUAL(PC.getSize(), 1);
+  responseBufSize = sizeof(responseBuf);
+  BOOST_CHECK(PC.get((const char*) longQuery.data(), longQuery.size(), longLived, QType::A, QClass::IN, longLived.wirelength(), responseBuf, &responseBufSize, nullptr));
+
+  /* a fresh answer replaces the expired one */
+  PC.insert(shortKey, shortLived, QType::A, QClass::IN, (const char*) shortResponse.data(), shortResponse.size());
+  responseBufSize = sizeof(responseBuf);
+  BOOST_CHECK(PC.get((const char*) shortQuery.data(), shortQuery.size(), shortLived, QType::A, QClass::IN, shortLived.wirelength(), responseBuf, &responseBufSize, nullptr));
+  BOOST_CHECK_EQUAL(PC.getSize(), 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
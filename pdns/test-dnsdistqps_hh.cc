@@ -0,0 +1,61 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist-qps.hh"
+
+BOOST_AUTO_TEST_SUITE(dnsdistqps_hh)
+
+static ComboAddress makeAddress(unsigned int n)
+{
+  return ComboAddress("10." + std::to_string((n >> 16) & 0xff) + "." + std::to_string((n >> 8) & 0xff) + "." + std::to_string(n & 0xff));
+}
+
+BOOST_AUTO_TEST_CASE(test_Limit) {
+  QPSLimiterTable table(1, 65536, 300);
+  time_t now = time(nullptr);
+
+  BOOST_CHECK(table.check(makeAddress(1), now));
+  BOOST_CHECK(!table.check(makeAddress(1), now));
+  BOOST_CHECK(table.check(makeAddress(2), now));
+  BOOST_CHECK(table.check(ComboAddress("2001:db8::1"), now));
+  BOOST_CHECK(!table.check(ComboAddress("2001:db8::1"), now));
+  BOOST_CHECK_EQUAL(table.getEntriesCount(), 3);
+  BOOST_CHECK_EQUAL(table.getEvictionsCount(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_Full) {
+  const unsigned int expiration = 300;
+  // the smallest table there is, a few slots per shard
+  QPSLimiterTable table(1, 0, expiration);
+  BOOST_REQUIRE_EQUAL(table.getSize(), QPSLimiterTable::s_shards * QPSLimiterTable::s_probes);
+  time_t now = time(nullptr);
+
+  const unsigned int sources = 1000;
+  for(unsigned int n = 0; n < sources; ++n)
+    BOOST_CHECK(table.check(makeAddress(n), now));
+
+  // it does not grow, the newest sources pushed out older ones
+  BOOST_CHECK_EQUAL(table.getEntriesCount(), table.getSize());
+  BOOST_CHECK_EQUAL(table.getEvictionsCount(), sources - table.getSize());
+  BOOST_CHECK(!table.check(makeAddress(sources - 1), now));
+
+  // a source that was pushed out starts over
+  BOOST_CHECK(table.check(makeAddress(0), now));
+  BOOST_CHECK_EQUAL(table.getEvictionsCount(), sources - table.getSize() + 1);
+
+  // the others have not expired yet
+  BOOST_CHECK(table.check(makeAddress(sources), now + expiration - 1));
+  BOOST_CHECK_EQUAL(table.getEvictionsCount(), sources - table.getSize() + 2);
+
+  // now they have, reusing their slot is not an eviction
+  BOOST_CHECK(table.check(makeAddress(sources + 1), now + expiration));
+  BOOST_CHECK_EQUAL(table.getEvictionsCount(), sources - table.getSize() + 2);
+  BOOST_CHECK_EQUAL(table.getEntriesCount(), table.getSize());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
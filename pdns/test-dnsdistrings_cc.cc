@@ -0,0 +1,90 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include <thread>
+
+#include "dnsdist-rings.hh"
+
+BOOST_AUTO_TEST_SUITE(dnsdistrings_cc)
+
+BOOST_AUTO_TEST_CASE(test_RingsMerge) {
+  Rings rings(100, 4);
+  BOOST_CHECK_EQUAL(rings.getNumberOfShards(), 4);
+
+  for(unsigned int n = 0; n < 40; ++n) {
+    rings.insertClient(ComboAddress("192.0.2." + std::to_string(n % 4)));
+    rings.insertQuery(DNSName(std::to_string(n % 2)) + DNSName("powerdns.com."));
+    rings.insertResponse(DNSName("powerdns.com."), QType::A, n < 10 ? 2 : 0, 100);
+  }
+
+  map<ComboAddress, int, ComboAddress::addressOnlyLessThan> clients;
+  rings.forEachClient([&clients](const ComboAddress& c) { clients[c]++; });
+  BOOST_REQUIRE_EQUAL(clients.size(), 4);
+  for(const auto& c : clients)
+    BOOST_CHECK_EQUAL(c.second, 10);
+
+  map<DNSName, int> queries;
+  rings.forEachQuery([&queries](const DNSName& q) { queries[q]++; });
+  BOOST_REQUIRE_EQUAL(queries.size(), 2);
+  BOOST_CHECK_EQUAL(queries[DNSName("0.powerdns.com.")], 20);
+  BOOST_CHECK_EQUAL(queries[DNSName("1.powerdns.com.")], 20);
+
+  unsigned int servfails = 0, total = 0;
+  rings.forEachResponse([&](const Rings::Response& r) {
+      total++;
+      if(r.rcode == 2)
+        servfails++;
+    });
+  BOOST_CHECK_EQUAL(total, 40);
+  BOOST_CHECK_EQUAL(servfails, 10);
+}
+
+BOOST_AUTO_TEST_CASE(test_RingsCapacity) {
+  Rings rings(10, 2);
+
+  for(unsigned int n = 0; n < 100; ++n)
+    rings.insertResponse(DNSName("powerdns.com."), QType::A, 0, n);
+
+  /* each shard only keeps its last 5 entries */
+  unsigned int total = 0;
+  rings.forEachResponse([&](const Rings::Response& r) {
+      total++;
+      BOOST_CHECK_GE(r.usec, 90);
+    });
+  BOOST_CHECK_EQUAL(total, 10);
+
+  /* zero shards means a single one */
+  rings.setCapacity(10, 0);
+  BOOST_CHECK_EQUAL(rings.getNumberOfShards(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_RingsThreaded) {
+  Rings rings(1000, 4);
+  vector<std::thread> threads;
+
+  for(unsigned int t = 0; t < 4; ++t) {
+    threads.push_back(std::thread([&rings]() {
+          for(unsigned int n = 0; n < 10000; ++n)
+            rings.insertQuery(DNSName("powerdns.com."));
+        }));
+  }
+
+  for(unsigned int n = 0; n < 100; ++n) {
+    unsigned int count = 0;
+    rings.forEachQuery([&count](const DNSName& q) { count++; });
+    BOOST_CHECK_LE(count, 1000);
+  }
+
+  for(auto& t : threads)
+    t.join();
+
+  unsigned int count = 0;
+  rings.forEachQuery([&count](const DNSName& q) { count++; });
+  BOOST_CHECK_EQUAL(count, 1000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,168 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include "filterpo.hh"
+#include "dnsrecords.hh"
+
+BOOST_AUTO_TEST_SUITE(filterpo_cc)
+
+typedef DNSFilterEngine::PolicyKind Kind;
+
+BOOST_AUTO_TEST_CASE(test_qname_triggers) {
+  DNSFilterEngine dfe;
+  ComboAddress client("192.0.2.1");
+  dfe.addQNameTrigger(DNSName("powerdns.com."), {Kind::Drop});
+  dfe.addQNameTrigger(DNSName("*.powerdns.com."), {Kind::NXDOMAIN});
+  dfe.addQNameTrigger(DNSName("www.powerdns.com."), {Kind::NODATA});
+  dfe.addQNameTrigger(DNSName("*.example.net."), {Kind::Truncate});
+
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("www.powerdns.com."), client).d_kind == Kind::NODATA);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("WWW.PowerDNS.com."), client).d_kind == Kind::NODATA);
+  // a name also covers what is below it, and wins from a wildcard next to it
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("powerdns.com."), client).d_kind == Kind::Drop);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("mail.powerdns.com."), client).d_kind == Kind::Drop);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("a.www.powerdns.com."), client).d_kind == Kind::NODATA);
+
+  // a wildcard does not match the name it is next to
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("example.net."), client).d_kind == Kind::NoAction);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("a.b.example.net."), client).d_kind == Kind::Truncate);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("powerdns.net."), client).d_kind == Kind::NoAction);
+
+  BOOST_CHECK(dfe.rmQNameTrigger(DNSName("powerdns.com."), {Kind::Drop}));
+  BOOST_CHECK(!dfe.rmQNameTrigger(DNSName("powerdns.com."), {Kind::Drop}));
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("powerdns.com."), client).d_kind == Kind::NoAction);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("mail.powerdns.com."), client).d_kind == Kind::NXDOMAIN);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("www.powerdns.com."), client).d_kind == Kind::NODATA);
+
+  dfe.addNSTrigger(DNSName("ns.example.org."), {Kind::Drop});
+  BOOST_CHECK(dfe.getProcessingPolicy(DNSName("ns.example.org.")).d_kind == Kind::Drop);
+  BOOST_CHECK(dfe.getProcessingPolicy(DNSName("example.org.")).d_kind == Kind::NoAction);
+}
+
+BOOST_AUTO_TEST_CASE(test_address_triggers) {
+  DNSFilterEngine dfe;
+  DNSName qname("www.powerdns.com.");
+  dfe.addClientTrigger(Netmask("192.0.2.0/24"), {Kind::Drop});
+  dfe.addClientTrigger(Netmask("192.0.2.128/25"), {Kind::NXDOMAIN});
+  dfe.addClientTrigger(Netmask("2001:db8::/32"), {Kind::Truncate});
+
+  BOOST_CHECK(dfe.getQueryPolicy(qname, ComboAddress("192.0.2.1")).d_kind == Kind::Drop);
+  BOOST_CHECK(dfe.getQueryPolicy(qname, ComboAddress("192.0.2.200")).d_kind == Kind::NXDOMAIN);
+  BOOST_CHECK(dfe.getQueryPolicy(qname, ComboAddress("2001:db8::1")).d_kind == Kind::Truncate);
+  BOOST_CHECK(dfe.getQueryPolicy(qname, ComboAddress("198.51.100.1")).d_kind == Kind::NoAction);
+
+  // only removed if the policy matches
+  BOOST_CHECK(!dfe.rmClientTrigger(Netmask("192.0.2.128/25"), {Kind::Drop}));
+  BOOST_CHECK(dfe.rmClientTrigger(Netmask("192.0.2.128/25"), {Kind::NXDOMAIN}));
+  BOOST_CHECK(dfe.getQueryPolicy(qname, ComboAddress("192.0.2.200")).d_kind == Kind::Drop);
+
+  dfe.addResponseTrigger(Netmask("203.0.113.0/24"), {Kind::NODATA}, 1);
+  vector<DNSRecord> records;
+  DNSRecord dr;
+  dr.d_name = qname;
+  dr.d_type = QType::A;
+  dr.d_place = DNSResourceRecord::ANSWER;
+  dr.d_content = std::make_shared<ARecordContent>(ComboAddress("198.51.100.1"));
+  records.push_back(dr);
+  BOOST_CHECK(dfe.getPostPolicy(records).d_kind == Kind::NoAction);
+  dr.d_content = std::make_shared<ARecordContent>(ComboAddress("203.0.113.5"));
+  records.push_back(dr);
+  BOOST_CHECK(dfe.getPostPolicy(records).d_kind == Kind::NODATA);
+
+  dfe.clear(1);
+  BOOST_CHECK(dfe.getPostPolicy(records).d_kind == Kind::NoAction);
+}
+
+BOOST_AUTO_TEST_CASE(test_zone_order) {
+  DNSFilterEngine dfe;
+  ComboAddress client("192.0.2.1");
+  dfe.addQNameTrigger(DNSName("www.powerdns.com."), {Kind::Drop}, 1);
+  dfe.addQNameTrigger(DNSName("powerdns.com."), {Kind::NXDOMAIN}, 0);
+
+  // the first zone with a match wins, however specific the match in a later zone
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("www.powerdns.com."), client).d_kind == Kind::NXDOMAIN);
+
+  // copies are independent
+  DNSFilterEngine copy(dfe);
+  dfe.clear();
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("www.powerdns.com."), client).d_kind == Kind::NoAction);
+  BOOST_CHECK(copy.getQueryPolicy(DNSName("www.powerdns.com."), client).d_kind == Kind::NXDOMAIN);
+}
+
+BOOST_AUTO_TEST_CASE(test_copy_on_write) {
+  DNSFilterEngine dfe;
+  ComboAddress client("192.0.2.1");
+  dfe.addQNameTrigger(DNSName("powerdns.com."), {Kind::Drop}, 0);
+  dfe.addQNameTrigger(DNSName("example.net."), {Kind::Drop}, 1);
+
+  DNSFilterEngine copy(dfe);
+  copy.addQNameTrigger(DNSName("example.com."), {Kind::NXDOMAIN}, 0);
+  BOOST_CHECK(copy.rmQNameTrigger(DNSName("powerdns.com."), {Kind::Drop}, 0));
+  copy.addClientTrigger(Netmask("192.0.2.0/24"), {Kind::Truncate}, 1);
+
+  BOOST_CHECK(copy.getQueryPolicy(DNSName("example.com."), client).d_kind == Kind::NXDOMAIN);
+  BOOST_CHECK(copy.getQueryPolicy(DNSName("powerdns.com."), client).d_kind == Kind::Truncate);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("example.com."), client).d_kind == Kind::NoAction);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("powerdns.com."), client).d_kind == Kind::Drop);
+
+  // a zone handed over by setZone is shared until one side changes it
+  DNSFilterEngine fresh;
+  fresh.addQNameTrigger(DNSName("example.org."), {Kind::NODATA}, 1);
+  dfe.setZone(1, fresh);
+  fresh.addQNameTrigger(DNSName("www.example.org."), {Kind::Drop}, 1);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("www.example.org."), client).d_kind == Kind::NODATA);
+  BOOST_CHECK(fresh.getQueryPolicy(DNSName("www.example.org."), client).d_kind == Kind::Drop);
+  fresh.clear(1);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("example.org."), client).d_kind == Kind::NODATA);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("example.net."), client).d_kind == Kind::NoAction);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("powerdns.com."), client).d_kind == Kind::Drop);
+}
+
+BOOST_AUTO_TEST_CASE(test_many_names) {
+  DNSFilterEngine dfe;
+  ComboAddress client("192.0.2.1");
+  const unsigned int count = 50000;
+  for(unsigned int n = 0; n < count; ++n)
+    dfe.addQNameTrigger(DNSName("host" + std::to_string(n) + ".example.com."), {n % 2 ? Kind::Drop : Kind::NXDOMAIN});
+
+  // an update to a copy leaves every name of the original alone
+  DNSFilterEngine copy(dfe);
+  for(unsigned int n = 0; n < count; n += 2)
+    BOOST_CHECK(copy.rmQNameTrigger(DNSName("host" + std::to_string(n) + ".example.com."), {Kind::NXDOMAIN}));
+  copy.addQNameTrigger(DNSName("host1.example.com."), {Kind::Truncate});
+  // and the other way around
+  dfe.addQNameTrigger(DNSName("www.host2.example.com."), {Kind::Truncate});
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("www.host2.example.com."), client).d_kind == Kind::Truncate);
+  BOOST_CHECK(copy.getQueryPolicy(DNSName("www.host2.example.com."), client).d_kind == Kind::NoAction);
+  BOOST_CHECK(dfe.rmQNameTrigger(DNSName("www.host2.example.com."), {Kind::Truncate}));
+
+  unsigned int failures = 0;
+  for(unsigned int n = 0; n < count; ++n) {
+    DNSName name("a.HOST" + std::to_string(n) + ".example.com.");
+    if(dfe.getQueryPolicy(name, client).d_kind != (n % 2 ? Kind::Drop : Kind::NXDOMAIN))
+      failures++;
+    Kind expected = n == 1 ? Kind::Truncate : (n % 2 ? Kind::Drop : Kind::NoAction);
+    if(copy.getQueryPolicy(name, client).d_kind != expected)
+      failures++;
+  }
+  BOOST_CHECK_EQUAL(failures, 0);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("host50000.example.com."), client).d_kind == Kind::NoAction);
+
+  for(unsigned int n = 1; n < count; n += 2)
+    BOOST_CHECK(copy.rmQNameTrigger(DNSName("host" + std::to_string(n) + ".example.com."), {Kind::Drop}));
+  BOOST_CHECK(copy.getQueryPolicy(DNSName("host3.example.com."), client).d_kind == Kind::NoAction);
+  BOOST_CHECK(dfe.getQueryPolicy(DNSName("host3.example.com."), client).d_kind == Kind::Drop);
+
+  // the root and its wildcard
+  copy.addQNameTrigger(DNSName("*."), {Kind::NODATA});
+  BOOST_CHECK(copy.getQueryPolicy(DNSName("."), client).d_kind == Kind::NoAction);
+  BOOST_CHECK(copy.getQueryPolicy(DNSName("com."), client).d_kind == Kind::NODATA);
+  copy.addQNameTrigger(DNSName("."), {Kind::Drop});
+  BOOST_CHECK(copy.getQueryPolicy(DNSName("."), client).d_kind == Kind::Drop);
+  BOOST_CHECK(copy.getQueryPolicy(DNSName("com."), client).d_kind == Kind::Drop);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
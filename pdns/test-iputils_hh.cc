@@ -169,5 +169,100 @@ BOOST_AUTO_TEST_CASE(test_NetmaskGroup) {
   BOOST_CHECK(!ng.match(ComboAddress("fe81::1")));
 }
 
+BOOST_AUTO_TEST_CASE(test_NetmaskGroupLongestPrefix) {
+  NetmaskGroup ng;
+  ng.toMasks("10.0.0.0/8, !10.1.0.0/16, 10.1.2.0/24, !10.1.2.3");
+  BOOST_CHECK(ng.match(ComboAddress("10.2.3.4")));
+  BOOST_CHECK(!ng.match(ComboAddress("10.1.3.4")));
+  BOOST_CHECK(ng.match(ComboAddress("10.1.2.4")));
+  BOOST_CHECK(!ng.match(ComboAddress("10.1.2.3")));
+  BOOST_CHECK(!ng.match(ComboAddress("11.1.2.3")));
+  BOOST_CHECK_EQUAL(ng.size(), 4);
+  BOOST_CHECK_EQUAL(ng.toString(), "10.0.0.0/8, !10.1.0.0/16, 10.1.2.0/24, !10.1.2.3/32");
+
+  /* IPv4 masks also apply to mapped IPv4 addresses */
+  BOOST_CHECK(ng.match(ComboAddress("::ffff:10.2.3.4")));
+  BOOST_CHECK(!ng.match(ComboAddress("::ffff:10.1.3.4")));
+  ng.addMask("::/0");
+  BOOST_CHECK(ng.match(ComboAddress("2001:db8::1")));
+  BOOST_CHECK(!ng.match(ComboAddress("::ffff:10.1.3.4")));
+  BOOST_CHECK(ng.match(ComboAddress("::ffff:11.1.2.3")));
+
+  ng.addMask("!2001:db8::/32");
+  BOOST_CHECK(!ng.match(ComboAddress("2001:db8::1")));
+  BOOST_CHECK(ng.match(ComboAddress("2001:db9::1")));
+
+  /* copies are independent */
+  NetmaskGroup copy(ng);
+  ng.clear();
+  BOOST_CHECK(ng.empty());
+  BOOST_CHECK(!ng.match(ComboAddress("10.2.3.4")));
+  BOOST_CHECK(copy.match(ComboAddress("10.2.3.4")));
+
+  /* a /0 matches everything of its family */
+  ng.addMask("0.0.0.0/0");
+  BOOST_CHECK(ng.match(ComboAddress("192.0.2.1")));
+  BOOST_CHECK(!ng.match(ComboAddress("2001:db8::1")));
+}
+
+BOOST_AUTO_TEST_CASE(test_NetmaskTree) {
+  NetmaskTree<string> nt;
+  BOOST_CHECK(nt.empty());
+  BOOST_CHECK(!nt.lookup(ComboAddress("10.1.2.3")));
+
+  nt.insert(Netmask("10.0.0.0/8"), "ten");
+  nt.insert(Netmask("10.1.0.0/16"), "ten-one");
+  nt.insert(Netmask("2001:db8::/32"), "doc");
+  BOOST_CHECK_EQUAL(nt.size(), 3);
+
+  int bits = 0;
+  BOOST_REQUIRE(nt.lookup(ComboAddress("10.1.2.3"), &bits));
+  BOOST_CHECK_EQUAL(*nt.lookup(ComboAddress("10.1.2.3")), "ten-one");
+  BOOST_CHECK_EQUAL(bits, 16);
+  BOOST_CHECK_EQUAL(*nt.lookup(ComboAddress("10.2.2.3")), "ten");
+  BOOST_CHECK_EQUAL(*nt.lookup(ComboAddress("::ffff:10.2.2.3"), &bits), "ten");
+  BOOST_CHECK_EQUAL(bits, 104);
+  BOOST_CHECK_EQUAL(*nt.lookup(ComboAddress("2001:db8::1")), "doc");
+  BOOST_CHECK(!nt.lookup(ComboAddress("11.0.0.1")));
+
+  /* find() only returns exact matches */
+  BOOST_CHECK(nt.find(Netmask("10.1.0.0/16")));
+  BOOST_CHECK(!nt.find(Netmask("10.1.0.0/24")));
+  BOOST_CHECK(!nt.find(Netmask("10.0.0.0/7")));
+
+  /* replacing and erasing */
+  nt.insert(Netmask("10.1.0.0/16"), "replaced");
+  BOOST_CHECK_EQUAL(nt.size(), 3);
+  BOOST_CHECK_EQUAL(*nt.lookup(ComboAddress("10.1.2.3")), "replaced");
+  BOOST_CHECK(nt.erase(Netmask("10.1.0.0/16")));
+  BOOST_CHECK(!nt.erase(Netmask("10.1.0.0/16")));
+  BOOST_CHECK(!nt.erase(Netmask("10.1.0.0/24")));
+  BOOST_CHECK_EQUAL(nt.size(), 2);
+  BOOST_CHECK_EQUAL(*nt.lookup(ComboAddress("10.1.2.3")), "ten");
+
+  nt.insert(Netmask("192.0.2.0/24"), "test-net");
+  BOOST_CHECK_EQUAL(*nt.lookup(ComboAddress("192.0.2.1")), "test-net");
+  BOOST_CHECK_EQUAL(*nt.lookup(ComboAddress("10.1.2.3")), "ten");
+
+  /* a copy shares its nodes, but does not see changes made to the original afterwards */
+  NetmaskTree<string> copy(nt);
+  nt.insert(Netmask("10.1.0.0/16"), "after");
+  nt.erase(Netmask("192.0.2.0/24"));
+  nt.insert(Netmask("0.0.0.0/0"), "default");
+  BOOST_CHECK_EQUAL(*nt.lookup(ComboAddress("10.1.2.3")), "after");
+  BOOST_CHECK_EQUAL(*nt.lookup(ComboAddress("192.0.2.1")), "default");
+  BOOST_CHECK_EQUAL(*copy.lookup(ComboAddress("10.1.2.3")), "ten");
+  BOOST_CHECK_EQUAL(*copy.lookup(ComboAddress("192.0.2.1")), "test-net");
+  BOOST_CHECK(!copy.lookup(ComboAddress("11.0.0.1")));
+  BOOST_CHECK_EQUAL(copy.size(), 3);
+  BOOST_CHECK_EQUAL(nt.size(), 4);
+  copy.clear();
+  BOOST_CHECK_EQUAL(*nt.lookup(ComboAddress("2001:db8::1")), "doc");
+
+  nt.clear();
+  BOOST_CHECK(nt.empty());
+  BOOST_CHECK(!nt.lookup(ComboAddress("10.1.2.3")));
+}
+
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,82 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include "ixfr.hh"
+#include "dnsrecords.hh"
+
+BOOST_AUTO_TEST_SUITE(ixfr_cc)
+
+static DNSRecord makeRecord(const string& name, uint16_t type, const string& content)
+{
+  DNSRecord dr;
+  dr.d_name=DNSName(name);
+  dr.d_type=type;
+  dr.d_class=QClass::IN;
+  dr.d_ttl=3600;
+  dr.d_content=shared_ptr<DNSRecordContent>(DNSRecordContent::mastermake(type, QClass::IN, content));
+  return dr;
+}
+
+static DNSRecord makeSOA(uint32_t serial)
+{
+  return makeRecord("example.com.", QType::SOA, "ns.example.com. hostmaster.example.com. "+std::to_string(serial)+" 3600 600 86400 300");
+}
+
+BOOST_AUTO_TEST_CASE(test_deltas) {
+  reportAllTypes();
+  IXFRCollector collector(DNSName("example.com."), 1);
+  vector<DNSRecord> response {
+    makeSOA(3),
+    makeSOA(1), makeRecord("www.example.com.", QType::A, "192.0.2.1"),
+    makeSOA(2), makeRecord("www.example.com.", QType::A, "192.0.2.2"),
+    makeSOA(2),
+    makeSOA(3), makeRecord("mail.example.com.", QType::A, "192.0.2.25"),
+    makeSOA(3)
+  };
+  for(size_t pos=0; pos < response.size(); ++pos) {
+    BOOST_CHECK_THROW(collector.getDeltas(), std::exception);
+    BOOST_CHECK_EQUAL(collector.add(response[pos]), pos == response.size() - 1);
+  }
+  BOOST_CHECK(!collector.isFullZone());
+
+  auto deltas=collector.getDeltas();
+  BOOST_REQUIRE_EQUAL(deltas.size(), 2);
+  BOOST_REQUIRE_EQUAL(deltas[0].first.size(), 2);
+  BOOST_CHECK_EQUAL(deltas[0].first[1].d_content->getZoneRepresentation(), "192.0.2.1");
+  BOOST_REQUIRE_EQUAL(deltas[0].second.size(), 2);
+  BOOST_CHECK_EQUAL(deltas[0].second[1].d_content->getZoneRepresentation(), "192.0.2.2");
+  BOOST_CHECK_EQUAL(deltas[1].first.size(), 1);
+  BOOST_REQUIRE_EQUAL(deltas[1].second.size(), 2);
+  BOOST_CHECK_EQUAL(deltas[1].second[1].d_name, DNSName("mail.example.com."));
+}
+
+BOOST_AUTO_TEST_CASE(test_up_to_date) {
+  reportAllTypes();
+  IXFRCollector collector(DNSName("example.com."), 3);
+  BOOST_CHECK(collector.add(makeSOA(3)));
+  BOOST_CHECK(collector.getDeltas().empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_full_zone) {
+  reportAllTypes();
+  // a master without deltas for us sends the whole zone, we know that from the second record on
+  IXFRCollector collector(DNSName("example.com."), 1);
+  BOOST_CHECK(!collector.add(makeSOA(3)));
+  BOOST_CHECK(!collector.isFullZone());
+  BOOST_CHECK(collector.add(makeRecord("www.example.com.", QType::A, "192.0.2.1")));
+  BOOST_CHECK(collector.isFullZone());
+  BOOST_CHECK(collector.add(makeSOA(3)));
+  BOOST_CHECK_THROW(collector.getDeltas(), std::exception);
+
+  // a zone that only has a SOA
+  IXFRCollector soaOnly(DNSName("example.com."), 1);
+  BOOST_CHECK(!soaOnly.add(makeSOA(3)));
+  BOOST_CHECK(soaOnly.add(makeSOA(3)));
+  BOOST_CHECK(soaOnly.isFullZone());
+  BOOST_CHECK_THROW(soaOnly.getDeltas(), std::exception);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
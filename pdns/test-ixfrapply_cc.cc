@@ -0,0 +1,218 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include "ixfrapply.hh"
+
+BOOST_AUTO_TEST_SUITE(ixfrapply_cc)
+
+// keeps one zone in memory, empty non-terminals are records with qtype 0 like in the SQL backends
+class MemoryBackend : public DNSBackend
+{
+public:
+  MemoryBackend(bool dnssec) : d_dnssec(dnssec)
+  {
+  }
+  void lookup(const QType& qtype, const DNSName& qdomain, DNSPacket* pkt_p=0, int zoneId=-1) override
+  {
+    d_result.clear();
+    for(const auto& rr : d_records)
+      if(rr.qname == qdomain && (qtype.getCode() == QType::ANY || rr.qtype == qtype))
+        d_result.push_back(rr);
+  }
+  bool get(DNSResourceRecord& rr) override
+  {
+    if(d_result.empty())
+      return false;
+    rr=d_result.front();
+    d_result.pop_front();
+    return true;
+  }
+  bool list(const DNSName& target, int domain_id, bool include_disabled=false) override
+  {
+    return false;
+  }
+  bool listSubZone(const DNSName& zone, int domain_id) override
+  {
+    d_result.clear();
+    for(const auto& rr : d_records)
+      if(rr.qname.isPartOf(zone))
+        d_result.push_back(rr);
+    return true;
+  }
+  bool replaceRRSet(uint32_t domain_id, const DNSName& qname, const QType& qt, const vector<DNSResourceRecord>& rrset) override
+  {
+    d_records.erase(remove_if(d_records.begin(), d_records.end(), [&](const DNSResourceRecord& rr) { return rr.qname == qname && rr.qtype == qt; }), d_records.end());
+    d_records.insert(d_records.end(), rrset.begin(), rrset.end());
+    return true;
+  }
+  bool updateDNSSECOrderNameAndAuth(uint32_t domain_id, const DNSName& zonename, const DNSName& qname, const DNSName& ordername, bool auth, const uint16_t qtype=QType::ANY) override
+  {
+    if(!d_dnssec)
+      return false;
+    for(auto& rr : d_records)
+      if(rr.qname == qname && (qtype == QType::ANY || rr.qtype.getCode() == qtype))
+        rr.auth=auth;
+    if(qtype == QType::ANY)
+      d_ordernames[qname]=ordername;
+    return true;
+  }
+  bool updateEmptyNonTerminals(uint32_t domain_id, const DNSName& zonename, set<DNSName>& insert, set<DNSName>& erase, bool remove) override
+  {
+    d_records.erase(remove_if(d_records.begin(), d_records.end(), [&](const DNSResourceRecord& rr) { return !rr.qtype.getCode() && erase.count(rr.qname); }), d_records.end());
+    for(const auto& qname : insert) {
+      DNSResourceRecord rr;
+      rr.qname=qname;
+      rr.qtype=QType(0);
+      d_records.push_back(rr);
+    }
+    return true;
+  }
+
+  void add(const string& qname, uint16_t qtype, const string& content, bool auth=true)
+  {
+    DNSResourceRecord rr;
+    rr.qname=DNSName(qname);
+    rr.qtype=qtype;
+    rr.content=content;
+    rr.auth=auth;
+    rr.domain_id=1;
+    d_records.push_back(rr);
+  }
+  vector<DNSResourceRecord> find(const string& qname, uint16_t qtype) const
+  {
+    vector<DNSResourceRecord> ret;
+    for(const auto& rr : d_records)
+      if(rr.qname == DNSName(qname) && rr.qtype.getCode() == qtype)
+        ret.push_back(rr);
+    return ret;
+  }
+  bool isAuth(const string& qname, uint16_t qtype) const
+  {
+    auto rrs=find(qname, qtype);
+    BOOST_REQUIRE(!rrs.empty());
+    return rrs.front().auth;
+  }
+
+  map<DNSName, DNSName> d_ordernames;
+
+private:
+  vector<DNSResourceRecord> d_records;
+  deque<DNSResourceRecord> d_result;
+  bool d_dnssec;
+};
+
+static DNSRecord makeRecord(const string& name, uint16_t type, const string& content)
+{
+  DNSRecord dr;
+  dr.d_name=DNSName(name);
+  dr.d_type=type;
+  dr.d_class=QClass::IN;
+  dr.d_ttl=3600;
+  dr.d_content=shared_ptr<DNSRecordContent>(DNSRecordContent::mastermake(type, QClass::IN, content));
+  return dr;
+}
+
+static DNSRecord makeSOA(uint32_t serial)
+{
+  return makeRecord("example.com.", QType::SOA, "ns.example.com. hostmaster.example.com. "+std::to_string(serial)+" 3600 600 86400 300");
+}
+
+static void fillZone(MemoryBackend& mb, DomainInfo& di)
+{
+  mb.add("example.com.", QType::SOA, "ns.example.com. hostmaster.example.com. 1 3600 600 86400 300");
+  mb.add("example.com.", QType::NS, "ns.example.com");
+  mb.add("www.example.com.", QType::A, "192.0.2.1");
+  mb.add("ns.sub.example.com.", QType::A, "192.0.2.53");
+  di.zone=DNSName("example.com.");
+  di.id=1;
+  di.serial=1;
+  di.backend=&mb;
+}
+
+// adds a delegation with glue that was there already, and a name below an empty non-terminal
+static IXFRCollector::deltas_t addDelegation()
+{
+  IXFRCollector::deltas_t deltas;
+  deltas.push_back(make_pair(
+    vector<DNSRecord>{makeSOA(1), makeRecord("www.example.com.", QType::A, "192.0.2.1")},
+    vector<DNSRecord>{makeSOA(2), makeRecord("www.example.com.", QType::A, "192.0.2.2"), makeRecord("sub.example.com.", QType::NS, "ns.sub.example.com."), makeRecord("a.b.example.com.", QType::A, "192.0.2.3")}));
+  return deltas;
+}
+
+static IXFRCollector::deltas_t removeDelegation()
+{
+  IXFRCollector::deltas_t deltas;
+  deltas.push_back(make_pair(
+    vector<DNSRecord>{makeSOA(2), makeRecord("sub.example.com.", QType::NS, "ns.sub.example.com."), makeRecord("a.b.example.com.", QType::A, "192.0.2.3")},
+    vector<DNSRecord>{makeSOA(3)}));
+  return deltas;
+}
+
+static void checkDelegation(bool dnssecBackend)
+{
+  reportAllTypes();
+  MemoryBackend mb(dnssecBackend);
+  DomainInfo di;
+  fillZone(mb, di);
+  NSEC3PARAMRecordContent ns3pr;
+
+  BOOST_CHECK_EQUAL(applyIXFRDeltas(di, addDelegation(), false, false, false, ns3pr, false), 2);
+  BOOST_REQUIRE_EQUAL(mb.find("www.example.com.", QType::A).size(), 1);
+  BOOST_CHECK_EQUAL(mb.find("www.example.com.", QType::A).front().content, "192.0.2.2");
+  BOOST_CHECK_EQUAL(mb.find("example.com.", QType::SOA).size(), 1);
+  BOOST_CHECK(mb.isAuth("www.example.com.", QType::A));
+  BOOST_CHECK(!mb.isAuth("sub.example.com.", QType::NS));
+  BOOST_CHECK(!mb.isAuth("ns.sub.example.com.", QType::A));
+  BOOST_CHECK_EQUAL(mb.find("b.example.com.", 0).size(), 1);
+
+  di.serial=2;
+  BOOST_CHECK_EQUAL(applyIXFRDeltas(di, removeDelegation(), false, false, false, ns3pr, false), 3);
+  BOOST_CHECK(mb.find("sub.example.com.", QType::NS).empty());
+  // the glue is in the zone again
+  BOOST_CHECK(mb.isAuth("ns.sub.example.com.", QType::A));
+  BOOST_CHECK(mb.find("b.example.com.", 0).empty());
+  BOOST_CHECK_EQUAL(mb.find("sub.example.com.", 0).size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_delegation) {
+  checkDelegation(false);
+}
+
+BOOST_AUTO_TEST_CASE(test_delegation_dnssec_backend) {
+  checkDelegation(true);
+}
+
+BOOST_AUTO_TEST_CASE(test_nsec_ordernames) {
+  reportAllTypes();
+  MemoryBackend mb(true);
+  DomainInfo di;
+  fillZone(mb, di);
+  NSEC3PARAMRecordContent ns3pr;
+
+  applyIXFRDeltas(di, addDelegation(), true, false, false, ns3pr, false);
+  BOOST_CHECK_EQUAL(mb.d_ordernames[DNSName("www.example.com.")], DNSName("www.example.com."));
+  BOOST_CHECK_EQUAL(mb.d_ordernames[DNSName("sub.example.com.")], DNSName("sub.example.com."));
+  BOOST_CHECK(mb.d_ordernames[DNSName("ns.sub.example.com.")].empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_mismatch) {
+  reportAllTypes();
+  MemoryBackend mb(false);
+  DomainInfo di;
+  fillZone(mb, di);
+  NSEC3PARAMRecordContent ns3pr;
+
+  // the deltas start at another serial
+  di.serial=2;
+  BOOST_CHECK_THROW(applyIXFRDeltas(di, addDelegation(), false, false, false, ns3pr, false), PDNSException);
+  // the deltas remove a record we do not have
+  di.serial=1;
+  auto deltas=addDelegation();
+  deltas.front().first.push_back(makeRecord("mail.example.com.", QType::A, "192.0.2.25"));
+  BOOST_CHECK_THROW(applyIXFRDeltas(di, deltas, false, false, false, ns3pr, false), PDNSException);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,119 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include <poll.h>
+#include <thread>
+#include "mpscqueue.hh"
+
+BOOST_AUTO_TEST_SUITE(test_mpscqueue_hh);
+
+static bool isReadable(int fd)
+{
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) == 1;
+}
+
+BOOST_AUTO_TEST_CASE(test_mpscqueue_simple) {
+  MPSCQueue<std::string> q(10); // becomes 16
+  BOOST_CHECK(q.empty());
+
+  for(int n=0; n < 16; ++n) {
+    std::string s(std::to_string(n));
+    BOOST_CHECK(q.push(std::move(s)));
+  }
+  std::string full("full");
+  BOOST_CHECK(!q.push(std::move(full)));
+  BOOST_CHECK_EQUAL(full, "full");
+
+  std::string s;
+  for(int n=0; n < 16; ++n) {
+    BOOST_CHECK(q.pop(&s));
+    BOOST_CHECK_EQUAL(s, std::to_string(n));
+  }
+  BOOST_CHECK(!q.pop(&s));
+  BOOST_CHECK(q.empty());
+
+  // wrap around a few times
+  for(int n=0; n < 100; ++n) {
+    BOOST_CHECK(q.push(std::to_string(n)));
+    BOOST_CHECK(q.pop(&s));
+    BOOST_CHECK_EQUAL(s, std::to_string(n));
+  }
+};
+
+BOOST_AUTO_TEST_CASE(test_mpscqueue_wakeup) {
+  MPSCQueue<int> q(16);
+
+  // not sleeping, so no signal
+  BOOST_CHECK(q.push(1));
+  BOOST_CHECK(!isReadable(q.getDescriptor()));
+
+  // something is pending already, so we must not sleep
+  q.prepareToSleep();
+  BOOST_CHECK(isReadable(q.getDescriptor()));
+  q.clearWakeup();
+  BOOST_CHECK(!isReadable(q.getDescriptor()));
+
+  int i;
+  BOOST_CHECK(q.pop(&i));
+  q.prepareToSleep();
+  BOOST_CHECK(!isReadable(q.getDescriptor()));
+  BOOST_CHECK(q.push(2));
+  BOOST_CHECK(isReadable(q.getDescriptor()));
+  q.clearWakeup();
+
+  // only the first push after prepareToSleep signals
+  BOOST_CHECK(q.push(3));
+  BOOST_CHECK(!isReadable(q.getDescriptor()));
+
+  q.wokeUp();
+  BOOST_CHECK(q.pop(&i));
+  BOOST_CHECK_EQUAL(i, 2);
+  BOOST_CHECK(q.pop(&i));
+  BOOST_CHECK_EQUAL(i, 3);
+};
+
+BOOST_AUTO_TEST_CASE(test_mpscqueue_threaded) {
+  MPSCQueue<std::pair<int,int> > q(64);
+  const int numThreads = 4, perThread = 100000;
+
+  std::vector<std::thread> producers;
+  for(int t=0; t < numThreads; ++t) {
+    producers.push_back(std::thread([&q,t]() {
+          for(int n=0; n < perThread; ++n)
+            while(!q.push(std::make_pair(t, n)))
+              std::this_thread::yield();
+        }));
+  }
+
+  // items of each producer must arrive in order, none may get lost
+  std::vector<int> next(numThreads, 0);
+  int received = 0;
+  std::pair<int,int> item;
+  while(received < numThreads * perThread) {
+    if(!q.pop(&item)) {
+      q.prepareToSleep();
+      struct pollfd pfd;
+      pfd.fd = q.getDescriptor();
+      pfd.events = POLLIN;
+      if(poll(&pfd, 1, 1000) == 1)
+        q.clearWakeup();
+      q.wokeUp();
+      continue;
+    }
+    BOOST_REQUIRE_EQUAL(item.second, next[item.first]);
+    next[item.first]++;
+    received++;
+  }
+
+  for(auto& t : producers)
+    t.join();
+  BOOST_CHECK(q.empty());
+};
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,314 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include "mtasker.hh"
+
+BOOST_AUTO_TEST_SUITE(mtasker_hh)
+
+static int g_result;
+
+static void doSomething(void* p)
+{
+  MTasker<>* mt = reinterpret_cast<MTasker<>*>(p);
+  int i=12, o;
+  if(mt->waitEvent(i, &o, 1000) == 1)
+    g_result = o;
+}
+
+BOOST_AUTO_TEST_CASE(test_Simple) {
+  MTasker<> mt;
+  mt.makeThread(doSomething, &mt);
+  struct timeval now;
+  gettimeofday(&now, 0);
+  bool first=true;
+  int o=24;
+  for(;;) {
+    while(mt.schedule(&now));
+    if(first) {
+      mt.sendEvent(12, &o);
+      first=false;
+    }
+    if(mt.noProcesses())
+      break;
+  }
+  BOOST_CHECK_EQUAL(g_result, o);
+}
+
+static void willWaitLong(void* p)
+{
+  MTasker<>* mt = reinterpret_cast<MTasker<>*>(p);
+  int i=12;
+  g_result = mt->waitEvent(i, 0, 1000);
+}
+
+BOOST_AUTO_TEST_CASE(test_Timeout) {
+  MTasker<> mt;
+  g_result = -1;
+  mt.makeThread(willWaitLong, &mt);
+  struct timeval now;
+  gettimeofday(&now, 0);
+  while(mt.schedule(&now));
+  BOOST_CHECK_EQUAL(mt.numProcesses(), 1);
+
+  now.tv_sec += 2;
+  while(mt.schedule(&now));
+  BOOST_CHECK_EQUAL(g_result, 0);
+  while(mt.schedule(&now)); // the thread that timed out is only cleaned up now
+  BOOST_CHECK(mt.noProcesses());
+}
+
+static double g_sums[3];
+
+// callee-saved registers, including floating point ones, need to survive a switch
+static void yieldAndSum(void* p)
+{
+  MTasker<>* mt = reinterpret_cast<MTasker<>*>(p);
+  int tid = mt->getTid();
+  double sum = 0.5 * tid;
+  for(int n=0; n < 100; ++n) {
+    sum += n * 1.5;
+    mt->yield();
+  }
+  g_sums[tid] = sum;
+}
+
+BOOST_AUTO_TEST_CASE(test_Yield) {
+  MTasker<> mt;
+  for(int n=0; n < 3; ++n)
+    mt.makeThread(yieldAndSum, &mt);
+
+  struct timeval now;
+  gettimeofday(&now, 0);
+  while(mt.schedule(&now));
+
+  BOOST_CHECK(mt.noProcesses());
+  for(int n=0; n < 3; ++n)
+    BOOST_CHECK_EQUAL(g_sums[n], 0.5 * n + 1.5 * 4950);
+}
+
+static void doNothing(void*)
+{
+}
+
+BOOST_AUTO_TEST_CASE(test_StackPool) {
+  MTasker<> mt(8192, 2);
+  struct timeval now;
+  gettimeofday(&now, 0);
+
+  for(int n=0; n < 3; ++n)
+    mt.makeThread(doNothing, 0);
+  BOOST_CHECK_EQUAL(mt.getStacksHighWater(), 3);
+  while(mt.schedule(&now));
+  BOOST_CHECK(mt.noProcesses());
+  BOOST_CHECK_EQUAL(mt.getStackPoolSize(), 2);
+  BOOST_CHECK_EQUAL(mt.getStackReuses(), 0);
+
+  for(int n=0; n < 2; ++n)
+    mt.makeThread(doNothing, 0);
+  BOOST_CHECK_EQUAL(mt.getStackPoolSize(), 0);
+  BOOST_CHECK_EQUAL(mt.getStackReuses(), 2);
+  while(mt.schedule(&now));
+  BOOST_CHECK_EQUAL(mt.getStackPoolSize(), 2);
+  BOOST_CHECK_EQUAL(mt.getStacksHighWater(), 3);
+}
+
+static vector<int> g_woken;
+
+struct WaitJob
+{
+  MTasker<>* mt;
+  int key;
+  unsigned int timeoutMsec;
+  int result;
+  int value;
+};
+
+static void waitForKey(void* p)
+{
+  WaitJob* job = reinterpret_cast<WaitJob*>(p);
+  job->result = job->mt->waitEvent(job->key, &job->value, job->timeoutMsec);
+  g_woken.push_back(job->key);
+}
+
+BOOST_AUTO_TEST_CASE(test_WaiterLookup) {
+  MTasker<> mt;
+  struct timeval now;
+  gettimeofday(&now, 0);
+  g_woken.clear();
+
+  vector<WaitJob> jobs(100);
+  for(int n=0; n < 100; ++n) {
+    jobs[n] = WaitJob{&mt, 1000 + 7 * n, 1000, -2, 0};
+    mt.makeThread(waitForKey, &jobs[n]);
+  }
+  // a second waiter for the same key is refused right away
+  WaitJob dup{&mt, 1000, 1000, -2, 0};
+  mt.makeThread(waitForKey, &dup);
+  while(mt.schedule(&now));
+  BOOST_CHECK_EQUAL(dup.result, -1);
+  BOOST_CHECK_EQUAL(mt.d_waiters.size(), 100);
+
+  int val = 42;
+  BOOST_CHECK_EQUAL(mt.sendEvent(1001, &val), 0);
+  for(int n=99; n >= 0; n -= 2) {
+    val = n;
+    BOOST_CHECK_EQUAL(mt.sendEvent(1000 + 7 * n, &val), 1);
+  }
+  BOOST_CHECK_EQUAL(mt.sendEvent(1000 + 7 * 99, &val), 0);
+  BOOST_CHECK_EQUAL(mt.d_waiters.size(), 50);
+  for(int n=0; n < 100; ++n) {
+    BOOST_CHECK_EQUAL(jobs[n].result, n % 2 ? 1 : -2);
+    if(n % 2)
+      BOOST_CHECK_EQUAL(jobs[n].value, n);
+  }
+
+  now.tv_sec += 2;
+  while(mt.schedule(&now));
+  BOOST_CHECK(mt.d_waiters.empty());
+  while(mt.schedule(&now));
+  BOOST_CHECK(mt.noProcesses());
+}
+
+BOOST_AUTO_TEST_CASE(test_TimeoutOrder) {
+  MTasker<> mt;
+  struct timeval now;
+  gettimeofday(&now, 0);
+  g_woken.clear();
+
+  // started in another order than they time out in, and one that waits forever
+  unsigned int timeouts[] = {3000, 1000, 0, 5000, 2000, 4000};
+  vector<WaitJob> jobs(6);
+  for(int n=0; n < 6; ++n) {
+    jobs[n] = WaitJob{&mt, n, timeouts[n], -2, 0};
+    mt.makeThread(waitForKey, &jobs[n]);
+  }
+  while(mt.schedule(&now));
+  BOOST_CHECK(g_woken.empty());
+
+  // the timeouts count from when the threads started waiting, a little after now
+  now.tv_sec += 2;
+  now.tv_usec += 500000;
+  if(now.tv_usec >= 1000000) {
+    now.tv_sec++;
+    now.tv_usec -= 1000000;
+  }
+  while(mt.schedule(&now));
+  BOOST_CHECK_EQUAL(g_woken.size(), 2);
+
+  now.tv_sec += 10;
+  while(mt.schedule(&now));
+  vector<int> expected{1, 4, 0, 5, 3};
+  BOOST_CHECK_EQUAL_COLLECTIONS(g_woken.begin(), g_woken.end(), expected.begin(), expected.end());
+  BOOST_CHECK_EQUAL(jobs[0].result, 0);
+  BOOST_CHECK_EQUAL(jobs[2].result, -2);
+  while(mt.schedule(&now));
+  BOOST_CHECK_EQUAL(mt.numProcesses(), 1);
+
+  int val = 2;
+  BOOST_CHECK_EQUAL(mt.sendEvent(2, &val), 1);
+  BOOST_CHECK_EQUAL(jobs[2].result, 1);
+  while(mt.schedule(&now));
+  BOOST_CHECK(mt.noProcesses());
+}
+
+// keys in the same decade are near matches
+struct DecadeCompare
+{
+  bool operator()(int a, int b) const
+  {
+    return a / 10 < b / 10;
+  }
+};
+
+static void waitForDecade(void* p)
+{
+  MTasker<int,int,DecadeCompare>* mt = reinterpret_cast<MTasker<int,int,DecadeCompare>*>(p);
+  int key = 10 + mt->getTid() * 4;
+  mt->waitEvent(key, 0, 1000);
+}
+
+BOOST_AUTO_TEST_CASE(test_OrderedKey) {
+  MTasker<int,int,DecadeCompare> mt;
+  struct timeval now;
+  gettimeofday(&now, 0);
+  for(int n=0; n < 5; ++n)  // 10, 14, 18, 22, 26
+    mt.makeThread(waitForDecade, &mt);
+  while(mt.schedule(&now));
+
+  auto& index = mt.d_waiters.get<OrderedKeyTag>();
+  auto range = index.equal_range(15);
+  BOOST_CHECK_EQUAL(std::distance(range.first, range.second), 3);
+  BOOST_CHECK_EQUAL(index.count(29), 2);
+  BOOST_CHECK_EQUAL(index.count(35), 0);
+  // the exact lookup is not fooled
+  BOOST_CHECK_EQUAL(mt.d_waiters.count(15), 0);
+  BOOST_CHECK_EQUAL(mt.d_waiters.count(14), 1);
+
+  now.tv_sec += 2;
+  while(mt.schedule(&now));
+  while(mt.schedule(&now));
+  BOOST_CHECK(mt.noProcesses());
+}
+
+#if defined(__linux__) && defined(MADV_DONTNEED)
+static char* g_stackFrame;
+
+static void fillStack(void*)
+{
+  volatile char buffer[32768];
+  for(unsigned int n=0; n < sizeof(buffer); ++n)
+    buffer[n] = 1;
+  g_stackFrame = (char*)__builtin_frame_address(0);
+}
+
+// whether the four pages right below the frame of fillStack hold memory
+static bool stackResident()
+{
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  char* start = (char*)((uintptr_t)g_stackFrame & ~(pagesize - 1)) - 4 * pagesize;
+  unsigned char vec[4];
+  BOOST_REQUIRE_EQUAL(mincore(start, 4 * pagesize, vec), 0);
+  unsigned int resident = 0;
+  for(unsigned int n=0; n < 4; ++n)
+    resident += vec[n] & 1;
+  BOOST_REQUIRE(resident == 0 || resident == 4);
+  return resident;
+}
+
+// a pooled stack keeps its memory while it is being reused, and gives it back once it is not
+BOOST_AUTO_TEST_CASE(test_StackPoolMemory) {
+  MTasker<> mt(65536);
+  struct timeval now;
+  gettimeofday(&now, 0);
+  mt.makeThread(fillStack, 0);
+  while(mt.schedule(&now));
+  BOOST_REQUIRE_EQUAL(mt.getStackPoolSize(), 1);
+  BOOST_CHECK(stackResident());
+
+  // it went into the pool after the previous trim, so it may still be wanted
+  mt.trimStackPool();
+  BOOST_CHECK(stackResident());
+  // it was, so it stays
+  mt.makeThread(fillStack, 0);
+  while(mt.schedule(&now));
+  BOOST_CHECK_EQUAL(mt.getStackReuses(), 1);
+  mt.trimStackPool();
+  BOOST_CHECK(stackResident());
+
+  // nobody wanted it since the previous trim
+  mt.trimStackPool();
+  BOOST_CHECK(!stackResident());
+  BOOST_CHECK_EQUAL(mt.getStackPoolSize(), 1);
+
+  // and it works all the same
+  mt.makeThread(fillStack, 0);
+  while(mt.schedule(&now));
+  BOOST_CHECK_EQUAL(mt.getStackReuses(), 2);
+  BOOST_CHECK(stackResident());
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -181,6 +181,171 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheClean) {
   }
 }
 
+static bool g_stopReplacing;
+static void *threadReplacer(void*)
+try
+{
+  while(!g_stopReplacing) {
+    for(unsigned int counter=0; counter < 1000; ++counter)
+      g_PC->insert(DNSName("hot ")+DNSName(std::to_string(counter)), QType(QType::A), PacketCache::QUERYCACHE, "something", 3600, 1);
+    g_PC->cleanup();
+  }
+  return 0;
+}
+catch(PDNSException& e) {
+  cerr<<"Had error in threadReplacer: "<<e.reason<<endl;
+  throw;
+}
+
+static void *threadHotReader(void*)
+try
+{
+  string entry;
+  for(unsigned int counter=0; counter < 250000; ++counter)
+    if(!g_PC->getEntry(DNSName("hot ")+DNSName(std::to_string(counter % 1000)), QType(QType::A), PacketCache::QUERYCACHE, entry, 1))
+      g_missing++;
+  return 0;
+}
+catch(PDNSException& e) {
+  cerr<<"Had error in threadHotReader: "<<e.reason<<endl;
+  throw;
+}
+
+// lookups don't wait for writers, so while the same entries are replaced and the cache is cleaned, they never miss
+BOOST_AUTO_TEST_CASE(test_PacketCacheContended) {
+  try {
+    PacketCache PC;
+    g_PC=&PC;
+    for(unsigned int counter=0; counter < 1000; ++counter)
+      PC.insert(DNSName("hot ")+DNSName(std::to_string(counter)), QType(QType::A), PacketCache::QUERYCACHE, "something", 3600, 1);
+
+    g_missing=AtomicCounter(0);
+    g_stopReplacing=false;
+    pthread_t replacer, tid[4];
+    pthread_create(&replacer, 0, threadReplacer, 0);
+
+    DTime dt;
+    dt.set();
+    for(int i=0; i < 4; ++i)
+      pthread_create(&tid[i], 0, threadHotReader, 0);
+    void* res;
+    for(int i=0; i < 4 ; ++i)
+      pthread_join(tid[i], &res);
+    unsigned int usec=dt.udiff();
+    g_stopReplacing=true;
+    pthread_join(replacer, &res);
+
+    BOOST_CHECK_EQUAL((AtomicCounter::native_t)g_missing, 0);
+    BOOST_CHECK_EQUAL(PC.size(), 1000);
+    BOOST_TEST_MESSAGE("contended lookups: "<<(4*250000.0/(usec/1000000.0))<<"/s");
+  }
+  catch(PDNSException& e) {
+    cerr<<"Had error: "<<e.reason<<endl;
+    throw;
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheKeys) {
+  PacketCache PC;
+  string entry;
+
+  PC.insert(DNSName("www.powerdns.com"), QType(QType::A), PacketCache::QUERYCACHE, "zone1", 3600, 1);
+  PC.insert(DNSName("www.powerdns.com"), QType(QType::A), PacketCache::QUERYCACHE, "zone2", 3600, 2);
+  PC.insert(DNSName("www.powerdns.com"), QType(QType::AAAA), PacketCache::QUERYCACHE, "aaaa", 3600, 1);
+  PC.insert(DNSName("powerdns.com"), QType(QType::A), PacketCache::QUERYCACHE, "apex", 3600, 1);
+  PC.insert(DNSName("www.powerdns.net"), QType(QType::A), PacketCache::QUERYCACHE, "net", 3600, 1);
+  BOOST_CHECK_EQUAL(PC.size(), 5);
+
+  BOOST_CHECK(PC.getEntry(DNSName("WWW.PowerDNS.com"), QType(QType::A), PacketCache::QUERYCACHE, entry, 1));
+  BOOST_CHECK_EQUAL(entry, "zone1");
+  BOOST_CHECK(PC.getEntry(DNSName("www.powerdns.com"), QType(QType::A), PacketCache::QUERYCACHE, entry, 2));
+  BOOST_CHECK_EQUAL(entry, "zone2");
+  BOOST_CHECK(PC.getEntry(DNSName("www.powerdns.com"), QType(QType::AAAA), PacketCache::QUERYCACHE, entry, 1));
+  BOOST_CHECK_EQUAL(entry, "aaaa");
+  BOOST_CHECK(!PC.getEntry(DNSName("www.powerdns.com"), QType(QType::A), PacketCache::QUERYCACHE, entry, 3));
+  BOOST_CHECK(!PC.getEntry(DNSName("www.powerdns.com"), QType(QType::A), PacketCache::PACKETCACHE, entry, 1));
+
+  /* replacing an entry does not add a new one */
+  PC.insert(DNSName("www.powerdns.com"), QType(QType::A), PacketCache::QUERYCACHE, "zone1 again", 3600, 1);
+  BOOST_CHECK_EQUAL(PC.size(), 5);
+  BOOST_CHECK(PC.getEntry(DNSName("www.powerdns.com"), QType(QType::A), PacketCache::QUERYCACHE, entry, 1));
+  BOOST_CHECK_EQUAL(entry, "zone1 again");
+
+  /* suffix purges stop at label boundaries */
+  BOOST_CHECK_EQUAL(PC.purge("dns.com$"), 0);
+  BOOST_CHECK_EQUAL(PC.purge("powerdns.com$"), 4);
+  BOOST_CHECK_EQUAL(PC.size(), 1);
+  BOOST_CHECK(PC.getEntry(DNSName("www.powerdns.net"), QType(QType::A), PacketCache::QUERYCACHE, entry, 1));
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheRaw) {
+  PacketCache PC;
+  string answer;
+  DNSName qname;
+  uint16_t qtype;
+  bool dnssecOk;
+
+  vector<uint8_t> ans;
+  DNSPacketWriter pwa(ans, DNSName("www.powerdns.com"), QType::A);
+  pwa.getHeader()->qr = 1;
+  pwa.startRecord(DNSName("www.powerdns.com"), QType::A, 16, 1, DNSResourceRecord::ANSWER);
+  pwa.xfrIP(htonl(0x7f000001));
+  pwa.commit();
+  PC.insert(DNSName("www.powerdns.com"), QType(QType::A), PacketCache::PACKETCACHE, string((char*)&ans[0], ans.size()), 3600);
+  string ednsAnswer((char*)&ans[0], ans.size());
+  ednsAnswer[ednsAnswer.size() - 1] = 2;
+  PC.insert(DNSName("www.powerdns.com"), QType(QType::A), PacketCache::PACKETCACHE, ednsAnswer, 3600, -1, false, DNSPacket::s_udpTruncationThreshold, true, true);
+
+  vector<uint8_t> pak;
+  DNSPacketWriter pw(pak, DNSName("WWW.PowerDNS.com"), QType::A);
+  pw.getHeader()->id = htons(4242);
+  pw.getHeader()->rd = 1;
+  BOOST_CHECK(!PC.getRaw((char*)&pak[0], pak.size(), true, answer, &qname, &qtype, &dnssecOk));
+  BOOST_REQUIRE(PC.getRaw((char*)&pak[0], pak.size(), false, answer, &qname, &qtype, &dnssecOk));
+  BOOST_CHECK_EQUAL(qname, DNSName("www.powerdns.com"));
+  BOOST_CHECK_EQUAL(qtype, QType::A);
+  BOOST_CHECK(!dnssecOk);
+
+  /* the answer carries the ID, RD bit and spelling of the query */
+  BOOST_REQUIRE_EQUAL(answer.size(), ans.size());
+  const struct dnsheader* dh = (const struct dnsheader*)answer.c_str();
+  BOOST_CHECK_EQUAL(ntohs(dh->id), 4242);
+  BOOST_CHECK(dh->rd);
+  BOOST_CHECK(dh->qr);
+  BOOST_CHECK_EQUAL(DNSName(answer.c_str(), answer.size(), sizeof(dnsheader), false).toString(), "WWW.PowerDNS.com.");
+  BOOST_CHECK(answer.compare(sizeof(dnsheader) + qname.wirelength(), string::npos, string((char*)&ans[0], ans.size()), sizeof(dnsheader) + qname.wirelength(), string::npos) == 0);
+
+  /* EDNS with the DO bit, the buffer size is capped like in DNSPacket::parse() */
+  pak.clear();
+  DNSPacketWriter pw2(pak, DNSName("www.powerdns.com"), QType::A);
+  pw2.addOpt(4096, 0, EDNSOpts::DNSSECOK);
+  pw2.commit();
+  BOOST_REQUIRE(PC.getRaw((char*)&pak[0], pak.size(), true, answer, &qname, &qtype, &dnssecOk));
+  BOOST_CHECK(dnssecOk);
+  BOOST_CHECK_EQUAL(answer[answer.size() - 1], 2);
+
+  /* EDNS options are left to the full parser */
+  pak.clear();
+  DNSPacketWriter pw3(pak, DNSName("www.powerdns.com"), QType::A);
+  DNSPacketWriter::optvect_t opts;
+  opts.push_back(make_pair(3, string()));
+  pw3.addOpt(4096, 0, EDNSOpts::DNSSECOK, opts);
+  pw3.commit();
+  BOOST_CHECK(!PC.getRaw((char*)&pak[0], pak.size(), true, answer, &qname, &qtype, &dnssecOk));
+
+  /* and so are other classes, truncated and unknown queries */
+  pak.clear();
+  DNSPacketWriter pw4(pak, DNSName("www.powerdns.com"), QType::A, QClass::CHAOS);
+  BOOST_CHECK(!PC.getRaw((char*)&pak[0], pak.size(), true, answer, &qname, &qtype, &dnssecOk));
+  pak.clear();
+  DNSPacketWriter pw5(pak, DNSName("www.powerdns.com"), QType::A);
+  BOOST_CHECK(!PC.getRaw((char*)&pak[0], pak.size() - 1, true, answer, &qname, &qtype, &dnssecOk));
+  BOOST_CHECK(!PC.getRaw((char*)&pak[0], sizeof(dnsheader) - 1, true, answer, &qname, &qtype, &dnssecOk));
+  pak.clear();
+  DNSPacketWriter pw6(pak, DNSName("www.powerdns.net"), QType::A);
+  BOOST_CHECK(!PC.getRaw((char*)&pak[0], pak.size(), true, answer, &qname, &qtype, &dnssecOk));
+}
+
 BOOST_AUTO_TEST_CASE(test_PacketCachePacket) {
   try {
     ::arg().setSwitch("no-shuffle","Set this to prevent random shuffling of answers - for regression testing")="off";
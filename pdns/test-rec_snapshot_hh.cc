@@ -0,0 +1,66 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include "rec-snapshot.hh"
+#include "dnsrecords.hh"
+
+BOOST_AUTO_TEST_SUITE(rec_snapshot_hh)
+
+BOOST_AUTO_TEST_CASE(test_roundtrip) {
+  reportAllTypes();
+  DNSName name("www.powerdns.com.");
+  shared_ptr<DNSRecordContent> mx(DNSRecordContent::mastermake(QType::MX, 1, "10 mx.powerdns.com."));
+
+  SnapshotWriter sw;
+  sw.put8((uint8_t)SnapshotKind::Record);
+  sw.putName(name);
+  sw.put16(0x1234);
+  sw.put32(0xdeadbeef);
+  sw.putString(mx->serialize(name));
+  sw.putName(DNSName("."));
+  sw.putAddress(ComboAddress("192.0.2.1:53"));
+  sw.putAddress(ComboAddress("[2001:db8::1]:5300"));
+
+  SnapshotReader sr(sw.str());
+  BOOST_CHECK((SnapshotKind)sr.get8() == SnapshotKind::Record);
+  BOOST_CHECK_EQUAL(sr.getName(), name);
+  BOOST_CHECK_EQUAL(sr.get16(), 0x1234);
+  BOOST_CHECK_EQUAL(sr.get32(), 0xdeadbeef);
+  BOOST_CHECK_EQUAL(DNSRecordContent::unserialize(name, QType::MX, sr.getString())->getZoneRepresentation(), mx->getZoneRepresentation());
+  BOOST_CHECK(sr.getName().isRoot());
+  BOOST_CHECK_EQUAL(sr.getAddress().toStringWithPort(), "192.0.2.1:53");
+  BOOST_CHECK_EQUAL(sr.getAddress().toStringWithPort(), "[2001:db8::1]:5300");
+  BOOST_CHECK(sr.eof());
+}
+
+BOOST_AUTO_TEST_CASE(test_truncated) {
+  SnapshotWriter sw;
+  sw.putName(DNSName("www.powerdns.com."));
+  sw.putString("hello");
+
+  for(size_t len=0; len < sw.str().size(); ++len) {
+    string data=sw.str().substr(0, len);
+    SnapshotReader sr(data);
+    BOOST_CHECK_THROW({ sr.getName(); sr.getString(); }, std::exception);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_parts) {
+  SnapshotPart total, first, second;
+  first.d_data="first";
+  first.d_count=2;
+  first.d_threads=1;
+  second.d_data="second";
+  second.d_count=3;
+  second.d_threads=1;
+  total+=first;
+  total+=second;
+  BOOST_CHECK_EQUAL(total.d_data, "firstsecond");
+  BOOST_CHECK_EQUAL(total.d_count, 5);
+  BOOST_CHECK_EQUAL(total.d_threads, 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
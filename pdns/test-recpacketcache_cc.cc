@@ -0,0 +1,123 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include <unordered_map>
+#include "dnswriter.hh"
+#include "dnsrecords.hh"
+#include "iputils.hh"
+#include "recpacketcache.hh"
+
+BOOST_AUTO_TEST_SUITE(recpacketcache_cc)
+
+static string makeQuery(const DNSName& qname, uint16_t qtype, uint16_t id=0, bool rd=true, int ednsSize=0, bool dnssecOK=false)
+{
+  vector<uint8_t> packet;
+  DNSPacketWriter pw(packet, qname, qtype);
+  pw.getHeader()->id=id;
+  pw.getHeader()->rd=rd;
+  if(ednsSize) {
+    pw.addOpt(ednsSize, 0, dnssecOK ? EDNSOpts::DNSSECOK : 0);
+    pw.commit();
+  }
+  return string(packet.begin(), packet.end());
+}
+
+static string makeResponse(const DNSName& qname, uint16_t qtype, const string& ip)
+{
+  vector<uint8_t> packet;
+  DNSPacketWriter pw(packet, qname, qtype);
+  pw.getHeader()->qr=1;
+  pw.startRecord(qname, qtype, 3600);
+  ARecordContent(ComboAddress(ip)).toPacket(pw);
+  pw.commit();
+  return string(packet.begin(), packet.end());
+}
+
+BOOST_AUTO_TEST_CASE(test_KeyMatch) {
+  RecursorPacketCache rpc;
+  time_t now=time(0);
+  DNSName name("www.powerdns.com.");
+  string response=makeResponse(name, QType::A, "192.0.2.1");
+  string found;
+  uint32_t age;
+
+  rpc.insertResponsePacket(makeQuery(name, QType::A), response, now, 3600);
+  BOOST_CHECK_EQUAL(rpc.size(), 1);
+  BOOST_CHECK(rpc.getResponsePacket(makeQuery(name, QType::A), now, &found, &age));
+  BOOST_CHECK(found == response);
+
+  // the ID comes from the query, and so does the case of the name
+  string query=makeQuery(name, QType::A, 0x4242);
+  query.replace(sizeof(dnsheader), 17, string("\003WwW\010pOWERdns\003COM", 17));
+  BOOST_REQUIRE(rpc.getResponsePacket(query, now, &found, &age));
+  BOOST_REQUIRE_EQUAL(found.size(), response.size());
+  BOOST_CHECK_EQUAL(((const dnsheader*)found.c_str())->id, 0x4242);
+  BOOST_CHECK_EQUAL(found.substr(sizeof(dnsheader), 17), query.substr(sizeof(dnsheader), 17));
+  BOOST_CHECK(found.substr(sizeof(dnsheader) + 17) == response.substr(sizeof(dnsheader) + 17));
+
+  // everything else the answer depends on has to be the same
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery(name, QType::AAAA), now, &found, &age));
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery(DNSName("powerdns.com."), QType::A), now, &found, &age));
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery(name, QType::A, 0, false), now, &found, &age));
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery(name, QType::A, 0, true, 1680), now, &found, &age));
+  rpc.insertResponsePacket(makeQuery(name, QType::A, 0, true, 1680), response, now, 3600);
+  BOOST_CHECK(rpc.getResponsePacket(makeQuery(name, QType::A, 0, true, 1680), now, &found, &age));
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery(name, QType::A, 0, true, 1680, true), now, &found, &age));
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery(name, QType::A, 0, true, 4096), now, &found, &age));
+  // anything below 512 is 512
+  rpc.insertResponsePacket(makeQuery(name, QType::A, 0, true, 100), response, now, 3600);
+  BOOST_CHECK(rpc.getResponsePacket(makeQuery(name, QType::A, 0, true, 512), now, &found, &age));
+  BOOST_CHECK_EQUAL(rpc.size(), 3);
+
+  // storing the same query again replaces the entry
+  rpc.insertResponsePacket(makeQuery(name, QType::A), makeResponse(name, QType::A, "192.0.2.2"), now, 3600);
+  BOOST_CHECK_EQUAL(rpc.size(), 3);
+  BOOST_CHECK(rpc.getResponsePacket(makeQuery(name, QType::A), now, &found, &age));
+  BOOST_CHECK(found == makeResponse(name, QType::A, "192.0.2.2"));
+
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery(name, QType::A), now + 3600, &found, &age));
+  BOOST_CHECK_EQUAL(rpc.doWipePacketCache(DNSName("WWW.PowerDNS.com.")), 3);
+  BOOST_CHECK_EQUAL(rpc.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_HashCollision) {
+  // find two names whose queries are filed under the same hash
+  std::unordered_map<uint32_t, unsigned int> seen;
+  DNSName first, second;
+  for(unsigned int n=0; n < 2000000; n++) {
+    uint32_t hash;
+    BOOST_REQUIRE(RecursorPacketCache::getQueryHash(makeQuery(DNSName("host"+std::to_string(n)+".example."), QType::A), &hash));
+    auto ret=seen.insert({hash, n});
+    if(!ret.second) {
+      first=DNSName("host"+std::to_string(ret.first->second)+".example.");
+      second=DNSName("host"+std::to_string(n)+".example.");
+      break;
+    }
+  }
+  BOOST_REQUIRE(!second.empty());
+
+  RecursorPacketCache rpc;
+  time_t now=time(0);
+  string found;
+  uint32_t age;
+
+  rpc.insertResponsePacket(makeQuery(first, QType::A), makeResponse(first, QType::A, "192.0.2.1"), now, 3600);
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery(second, QType::A), now, &found, &age));
+  rpc.insertResponsePacket(makeQuery(second, QType::A), makeResponse(second, QType::A, "192.0.2.2"), now, 3600);
+  BOOST_CHECK_EQUAL(rpc.size(), 2);
+
+  BOOST_CHECK(rpc.getResponsePacket(makeQuery(first, QType::A), now, &found, &age));
+  BOOST_CHECK(found == makeResponse(first, QType::A, "192.0.2.1"));
+  BOOST_CHECK(rpc.getResponsePacket(makeQuery(second, QType::A), now, &found, &age));
+  BOOST_CHECK(found == makeResponse(second, QType::A, "192.0.2.2"));
+
+  BOOST_CHECK_EQUAL(rpc.doWipePacketCache(first), 1);
+  BOOST_CHECK(!rpc.getResponsePacket(makeQuery(first, QType::A), now, &found, &age));
+  BOOST_CHECK(rpc.getResponsePacket(makeQuery(second, QType::A), now, &found, &age));
+  BOOST_CHECK(found == makeResponse(second, QType::A, "192.0.2.2"));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
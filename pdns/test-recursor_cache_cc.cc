@@ -0,0 +1,187 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include <thread>
+#include "iputils.hh"
+#include "recursor_cache.hh"
+
+BOOST_AUTO_TEST_SUITE(recursor_cache_cc)
+
+static void store(MemRecursorCache& rc, time_t now, const DNSName& name, uint32_t ip, uint32_t ttl=3600, bool prefetched=false)
+{
+  DNSRecord dr;
+  dr.d_name=name;
+  dr.d_type=QType::A;
+  dr.d_ttl=now + ttl;
+  dr.d_content=std::make_shared<ARecordContent>(ip);
+  rc.replace(now, name, QType(QType::A), {dr}, {}, false, prefetched);
+}
+
+static DNSName makeName(unsigned int thread, unsigned int n)
+{
+  return DNSName("host"+std::to_string(n)+".thread"+std::to_string(thread)+".example.");
+}
+
+BOOST_AUTO_TEST_CASE(test_InsertGetWipe) {
+  MemRecursorCache rc(8);
+  time_t now=time(0);
+  vector<DNSRecord> res;
+
+  store(rc, now, DNSName("www.example.com."), htonl(0xc0000201));
+  store(rc, now, DNSName("mail.example.com."), htonl(0xc0000202));
+  store(rc, now, DNSName("www.example.net."), htonl(0xc0000203));
+  BOOST_CHECK_EQUAL(rc.size(), 3);
+
+  BOOST_CHECK_GT(rc.get(now, DNSName("www.example.com."), QType(QType::A), &res), 0);
+  BOOST_REQUIRE_EQUAL(res.size(), 1);
+  BOOST_CHECK_EQUAL(res[0].d_content->getZoneRepresentation(), "192.0.2.1");
+  BOOST_CHECK_LT(rc.get(now, DNSName("www.example.com."), QType(QType::AAAA), &res), 0);
+  BOOST_CHECK_LT(rc.get(now, DNSName("ftp.example.com."), QType(QType::A), &res), 0);
+
+  BOOST_CHECK_EQUAL(rc.doWipeCache(DNSName("www.example.com."), false), 1);
+  BOOST_CHECK_LT(rc.get(now, DNSName("www.example.com."), QType(QType::A), &res), 0);
+  // the names below example.com. are spread over the shards
+  store(rc, now, DNSName("www.example.com."), htonl(0xc0000201));
+  BOOST_CHECK_EQUAL(rc.doWipeCache(DNSName("example.com."), true), 2);
+  BOOST_CHECK_EQUAL(rc.size(), 1);
+  BOOST_CHECK_GT(rc.get(now, DNSName("www.example.net."), QType(QType::A), &res), 0);
+
+  // a cache used by a single thread takes no locks
+  BOOST_CHECK_EQUAL(rc.getLockAcquisitions(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_Shared) {
+  MemRecursorCache rc(16, true);
+  time_t now=time(0);
+  const unsigned int numThreads=4;
+  const unsigned int numNames=1000;
+  vector<unsigned int> found(numThreads);
+
+  // every thread stores its own names and looks them up, while looking up those of the others
+  vector<std::thread> threads;
+  for(unsigned int t=0; t < numThreads; t++) {
+    threads.push_back(std::thread([&rc, &found, now, t]() {
+      vector<DNSRecord> res;
+      for(unsigned int n=0; n < numNames; n++) {
+        store(rc, now, makeName(t, n), htonl(n));
+        rc.get(now, makeName((t + 1) % numThreads, n), QType(QType::A), &res);
+      }
+      for(unsigned int n=0; n < numNames; n++) {
+        if(rc.get(now, makeName(t, n), QType(QType::A), &res) > 0 && res.size() == 1 &&
+           std::dynamic_pointer_cast<ARecordContent>(res[0].d_content)->getCA().sin4.sin_addr.s_addr == htonl(n))
+          found[t]++;
+      }
+    }));
+  }
+  for(auto& thread : threads)
+    thread.join();
+  threads.clear();
+
+  for(unsigned int t=0; t < numThreads; t++)
+    BOOST_CHECK_EQUAL(found[t], numNames);
+  BOOST_CHECK_EQUAL(rc.size(), numThreads * numNames);
+  BOOST_CHECK_GE(rc.getLockAcquisitions(), 3 * numThreads * numNames);
+
+  // every thread wipes its own names, while the others are still looking theirs up
+  vector<int> wiped(numThreads);
+  for(unsigned int t=0; t < numThreads; t++) {
+    threads.push_back(std::thread([&rc, &wiped, now, t]() {
+      vector<DNSRecord> res;
+      for(unsigned int n=0; n < numNames; n++)
+        rc.get(now, makeName((t + 1) % numThreads, n), QType(QType::A), &res);
+      wiped[t]=rc.doWipeCache(makeName(t, 0), false);
+      wiped[t]+=rc.doWipeCache(DNSName("thread"+std::to_string(t)+".example."), true);
+    }));
+  }
+  for(auto& thread : threads)
+    thread.join();
+
+  for(unsigned int t=0; t < numThreads; t++)
+    BOOST_CHECK_EQUAL(wiped[t], numNames);
+  BOOST_CHECK_EQUAL(rc.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_PrefetchClaim) {
+  MemRecursorCache rc;
+  time_t now=time(0);
+  DNSName name("www.example.com.");
+
+  BOOST_CHECK(!rc.claimPrefetch(now, name, QType(QType::A)));
+  store(rc, now, name, htonl(0xc0000201), 100);
+
+  BOOST_CHECK(rc.claimPrefetch(now, name, QType(QType::A)));
+  // only one prefetch at a time
+  BOOST_CHECK(!rc.claimPrefetch(now, name, QType(QType::A)));
+  BOOST_CHECK(!rc.claimPrefetch(now + PrefetchClaim::s_maxSeconds - 1, name, QType(QType::A)));
+
+  // the prefetch never stored anything, somebody else may try
+  BOOST_CHECK(rc.claimPrefetch(now + PrefetchClaim::s_maxSeconds, name, QType(QType::A)));
+  BOOST_CHECK(!rc.claimPrefetch(now + PrefetchClaim::s_maxSeconds, name, QType(QType::A)));
+
+  // the prefetch stored the entry again
+  store(rc, now + PrefetchClaim::s_maxSeconds, name, htonl(0xc0000201), 100);
+  BOOST_CHECK(rc.claimPrefetch(now + PrefetchClaim::s_maxSeconds, name, QType(QType::A)));
+
+  // there is nothing to refresh once it expired
+  store(rc, now, name, htonl(0xc0000201), 100);
+  BOOST_CHECK(!rc.claimPrefetch(now + 100, name, QType(QType::A)));
+}
+
+// what SyncRes does on a cache hit: a popular entry with less than a tenth of its TTL left gets prefetched
+static bool hitSchedulesPrefetch(MemRecursorCache& rc, time_t now, const DNSName& name, MemRecursorCache::EntryState& state)
+{
+  vector<DNSRecord> res;
+  int ttl=rc.get(now, name, QType(QType::A), &res, 0, &state);
+  return ttl > 0 && state.hits >= 3 && (uint64_t)ttl * 100 <= (uint64_t)state.origTTL * 10 &&
+    rc.claimPrefetch(now, name, QType(QType::A));
+}
+
+BOOST_AUTO_TEST_CASE(test_PrefetchPopularEntry) {
+  MemRecursorCache rc;
+  MemRecursorCache::EntryState state;
+  time_t now=time(0);
+  DNSName name("www.example.com."), other("mail.example.com.");
+
+  store(rc, now, name, htonl(0xc0000201), 1000);
+  store(rc, now, other, htonl(0xc0000202), 1000);
+  for(int n=0; n < 3; n++)
+    BOOST_CHECK(!hitSchedulesPrefetch(rc, now, name, state));
+  BOOST_CHECK_EQUAL(state.hits, 3);
+  BOOST_CHECK_EQUAL(state.origTTL, 1000);
+  BOOST_CHECK(!state.prefetched);
+  // not popular enough
+  BOOST_CHECK(!hitSchedulesPrefetch(rc, now + 950, other, state));
+
+  // close to expiry, the first hit schedules the prefetch, those that follow while it runs don't
+  BOOST_CHECK(hitSchedulesPrefetch(rc, now + 950, name, state));
+  BOOST_CHECK(!hitSchedulesPrefetch(rc, now + 950, name, state));
+  BOOST_CHECK(!hitSchedulesPrefetch(rc, now + 950 + PrefetchClaim::s_maxSeconds - 1, name, state));
+
+  // the prefetch never stored anything, a later hit schedules another one
+  BOOST_CHECK(hitSchedulesPrefetch(rc, now + 950 + PrefetchClaim::s_maxSeconds, name, state));
+  BOOST_CHECK(!hitSchedulesPrefetch(rc, now + 951 + PrefetchClaim::s_maxSeconds, name, state));
+
+  // that one stores the entry again, which starts afresh
+  time_t refreshed=now + 951 + PrefetchClaim::s_maxSeconds;
+  store(rc, refreshed, name, htonl(0xc0000201), 1000, true);
+  BOOST_CHECK(!hitSchedulesPrefetch(rc, refreshed, name, state));
+  BOOST_CHECK_EQUAL(state.hits, 1);
+  BOOST_CHECK(state.prefetched);
+  // its claim is gone with it
+  BOOST_CHECK(rc.claimPrefetch(refreshed, name, QType(QType::A)));
+  BOOST_CHECK(!rc.claimPrefetch(refreshed, name, QType(QType::A)));
+
+  // and once it is popular and close to expiry again, so is the next prefetch
+  BOOST_CHECK(!hitSchedulesPrefetch(rc, refreshed + 950, name, state));
+  BOOST_CHECK(hitSchedulesPrefetch(rc, refreshed + 950, name, state));
+  BOOST_CHECK(!hitSchedulesPrefetch(rc, refreshed + 950, name, state));
+
+  // nothing is prefetched once it expired
+  BOOST_CHECK(!hitSchedulesPrefetch(rc, refreshed + 1000, name, state));
+  BOOST_CHECK(!hitSchedulesPrefetch(rc, refreshed + 1000 + PrefetchClaim::s_maxSeconds, name, state));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
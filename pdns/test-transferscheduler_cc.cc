@@ -0,0 +1,117 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <boost/test/unit_test.hpp>
+#include "transferscheduler.hh"
+
+BOOST_AUTO_TEST_SUITE(transferscheduler_cc)
+
+static SuckRequest makeRequest(const string& domain, const string& master)
+{
+  SuckRequest sr;
+  sr.domain=DNSName(domain);
+  sr.master=master;
+  return sr;
+}
+
+BOOST_AUTO_TEST_CASE(test_priority_and_dedup) {
+  TransferScheduler ts(10);
+  BOOST_CHECK(ts.add(makeRequest("a.example.", "192.0.2.1"), false));
+  BOOST_CHECK(ts.add(makeRequest("b.example.", "192.0.2.1"), false));
+  BOOST_CHECK(!ts.add(makeRequest("a.example.", "192.0.2.1"), false));
+  BOOST_CHECK(ts.add(makeRequest("c.example.", "192.0.2.1"), true));
+  // moves the queued request forward
+  BOOST_CHECK(ts.add(makeRequest("b.example.", "192.0.2.1"), true));
+  BOOST_CHECK(!ts.add(makeRequest("b.example.", "192.0.2.1"), true));
+  BOOST_CHECK_EQUAL(ts.getQueued(), 3);
+  BOOST_CHECK(ts.isQueued(makeRequest("a.example.", "192.0.2.1")));
+
+  SuckRequest sr;
+  BOOST_REQUIRE(ts.get(sr, 0));
+  BOOST_CHECK_EQUAL(sr.domain, DNSName("c.example."));
+  BOOST_REQUIRE(ts.get(sr, 0));
+  BOOST_CHECK_EQUAL(sr.domain, DNSName("b.example."));
+  BOOST_REQUIRE(ts.get(sr, 0));
+  BOOST_CHECK_EQUAL(sr.domain, DNSName("a.example."));
+  BOOST_CHECK(!ts.get(sr, 0));
+  BOOST_CHECK_EQUAL(ts.getQueued(), 0);
+  BOOST_CHECK_EQUAL(ts.getInFlight(), 3);
+
+  // a zone being transferred can be queued again, but is not taken until that transfer is done
+  BOOST_CHECK(ts.add(makeRequest("a.example.", "192.0.2.1"), false));
+  BOOST_CHECK(ts.add(makeRequest("d.example.", "192.0.2.1"), false));
+  BOOST_REQUIRE(ts.get(sr, 0));
+  BOOST_CHECK_EQUAL(sr.domain, DNSName("d.example."));
+  BOOST_CHECK(!ts.get(sr, 0));
+  BOOST_CHECK(ts.isQueued(makeRequest("a.example.", "192.0.2.1")));
+  BOOST_CHECK(ts.add(makeRequest("a.example.", "192.0.2.1"), true));
+  BOOST_CHECK(!ts.get(sr, 0));
+  ts.done(makeRequest("a.example.", "192.0.2.1"), false, 100, 10, 0);
+  BOOST_CHECK_EQUAL(ts.getInFlight(), 3);
+  BOOST_REQUIRE(ts.get(sr, 0));
+  BOOST_CHECK_EQUAL(sr.domain, DNSName("a.example."));
+  BOOST_CHECK(!ts.get(sr, 0));
+  BOOST_CHECK_EQUAL(ts.getQueued(), 0);
+
+  // nor from another master
+  BOOST_CHECK(ts.add(makeRequest("a.example.", "192.0.2.2"), false));
+  BOOST_CHECK(!ts.get(sr, 0));
+  ts.done(makeRequest("a.example.", "192.0.2.1"), false, 100, 10, 0);
+  BOOST_REQUIRE(ts.get(sr, 0));
+  BOOST_CHECK_EQUAL(sr.master, "192.0.2.2");
+}
+
+BOOST_AUTO_TEST_CASE(test_per_master_limit) {
+  TransferScheduler ts(2);
+  for(int n=0; n < 4; ++n)
+    ts.add(makeRequest(std::to_string(n)+".example.", "192.0.2.1"), false);
+  ts.add(makeRequest("other.example.", "192.0.2.2"), false);
+
+  SuckRequest first, sr;
+  BOOST_REQUIRE(ts.get(first, 0));
+  BOOST_REQUIRE(ts.get(sr, 0));
+  BOOST_REQUIRE(ts.get(sr, 0));
+  BOOST_REQUIRE(!ts.get(sr, 0));
+  auto stats=ts.getMasterStats();
+  BOOST_CHECK_EQUAL(stats["192.0.2.1"].inFlight, 2);
+  BOOST_CHECK_EQUAL(stats["192.0.2.1"].queued, 2);
+  BOOST_CHECK_EQUAL(stats["192.0.2.2"].inFlight, 1);
+
+  ts.done(first, false, 1000, 20, 0);
+  BOOST_REQUIRE(ts.get(sr, 0));
+  BOOST_CHECK_EQUAL(sr.master, "192.0.2.1");
+  BOOST_CHECK(!ts.get(sr, 0));
+  stats=ts.getMasterStats();
+  BOOST_CHECK_EQUAL(stats[first.master].transfers, 1);
+  BOOST_CHECK_EQUAL(stats[first.master].bytes, 1000);
+  BOOST_CHECK_EQUAL(stats[first.master].avgMsec, 20);
+}
+
+BOOST_AUTO_TEST_CASE(test_backoff) {
+  TransferScheduler ts(1);
+  ts.add(makeRequest("a.example.", "192.0.2.1"), false);
+  ts.add(makeRequest("b.example.", "192.0.2.1"), false);
+
+  SuckRequest sr;
+  BOOST_REQUIRE(ts.get(sr, 1000));
+  ts.done(sr, true, 0, 10000, 1000);
+  BOOST_CHECK(!ts.get(sr, 1001));
+  BOOST_REQUIRE(ts.get(sr, 1002));
+  ts.done(sr, true, 0, 10000, 1002);
+  ts.add(makeRequest("a.example.", "192.0.2.1"), true);
+  // waits longer after every failure in a row
+  BOOST_CHECK(!ts.get(sr, 1005));
+  auto stats=ts.getMasterStats();
+  BOOST_CHECK_EQUAL(stats["192.0.2.1"].failures, 2);
+  BOOST_CHECK_EQUAL(stats["192.0.2.1"].backoffUntil, 1006);
+
+  BOOST_REQUIRE(ts.get(sr, 1006));
+  ts.done(sr, false, 0, 10, 1006);
+  stats=ts.getMasterStats();
+  BOOST_CHECK_EQUAL(stats["192.0.2.1"].failuresInARow, 0);
+  BOOST_CHECK_EQUAL(stats["192.0.2.1"].failures, 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,139 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "transferscheduler.hh"
+
+bool TransferScheduler::add(const SuckRequest& sr, bool priority)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  Master& m=d_masters[sr.master];
+  auto iter=d_queued.find(sr);
+  if(iter != d_queued.end()) {
+    if(!priority || iter->second)
+      return false;
+    // the entry in the normal queue is skipped once this one is taken
+    iter->second=true;
+    m.priority.push_back(sr.domain);
+  }
+  else {
+    d_queued[sr]=priority;
+    (priority ? m.priority : m.normal).push_back(sr.domain);
+    m.stats.queued++;
+  }
+  d_cond.notify_one();
+  return true;
+}
+
+// a request for a zone that is being transferred, from this master or another, stays in the queue until that transfer is done
+bool TransferScheduler::take(Master& m, bool priority, const string& master, SuckRequest& sr)
+{
+  auto& queue = priority ? m.priority : m.normal;
+  for(auto pos = queue.begin(); pos != queue.end(); ) {
+    sr.domain=*pos;
+    sr.master=master;
+    auto iter=d_queued.find(sr);
+    if(iter == d_queued.end() || iter->second != priority) { // taken already, or moved to the priority queue
+      pos=queue.erase(pos);
+      continue;
+    }
+    auto busy=d_inFlight.lower_bound(SuckRequest{sr.domain, string()});
+    if(busy != d_inFlight.end() && busy->domain == sr.domain) { // from any master
+      ++pos;
+      continue;
+    }
+    queue.erase(pos);
+    d_queued.erase(iter);
+    d_inFlight.insert(sr);
+    m.stats.queued--;
+    m.stats.inFlight++;
+    d_lastMaster=master;
+    return true;
+  }
+  return false;
+}
+
+bool TransferScheduler::get(SuckRequest& sr, time_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  if(d_masters.empty())
+    return false;
+
+  // masters take turns, starting with the one after the master we picked last time
+  vector<map<string, Master>::iterator> order;
+  auto start=d_masters.upper_bound(d_lastMaster);
+  for(auto iter=start; iter != d_masters.end(); ++iter)
+    order.push_back(iter);
+  for(auto iter=d_masters.begin(); iter != start; ++iter)
+    order.push_back(iter);
+
+  for(auto& iter : order)
+    if(eligible(iter->second, now) && take(iter->second, true, iter->first, sr))
+      return true;
+  for(auto& iter : order)
+    if(eligible(iter->second, now) && take(iter->second, false, iter->first, sr))
+      return true;
+  return false;
+}
+
+bool TransferScheduler::wait(SuckRequest& sr)
+{
+  if(get(sr, time(0)))
+    return true;
+  {
+    std::unique_lock<std::mutex> l(d_lock);
+    d_cond.wait_for(l, std::chrono::seconds(1));
+  }
+  return get(sr, time(0));
+}
+
+void TransferScheduler::done(const SuckRequest& sr, bool masterFailed, uint64_t bytes, unsigned int msec, time_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto iter=d_inFlight.find(sr);
+  if(iter == d_inFlight.end())
+    return;
+  d_inFlight.erase(iter);
+
+  MasterStats& stats=d_masters[sr.master].stats;
+  stats.inFlight--;
+  stats.bytes+=bytes;
+  stats.avgMsec = stats.transfers ? 0.8*stats.avgMsec + 0.2*msec : msec;
+  stats.transfers++;
+  if(masterFailed) {
+    stats.failures++;
+    stats.failuresInARow++;
+    stats.backoffUntil = now + std::min(1U << std::min(stats.failuresInARow, 10U), 600U);
+  }
+  else {
+    stats.failuresInARow=0;
+    stats.backoffUntil=0;
+  }
+  d_cond.notify_all();
+}
+
+bool TransferScheduler::isQueued(const SuckRequest& sr) const
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  return d_queued.count(sr);
+}
+
+uint64_t TransferScheduler::getQueued() const
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  return d_queued.size();
+}
+
+uint64_t TransferScheduler::getInFlight() const
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  return d_inFlight.size();
+}
+
+map<string, TransferScheduler::MasterStats> TransferScheduler::getMasterStats() const
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  map<string, MasterStats> ret;
+  for(const auto& m : d_masters)
+    ret[m.first]=m.second.stats;
+  return ret;
+}
@@ -0,0 +1,92 @@
+#ifndef PDNS_TRANSFERSCHEDULER_HH
+#define PDNS_TRANSFERSCHEDULER_HH
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <boost/tuple/tuple_comparison.hpp>
+#include "dnsname.hh"
+#include "namespaces.hh"
+
+struct SuckRequest
+{
+  DNSName domain;
+  string master;
+  bool operator<(const SuckRequest& b) const
+  {
+    return tie(domain, master) < tie(b.domain, b.master);
+  }
+};
+
+/** Decides which incoming zone transfer the retrieval threads do next.
+
+    Every master has its own queues, so a master with many zones to transfer does not hold up
+    the others. Transfers asked for by a NOTIFY or an operator go before those found by the
+    refresh timer, no more than d_maxPerMaster transfers from one master run at the same time,
+    and a master that failed is left alone for a while, longer after each failure in a row.
+    A request that is queued already is not queued twice, but one for a zone that is being
+    transferred is, as the zone may have changed again in the meantime. It waits in the queue
+    until that transfer is done, so two threads never transfer the same zone at once. */
+class TransferScheduler
+{
+public:
+  struct MasterStats
+  {
+    unsigned int queued{0};
+    unsigned int inFlight{0};
+    unsigned int failuresInARow{0};
+    time_t backoffUntil{0};
+    uint64_t transfers{0};
+    uint64_t failures{0};
+    uint64_t bytes{0};
+    double avgMsec{0}; //!< of the recent transfers, successful or not
+  };
+
+  explicit TransferScheduler(unsigned int maxPerMaster=4) : d_maxPerMaster(maxPerMaster ? maxPerMaster : 1)
+  {}
+
+  void setMaxPerMaster(unsigned int maxPerMaster)
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    d_maxPerMaster = maxPerMaster ? maxPerMaster : 1;
+  }
+
+  //! queues a transfer, returns false if it was queued already. A priority request moves an already queued one forward
+  bool add(const SuckRequest& sr, bool priority);
+  //! the next transfer that may start at 'now', returns false if there is none. Call done() when it has ended
+  bool get(SuckRequest& sr, time_t now);
+  //! like get(), but waits for a transfer for up to a second
+  bool wait(SuckRequest& sr);
+  //! a transfer from get() has ended, masterFailed if the master could not be reached or did not give us the zone
+  void done(const SuckRequest& sr, bool masterFailed, uint64_t bytes, unsigned int msec, time_t now);
+
+  //! if sr is waiting for a retrieval thread
+  bool isQueued(const SuckRequest& sr) const;
+  uint64_t getQueued() const;
+  uint64_t getInFlight() const;
+  map<string, MasterStats> getMasterStats() const;
+
+private:
+  struct Master
+  {
+    std::deque<DNSName> priority, normal; // may hold requests that were taken already, see d_queued
+    MasterStats stats;
+  };
+
+  bool eligible(const Master& m, time_t now) const
+  {
+    return (!m.priority.empty() || !m.normal.empty()) && m.stats.inFlight < d_maxPerMaster && m.stats.backoffUntil <= now;
+  }
+  bool take(Master& m, bool priority, const string& master, SuckRequest& sr);
+
+  mutable std::mutex d_lock;
+  std::condition_variable d_cond;
+  map<string, Master> d_masters;
+  map<SuckRequest, bool> d_queued; // the value is true for priority requests
+  std::set<SuckRequest> d_inFlight;
+  string d_lastMaster; // where get() continues, so masters take turns
+  unsigned int d_maxPerMaster;
+};
+#endif